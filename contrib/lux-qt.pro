@@ -62,6 +62,7 @@ HEADERS += src/activemasternode.h \
            src/allocators.h \
            src/amount.h \
            src/base58.h \
+           src/blockencodings.h \
            src/bloom.h \
            src/chain.h \
            src/chainparams.h \
@@ -81,8 +82,9 @@ HEADERS += src/activemasternode.h \
            src/lux-config.h \
            src/db.h \
            src/eccryptoverify.h \
-           src/ecwrapper.h \
            src/hash.h \
+           src/httprpc.h \
+           src/httpserver.h \
            src/init.h \
            src/instantx.h \
            src/keepass.h \
@@ -111,6 +113,7 @@ HEADERS += src/activemasternode.h \
            src/rpcprotocol.h \
            src/rpcserver.h \
            src/serialize.h \
+           src/snapshot.h \
            src/spork.h \
            src/streams.h \
            src/sync.h \
@@ -361,6 +364,7 @@ SOURCES += src/activemasternode.cpp \
            src/allocators.cpp \
            src/amount.cpp \
            src/base58.cpp \
+           src/blockencodings.cpp \
            src/bloom.cpp \
            src/chain.cpp \
            src/chainparams.cpp \
@@ -379,9 +383,10 @@ SOURCES += src/activemasternode.cpp \
            src/lux.cpp \
            src/db.cpp \
            src/eccryptoverify.cpp \
-           src/ecwrapper.cpp \
            src/editaddressdialog.cpp \
            src/hash.cpp \
+           src/httprpc.cpp \
+           src/httpserver.cpp \
            src/init.cpp \
            src/instantx.cpp \
            src/keepass.cpp \
@@ -417,6 +422,7 @@ SOURCES += src/activemasternode.cpp \
            src/rpcrawtransaction.cpp \
            src/rpcserver.cpp \
            src/rpcwallet.cpp \
+           src/snapshot.cpp \
            src/spork.cpp \
            src/sync.cpp \
            src/timedata.cpp \
@@ -523,6 +529,7 @@ SOURCES += src/activemasternode.cpp \
            src/test/base58_tests.cpp \
            src/test/base64_tests.cpp \
            src/test/bip32_tests.cpp \
+           src/test/blockencodings_tests.cpp \
            src/test/bloom_tests.cpp \
            src/test/checkblock_tests.cpp \
            src/test/Checkpoints_tests.cpp \
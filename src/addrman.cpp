@@ -70,9 +70,30 @@ double CAddrInfo::GetChance(int64_t nNow) const
     // deprioritize 66% after each failed attempt, but at most 1/28th to avoid the search taking forever or overly penalizing outages.
     fChance *= pow(0.66, min(nAttempts, 8));
 
+    // favor peers that answered quickly and stayed connected
+    fChance *= GetQuality();
+
     return fChance;
 }
 
+double CAddrInfo::GetQuality() const
+{
+    // handshake success rate, counting one success in two attempts for addresses never tried: 0.25x-2x
+    double fQuality = max(0.25, min(2.0, 2.0 * (stats.nHandshakes + 1) / (stats.nConnAttempts + 2)));
+
+    // ping time: 1.5x below 100ms, down to 0.5x from one second
+    if (stats.nPingUsec > 0) {
+        double fPing = stats.nPingUsec / 1000000.0;
+        fQuality *= max(0.5, min(1.5, 1.5 - (fPing - 0.1) / 0.9));
+    }
+
+    // average session length: up to 1.5x for an hour or more
+    if (stats.nHandshakes > 0)
+        fQuality *= 1.0 + 0.5 * min(1.0, (double)stats.nUptime / stats.nHandshakes / (60 * 60));
+
+    return fQuality;
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
     std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
@@ -80,22 +101,26 @@ CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
-    return NULL;
+    return &vInfo[(*it).second];
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, int* pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    int nId;
+    if (!vFreeIds.empty()) {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    } else {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    }
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -108,27 +133,46 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
+    assert(vInfo[nId1].nRandomPos == (int)nRndPos1);
+    assert(vInfo[nId2].nRandomPos == (int)nRndPos2);
 
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
 }
 
+void CAddrMan::AddToTable(std::vector<int>& vIds, int nId)
+{
+    assert(vInfo[nId].nTablePos == -1);
+    vInfo[nId].nTablePos = vIds.size();
+    vIds.push_back(nId);
+}
+
+void CAddrMan::RemoveFromTable(std::vector<int>& vIds, int nId)
+{
+    int nPos = vInfo[nId].nTablePos;
+    assert(nPos >= 0 && nPos < (int)vIds.size() && vIds[nPos] == nId);
+    vIds[nPos] = vIds.back();
+    vInfo[vIds[nPos]].nTablePos = nPos;
+    vIds.pop_back();
+    vInfo[nId].nTablePos = -1;
+}
+
 void CAddrMan::Delete(int nId)
 {
-    assert(mapInfo.count(nId) != 0);
-    CAddrInfo& info = mapInfo[nId];
+    CAddrInfo& info = vInfo[nId];
+    assert(info.nRandomPos != -1);
     assert(!info.fInTried);
     assert(info.nRefCount == 0);
+    assert(info.nTablePos == -1);
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
     mapAddr.erase(info);
-    mapInfo.erase(nId);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
     nNew--;
 }
 
@@ -137,11 +181,12 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
     // if there is an entry in the specified bucket, delete it.
     if (vvNew[nUBucket][nUBucketPos] != -1) {
         int nIdDelete = vvNew[nUBucket][nUBucketPos];
-        CAddrInfo& infoDelete = mapInfo[nIdDelete];
+        CAddrInfo& infoDelete = vInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
         vvNew[nUBucket][nUBucketPos] = -1;
         if (infoDelete.nRefCount == 0) {
+            RemoveFromTable(vNewIds, nIdDelete);
             Delete(nIdDelete);
         }
     }
@@ -158,6 +203,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
         }
     }
     nNew--;
+    RemoveFromTable(vNewIds, nId);
 
     assert(info.nRefCount == 0);
 
@@ -169,13 +215,13 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     if (vvTried[nKBucket][nKBucketPos] != -1) {
         // find an item to evict
         int nIdEvict = vvTried[nKBucket][nKBucketPos];
-        assert(mapInfo.count(nIdEvict) == 1);
-        CAddrInfo& infoOld = mapInfo[nIdEvict];
+        CAddrInfo& infoOld = vInfo[nIdEvict];
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
         vvTried[nKBucket][nKBucketPos] = -1;
         nTried--;
+        RemoveFromTable(vTriedIds, nIdEvict);
 
         // find which new bucket it belongs to
         int nUBucket = infoOld.GetNewBucket(nKey);
@@ -187,12 +233,14 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
         infoOld.nRefCount = 1;
         vvNew[nUBucket][nUBucketPos] = nIdEvict;
         nNew++;
+        AddToTable(vNewIds, nIdEvict);
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
     vvTried[nKBucket][nKBucketPos] = nId;
     nTried++;
     info.fInTried = true;
+    AddToTable(vTriedIds, nId);
 }
 
 void CAddrMan::Good_(const CService& addr, int64_t nTime)
@@ -216,6 +264,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nAttempts = 0;
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
+    fDirty = true;
 
     // if it is already in the tried set, don't do anything else
     if (info.fInTried)
@@ -257,11 +306,17 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         // periodically update nTime
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty)) {
             pinfo->nTime = max((int64_t)0, addr.nTime - nTimePenalty);
+            fDirty = true;
+        }
 
         // add services
-        pinfo->nServices = ServiceFlags(pinfo->nServices | addr.nServices);
+        ServiceFlags nServices = ServiceFlags(pinfo->nServices | addr.nServices);
+        if (nServices != pinfo->nServices) {
+            pinfo->nServices = nServices;
+            fDirty = true;
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -286,6 +341,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         pinfo->nTime = max((int64_t)0, (int64_t)pinfo->nTime - nTimePenalty);
         nNew++;
         fNew = true;
+        fDirty = true;
     }
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
@@ -293,7 +349,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
     if (vvNew[nUBucket][nUBucketPos] != nId) {
         bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
         if (!fInsert) {
-            CAddrInfo& infoExisting = mapInfo[vvNew[nUBucket][nUBucketPos]];
+            CAddrInfo& infoExisting = vInfo[vvNew[nUBucket][nUBucketPos]];
             if (infoExisting.IsTerrible() || (infoExisting.nRefCount > 1 && pinfo->nRefCount == 0)) {
                 // Overwrite the existing new table entry.
                 fInsert = true;
@@ -301,8 +357,10 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         }
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
-            pinfo->nRefCount++;
+            if (pinfo->nRefCount++ == 0)
+                AddToTable(vNewIds, nId);
             vvNew[nUBucket][nUBucketPos] = nId;
+            fDirty = true;
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -329,6 +387,14 @@ void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+
+    // decay the statistics, so they reflect how the peer behaves lately
+    if (++info.stats.nConnAttempts > ADDRMAN_STATS_MAX_ATTEMPTS) {
+        info.stats.nConnAttempts /= 2;
+        info.stats.nHandshakes /= 2;
+        info.stats.nUptime /= 2;
+    }
+    fDirty = true;
 }
 
 CAddress CAddrMan::Select_()
@@ -337,36 +403,21 @@ CAddress CAddrMan::Select_()
         return CAddress();
 
     // Use a 50% chance for choosing between tried and new table entries.
-    if (nTried > 0 && (nNew == 0 || GetRandInt(2) == 0)) {
-        // use a tried node
-        double fChanceFactor = 1.0;
-        while (1) {
-            int nKBucket = GetRandInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            if (vvTried[nKBucket][nKBucketPos] == -1)
-                continue;
-            int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
-    } else {
-        // use a new node
-        double fChanceFactor = 1.0;
-        while (1) {
-            int nUBucket = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            if (vvNew[nUBucket][nUBucketPos] == -1)
-                continue;
-            int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
+    bool fTried = nTried > 0 && (nNew == 0 || GetRandInt(2) == 0);
+    const std::vector<int>& vIds = fTried ? vTriedIds : vNewIds;
+    if (vIds.empty())
+        return CAddress();
+
+    int64_t nNow = GetAdjustedTime();
+    double fChanceFactor = 1.0;
+    while (1) {
+        const CAddrInfo& info = vInfo[vIds[GetRandInt(vIds.size())]];
+        // keep the odds of a new entry proportional to the number of buckets referencing it,
+        // as when positions in the new table were probed directly
+        double fRefFactor = fTried ? 1.0 : (double)info.nRefCount / ADDRMAN_NEW_BUCKETS_PER_ADDRESS;
+        if (GetRandInt(1 << 30) < fChanceFactor * fRefFactor * info.GetChance(nNow) * (1 << 30))
+            return info;
+        fChanceFactor *= 1.2;
     }
 }
 
@@ -379,20 +430,28 @@ int CAddrMan::Check_()
     if (vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-        int n = (*it).first;
-        CAddrInfo& info = (*it).second;
+    if (vTriedIds.size() != nTried || vNewIds.size() != nNew)
+        return -20;
+
+    for (int n = 0; n < (int)vInfo.size(); n++) {
+        CAddrInfo& info = vInfo[n];
+        if (info.nRandomPos == -1)
+            continue;
         if (info.fInTried) {
             if (!info.nLastSuccess)
                 return -1;
             if (info.nRefCount)
                 return -2;
+            if (info.nTablePos < 0 || info.nTablePos >= (int)vTriedIds.size() || vTriedIds[info.nTablePos] != n)
+                return -21;
             setTried.insert(n);
         } else {
             if (info.nRefCount < 0 || info.nRefCount > ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
                 return -3;
             if (!info.nRefCount)
                 return -4;
+            if (info.nTablePos < 0 || info.nTablePos >= (int)vNewIds.size() || vNewIds[info.nTablePos] != n)
+                return -22;
             mapNew[n] = info.nRefCount;
         }
         if (mapAddr[info] != n)
@@ -415,9 +474,9 @@ int CAddrMan::Check_()
             if (vvTried[n][i] != -1) {
                 if (!setTried.count(vvTried[n][i]))
                     return -11;
-                if (mapInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
+                if (vInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
                     return -17;
-                if (mapInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
+                if (vInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
                     return -18;
                 setTried.erase(vvTried[n][i]);
             }
@@ -429,7 +488,7 @@ int CAddrMan::Check_()
             if (vvNew[n][i] != -1) {
                 if (!mapNew.count(vvNew[n][i]))
                     return -12;
-                if (mapInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
+                if (vInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
                     return -19;
                 if (--mapNew[vvNew[n][i]] == 0)
                     mapNew.erase(vvNew[n][i]);
@@ -461,9 +520,7 @@ void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
 
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-
-        const CAddrInfo& ai = mapInfo[vRandom[n]];
+        const CAddrInfo& ai = vInfo[vRandom[n]];
         if (!ai.IsTerrible())
             vAddr.push_back(ai);
     }
@@ -485,6 +542,42 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
-    if (nTime - info.nTime > nUpdateInterval)
+    if (nTime - info.nTime > nUpdateInterval) {
         info.nTime = nTime;
+        fDirty = true;
+    }
+}
+
+void CAddrMan::Handshake_(const CService& addr)
+{
+    CAddrInfo* pinfo = Find(addr);
+    if (!pinfo || *pinfo != addr)
+        return;
+
+    CAddrStats& stats = pinfo->stats;
+    stats.nHandshakes++;
+    stats.nConnAttempts = max(stats.nConnAttempts, stats.nHandshakes);
+    fDirty = true;
+}
+
+void CAddrMan::ReportLatency_(const CService& addr, int64_t nPingUsec)
+{
+    CAddrInfo* pinfo = Find(addr);
+    if (!pinfo || *pinfo != addr || nPingUsec <= 0)
+        return;
+
+    // smooth over the last few pings
+    CAddrStats& stats = pinfo->stats;
+    stats.nPingUsec = stats.nPingUsec ? (3 * stats.nPingUsec + nPingUsec) / 4 : nPingUsec;
+    fDirty = true;
+}
+
+void CAddrMan::Disconnected_(const CService& addr, int64_t nDuration)
+{
+    CAddrInfo* pinfo = Find(addr);
+    if (!pinfo || *pinfo != addr || nDuration <= 0)
+        return;
+
+    pinfo->stats.nUptime += nDuration;
+    fDirty = true;
 }
@@ -17,6 +17,37 @@
 #include <stdint.h>
 #include <vector>
 
+/**
+ * How well connections to an address went, used to prefer good peers for
+ * outbound connections. Kept in peers.dat after the address tables.
+ */
+class CAddrStats
+{
+public:
+    //! smoothed round-trip time of our pings, in microseconds (0 = never measured)
+    int64_t nPingUsec;
+
+    //! outbound connection attempts, and how many of them completed the version handshake
+    uint32_t nConnAttempts;
+    uint32_t nHandshakes;
+
+    //! seconds spent connected, summed over sessions that have ended
+    int64_t nUptime;
+
+    CAddrStats() : nPingUsec(0), nConnAttempts(0), nHandshakes(0), nUptime(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nPingUsec);
+        READWRITE(nConnAttempts);
+        READWRITE(nHandshakes);
+        READWRITE(nUptime);
+    }
+};
+
 /** 
  * Extended statistics about a CAddress 
  */
@@ -41,9 +72,15 @@ private:
     //! in tried set? (memory only)
     bool fInTried;
 
-    //! position in vRandom
+    //! position in vRandom (memory only); -1 for a free slot
     int nRandomPos;
 
+    //! position in vTriedIds or vNewIds (memory only)
+    int nTablePos;
+
+    //! connection quality
+    CAddrStats stats;
+
     friend class CAddrMan;
 
 public:
@@ -66,6 +103,8 @@ public:
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
+        nTablePos = -1;
+        stats = CAddrStats();
     }
 
     CAddrInfo(const CAddress& addrIn, const CNetAddr& addrSource) : CAddress(addrIn), source(addrSource)
@@ -98,6 +137,11 @@ public:
 
     //! Calculate the relative chance this entry should be given when selecting nodes to connect to
     double GetChance(int64_t nNow = GetAdjustedTime()) const;
+
+    //! How much to favor this entry for its latency, handshake success rate and uptime (0.125-4.5)
+    double GetQuality() const;
+
+    const CAddrStats& GetStats() const { return stats; }
 };
 
 /** Stochastic address manager
@@ -122,6 +166,10 @@ public:
  *        tried ones) is evicted from it, back to the "new" buckets.
  *    * Bucket selection is based on cryptographic hashing, using a randomly-generated 256-bit key, which should not
  *      be observable by adversaries.
+ *    * Entries live in a flat vector indexed by nId, and the nIds in each table are also kept in a flat list so an
+ *      entry can be selected without probing empty bucket positions.
+ *    * Outbound selection favors entries with low latency, a high handshake success rate and long sessions, within
+ *      bounds (see CAddrInfo::GetQuality) so well-connected peers cannot crowd out the rest of the table.
  *    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
  *      consistency checks for the entire data structure.
  */
@@ -162,6 +210,9 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+//! connection statistics are halved after this many attempts, so they follow a peer's recent behaviour
+#define ADDRMAN_STATS_MAX_ATTEMPTS 64
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -174,11 +225,11 @@ private:
     //! secret key to randomize bucket select with
     uint256 nKey;
 
-    //! last used nId
-    int nIdCount;
+    //! information about all nIds, indexed by nId; free slots have nRandomPos == -1
+    std::vector<CAddrInfo> vInfo;
 
-    //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    //! free slots in vInfo, reused before it grows
+    std::vector<int> vFreeIds;
 
     //! find an nId based on its network address
     std::map<CNetAddr, int> mapAddr;
@@ -186,6 +237,10 @@ private:
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
 
+    //! nIds in the "tried" table, and nIds referenced from the "new" table, in no particular order
+    std::vector<int> vTriedIds;
+    std::vector<int> vNewIds;
+
     // number of "tried" entries
     int nTried;
 
@@ -198,6 +253,9 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! whether anything changed since the tables were last written out
+    bool fDirty;
+
 protected:
     //! Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int* pnId = NULL);
@@ -209,6 +267,10 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    //! Add an nId to vTriedIds or vNewIds, or remove it.
+    void AddToTable(std::vector<int>& vIds, int nId);
+    void RemoveFromTable(std::vector<int>& vIds, int nId);
+
     //! Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
@@ -242,6 +304,15 @@ protected:
     //! Mark an entry as currently-connected-to.
     void Connected_(const CService& addr, int64_t nTime);
 
+    //! Record a completed handshake with an outbound connection to an entry.
+    void Handshake_(const CService& addr);
+
+    //! Record a ping round-trip time to an entry.
+    void ReportLatency_(const CService& addr, int64_t nPingUsec);
+
+    //! Record the end of a connection to an entry.
+    void Disconnected_(const CService& addr, int64_t nDuration);
+
 public:
     /**
      * serialized format:
@@ -255,11 +326,15 @@ public:
      * * for each bucket:
      *   * number of elements
      *   * for each element: index
+     * * number of addrinfos, then a CAddrStats for each of them, in the order above
      *
      * 2**30 is xorred with the number of buckets to make addrman deserializer v0 detect it
      * as incompatible. This is necessary because it did not check the version number on
      * deserialization.
      *
+     * The connection statistics come last so that older versions, which stop reading after
+     * the buckets, still accept the file; files without them load with empty statistics.
+     *
      * Notice that vvTried, mapAddr and vVector are never encoded explicitly;
      * they are instead reconstructed from the other information.
      *
@@ -275,51 +350,62 @@ public:
     template <typename Stream>
     void Serialize(Stream& s, int nType, int nVersionDummy) const
     {
-        LOCK(cs);
+        // Take a snapshot under the lock and serialize it without holding cs,
+        // so peers.dat writes do not stall the threads handling addresses.
+        uint256 nKeySnapshot;
+        std::vector<CAddrInfo> vNewInfo;
+        std::vector<CAddrInfo> vTriedInfo;
+        std::vector<int> vBuckets; // for each bucket: number of elements, then their indexes
+        {
+            LOCK(cs);
+            nKeySnapshot = nKey;
+            vNewInfo.reserve(nNew);
+            vTriedInfo.reserve(nTried);
+            std::vector<int> vUnkIds(vInfo.size(), -1);
+            for (size_t nId = 0; nId < vInfo.size(); nId++) {
+                const CAddrInfo& info = vInfo[nId];
+                if (info.nRefCount) {
+                    assert((int)vNewInfo.size() != nNew); // this means nNew was wrong, oh ow
+                    vUnkIds[nId] = vNewInfo.size();
+                    vNewInfo.push_back(info);
+                } else if (info.fInTried) {
+                    assert((int)vTriedInfo.size() != nTried); // this means nTried was wrong, oh ow
+                    vTriedInfo.push_back(info);
+                }
+            }
+            for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
+                size_t nSizePos = vBuckets.size();
+                vBuckets.push_back(0);
+                for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
+                    if (vvNew[bucket][i] != -1) {
+                        vBuckets.push_back(vUnkIds[vvNew[bucket][i]]);
+                        vBuckets[nSizePos]++;
+                    }
+                }
+            }
+        }
 
         unsigned char nVersion = 1;
         s << nVersion;
         s << ((unsigned char)32);
-        s << nKey;
-        s << nNew;
-        s << nTried;
+        s << nKeySnapshot;
+        s << (int)vNewInfo.size();
+        s << (int)vTriedInfo.size();
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
-        int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            mapUnkIds[(*it).first] = nIds;
-            const CAddrInfo& info = (*it).second;
-            if (info.nRefCount) {
-                assert(nIds != nNew); // this means nNew was wrong, oh ow
-                s << info;
-                nIds++;
-            }
-        }
-        nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            const CAddrInfo& info = (*it).second;
-            if (info.fInTried) {
-                assert(nIds != nTried); // this means nTried was wrong, oh ow
-                s << info;
-                nIds++;
-            }
-        }
-        for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
-            int nSize = 0;
-            for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-                if (vvNew[bucket][i] != -1)
-                    nSize++;
-            }
-            s << nSize;
-            for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
-                if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
-                    s << nIndex;
-                }
-            }
-        }
+        for (std::vector<CAddrInfo>::const_iterator it = vNewInfo.begin(); it != vNewInfo.end(); it++)
+            s << *it;
+        for (std::vector<CAddrInfo>::const_iterator it = vTriedInfo.begin(); it != vTriedInfo.end(); it++)
+            s << *it;
+        for (std::vector<int>::const_iterator it = vBuckets.begin(); it != vBuckets.end(); it++)
+            s << *it;
+
+        s << (int)(vNewInfo.size() + vTriedInfo.size());
+        for (std::vector<CAddrInfo>::const_iterator it = vNewInfo.begin(); it != vNewInfo.end(); it++)
+            s << it->stats;
+        for (std::vector<CAddrInfo>::const_iterator it = vTriedInfo.begin(); it != vTriedInfo.end(); it++)
+            s << it->stats;
     }
 
     template <typename Stream>
@@ -343,13 +429,25 @@ public:
             nUBuckets ^= (1 << 30);
         }
 
+        if (nNew < 0 || nNew > ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE)
+            throw std::ios_base::failure("Corrupt CAddrMan serialization, nNew exceeds limit");
+        if (nTried < 0 || nTried > ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_BUCKET_SIZE)
+            throw std::ios_base::failure("Corrupt CAddrMan serialization, nTried exceeds limit");
+
+        // nId of every serialized entry (or -1 if it was lost), to attach the statistics to
+        std::vector<int> vSerialIds;
+        vSerialIds.reserve(nNew + nTried);
+
         // Deserialize entries from the new table.
+        vInfo.reserve(nNew + nTried);
+        vInfo.resize(nNew);
         for (int n = 0; n < nNew; n++) {
-            CAddrInfo& info = mapInfo[n];
+            CAddrInfo& info = vInfo[n];
             s >> info;
             mapAddr[info] = n;
             info.nRandomPos = vRandom.size();
             vRandom.push_back(n);
+            vSerialIds.push_back(n);
             if (nVersion != 1 || nUBuckets != ADDRMAN_NEW_BUCKET_COUNT) {
                 // In case the new table data cannot be used (nVersion unknown, or bucket count wrong),
                 // immediately try to give them a reference based on their primary source address.
@@ -361,7 +459,6 @@ public:
                 }
             }
         }
-        nIdCount = nNew;
 
         // Deserialize entries from the tried table.
         int nLost = 0;
@@ -371,14 +468,16 @@ public:
             int nKBucket = info.GetTriedBucket(nKey);
             int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
             if (vvTried[nKBucket][nKBucketPos] == -1) {
+                int nId = vInfo.size();
                 info.nRandomPos = vRandom.size();
                 info.fInTried = true;
-                vRandom.push_back(nIdCount);
-                mapInfo[nIdCount] = info;
-                mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
-                nIdCount++;
+                vRandom.push_back(nId);
+                vInfo.push_back(info);
+                mapAddr[info] = nId;
+                vvTried[nKBucket][nKBucketPos] = nId;
+                vSerialIds.push_back(nId);
             } else {
+                vSerialIds.push_back(-1);
                 nLost++;
             }
         }
@@ -392,7 +491,7 @@ public:
                 int nIndex = 0;
                 s >> nIndex;
                 if (nIndex >= 0 && nIndex < nNew) {
-                    CAddrInfo& info = mapInfo[nIndex];
+                    CAddrInfo& info = vInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
@@ -402,21 +501,41 @@ public:
             }
         }
 
+        // Deserialize connection statistics (absent in files written by older versions).
+        if (!s.empty()) {
+            int nStats = 0;
+            s >> nStats;
+            for (int n = 0; n < nStats; n++) {
+                CAddrStats stats;
+                s >> stats;
+                if (n < (int)vSerialIds.size() && vSerialIds[n] != -1)
+                    vInfo[vSerialIds[n]].stats = stats;
+            }
+        }
+
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end();) {
-            if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
-                Delete(itCopy->first);
+        for (int nId = 0; nId < (int)vInfo.size(); nId++) {
+            const CAddrInfo& info = vInfo[nId];
+            if (info.nRandomPos != -1 && info.fInTried == false && info.nRefCount == 0) {
+                Delete(nId);
                 nLostUnk++;
-            } else {
-                it++;
             }
         }
         if (nLost + nLostUnk > 0) {
             LogPrint("addrman", "addrman lost %i new and %i tried addresses due to collisions\n", nLostUnk, nLost);
         }
 
+        // Rebuild the per-table lists used for selection.
+        for (int nId = 0; nId < (int)vInfo.size(); nId++) {
+            if (vInfo[nId].nRandomPos == -1)
+                continue;
+            if (vInfo[nId].fInTried)
+                AddToTable(vTriedIds, nId);
+            else
+                AddToTable(vNewIds, nId);
+        }
+
         Check();
     }
 
@@ -427,7 +546,13 @@ public:
 
     void Clear()
     {
+        LOCK(cs);
+        std::vector<CAddrInfo>().swap(vInfo);
+        std::vector<int>().swap(vFreeIds);
+        mapAddr.clear();
         std::vector<int>().swap(vRandom);
+        std::vector<int>().swap(vTriedIds);
+        std::vector<int>().swap(vNewIds);
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
@@ -440,9 +565,9 @@ public:
             }
         }
 
-        nIdCount = 0;
         nTried = 0;
         nNew = 0;
+        fDirty = false;
     }
 
     CAddrMan()
@@ -462,6 +587,19 @@ public:
         return vRandom.size();
     }
 
+    //! Whether the tables changed since SetDirty(false) was last called.
+    bool IsDirty()
+    {
+        LOCK(cs);
+        return fDirty;
+    }
+
+    void SetDirty(bool fDirtyIn)
+    {
+        LOCK(cs);
+        fDirty = fDirtyIn;
+    }
+
     //! Consistency check
     void Check()
     {
@@ -561,6 +699,34 @@ public:
             Connected_(addr, nTime);
             Check();
     }
+
+    //! Record a completed handshake with an outbound peer; inbound peers don't count towards its quality.
+    void Handshake(const CService& addr)
+    {
+            LOCK(cs);
+            Check();
+            Handshake_(addr);
+            Check();
+    }
+
+    //! Record the round-trip time of a ping to an outbound peer.
+    void ReportLatency(const CService& addr, int64_t nPingUsec)
+    {
+            LOCK(cs);
+            Check();
+            ReportLatency_(addr, nPingUsec);
+            Check();
+    }
+
+    //! Record how long a connection to an outbound peer lasted, once it is closed.
+    void Disconnected(const CService& addr, int64_t nDuration)
+    {
+            LOCK(cs);
+            Check();
+            Disconnected_(addr, nDuration);
+            Check();
+    }
 };
 
+
 #endif // BITCOIN_ADDRMAN_H
@@ -0,0 +1,396 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "hash.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+/** Golomb-Rice parameters of both filter types, from BIP 158 */
+static const uint8_t BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+namespace
+{
+/** Writes a bit stream, most significant bit first, to a byte vector */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    uint8_t nBuffer;
+    int nOffset; //!< bits of nBuffer already used
+
+public:
+    explicit CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nOffset(0) {}
+    ~CBitWriter() { Flush(); }
+
+    /** Write the nBits (1-64) least significant bits of nData */
+    void Write(uint64_t nData, int nBits)
+    {
+        while (nBits > 0) {
+            int nNow = std::min(8 - nOffset, nBits);
+            nBuffer |= (nData << (64 - nBits)) >> (64 - 8 + nOffset);
+            nOffset += nNow;
+            nBits -= nNow;
+            if (nOffset == 8)
+                Flush();
+        }
+    }
+
+    /** Write out the partial last byte, padded with zero bits */
+    void Flush()
+    {
+        if (nOffset == 0)
+            return;
+        vch.push_back(nBuffer);
+        nBuffer = 0;
+        nOffset = 0;
+    }
+};
+
+/** Reads a bit stream written by CBitWriter */
+class CBitReader
+{
+private:
+    const std::vector<unsigned char>& vch;
+    size_t nPos;
+    uint8_t nBuffer;
+    int nOffset; //!< bits of nBuffer already consumed
+
+public:
+    CBitReader(const std::vector<unsigned char>& vchIn, size_t nPosIn) : vch(vchIn), nPos(nPosIn), nBuffer(0), nOffset(8) {}
+
+    /** Read nBits (1-64) bits; throws std::ios_base::failure past the end */
+    uint64_t Read(int nBits)
+    {
+        uint64_t nData = 0;
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                if (nPos >= vch.size())
+                    throw std::ios_base::failure("CBitReader::Read(): end of data");
+                nBuffer = vch[nPos++];
+                nOffset = 0;
+            }
+            int nNow = std::min(8 - nOffset, nBits);
+            nData <<= nNow;
+            nData |= static_cast<uint8_t>(nBuffer << nOffset) >> (8 - nNow);
+            nOffset += nNow;
+            nBits -= nNow;
+        }
+        return nData;
+    }
+
+    size_t GetPos() const { return nPos; }
+};
+
+void GolombRiceEncode(CBitWriter& writer, uint8_t nP, uint64_t x)
+{
+    // Write quotient as unary-encoded: q 1's followed by one 0.
+    uint64_t q = x >> nP;
+    while (q > 0) {
+        int nBits = q <= 64 ? static_cast<int>(q) : 64;
+        writer.Write(~0ULL, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+
+    // Write the remainder in P bits. Since the remainder is just the bottom
+    // P bits of x, there is no need to mask first.
+    writer.Write(x, nP);
+}
+
+uint64_t GolombRiceDecode(CBitReader& reader, uint8_t nP)
+{
+    // Read unary-encoded quotient: q 1's followed by one 0.
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        ++q;
+
+    uint64_t r = reader.Read(nP);
+
+    return (q << nP) + r;
+}
+
+/** floor(x * n / 2^64): maps a uniform 64-bit hash into [0, n) without a division */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (static_cast<unsigned __int128>(x) * static_cast<unsigned __int128>(n)) >> 64;
+#else
+    uint64_t x_hi = x >> 32;
+    uint64_t x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32;
+    uint64_t n_lo = n & 0xFFFFFFFF;
+
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+
+/** The number of elements, as a CompactSize at the start of an encoded filter */
+uint64_t ReadElementCount(const std::vector<unsigned char>& vch, size_t& nPos)
+{
+    const char* pch = reinterpret_cast<const char*>(vch.data());
+    CDataStream ss(pch, pch + std::min<size_t>(vch.size(), 9), SER_NETWORK, PROTOCOL_VERSION);
+    size_t nSize = ss.size();
+    uint64_t n = ReadCompactSize(ss);
+    nPos = nSize - ss.size();
+    return n;
+}
+} // namespace
+
+uint64_t CGCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t hash = CSipHasher(params.nSipHashK0, params.nSipHashK1)
+                        .Write(element.data(), element.size())
+                        .Finalize();
+    return MapIntoRange(hash, nRange);
+}
+
+std::vector<uint64_t> CGCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vHashed;
+    vHashed.reserve(elements.size());
+    for (ElementSet::const_iterator it = elements.begin(); it != elements.end(); ++it)
+        vHashed.push_back(HashToRange(*it));
+    return vHashed;
+}
+
+CGCSFilter::CGCSFilter(const Params& paramsIn)
+    : params(paramsIn), nElements(0), nRange(0), vchEncoded(1, 0)
+{
+}
+
+CGCSFilter::CGCSFilter(const Params& paramsIn, const std::vector<unsigned char>& vchEncodedIn)
+    : params(paramsIn), vchEncoded(vchEncodedIn)
+{
+    size_t nPos = 0;
+    uint64_t n = ReadElementCount(vchEncoded, nPos);
+    nElements = static_cast<uint32_t>(n);
+    if (nElements != n)
+        throw std::ios_base::failure("N must be <2^32");
+    nRange = static_cast<uint64_t>(nElements) * static_cast<uint64_t>(params.nM);
+
+    // Verify that the encoded filter contains exactly N elements. If it has
+    // too much or too little data, a std::ios_base::failure exception will be
+    // raised.
+    CBitReader reader(vchEncoded, nPos);
+    for (uint64_t i = 0; i < nElements; ++i)
+        GolombRiceDecode(reader, params.nP);
+    if (reader.GetPos() != vchEncoded.size())
+        throw std::ios_base::failure("encoded_filter contains excess data");
+}
+
+CGCSFilter::CGCSFilter(const Params& paramsIn, const ElementSet& elements)
+    : params(paramsIn)
+{
+    size_t nSize = elements.size();
+    nElements = static_cast<uint32_t>(nSize);
+    if (nElements != nSize)
+        throw std::invalid_argument("N must be <2^32");
+    nRange = static_cast<uint64_t>(nElements) * static_cast<uint64_t>(params.nM);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nElements);
+    vchEncoded.assign(ss.begin(), ss.end());
+
+    if (elements.empty())
+        return;
+
+    std::vector<uint64_t> vHashed = BuildHashedSet(elements);
+    std::sort(vHashed.begin(), vHashed.end());
+
+    CBitWriter writer(vchEncoded);
+    uint64_t nLast = 0;
+    for (size_t i = 0; i < vHashed.size(); i++) {
+        GolombRiceEncode(writer, params.nP, vHashed[i] - nLast);
+        nLast = vHashed[i];
+    }
+    writer.Flush();
+}
+
+bool CGCSFilter::MatchInternal(const uint64_t* pElements, size_t nSize) const
+{
+    size_t nPos = 0;
+    ReadElementCount(vchEncoded, nPos);
+    CBitReader reader(vchEncoded, nPos);
+
+    uint64_t nValue = 0;
+    size_t nHashedIndex = 0;
+    for (uint32_t i = 0; i < nElements; ++i) {
+        uint64_t nDelta = GolombRiceDecode(reader, params.nP);
+        nValue += nDelta;
+
+        while (true) {
+            if (nHashedIndex == nSize)
+                return false;
+            else if (pElements[nHashedIndex] == nValue)
+                return true;
+            else if (pElements[nHashedIndex] > nValue)
+                break;
+            nHashedIndex++;
+        }
+    }
+
+    return false;
+}
+
+bool CGCSFilter::Match(const Element& element) const
+{
+    uint64_t nQuery = HashToRange(element);
+    return MatchInternal(&nQuery, 1);
+}
+
+bool CGCSFilter::MatchAny(const ElementSet& elements) const
+{
+    if (elements.empty())
+        return false;
+    std::vector<uint64_t> vQueries = BuildHashedSet(elements);
+    std::sort(vQueries.begin(), vQueries.end());
+    return MatchInternal(vQueries.data(), vQueries.size());
+}
+
+static const std::pair<BlockFilterType, std::string> filterTypeNames[] = {
+    std::make_pair(BLOCK_FILTER_BASIC, std::string("basic")),
+    std::make_pair(BLOCK_FILTER_CONTRACT, std::string("contract")),
+};
+
+const std::string& BlockFilterTypeName(BlockFilterType filterType)
+{
+    static const std::string strUnknown;
+    for (size_t i = 0; i < ARRAYLEN(filterTypeNames); i++) {
+        if (filterTypeNames[i].first == filterType)
+            return filterTypeNames[i].second;
+    }
+    return strUnknown;
+}
+
+bool BlockFilterTypeByName(const std::string& strName, BlockFilterType& filterType)
+{
+    for (size_t i = 0; i < ARRAYLEN(filterTypeNames); i++) {
+        if (filterTypeNames[i].second == strName) {
+            filterType = filterTypeNames[i].first;
+            return true;
+        }
+    }
+    return false;
+}
+
+const std::vector<BlockFilterType>& AllBlockFilterTypes()
+{
+    static std::vector<BlockFilterType> vTypes;
+    if (vTypes.empty()) {
+        for (size_t i = 0; i < ARRAYLEN(filterTypeNames); i++)
+            vTypes.push_back(filterTypeNames[i].first);
+    }
+    return vTypes;
+}
+
+std::string ListBlockFilterTypes()
+{
+    std::string strRet;
+    for (size_t i = 0; i < ARRAYLEN(filterTypeNames); i++) {
+        if (i > 0)
+            strRet += ", ";
+        strRet += filterTypeNames[i].second;
+    }
+    return strRet;
+}
+
+/** The BIP 158 basic filter: every script created or spent, except empty and OP_RETURN ones */
+static CGCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockUndo)
+{
+    CGCSFilter::ElementSet elements;
+
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            const CScript& script = tx.vout[j].scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+
+    for (size_t i = 0; i < blockUndo.vtxundo.size(); i++) {
+        const CTxUndo& txUndo = blockUndo.vtxundo[i];
+        for (size_t j = 0; j < txUndo.vprevout.size(); j++) {
+            const CScript& script = txUndo.vprevout[j].txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+
+    return elements;
+}
+
+CBlockFilter::CBlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vchFilter)
+    : filterType(filterTypeIn), hashBlock(hashBlockIn)
+{
+    CGCSFilter::Params params;
+    if (!BuildParams(params))
+        throw std::invalid_argument("unknown filter_type");
+    filter = CGCSFilter(params, vchFilter);
+}
+
+CBlockFilter::CBlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const CGCSFilter::ElementSet& elements)
+    : filterType(filterTypeIn), hashBlock(hashBlockIn)
+{
+    CGCSFilter::Params params;
+    if (!BuildParams(params))
+        throw std::invalid_argument("unknown filter_type");
+    filter = CGCSFilter(params, elements);
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block, const CBlockUndo& blockUndo)
+    : filterType(BLOCK_FILTER_BASIC), hashBlock(block.GetHash())
+{
+    CGCSFilter::Params params;
+    BuildParams(params);
+    filter = CGCSFilter(params, BasicFilterElements(block, blockUndo));
+}
+
+bool CBlockFilter::BuildParams(CGCSFilter::Params& params) const
+{
+    switch (filterType) {
+    case BLOCK_FILTER_BASIC:
+    case BLOCK_FILTER_CONTRACT:
+        params.nSipHashK0 = hashBlock.Get64(0);
+        params.nSipHashK1 = hashBlock.Get64(1);
+        params.nP = BASIC_FILTER_P;
+        params.nM = BASIC_FILTER_M;
+        return true;
+    case BLOCK_FILTER_INVALID:
+        return false;
+    }
+
+    return false;
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vchData = GetEncodedFilter();
+    return Hash(vchData.begin(), vchData.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    const uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
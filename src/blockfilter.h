@@ -0,0 +1,150 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * Golomb-coded set (BIP 158): a compact, probabilistic set of byte strings.
+ * Elements are hashed into [0, N * M) and the sorted hashes are stored as
+ * Golomb-Rice coded differences, giving a false positive rate of about 1/M.
+ */
+class CGCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    struct Params {
+        uint64_t nSipHashK0;
+        uint64_t nSipHashK1;
+        uint8_t nP; //!< Golomb-Rice coding parameter
+        uint32_t nM; //!< Inverse false positive rate
+
+        Params(uint64_t nSipHashK0In = 0, uint64_t nSipHashK1In = 0, uint8_t nPIn = 0, uint32_t nMIn = 1)
+            : nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn) {}
+    };
+
+private:
+    Params params;
+    uint32_t nElements;
+    uint64_t nRange; //!< nElements * nM, the range hashed elements are mapped into
+    std::vector<unsigned char> vchEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+
+    /** Whether any of the sorted, hashed query values is in the set */
+    bool MatchInternal(const uint64_t* pElements, size_t nSize) const;
+
+public:
+    explicit CGCSFilter(const Params& paramsIn = Params());
+
+    /** Reconstruct a filter from its encoding; throws std::ios_base::failure if it is malformed */
+    CGCSFilter(const Params& paramsIn, const std::vector<unsigned char>& vchEncodedIn);
+
+    /** Build a filter holding the given elements */
+    CGCSFilter(const Params& paramsIn, const ElementSet& elements);
+
+    uint32_t GetN() const { return nElements; }
+    const Params& GetParams() const { return params; }
+    const std::vector<unsigned char>& GetEncoded() const { return vchEncoded; }
+
+    /** Whether the element may be in the set; false positives happen with probability 1/M */
+    bool Match(const Element& element) const;
+
+    /** Whether any of the elements may be in the set; much cheaper than calling Match on each */
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+/** Filter types served by getcfilters and friends */
+enum BlockFilterType : uint8_t {
+    BLOCK_FILTER_BASIC = 0,    //!< BIP 158 basic: output scripts created and spent in the block
+    BLOCK_FILTER_CONTRACT = 1, //!< Lux: contract addresses called or created, log addresses and topics
+    BLOCK_FILTER_INVALID = 255,
+};
+
+/** The name of a filter type, as used by -blockfilterindex and RPC; empty if unknown */
+const std::string& BlockFilterTypeName(BlockFilterType filterType);
+
+/** Find a filter type by name; false if there is none */
+bool BlockFilterTypeByName(const std::string& strName, BlockFilterType& filterType);
+
+/** All known filter types */
+const std::vector<BlockFilterType>& AllBlockFilterTypes();
+
+/** A comma separated list of the known filter type names */
+std::string ListBlockFilterTypes();
+
+/**
+ * The filter of one block: a GCS of its elements, keyed by the block hash so
+ * that nobody can craft elements that collide in every filter.
+ */
+class CBlockFilter
+{
+private:
+    BlockFilterType filterType;
+    uint256 hashBlock;
+    CGCSFilter filter;
+
+    bool BuildParams(CGCSFilter::Params& params) const;
+
+public:
+    CBlockFilter() : filterType(BLOCK_FILTER_INVALID) {}
+
+    /** Reconstruct a filter from its encoding; throws std::ios_base::failure if it is malformed */
+    CBlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vchFilter);
+
+    /** Build a filter over the given elements */
+    CBlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const CGCSFilter::ElementSet& elements);
+
+    /** Build a BIP 158 basic filter for a block, given the outputs it spends */
+    CBlockFilter(const CBlock& block, const CBlockUndo& blockUndo);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const CGCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    /** Hash of the encoded filter */
+    uint256 GetHash() const;
+
+    /** Filter header: the hash of this filter chained to the previous block's header */
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint8_t nFilterType = filterType;
+        std::vector<unsigned char> vchFilter;
+        if (!ser_action.ForRead())
+            vchFilter = GetEncodedFilter();
+        READWRITE(nFilterType);
+        READWRITE(hashBlock);
+        READWRITE(vchFilter);
+        if (ser_action.ForRead()) {
+            filterType = static_cast<BlockFilterType>(nFilterType);
+            CGCSFilter::Params params;
+            if (!BuildParams(params))
+                throw std::ios_base::failure("unknown filter type");
+            filter = CGCSFilter(params, vchFilter);
+        }
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
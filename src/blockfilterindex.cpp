@@ -0,0 +1,375 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilterindex.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "script/script.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+static const char DB_BEST_BLOCK = 'B';
+static const char DB_NEXT_POS = 'P';
+static const char DB_BLOCK_HASH = 'h';
+
+/** Number of blocks indexed between two database writes while catching up */
+static const int FLUSH_INTERVAL = 1000;
+
+static std::map<BlockFilterType, CBlockFilterIndex*> mapBlockFilterIndexes;
+
+/**
+ * Elements of a contract filter: the contracts called by OP_CALL outputs and,
+ * from the receipts kept with -logevents, the contracts created or called
+ * and the addresses and topics of the logs they emitted.
+ */
+static CGCSFilter::ElementSet ContractFilterElements(const CBlock& block)
+{
+    CGCSFilter::ElementSet elements;
+    uint256 hashBlock = block.GetHash();
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        bool fContract = false;
+        BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.HasOpCreate())
+                fContract = true;
+            if (!script.HasOpCall())
+                continue;
+            fContract = true;
+            // The contract address is the last push before OP_CALL
+            CScript::const_iterator pc = script.begin();
+            opcodetype opcode;
+            std::vector<unsigned char> vch, vchLast;
+            while (script.GetOp(pc, opcode, vch)) {
+                if (opcode == OP_CALL && vchLast.size() == 20)
+                    elements.insert(vchLast);
+                vchLast.swap(vch);
+            }
+        }
+        if (!fContract || !fLogEvents || !pstorageresult)
+            continue;
+
+        std::vector<TransactionReceiptInfo> receipts;
+        {
+            LOCK(cs_main);
+            receipts = pstorageresult->getResult(uintToh256(tx.GetHash()));
+        }
+        BOOST_FOREACH (const TransactionReceiptInfo& receipt, receipts) {
+            if (receipt.blockHash != hashBlock)
+                continue;
+            if (receipt.contractAddress != dev::Address())
+                elements.insert(receipt.contractAddress.asBytes());
+            if (receipt.to != dev::Address())
+                elements.insert(receipt.to.asBytes());
+            BOOST_FOREACH (const dev::eth::LogEntry& log, receipt.logs) {
+                elements.insert(log.address.asBytes());
+                BOOST_FOREACH (const dev::h256& topic, log.topics)
+                    elements.insert(topic.asBytes());
+            }
+        }
+    }
+    return elements;
+}
+
+CBlockFilterIndex::CBlockFilterIndex(BlockFilterType filterTypeIn, size_t nCacheSize, bool fWipe)
+    : filterType(filterTypeIn), hashBest(0), posNext(0, 0), fStoppedAtSnapshot(false)
+{
+    pathDir = GetDataDir() / "indexes" / "blockfilter" / BlockFilterTypeName(filterType);
+    boost::filesystem::create_directories(pathDir);
+    pdb.reset(new CLevelDBWrapper(pathDir / "db", nCacheSize, false, fWipe));
+
+    if (pdb->Read(DB_BEST_BLOCK, hashBest) && hashBest != 0 &&
+        !pdb->Read(std::make_pair(DB_BLOCK_HASH, hashBest), entryBest)) {
+        LogPrintf("%s: %s filter index is missing its best block, rebuilding\n", __func__, BlockFilterTypeName(filterType));
+        hashBest = 0;
+    }
+    if (hashBest == 0 || !pdb->Read(DB_NEXT_POS, posNext))
+        posNext = CDiskBlockPos(0, 0);
+}
+
+FILE* CBlockFilterIndex::OpenFilterFile(const CDiskBlockPos& pos, bool fReadOnly) const
+{
+    if (pos.IsNull())
+        return NULL;
+    boost::filesystem::path path = pathDir / strprintf("fltr%05u.dat", pos.nFile);
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    if (!file && !fReadOnly)
+        file = fopen(path.string().c_str(), "wb+");
+    if (!file) {
+        LogPrintf("Unable to open file %s\n", path.string());
+        return NULL;
+    }
+    if (pos.nPos && fseek(file, pos.nPos, SEEK_SET)) {
+        LogPrintf("Unable to seek to position %u of %s\n", pos.nPos, path.string());
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+bool CBlockFilterIndex::WriteFilter(const CBlockFilter& filter, CDiskBlockPos& pos)
+{
+    unsigned int nSize = ::GetSerializeSize(filter, SER_DISK, CLIENT_VERSION);
+    if (posNext.nPos > 0 && posNext.nPos + nSize > MAX_FLTR_FILE_SIZE) {
+        // Everything written to the full file must be on disk before the database points past it
+        CAutoFile fileOld(OpenFilterFile(CDiskBlockPos(posNext.nFile, 0), true), SER_DISK, CLIENT_VERSION);
+        if (fileOld.IsNull())
+            return error("%s: cannot open filter file %u", __func__, posNext.nFile);
+        FileCommit(fileOld.Get());
+        posNext = CDiskBlockPos(posNext.nFile + 1, 0);
+    }
+
+    CAutoFile fileout(OpenFilterFile(posNext, false), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s: cannot open filter file %u", __func__, posNext.nFile);
+    fileout << filter;
+
+    pos = posNext;
+    posNext.nPos += nSize;
+    return true;
+}
+
+bool CBlockFilterIndex::ReadFilter(const CBlockFilterEntry& entry, const uint256& hashBlock, CBlockFilter& filter) const
+{
+    CAutoFile filein(OpenFilterFile(entry.pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: cannot open filter of block %s", __func__, hashBlock.ToString());
+    try {
+        filein >> filter;
+    } catch (const std::exception& e) {
+        return error("%s: deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (filter.GetBlockHash() != hashBlock || filter.GetFilterType() != filterType || filter.GetHash() != entry.hashFilter)
+        return error("%s: filter of block %s is corrupt", __func__, hashBlock.ToString());
+    return true;
+}
+
+bool CBlockFilterIndex::LookupEntry(const CBlockIndex* pindex, CBlockFilterEntry& entry) const
+{
+    uint256 hashBlock = pindex->GetBlockHash();
+    {
+        LOCK(cs);
+        std::map<uint256, CBlockFilterEntry>::const_iterator it = mapPending.find(hashBlock);
+        if (it != mapPending.end()) {
+            entry = it->second;
+            return true;
+        }
+    }
+    return pdb->Read(std::make_pair(DB_BLOCK_HASH, hashBlock), entry);
+}
+
+bool CBlockFilterIndex::IndexBlock(const CBlockIndex* pindex)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+        return error("%s: cannot read block %s", __func__, pindex->GetBlockHash().ToString());
+
+    CBlockFilter filter;
+    if (filterType == BLOCK_FILTER_BASIC) {
+        CBlockUndo blockUndo;
+        if (pindex->pprev) {
+            CDiskBlockPos posUndo;
+            {
+                LOCK(cs_main);
+                posUndo = pindex->GetUndoPos();
+            }
+            if (posUndo.IsNull() || !blockUndo.ReadFromDisk(posUndo, pindex->pprev->GetBlockHash()))
+                return error("%s: cannot read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+        }
+        filter = CBlockFilter(block, blockUndo);
+    } else {
+        filter = CBlockFilter(filterType, block.GetHash(), ContractFilterElements(block));
+    }
+
+    LOCK(cs);
+    CBlockFilterEntry entry;
+    entry.nHeight = pindex->nHeight;
+    entry.hashFilter = filter.GetHash();
+    entry.hashHeader = filter.ComputeHeader(pindex->pprev ? entryBest.hashHeader : uint256(0));
+    if (!WriteFilter(filter, entry.pos))
+        return false;
+    mapPending[pindex->GetBlockHash()] = entry;
+    hashBest = pindex->GetBlockHash();
+    entryBest = entry;
+    return true;
+}
+
+bool CBlockFilterIndex::Flush()
+{
+    LOCK(cs);
+    if (mapPending.empty())
+        return true;
+
+    CAutoFile file(OpenFilterFile(CDiskBlockPos(posNext.nFile, 0), true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: cannot open filter file %u", __func__, posNext.nFile);
+    FileCommit(file.Get());
+
+    CLevelDBBatch batch;
+    for (std::map<uint256, CBlockFilterEntry>::const_iterator it = mapPending.begin(); it != mapPending.end(); ++it)
+        batch.Write(std::make_pair(DB_BLOCK_HASH, it->first), it->second);
+    batch.Write(DB_NEXT_POS, posNext);
+    batch.Write(DB_BEST_BLOCK, hashBest);
+    if (!pdb->WriteBatch(batch, true))
+        return error("%s: failed to write filter index", __func__);
+    mapPending.clear();
+    return true;
+}
+
+bool CBlockFilterIndex::Sync()
+{
+    int nIndexed = 0;
+    while (!boost::this_thread::interruption_requested()) {
+        const CBlockIndex* pindexNext = NULL;
+        {
+            LOCK(cs_main);
+            uint256 hashLast;
+            {
+                LOCK(cs);
+                hashLast = hashBest;
+            }
+            if (hashLast == 0) {
+                pindexNext = chainActive.Genesis();
+            } else {
+                BlockMap::const_iterator mi = mapBlockIndex.find(hashLast);
+                if (mi == mapBlockIndex.end()) {
+                    // Only possible after the block index was rebuilt without us
+                    LOCK(cs);
+                    hashBest = 0;
+                    continue;
+                }
+                const CBlockIndex* pindexLast = mi->second;
+                if (!chainActive.Contains(pindexLast)) {
+                    // Reorganisation: continue from the fork; filters of the
+                    // disconnected blocks stay in the index.
+                    const CBlockIndex* pindexFork = chainActive.FindFork(pindexLast);
+                    CBlockFilterEntry entryFork;
+                    if (!pindexFork || !LookupEntry(pindexFork, entryFork))
+                        return error("%s: no filter for fork point of %s", __func__, hashLast.ToString());
+                    LOCK(cs);
+                    hashBest = pindexFork->GetBlockHash();
+                    entryBest = entryFork;
+                    continue;
+                }
+                pindexNext = chainActive.Next(pindexLast);
+            }
+            // Blocks loaded from a chainstate snapshot have no undo data or
+            // contract receipts, and every later filter header commits to
+            // their filters, so the index cannot get past them.
+            if (pindexNext && (pindexNext->nStatus & BLOCK_ASSUMED_VALID)) {
+                if (!fStoppedAtSnapshot)
+                    LogPrintf("%s filter index cannot cover blocks loaded from a chainstate snapshot, restart with -reindex to build it\n", BlockFilterTypeName(filterType));
+                fStoppedAtSnapshot = true;
+                break;
+            }
+        }
+        if (!pindexNext)
+            break;
+
+        if (!IndexBlock(pindexNext))
+            return false;
+        if (++nIndexed % FLUSH_INTERVAL == 0) {
+            if (!Flush())
+                return false;
+            LogPrint("fltrindex", "%s filter index synced to height %d\n", BlockFilterTypeName(filterType), pindexNext->nHeight);
+        }
+    }
+    return Flush();
+}
+
+bool CBlockFilterIndex::IsSyncedTo(const CBlockIndex* pindex) const
+{
+    CBlockFilterEntry entry;
+    return LookupEntry(pindex, entry);
+}
+
+int CBlockFilterIndex::GetBestHeight() const
+{
+    LOCK(cs);
+    return hashBest == 0 ? -1 : entryBest.nHeight;
+}
+
+bool CBlockFilterIndex::LookupFilter(const CBlockIndex* pindex, CBlockFilter& filter) const
+{
+    CBlockFilterEntry entry;
+    return LookupEntry(pindex, entry) && ReadFilter(entry, pindex->GetBlockHash(), filter);
+}
+
+bool CBlockFilterIndex::LookupFilterHeader(const CBlockIndex* pindex, uint256& hashHeader) const
+{
+    CBlockFilterEntry entry;
+    if (!LookupEntry(pindex, entry))
+        return false;
+    hashHeader = entry.hashHeader;
+    return true;
+}
+
+bool CBlockFilterIndex::LookupFilterRange(int nStartHeight, const CBlockIndex* pindexStop, std::vector<CBlockFilter>& vFilters) const
+{
+    if (nStartHeight < 0 || nStartHeight > pindexStop->nHeight)
+        return false;
+    vFilters.resize(pindexStop->nHeight - nStartHeight + 1);
+    for (const CBlockIndex* pindex = pindexStop; pindex && pindex->nHeight >= nStartHeight; pindex = pindex->pprev) {
+        if (!LookupFilter(pindex, vFilters[pindex->nHeight - nStartHeight]))
+            return false;
+    }
+    return true;
+}
+
+bool CBlockFilterIndex::LookupFilterHashRange(int nStartHeight, const CBlockIndex* pindexStop, std::vector<uint256>& vHashes) const
+{
+    if (nStartHeight < 0 || nStartHeight > pindexStop->nHeight)
+        return false;
+    vHashes.resize(pindexStop->nHeight - nStartHeight + 1);
+    for (const CBlockIndex* pindex = pindexStop; pindex && pindex->nHeight >= nStartHeight; pindex = pindex->pprev) {
+        CBlockFilterEntry entry;
+        if (!LookupEntry(pindex, entry))
+            return false;
+        vHashes[pindex->nHeight - nStartHeight] = entry.hashFilter;
+    }
+    return true;
+}
+
+CBlockFilterIndex* GetBlockFilterIndex(BlockFilterType filterType)
+{
+    std::map<BlockFilterType, CBlockFilterIndex*>::const_iterator it = mapBlockFilterIndexes.find(filterType);
+    return it == mapBlockFilterIndexes.end() ? NULL : it->second;
+}
+
+void InitBlockFilterIndex(BlockFilterType filterType, size_t nCacheSize, bool fWipe)
+{
+    if (!mapBlockFilterIndexes.count(filterType))
+        mapBlockFilterIndexes[filterType] = new CBlockFilterIndex(filterType, nCacheSize, fWipe);
+}
+
+static void ThreadBlockFilterIndex()
+{
+    while (true) {
+        for (std::map<BlockFilterType, CBlockFilterIndex*>::iterator it = mapBlockFilterIndexes.begin(); it != mapBlockFilterIndexes.end(); ++it) {
+            if (!it->second->Sync()) {
+                LogPrintf("%s filter index stopped after an error\n", BlockFilterTypeName(it->first));
+                return;
+            }
+        }
+        MilliSleep(1000);
+    }
+}
+
+void StartBlockFilterIndexes(boost::thread_group& threadGroup)
+{
+    if (!mapBlockFilterIndexes.empty())
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "fltrindex", &ThreadBlockFilterIndex));
+}
+
+void DestroyBlockFilterIndexes()
+{
+    for (std::map<BlockFilterType, CBlockFilterIndex*>::iterator it = mapBlockFilterIndexes.begin(); it != mapBlockFilterIndexes.end(); ++it)
+        delete it->second;
+    mapBlockFilterIndexes.clear();
+}
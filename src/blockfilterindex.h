@@ -0,0 +1,147 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTERINDEX_H
+#define BITCOIN_BLOCKFILTERINDEX_H
+
+#include "blockfilter.h"
+#include "chain.h"
+#include "leveldbwrapper.h"
+#include "sync.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/scoped_ptr.hpp>
+
+class CBlockIndex;
+
+namespace boost
+{
+class thread_group;
+} // namespace boost
+
+/** -blockfilterindex default */
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+/** -peerblockfilters default */
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
+/** Maximum size of a filter data file (fltr?????.dat) */
+static const unsigned int MAX_FLTR_FILE_SIZE = 0x1000000; // 16 MiB
+/** Interval between filter headers returned by getcfcheckpt */
+static const int CFCHECKPT_INTERVAL = 1000;
+/** Maximum number of filters returned for one getcfilters */
+static const int MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of filter hashes returned for one getcfheaders */
+static const int MAX_GETCFHEADERS_SIZE = 2000;
+
+/**
+ * Where the filter of one block is stored, and what a peer needs to check
+ * it: the filter hash and the filter header chained from the genesis block.
+ */
+class CBlockFilterEntry
+{
+public:
+    int nHeight;
+    uint256 hashFilter;
+    uint256 hashHeader;
+    CDiskBlockPos pos;
+
+    CBlockFilterEntry() : nHeight(0), hashFilter(0), hashHeader(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nHeight);
+        READWRITE(hashFilter);
+        READWRITE(hashHeader);
+        READWRITE(pos);
+    }
+};
+
+/**
+ * Compact filters of one type for every block of the active chain, built
+ * once per block in the background (so also during initial block download)
+ * and served to any number of light clients without further work.
+ *
+ * Filters are appended to flat files (indexes/blockfilter/<type>/fltr?????.dat);
+ * a LevelDB database next to them maps block hashes to CBlockFilterEntry and
+ * records the best indexed block. Lookups by height go through the block
+ * index of the active chain. Entries of blocks that were disconnected are
+ * kept, so filters stay available for recent forks.
+ */
+class CBlockFilterIndex
+{
+private:
+    BlockFilterType filterType;
+    boost::filesystem::path pathDir;
+    boost::scoped_ptr<CLevelDBWrapper> pdb;
+
+    //! Guards everything below, and appending to the filter files
+    mutable CCriticalSection cs;
+    //! The last block whose filter was written, and its entry
+    uint256 hashBest;
+    CBlockFilterEntry entryBest;
+    //! Where the next filter is appended
+    CDiskBlockPos posNext;
+    //! Entries of filters written since the last flush
+    std::map<uint256, CBlockFilterEntry> mapPending;
+    //! Whether Sync() reached a block loaded from a chainstate snapshot
+    bool fStoppedAtSnapshot;
+
+    FILE* OpenFilterFile(const CDiskBlockPos& pos, bool fReadOnly) const;
+    bool WriteFilter(const CBlockFilter& filter, CDiskBlockPos& pos);
+    bool ReadFilter(const CBlockFilterEntry& entry, const uint256& hashBlock, CBlockFilter& filter) const;
+    bool LookupEntry(const CBlockIndex* pindex, CBlockFilterEntry& entry) const;
+
+    /** Build the filter of a block following the best indexed one, and append it */
+    bool IndexBlock(const CBlockIndex* pindex);
+
+    /** Sync the filter files, then record the pending entries and the best block */
+    bool Flush();
+
+public:
+    CBlockFilterIndex(BlockFilterType filterTypeIn, size_t nCacheSize, bool fWipe);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+
+    /**
+     * Index blocks of the active chain until the index is caught up with it,
+     * following reorganisations. Stops before blocks loaded from a chainstate
+     * snapshot. Returns false on a disk error.
+     */
+    bool Sync();
+
+    /** Whether the index covers the active chain up to pindex */
+    bool IsSyncedTo(const CBlockIndex* pindex) const;
+
+    /** The height of the last indexed block, or -1 */
+    int GetBestHeight() const;
+
+    bool LookupFilter(const CBlockIndex* pindex, CBlockFilter& filter) const;
+    bool LookupFilterHeader(const CBlockIndex* pindex, uint256& hashHeader) const;
+
+    /** Filters of the blocks from nStartHeight up to pindexStop, which must be in the index */
+    bool LookupFilterRange(int nStartHeight, const CBlockIndex* pindexStop, std::vector<CBlockFilter>& vFilters) const;
+
+    /** Filter hashes of the blocks from nStartHeight up to pindexStop */
+    bool LookupFilterHashRange(int nStartHeight, const CBlockIndex* pindexStop, std::vector<uint256>& vHashes) const;
+};
+
+/** The index of a filter type, or NULL if it is not enabled */
+CBlockFilterIndex* GetBlockFilterIndex(BlockFilterType filterType);
+
+/** Open the index of a filter type; call before StartBlockFilterIndexes */
+void InitBlockFilterIndex(BlockFilterType filterType, size_t nCacheSize, bool fWipe);
+
+/** Build the enabled indexes in the background; no-op if none are enabled */
+void StartBlockFilterIndexes(boost::thread_group& threadGroup);
+
+/** Close all indexes; the thread started by StartBlockFilterIndexes must have been stopped */
+void DestroyBlockFilterIndexes();
+
+#endif // BITCOIN_BLOCKFILTERINDEX_H
@@ -99,6 +99,10 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS = 128, //!< block data in blk*.data was received with a witness-enforcing client
+
+    //! Part of a chainstate loaded from a snapshot: never connected here, so it has no undo data,
+    //! its scripts were not checked and it is not in the transaction or filter indexes.
+    BLOCK_ASSUMED_VALID = 256,
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -206,6 +206,12 @@ public:
         consensus.hashGenesisBlock = genesis.GetHash();
 
         assert(consensus.hashGenesisBlock == uint256("0x00000759bb3da130d7c9aedae170da8335f5a0d01a9007e4c8d3ccd08ace6a42"));
+
+        // Scripts below the last checkpoint (293220) are never checked, so an assumed valid block only
+        // makes a difference above it. Both values are taken from a synced node when cutting a release;
+        // none is known yet, which leaves every script above the checkpoint verified.
+        consensus.defaultAssumeValid = uint256(0);
+        consensus.nMinimumChainWork = uint256(0);
         assert(genesis.hashMerkleRoot == uint256("0xe08ae0cfc35a1d70e6764f347fdc54355206adeb382446dd54c32cd0201000d3"));
 
         vSeeds.push_back(CDNSSeedData("luxseed1.luxcore.io", "luxseed1.luxcore.io")); // DNSSeed
@@ -330,6 +336,8 @@ public:
         nSplitRewardBlock = 1000;
 
         consensus.hashGenesisBlock = genesis.GetHash();
+        consensus.defaultAssumeValid = uint256(0);
+        consensus.nMinimumChainWork = uint256(0);
 
         assert(consensus.hashGenesisBlock == uint256("0x00000ed61786c92e01948df9f543fc2effc17a025ec14f743ec1848dff81233b"));
         assert(genesis.hashMerkleRoot == uint256("0x484415096c0c3f026838b97854d02bbf38aad5449938ef62f1fdd51c371a1696"));
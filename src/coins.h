@@ -333,6 +333,28 @@ struct CCoinsStats {
 };
 
 
+/** Cursor for iterating over CoinsView state */
+class CCoinsViewCursor
+{
+public:
+    CCoinsViewCursor(const uint256& hashBlockIn) : hashBlock(hashBlockIn) {}
+    virtual ~CCoinsViewCursor() {}
+
+    virtual bool GetKey(uint256& key) const = 0;
+    virtual bool GetValue(CCoins& coins) const = 0;
+    //! Get serialized size of the value
+    virtual unsigned int GetValueSize() const = 0;
+
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+
+    //! Get best block at the time this cursor was created
+    const uint256& GetBestBlock() const { return hashBlock; }
+
+private:
+    uint256 hashBlock;
+};
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -354,6 +376,9 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats& stats) const;
 
+    //! Get a cursor to iterate over the whole state; NULL if the view does not support it
+    virtual CCoinsViewCursor* Cursor() const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -373,6 +398,7 @@ public:
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    CCoinsViewCursor* Cursor() const;
 };
 
 class CCoinsViewCache;
@@ -55,6 +55,10 @@ namespace Consensus {
         int64_t nPowTargetTimespan;
         uint256 powLimit;
         uint256 hashGenesisBlock;
+        /** Block whose ancestors' scripts are assumed valid unless -assumevalid overrides it (0 = none) */
+        uint256 defaultAssumeValid;
+        /** Work the best header chain needs before -assumevalid applies, unless -minimumchainwork overrides it */
+        uint256 nMinimumChainWork;
     };
 } // namespace Consensus
 
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,17 @@ public:
     CSHA256& Reset();
 };
 
+/**
+ * Select the fastest SHA-256 implementation the CPU supports and check it
+ * against the portable one. Returns a description of what was selected.
+ * Call once at startup, before any other thread hashes.
+ */
+std::string SHA256AutoDetect();
+
+/**
+ * Compute the double SHA-256 of 'blocks' 64-byte inputs at once, e.g. the
+ * pairs of nodes of one merkle tree level. output may alias input.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -0,0 +1,88 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// Single-stream SHA-256 transform using the x86 SHA extensions.
+// Compiled with -msse4 -msha; only called after CPUID reported them.
+
+#ifdef ENABLE_SHANI
+
+#include <stddef.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace sha256_shani
+{
+namespace
+{
+alignas(16) const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** Four rounds: the state is kept as (ABEF, CDGH) as the SHA instructions expect. */
+void inline QuadRound(__m128i& abef, __m128i& cdgh, __m128i msg, int i)
+{
+    __m128i wk = _mm_add_epi32(msg, _mm_load_si128((const __m128i*)&K[i]));
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e));
+}
+
+/** Next four message words from the previous sixteen, in m0..m3 (m0 oldest); m0 is replaced. */
+void inline Schedule(__m128i& m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+    m0 = _mm_add_epi32(m0, _mm_alignr_epi8(m3, m2, 4));
+    m0 = _mm_sha256msg2_epu32(m0, m3);
+}
+} // namespace
+
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xb1);  // CDAB
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(s + 4)), 0x1b); // EFGH
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    while (blocks--) {
+        const __m128i abef_save = abef, cdgh_save = cdgh;
+        __m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)chunk), MASK);
+        __m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16)), MASK);
+        __m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 32)), MASK);
+        __m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 48)), MASK);
+
+        QuadRound(abef, cdgh, m0, 0);
+        QuadRound(abef, cdgh, m1, 4);
+        QuadRound(abef, cdgh, m2, 8);
+        QuadRound(abef, cdgh, m3, 12);
+        for (int i = 16; i < 64; i += 16) {
+            Schedule(m0, m1, m2, m3);
+            QuadRound(abef, cdgh, m0, i);
+            Schedule(m1, m2, m3, m0);
+            QuadRound(abef, cdgh, m1, i + 4);
+            Schedule(m2, m3, m0, m1);
+            QuadRound(abef, cdgh, m2, i + 8);
+            Schedule(m3, m0, m1, m2);
+            QuadRound(abef, cdgh, m3, i + 12);
+        }
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+        chunk += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);  // FEBA
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1); // DCHG
+    _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(tmp, cdgh, 0xf0)); // DCBA
+    _mm_storeu_si128((__m128i*)(s + 4), _mm_alignr_epi8(cdgh, tmp, 8)); // HGFE
+}
+} // namespace sha256_shani
+
+#endif
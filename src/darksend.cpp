@@ -21,8 +21,10 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #include <algorithm>
+#include <deque>
 #include <boost/assign/list_of.hpp>
 
 using namespace std;
@@ -46,15 +48,33 @@ CActiveMasternode activeMasternode;
 // count peers we've requested the list from
 int RequestedMasterNodeList = 0;
 
+// a darksend message waiting for ThreadCheckDarkSendPool; holds a reference to the peer
+class CDarkSendMessage
+{
+public:
+    CNode* pfrom;
+    std::string strCommand;
+    CDataStream vRecv;
+
+    CDarkSendMessage(CNode* pfromIn, const std::string& strCommandIn, const CDataStream& vRecvIn) :
+        pfrom(pfromIn), strCommand(strCommandIn), vRecv(vRecvIn) {}
+};
+
+static boost::mutex csDarkSendMessages;
+static boost::condition_variable condDarkSendMessages;
+static std::deque<CDarkSendMessage> queueDarkSendMessages;
+
+// guarded by cs_darksend, except the pending and dropped counts which csDarkSendMessages guards
+static CDarkSendStats dsStats;
+
 /* *** BEGIN DARKSEND MAGIC  **********
     Copyright 2014, Darkcoin Developers
         eduffield - evan@darkcoin.io
 */
 
-void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, bool &isDarksend)
+static void ProcessDarksendMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv)
 {
     if (strCommand == "dsf") { //DarkSend Final tx
-        isDarksend = true;
 
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             return;
@@ -79,8 +99,6 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
     }
 
     else if (strCommand == "dsc") { //DarkSend Complete
-        isDarksend = true;
-
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             return;
         }
@@ -104,8 +122,6 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
     }
 
     else if (strCommand == "dsa") { //DarkSend Acceptable
-        isDarksend = true;
-
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             std::string strError = _("Incompatible version.");
             LogPrintf("dsa -- incompatible version! \n");
@@ -157,8 +173,6 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
     }
 
     else if (strCommand == "dsq") { //DarkSend Queue
-        isDarksend = true;
-
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             return;
         }
@@ -210,8 +224,6 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
     }
 
     else if (strCommand == "dsi") { //DarkSend vIn
-        isDarksend = true;
-
         std::string error = "";
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             LogPrintf("dsi -- incompatible version! \n");
@@ -318,7 +330,8 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
             }
 
             bool* pfMissingInputs = nullptr;
-	    if (!AcceptableInputs(mempool, state, CTransaction(tx), false, pfMissingInputs)) {
+            LOCK(cs_main);
+            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, pfMissingInputs)) {
                 LogPrintf("dsi -- transaction not valid! \n");
                 error = _("Transaction not valid.");
                 pfrom->PushMessage("dssu", darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_REJECTED, error);
@@ -337,8 +350,6 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
     }
 
     else if (strCommand == "dssub") { //DarkSend Subscribe To
-        isDarksend = true;
-
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             return;
         }
@@ -351,8 +362,6 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
     }
 
     else if (strCommand == "dssu") { //DarkSend status update
-        isDarksend = true;
-
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             return;
         }
@@ -381,8 +390,6 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
     }
 
     else if (strCommand == "dss") { //DarkSend Sign Final Tx
-        isDarksend = true;
-
         if (pfrom->nVersion < darkSendPool.MIN_PEER_PROTO_VERSION) {
             return;
         }
@@ -390,25 +397,66 @@ void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& v
         vector<CTxIn> sigs;
         vRecv >> sigs;
 
-        bool success = false;
-        int count = 0;
-
-        LogPrintf(" -- sigs count %d %d\n", (int)sigs.size(), count);
+        LogPrintf(" -- sigs count %d\n", (int)sigs.size());
 
-        BOOST_FOREACH(const CTxIn item, sigs)
-        {
-            if(darkSendPool.AddScriptSig(item)) success = true;
-            if(fDebug) LogPrintf(" -- sigs count %d %d\n", (int)sigs.size(), count);
-            count++;
-        }
-
-        if(success){
+        if(darkSendPool.AddScriptSigs(sigs) > 0){
             darkSendPool.Check();
             RelayDarkSendStatus(darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_RESET);
         }
     }
 }
 
+static bool IsDarksendCommand(const std::string& strCommand)
+{
+    return strCommand == "dsf" || strCommand == "dsc" || strCommand == "dsa" || strCommand == "dsq" ||
+           strCommand == "dsi" || strCommand == "dssub" || strCommand == "dssu" || strCommand == "dss";
+}
+
+void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, bool &isDarksend)
+{
+    if (!IsDarksendCommand(strCommand)) return;
+    isDarksend = true;
+
+    // collateral and signature checks can take a while, so a mixing session must not hold up the other peers
+    {
+        boost::lock_guard<boost::mutex> lock(csDarkSendMessages);
+        if (queueDarkSendMessages.size() >= DARKSEND_MAX_PENDING_MESSAGES) {
+            LogPrint("darksend", "ProcessDarksend - too many messages waiting, ignoring %s from peer=%d\n", strCommand, pfrom->id);
+            dsStats.nMessagesDropped++;
+            return;
+        }
+        queueDarkSendMessages.push_back(CDarkSendMessage(pfrom->AddRef(), strCommand, vRecv));
+    }
+    condDarkSendMessages.notify_one();
+}
+
+static void HandleDarksendMessage(CDarkSendMessage& msg)
+{
+    int64_t nStart = GetTimeMicros();
+    try {
+        LOCK(cs_darksend);
+        ProcessDarksendMessage(msg.pfrom, msg.strCommand, msg.vRecv);
+
+        dsStats.nMessagesProcessed++;
+        dsStats.nMessageTimeMax = std::max(dsStats.nMessageTimeMax, GetTimeMicros() - nStart);
+    } catch (const std::exception& e) {
+        LogPrintf("ProcessDarksend - %s from peer=%d failed: %s\n", msg.strCommand, msg.pfrom->id, e.what());
+    }
+    msg.pfrom->Release();
+}
+
+void GetDarkSendStats(CDarkSendStats& stats)
+{
+    {
+        LOCK(cs_darksend);
+        stats = dsStats;
+    }
+
+    boost::lock_guard<boost::mutex> lock(csDarkSendMessages);
+    stats.nMessagesPending = queueDarkSendMessages.size();
+    stats.nMessagesDropped = dsStats.nMessagesDropped;
+}
+
 int randomizeList (int i) { return std::rand()%i;}
 
 // Recursively determine the rounds of a given input (How deep is the darksend chain for a given input)
@@ -460,6 +508,8 @@ void CDarkSendPool::Reset(){
 }
 
 void CDarkSendPool::SetNull(bool clearEverything){
+    EndSession(false);
+
     finalTransaction.vin.clear();
     finalTransaction.vout.clear();
 
@@ -536,6 +586,7 @@ void CDarkSendPool::Check()
     if(state == POOL_STATUS_FINALIZE_TRANSACTION && finalTransaction.vin.empty() && finalTransaction.vout.empty()) {
         if(fDebug) LogPrintf("CDarkSendPool::Check() -- FINALIZE TRANSACTIONS\n");
         UpdateState(POOL_STATUS_SIGNING);
+        signingStartTime = GetTimeMillis();
 
         if (fMasterNode) {
             // make our new transaction
@@ -629,6 +680,7 @@ void CDarkSendPool::Check()
 
                 // Tell the clients it was successful
                 RelayDarkSendCompletedTransaction(sessionID, false, _("Transaction created successfully."));
+                EndSession(true);
 
                 // Randomly charge clients
                 ChargeRandomFees();
@@ -818,6 +870,15 @@ void CDarkSendPool::CheckTimeout(){
         }
     }
 
+    // forget collaterals checked too long ago
+    std::map<uint256, int64_t>::iterator itCollateral = mapCollateralChecked.begin();
+    while(itCollateral != mapCollateralChecked.end()){
+        if(GetTime() - itCollateral->second >= DARKSEND_COLLATERAL_CACHE_TIME)
+            mapCollateralChecked.erase(itCollateral++);
+        else
+            ++itCollateral;
+    }
+
     // check darksend queue objects for timeouts
     int c = 0;
     vector<CDarksendQueue>::iterator it;
@@ -875,6 +936,7 @@ void CDarkSendPool::CheckTimeout(){
             lastTimeChanged = GetTimeMillis();
 
             ChargeFees();
+            EndSession(false);
             // reset session information for the queue query stage (before entering a masternode, clients will send a queue request to make sure they're compatible denomination wise)
             sessionUsers = 0;
             sessionDenom = 0;
@@ -904,69 +966,35 @@ void CDarkSendPool::CheckTimeout(){
     }
 }
 
-// check to see if the signature is valid
-bool CDarkSendPool::SignatureValid(const CScript& newSig, const CTxIn& newVin){
-    CMutableTransaction txNew;
-    txNew.vin.clear();
-    txNew.vout.clear();
-
-    int found = -1;
-    CScript sigPubKey = CScript();
-    unsigned int i = 0;
-
-    BOOST_FOREACH(CDarkSendEntry e, entries) {
-        BOOST_FOREACH(const CTxOut out, e.vout)
-            txNew.vout.push_back(out);
-
-        BOOST_FOREACH(const CDarkSendEntryVin s, e.sev){
-            txNew.vin.push_back(s.vin);
-
-            if(s.vin == newVin){
-                found = i;
-                sigPubKey = s.vin.prevPubKey;
-            }
-            i++;
-        }
-    }
-
-    if(found >= 0){ //might have to do this one input at a time?
-        int n = found;
-        txNew.vin[n].scriptSig = newSig;
-        if (fDebug) LogPrintf("CDarkSendPool::SignatureValid() - Sign with sig %s\n", newSig.ToString().substr(0,24).c_str());
-
-        //TODO: !IMPORTANT Script verifying may not work with witness scripts for dark send TXs, should be thoroughly tested
-
-        CTransaction txPrev;
-        uint256 prevBlockHash;
-        //Find previous transaction with the same output as txNew input
-        if (!GetTransaction(txNew.vin[n].prevout.hash, txPrev, Params().GetConsensus(), prevBlockHash)) {
-            if(fDebug) LogPrintf("CDarkSendPool::SignatureValid() - Signing - Failed to get previous transaction %u\n", n);
-            return false;
-        }
-
-        const CAmount& amount = txPrev.vout[txNew.vin[n].prevout.n].nValue;
-        CScriptWitness *witness;
-        int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
-        //If transaction contains witness, then witness script should be verified
-        if (n < (int)txNew.wit.vtxinwit.size()) {
-            witness = &txNew.wit.vtxinwit[n].scriptWitness;
-            flags |= SCRIPT_VERIFY_WITNESS;
-        } else {
-            witness = nullptr;
-        }
-
-        if (!VerifyScript(txNew.vin[n].scriptSig, sigPubKey, witness, flags, MutableTransactionSignatureChecker(&txNew, n, amount))) {
-            if(fDebug) LogPrintf("CDarkSendPool::SignatureValid() - Signing - Error signing input %u\n", n);
-            return false;
-        }
+//
+// Update the session statistics when a masternode session ends
+//
+void CDarkSendPool::EndSession(bool fCompleted){
+    if(!fMasterNode || sessionStartTime == 0) return;
+
+    if(fCompleted){
+        int64_t nNow = GetTimeMillis();
+        int64_t nSigningStart = signingStartTime ? signingStartTime : nNow;
+
+        dsStats.nSessionsCompleted++;
+        dsStats.nQueueTimeTotal += nSigningStart - sessionStartTime;
+        dsStats.nSigningTimeTotal += nNow - nSigningStart;
+        dsStats.nLastSessionTime = nNow - sessionStartTime;
+        LogPrintf("CDarkSendPool::EndSession -- session %d completed in %dms, %dms of them signing\n", sessionID, nNow - sessionStartTime, nNow - nSigningStart);
+    } else {
+        dsStats.nSessionsFailed++;
     }
 
-    if(fDebug) LogPrintf("CDarkSendPool::SignatureValid() - Signing - Succesfully signed input\n");
-    return true;
+    sessionStartTime = 0;
+    signingStartTime = 0;
 }
 
 // check to make sure the collateral provided by the client is valid
 bool CDarkSendPool::IsCollateralValid(const CTransaction& txCollateral){
+    // the collateral of a "dsa" comes again with the "dsi" that follows it
+    std::map<uint256, int64_t>::const_iterator it = mapCollateralChecked.find(txCollateral.GetHash());
+    if(it != mapCollateralChecked.end() && GetTime() - it->second < DARKSEND_COLLATERAL_CACHE_TIME) return true;
+
     if(txCollateral.vout.size() < 1) return false;
     if(txCollateral.nLockTime != 0) return false;
 
@@ -1009,13 +1037,17 @@ bool CDarkSendPool::IsCollateralValid(const CTransaction& txCollateral){
 
     if(fDebug) LogPrintf("CDarkSendPool::IsCollateralValid %s\n", txCollateral.ToString().c_str());
 
-    CValidationState state;
-    bool* pfMissingInputs = nullptr;
-    if(!AcceptableInputs(mempool, state, txCollateral, false, pfMissingInputs)){
-        if(fDebug) LogPrintf ("CDarkSendPool::IsCollateralValid - didn't pass IsAcceptable\n");
-        return false;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        bool* pfMissingInputs = nullptr;
+        if(!AcceptableInputs(mempool, state, txCollateral, false, pfMissingInputs)){
+            if(fDebug) LogPrintf ("CDarkSendPool::IsCollateralValid - didn't pass IsAcceptable\n");
+            return false;
+        }
     }
 
+    mapCollateralChecked[txCollateral.GetHash()] = GetTime();
     return true;
 }
 
@@ -1080,43 +1112,103 @@ bool CDarkSendPool::AddEntry(const std::vector<CTxIn>& newInput, const int64_t&
     return false;
 }
 
-bool CDarkSendPool::AddScriptSig(const CTxIn newVin){
-    if(fDebug) LogPrintf("CDarkSendPool::AddScriptSig -- new sig  %s\n", newVin.scriptSig.ToString().substr(0,24).c_str());
+//
+// Add the signatures of a client to the final transaction. They are checked together, against
+// one copy of the transaction, so the signature hash work is shared between the inputs.
+//
+int CDarkSendPool::AddScriptSigs(const std::vector<CTxIn>& vNewVin){
+    if(state != POOL_STATUS_SIGNING) {
+        LogPrintf("CDarkSendPool::AddScriptSigs -- Couldn't set sigs, wrong state!\n");
+        return 0;
+    }
 
-    BOOST_FOREACH(const CDarkSendEntry v, entries) {
-        BOOST_FOREACH(const CDarkSendEntryVin s, v.sev){
-            if(s.vin.scriptSig == newVin.scriptSig) {
-                LogPrintf("CDarkSendPool::AddScriptSig - already exists \n");
-                return false;
+    CMutableTransaction txNew = finalTransaction;
+    std::vector<std::pair<unsigned int, CTxIn> > vSigned;
+
+    BOOST_FOREACH(const CTxIn& newVin, vNewVin) {
+        if(fDebug) LogPrintf("CDarkSendPool::AddScriptSigs -- new sig  %s\n", newVin.scriptSig.ToString().substr(0,24).c_str());
+
+        bool fExists = false;
+        BOOST_FOREACH(const CDarkSendEntry& v, entries) {
+            BOOST_FOREACH(const CDarkSendEntryVin& s, v.sev){
+                if(s.vin.scriptSig == newVin.scriptSig) fExists = true;
+            }
+        }
+        if(fExists) {
+            LogPrintf("CDarkSendPool::AddScriptSigs - already exists \n");
+            continue;
+        }
+
+        for(unsigned int i = 0; i < txNew.vin.size(); i++){
+            if(newVin.prevout == txNew.vin[i].prevout && txNew.vin[i].nSequence == newVin.nSequence){
+                txNew.vin[i].scriptSig = newVin.scriptSig;
+                vSigned.push_back(make_pair(i, newVin));
+                break;
             }
         }
     }
 
-    if(!SignatureValid(newVin.scriptSig, newVin)){
-        if(fDebug) LogPrintf("CDarkSendPool::AddScriptSig - Invalid Sig\n");
-        return false;
+    if(vSigned.empty()) {
+        LogPrintf("CDarkSendPool::AddScriptSigs -- Couldn't set sig!\n" );
+        return 0;
     }
 
-    if(fDebug) LogPrintf("CDarkSendPool::AddScriptSig -- sig %s\n", newVin.ToString().c_str());
+    //TODO: !IMPORTANT Script verifying may not work with witness scripts for dark send TXs, should be thoroughly tested
 
-    if(state == POOL_STATUS_SIGNING) {
-        BOOST_FOREACH(CTxIn& vin, finalTransaction.vin){
-            if(newVin.prevout == vin.prevout && vin.nSequence == newVin.nSequence){
-                vin.scriptSig = newVin.scriptSig;
-                vin.prevPubKey = newVin.prevPubKey;
-                if(fDebug) LogPrintf("CDarkSendPool::AddScriptSig -- adding to finalTransaction  %s\n", newVin.scriptSig.ToString().substr(0,24).c_str());
+    // scriptSigs are not part of the signature hash, so all inputs are checked against the same transaction
+    const CTransaction txConst(txNew);
+    PrecomputedTransactionData txdata(txConst);
+    std::vector<bool> vValid(vSigned.size(), false);
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsView viewDummy;
+        CCoinsViewCache view(&viewDummy);
+        CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
+        view.SetBackend(viewMempool);
+
+        for(unsigned int k = 0; k < vSigned.size(); k++){
+            unsigned int n = vSigned[k].first;
+            const COutPoint& prevout = txConst.vin[n].prevout;
+            const CCoins* coins = view.AccessCoins(prevout.hash);
+            if(!coins || !coins->IsAvailable(prevout.n)){
+                if(fDebug) LogPrintf("CDarkSendPool::AddScriptSigs - Signing - Failed to get previous output %u\n", n);
+                continue;
+            }
+
+            const CTxOut& txout = coins->vout[prevout.n];
+            const CScriptWitness* witness = nullptr;
+            int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+            //If transaction contains witness, then witness script should be verified
+            if (n < txConst.wit.vtxinwit.size()) {
+                witness = &txConst.wit.vtxinwit[n].scriptWitness;
+                flags |= SCRIPT_VERIFY_WITNESS;
             }
+
+            vValid[k] = VerifyScript(txConst.vin[n].scriptSig, txout.scriptPubKey, witness, flags, TransactionSignatureChecker(&txConst, n, txout.nValue, txdata));
+            if(!vValid[k] && fDebug) LogPrintf("CDarkSendPool::AddScriptSigs - Signing - Error signing input %u\n", n);
         }
+    }
+
+    int nAdded = 0;
+    for(unsigned int k = 0; k < vSigned.size(); k++){
+        if(!vValid[k]) continue;
+
+        const CTxIn& newVin = vSigned[k].second;
+        CTxIn& vin = finalTransaction.vin[vSigned[k].first];
+        vin.scriptSig = newVin.scriptSig;
+        vin.prevPubKey = newVin.prevPubKey;
+        if(fDebug) LogPrintf("CDarkSendPool::AddScriptSigs -- adding to finalTransaction  %s\n", newVin.scriptSig.ToString().substr(0,24).c_str());
+
         for(unsigned int i = 0; i < entries.size(); i++){
             if(entries[i].AddSig(newVin)){
-                if(fDebug) LogPrintf("CDarkSendPool::AddScriptSig -- adding  %s\n", newVin.scriptSig.ToString().substr(0,24).c_str());
-                return true;
+                if(fDebug) LogPrintf("CDarkSendPool::AddScriptSigs -- adding  %s\n", newVin.scriptSig.ToString().substr(0,24).c_str());
+                nAdded++;
+                break;
             }
         }
     }
 
-    LogPrintf("CDarkSendPool::AddScriptSig -- Couldn't set sig!\n" );
-    return false;
+    return nAdded;
 }
 
 // check to make sure everything is signed
@@ -1851,6 +1943,10 @@ bool CDarkSendPool::IsCompatibleWithSession(int64_t nDenom, CTransaction txColla
         lastTimeChanged = GetTimeMillis();
         entries.clear();
 
+        EndSession(false);
+        sessionStartTime = GetTimeMillis();
+        dsStats.nSessionsStarted++;
+
         if(!unitTest){
             //broadcast that I'm accepting entries, only if it's the first entry though
             CDarksendQueue dsq;
@@ -2150,14 +2246,34 @@ void ThreadCheckDarkSendPool()
 
     unsigned int c = 0;
     std::string errorMessage;
+    int64_t nNextCheck = GetTimeMillis() + 2500;
 
     while (true)
     {
+        // handle darksend messages as they arrive, and the timers every 2.5 seconds
+        std::deque<CDarkSendMessage> queue;
+        {
+            boost::unique_lock<boost::mutex> lock(csDarkSendMessages);
+            while (queueDarkSendMessages.empty()) {
+                int64_t nWait = nNextCheck - GetTimeMillis();
+                if (nWait <= 0) break;
+                condDarkSendMessages.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            }
+            queue.swap(queueDarkSendMessages);
+        }
+
+        BOOST_FOREACH(CDarkSendMessage& msg, queue)
+            HandleDarksendMessage(msg);
+
+        if (GetTimeMillis() < nNextCheck) continue;
+        nNextCheck = GetTimeMillis() + 2500;
         c++;
 
-        MilliSleep(2500);
         //LogPrintf("ThreadCheckDarkSendPool::check timeout\n");
-        darkSendPool.CheckTimeout();
+        {
+            LOCK(cs_darksend);
+            darkSendPool.CheckTimeout();
+        }
 
         if(c % 60 == 0){
             LOCK(cs_main);
@@ -36,6 +36,10 @@ class CActiveMasternode;
 
 #define DARKSEND_QUEUE_TIMEOUT                 120
 #define DARKSEND_SIGNING_TIMEOUT               30
+// darksend messages waiting to be handled beyond this are dropped
+#define DARKSEND_MAX_PENDING_MESSAGES          1000
+// seconds a collateral that passed IsCollateralValid is trusted without checking it again
+#define DARKSEND_COLLATERAL_CACHE_TIME         60
 
 extern CDarkSendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
@@ -44,9 +48,29 @@ extern std::string strMasterNodePrivKey;
 extern map<uint256, CDarksendBroadcastTx> mapDarksendBroadcastTxes;
 extern CActiveMasternode activeMasternode;
 
-//specific messages for the Darksend protocol
+//specific messages for the Darksend protocol, queued for ThreadCheckDarkSendPool
 void ProcessDarksend(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, bool &isDarksend);
 
+struct CDarkSendStats
+{
+    int64_t nMessagesPending;
+    int64_t nMessagesProcessed;
+    int64_t nMessagesDropped;
+    // longest time spent handling one message, in microseconds
+    int64_t nMessageTimeMax;
+    // sessions run as a masternode; times are in milliseconds
+    int64_t nSessionsStarted;
+    int64_t nSessionsCompleted;
+    int64_t nSessionsFailed;
+    // from the first user joining until the final transaction is sent for signing
+    int64_t nQueueTimeTotal;
+    // from sending the final transaction until it is relayed
+    int64_t nSigningTimeTotal;
+    int64_t nLastSessionTime;
+};
+
+void GetDarkSendStats(CDarkSendStats& stats);
+
 // get the darksend chain depth for a given input
 int GetInputDarksendRounds(CTxIn in, int rounds=0);
 
@@ -272,6 +296,13 @@ public:
     //incremented whenever a DSQ comes through
     int64_t nDsqCount;
 
+    //when the current masternode session started and entered signing (0 if not)
+    int64_t sessionStartTime;
+    int64_t signingStartTime;
+
+    //collaterals that passed IsCollateralValid, and when
+    std::map<uint256, int64_t> mapCollateralChecked;
+
     CDarkSendPool()
     {
         /* DarkSend uses collateral addresses to trust parties entering the pool
@@ -284,6 +315,8 @@ public:
         minBlockSpacing = 1;
         nDsqCount = 0;
         lastNewBlock = 0;
+        sessionStartTime = 0;
+        signingStartTime = 0;
 
         SetNull();
     }
@@ -384,14 +417,14 @@ public:
     // rarely charge fees to pay miners
     void ChargeRandomFees();
     void CheckTimeout();
-    // check to make sure a signature matches an input in the pool
-    bool SignatureValid(const CScript& newSig, const CTxIn& newVin);
+    // record the end of a masternode session in the statistics
+    void EndSession(bool fCompleted);
     // if the collateral is valid given by a client
     bool IsCollateralValid(const CTransaction& txCollateral);
     // add a clients entry to the pool
     bool AddEntry(const std::vector<CTxIn>& newInput, const int64_t& nAmount, const CTransaction& txCollateral, const std::vector<CTxOut>& newOutput, std::string& error);
-    // add signature to a vin
-    bool AddScriptSig(const CTxIn newVin);
+    // verify signatures against the final transaction and add the valid ones, returns how many were added
+    int AddScriptSigs(const std::vector<CTxIn>& vNewVin);
     // are all inputs signed?
     bool SignaturesComplete();
     // as a client, send a transaction to a masternode to start the denomination process
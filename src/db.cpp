@@ -5,9 +5,6 @@
 
 #include "db.h"
 
-#include "addrman.h"
-#include "hash.h"
-#include "protocol.h"
 #include "util.h"
 #include "utilstrencodings.h"
 
@@ -21,7 +18,7 @@
 #include <boost/thread.hpp>
 #include <boost/version.hpp>
 
-#include <openssl/rand.h>
+#include <db_cxx.h>
 
 using namespace std;
 using namespace boost;
@@ -36,20 +33,14 @@ unsigned int nWalletDBUpdated;
 
 CDBEnv bitdb;
 
-void CDBEnv::EnvShutdown()
+static void WipeBatch(CLogDB::Batch& batch)
 {
-    if (!fDbEnvInit)
-        return;
-
-    fDbEnvInit = false;
-    int ret = dbenv.close(0);
-    if (ret != 0)
-        LogPrintf("CDBEnv::EnvShutdown : Error %d shutting down database environment: %s\n", ret, DbEnv::strerror(ret));
-    if (!fMockDb)
-        DbEnv(0).remove(strPath.c_str(), 0);
+    for (CLogDB::Batch::iterator it = batch.begin(); it != batch.end(); ++it)
+        if (!it->second.second.empty())
+            memset(&it->second.second[0], 0, it->second.second.size());
 }
 
-CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
+CDBEnv::CDBEnv()
 {
     fDbEnvInit = false;
     fMockDb = false;
@@ -57,12 +48,17 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 
 CDBEnv::~CDBEnv()
 {
-    EnvShutdown();
+    for (map<string, CLogDB*>::iterator it = mapDb.begin(); it != mapDb.end(); ++it)
+        delete it->second;
 }
 
 void CDBEnv::Close()
 {
-    EnvShutdown();
+    LOCK(cs_db);
+    for (map<string, CLogDB*>::iterator it = mapDb.begin(); it != mapDb.end(); ++it)
+        delete it->second;
+    mapDb.clear();
+    fDbEnvInit = false;
 }
 
 bool CDBEnv::Open(const boost::filesystem::path& pathIn)
@@ -73,48 +69,9 @@ bool CDBEnv::Open(const boost::filesystem::path& pathIn)
     boost::this_thread::interruption_point();
 
     strPath = pathIn.string();
-    boost::filesystem::path pathLogDir = pathIn / "database";
-    TryCreateDirectory(pathLogDir);
-    boost::filesystem::path pathErrorFile = pathIn / "db.log";
-    LogPrintf("CDBEnv::Open: LogDir=%s ErrorFile=%s\n", pathLogDir.string(), pathErrorFile.string());
-
-    unsigned int nEnvFlags = 0;
-    if (GetBoolArg("-privdb", true))
-        nEnvFlags |= DB_PRIVATE;
-
-    dbenv.set_lg_dir(pathLogDir.string().c_str());
-    dbenv.set_cachesize(0, 0x100000, 1); // 1 MiB should be enough for just the wallet
-    dbenv.set_lg_bsize(0x10000);
-    dbenv.set_lg_max(1048576);
-    dbenv.set_lk_max_locks(40000);
-    dbenv.set_lk_max_objects(40000);
-    dbenv.set_errfile(fopen(pathErrorFile.string().c_str(), "a")); /// debug
-    dbenv.set_flags(DB_AUTO_COMMIT, 1);
-    dbenv.set_flags(DB_TXN_WRITE_NOSYNC, 1);
-    dbenv.log_set_config(DB_LOG_AUTO_REMOVE, 1);
-    int ret = dbenv.open(strPath.c_str(),
-        DB_CREATE |
-            DB_INIT_LOCK |
-            DB_INIT_LOG |
-            DB_INIT_MPOOL |
-            DB_INIT_TXN |
-            DB_THREAD |
-            DB_RECOVER |
-            nEnvFlags,
-        S_IRUSR | S_IWUSR);
-    if (ret != 0)
-    {
-        LogPrintf("CDBEnv::Open : Error %d opening database environment: %s\n", ret, DbEnv::strerror(ret));
-
-        // According to Berkeley DB specification, we must call dbenv.close() method on failure
-        int ret = dbenv.close(0);
-        if (ret != 0)
-        {
-            LogPrintf("CDBEnv::Open : Error %d shutting down database environment: %s\n", ret, DbEnv::strerror(ret));
-        }
-
-        return error("CDBEnv::Open : Error %d opening database environment: %s\n", ret, DbEnv::strerror(ret));
-    }
+    if (!boost::filesystem::is_directory(pathIn))
+        return error("CDBEnv::Open : %s is not a directory", strPath);
+    LogPrintf("CDBEnv::Open: Path=%s\n", strPath);
 
     fDbEnvInit = true;
     fMockDb = false;
@@ -130,35 +87,6 @@ void CDBEnv::MakeMock()
 
     LogPrint("db", "CDBEnv::MakeMock\n");
 
-    dbenv.set_cachesize(1, 0, 1);
-    dbenv.set_lg_bsize(10485760 * 4);
-    dbenv.set_lg_max(10485760);
-    dbenv.set_lk_max_locks(10000);
-    dbenv.set_lk_max_objects(10000);
-    dbenv.set_flags(DB_AUTO_COMMIT, 1);
-    dbenv.log_set_config(DB_LOG_IN_MEMORY, 1);
-    int ret = dbenv.open(NULL,
-        DB_CREATE |
-            DB_INIT_LOCK |
-            DB_INIT_LOG |
-            DB_INIT_MPOOL |
-            DB_INIT_TXN |
-            DB_THREAD |
-            DB_PRIVATE,
-        S_IRUSR | S_IWUSR);
-    if (ret != 0)
-    {
-        LogPrintf("CDBEnv::MakeMock : Error %d opening database environment: %s\n", ret, DbEnv::strerror(ret));
-
-        // According to Berkeley DB specification, we must call dbenv.close() method on failure
-        int ret = dbenv.close(0);
-        if (ret != 0)
-        {
-            LogPrintf("CDBEnv::MakeMock : Error %d shutting down database environment: %s\n", ret, DbEnv::strerror(ret));
-        }
-        throw runtime_error(strprintf("CDBEnv::MakeMock : Error %d opening database environment.", ret));
-    }
-
     fDbEnvInit = true;
     fMockDb = true;
 }
@@ -168,11 +96,15 @@ CDBEnv::VerifyResult CDBEnv::Verify(std::string strFile, bool (*recoverFunc)(CDB
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
-    Db db(&dbenv, 0);
-    int result = db.verify(strFile.c_str(), NULL, NULL, 0);
-    if (result == 0)
+    // Replaying the log checks every commit, so keep it open for the wallet
+    CLogDB* pdb = new CLogDB((boost::filesystem::path(strPath) / strFile).string());
+    if (pdb->Open(false)) {
+        delete mapDb[strFile];
+        mapDb[strFile] = pdb;
         return VERIFY_OK;
-    else if (recoverFunc == NULL)
+    }
+    delete pdb;
+    if (recoverFunc == NULL)
         return RECOVER_FAIL;
 
     // Try to recover:
@@ -185,23 +117,36 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive, std::vector<CDBEnv::
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
-    u_int32_t flags = DB_SALVAGE;
-    if (fAggressive)
-        flags |= DB_AGGRESSIVE;
-
-    stringstream strDump;
-
-    Db db(&dbenv, 0);
-    int result = db.verify(strFile.c_str(), NULL, &strDump, flags);
-    if (result == DB_VERIFY_BAD) {
+    map<CLogDB::Data, CLogDB::Data> mapRecords;
+    CLogDB::ScanResult result = CLogDB::Scan((boost::filesystem::path(strPath) / strFile).string(), fAggressive, mapRecords);
+    if (result == CLogDB::SCAN_CORRUPT) {
         LogPrintf("CDBEnv::Salvage : Database salvage found errors, all data may not be recoverable.\n");
         if (!fAggressive) {
             LogPrintf("CDBEnv::Salvage : Rerun with aggressive mode to ignore errors and continue.\n");
             return false;
         }
     }
+
+    for (map<CLogDB::Data, CLogDB::Data>::iterator it = mapRecords.begin(); it != mapRecords.end(); ++it) {
+        vResult.push_back(*it);
+        if (!it->second.empty())
+            memset(&it->second[0], 0, it->second.size());
+    }
+
+    return (result != CLogDB::SCAN_CORRUPT);
+}
+
+/** Salvage what BerkeleyDB can read of strFile, like -salvagewallet did before wallets were logs */
+static bool SalvageBerkeleyDB(DbEnv& dbenv, const string& strFile, std::vector<CDBEnv::KeyValPair>& vResult)
+{
+    stringstream strDump;
+
+    Db db(&dbenv, 0);
+    int result = db.verify(strFile.c_str(), NULL, &strDump, DB_SALVAGE | DB_AGGRESSIVE);
+    if (result == DB_VERIFY_BAD)
+        LogPrintf("SalvageBerkeleyDB : Database salvage found errors, all data may not be recoverable.\n");
     if (result != 0 && result != DB_VERIFY_BAD) {
-        LogPrintf("CDBEnv::Salvage : Database salvage failed with result %d.\n", result);
+        LogPrintf("SalvageBerkeleyDB : Database salvage failed with result %d.\n", result);
         return false;
     }
 
@@ -229,28 +174,142 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive, std::vector<CDBEnv::
     return (result == 0);
 }
 
+/** Read every record of the BerkeleyDB file strFile, salvaging it if it can't be read */
+static bool ReadBerkeleyDB(const string& strPath, const string& strFile, std::vector<CDBEnv::KeyValPair>& vResult, bool& fSalvaged)
+{
+    boost::filesystem::path pathLogDir = boost::filesystem::path(strPath) / "database";
+    TryCreateDirectory(pathLogDir);
 
-void CDBEnv::CheckpointLSN(const std::string& strFile)
+    DbEnv dbenv(DB_CXX_NO_EXCEPTIONS);
+    dbenv.set_lg_dir(pathLogDir.string().c_str());
+    dbenv.set_cachesize(0, 0x100000, 1);
+    dbenv.set_lk_max_locks(40000);
+    dbenv.set_lk_max_objects(40000);
+    // DB_RECOVER applies what an unclean shutdown left in the environment logs
+    int ret = dbenv.open(strPath.c_str(),
+        DB_CREATE |
+            DB_INIT_LOCK |
+            DB_INIT_LOG |
+            DB_INIT_MPOOL |
+            DB_INIT_TXN |
+            DB_RECOVER |
+            DB_PRIVATE,
+        S_IRUSR | S_IWUSR);
+    if (ret != 0) {
+        LogPrintf("ReadBerkeleyDB : Error %d opening database environment: %s\n", ret, DbEnv::strerror(ret));
+        dbenv.close(0);
+        return false;
+    }
+
+    bool fRead = false;
+    {
+        Db db(&dbenv, 0);
+        if (db.open(NULL, strFile.c_str(), "main", DB_BTREE, DB_RDONLY, 0) == 0) {
+            Dbc* pcursor = NULL;
+            if (db.cursor(NULL, &pcursor, 0) == 0) {
+                Dbt datKey, datValue;
+                while ((ret = pcursor->get(&datKey, &datValue, DB_NEXT)) == 0) {
+                    const unsigned char* pKey = (const unsigned char*)datKey.get_data();
+                    const unsigned char* pValue = (const unsigned char*)datValue.get_data();
+                    vResult.push_back(make_pair(std::vector<unsigned char>(pKey, pKey + datKey.get_size()),
+                        std::vector<unsigned char>(pValue, pValue + datValue.get_size())));
+                }
+                fRead = (ret == DB_NOTFOUND);
+                pcursor->close();
+            }
+        }
+        db.close(0);
+    }
+
+    fSalvaged = !fRead;
+    if (fSalvaged) {
+        LogPrintf("ReadBerkeleyDB : %s can't be read, salvaging it\n", strFile);
+        vResult.clear();
+        fRead = SalvageBerkeleyDB(dbenv, strFile, vResult) || !vResult.empty();
+    }
+    dbenv.close(0);
+    return fRead;
+}
+
+bool CDBEnv::IsBerkeleyDB(const std::string& strFile)
 {
-    dbenv.txn_checkpoint(0, 0, 0);
     if (fMockDb)
-        return;
-    dbenv.lsn_reset(strFile.c_str(), 0);
+        return false;
+    boost::filesystem::path pathFile = boost::filesystem::path(strPath) / strFile;
+    return boost::filesystem::exists(pathFile) && boost::filesystem::file_size(pathFile) > 0 &&
+           !CLogDB::IsLogFile(pathFile.string());
+}
+
+bool CDBEnv::ImportBerkeleyDB(const std::string& strFile, bool& fSalvaged)
+{
+    LOCK(cs_db);
+    assert(mapFileUseCount.count(strFile) == 0);
+
+    int64_t nStart = GetTimeMillis();
+    LogPrintf("CDBEnv::ImportBerkeleyDB : Converting %s...\n", strFile);
+    std::vector<KeyValPair> vRecords;
+    if (!ReadBerkeleyDB(strPath, strFile, vRecords, fSalvaged))
+        return error("CDBEnv::ImportBerkeleyDB : Unable to read %s", strFile);
+
+    // Write the log next to the file and then move it into place, so a
+    // crash leaves either the BerkeleyDB file or the whole log
+    boost::filesystem::path pathFile = boost::filesystem::path(strPath) / strFile;
+    boost::filesystem::path pathImport = boost::filesystem::path(strPath) / (strFile + ".import");
+    boost::filesystem::path pathBackup = boost::filesystem::path(strPath) / strprintf("%s.%d.bdb", strFile, GetTime());
+    boost::filesystem::remove(pathImport);
+    bool fSuccess;
+    {
+        CLogDB db(pathImport.string());
+        fSuccess = db.Open(true);
+        CLogDB::Batch batch;
+        size_t nBatchSize = 0;
+        for (std::vector<KeyValPair>::iterator it = vRecords.begin(); fSuccess && it != vRecords.end(); ++it) {
+            batch[it->first] = make_pair(false, it->second);
+            nBatchSize += it->first.size() + it->second.size();
+            if (nBatchSize >= 1000000 || it + 1 == vRecords.end()) {
+                fSuccess = db.Commit(batch, false);
+                WipeBatch(batch);
+                batch.clear();
+                nBatchSize = 0;
+            }
+        }
+        fSuccess = fSuccess && db.Sync();
+    }
+    for (std::vector<KeyValPair>::iterator it = vRecords.begin(); it != vRecords.end(); ++it)
+        if (!it->second.empty())
+            memset(&it->second[0], 0, it->second.size());
+
+    if (fSuccess) {
+        try {
+            boost::filesystem::copy_file(pathFile, pathBackup);
+        } catch (const boost::filesystem::filesystem_error& e) {
+            LogPrintf("CDBEnv::ImportBerkeleyDB : Unable to copy %s to %s: %s\n", strFile, pathBackup.string(), e.what());
+            fSuccess = false;
+        }
+    }
+    if (fSuccess)
+        fSuccess = RenameOver(pathImport, pathFile);
+    if (!fSuccess) {
+        boost::filesystem::remove(pathImport);
+        return error("CDBEnv::ImportBerkeleyDB : Unable to convert %s", strFile);
+    }
+
+    // The environment logs only served the BerkeleyDB file
+    boost::filesystem::remove_all(boost::filesystem::path(strPath) / "database");
+    LogPrintf("CDBEnv::ImportBerkeleyDB : Converted %u records of %s in %dms, the original is kept as %s\n",
+        vRecords.size(), strFile, GetTimeMillis() - nStart, pathBackup.string());
+    return true;
 }
 
 
 CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
 {
-    int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
     fFlushOnClose = fFlushOnCloseIn;
     if (strFilename.empty())
         return;
 
     bool fCreate = strchr(pszMode, 'c') != NULL;
-    unsigned int nFlags = DB_THREAD;
-    if (fCreate)
-        nFlags |= DB_CREATE;
 
     {
         LOCK(bitdb.cs_db);
@@ -261,30 +320,17 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
         ++bitdb.mapFileUseCount[strFile];
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
-            pdb = new Db(&bitdb.dbenv, 0);
-
-            bool fMockDb = bitdb.IsMock();
-            if (fMockDb) {
-                DbMpoolFile* mpf = pdb->get_mpf();
-                ret = mpf->set_flags(DB_MPOOL_NOFILE, 1);
-                if (ret != 0)
-                    throw runtime_error(strprintf("CDB : Failed to configure for no temp file backing for database %s", strFile));
-            }
-
-            ret = pdb->open(NULL,                   // Txn pointer
-                fMockDb ? NULL : strFile.c_str(),   // Filename
-                fMockDb ? strFile.c_str() : "main", // Logical db name
-                DB_BTREE,                           // Database type
-                nFlags,                             // Flags
-                0);
-
-            if (ret != 0) {
+            // A mock database lives in memory only
+            pdb = new CLogDB(bitdb.IsMock() ? "" : (GetDataDir() / strFile).string());
+            if (!pdb->Open(fCreate)) {
                 delete pdb;
                 pdb = NULL;
                 --bitdb.mapFileUseCount[strFile];
+                bitdb.mapDb.erase(strFile);
                 strFile = "";
-                throw runtime_error(strprintf("CDB : Error %d, can't open database %s", ret, strFile));
+                throw runtime_error(strprintf("CDB : Can't open database %s", strFilename));
             }
+            bitdb.mapDb[strFile] = pdb;
 
             if (fCreate && !Exists(string("version"))) {
                 bool fTmp = fReadOnly;
@@ -292,23 +338,17 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
                 WriteVersion(CLIENT_VERSION);
                 fReadOnly = fTmp;
             }
-
-            bitdb.mapDb[strFile] = pdb;
         }
     }
 }
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (!pdb || activeTxn)
         return;
 
-    // Flush database activity from memory pool to disk log
-    unsigned int nMinutes = 0;
-    if (fReadOnly)
-        nMinutes = 1;
-
-    bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100) * 1024 : 0, nMinutes, 0);
+    // Move the commits of this handle from the OS cache to disk
+    pdb->Sync();
 }
 
 void CDB::Close()
@@ -316,12 +356,11 @@ void CDB::Close()
     if (!pdb)
         return;
     if (activeTxn)
-        activeTxn->abort();
-    activeTxn = NULL;
-    pdb = NULL;
+        TxnAbort();
 
     if (fFlushOnClose)
         Flush();
+    pdb = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -329,16 +368,140 @@ void CDB::Close()
     }
 }
 
+bool CDB::ReadData(const CDataStream& ssKey, std::vector<unsigned char>& vchValue)
+{
+    CLogDB::Data key(ssKey.begin(), ssKey.end());
+    bool fFound;
+    CLogDB::Batch::const_iterator it;
+    if (activeTxn && (it = activeTxn->find(key)) != activeTxn->end()) {
+        // Reads see the writes of the open transaction
+        fFound = !it->second.first;
+        if (fFound)
+            vchValue = it->second.second;
+    } else
+        fFound = pdb->Read(key, vchValue);
+    memset(&key[0], 0, key.size());
+    return fFound;
+}
+
+bool CDB::WriteData(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && ExistsData(ssKey))
+        return false;
+
+    CLogDB::Batch batchWrite;
+    CLogDB::Batch& batch = activeTxn ? *activeTxn : batchWrite;
+    std::pair<bool, CLogDB::Data>& entry = batch[CLogDB::Data(ssKey.begin(), ssKey.end())];
+    entry.first = false;
+    entry.second.assign(ssValue.begin(), ssValue.end());
+    if (activeTxn)
+        return true;
+
+    bool fSuccess = pdb->Commit(batchWrite, false);
+    WipeBatch(batchWrite);
+    return fSuccess;
+}
+
+bool CDB::EraseData(const CDataStream& ssKey)
+{
+    CLogDB::Data key(ssKey.begin(), ssKey.end());
+    if (activeTxn) {
+        (*activeTxn)[key] = make_pair(true, CLogDB::Data());
+        return true;
+    }
+    if (!pdb->Exists(key))
+        return true;
+
+    CLogDB::Batch batch;
+    batch[key] = make_pair(true, CLogDB::Data());
+    return pdb->Commit(batch, false);
+}
+
+bool CDB::ExistsData(const CDataStream& ssKey)
+{
+    CLogDB::Data key(ssKey.begin(), ssKey.end());
+    CLogDB::Batch::const_iterator it;
+    if (activeTxn && (it = activeTxn->find(key)) != activeTxn->end())
+        return !it->second.first;
+    return pdb->Exists(key);
+}
+
+bool CDB::ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool fSetRange)
+{
+    CLogDB::Data key, value;
+    bool fFound;
+    if (fSetRange)
+        fFound = pdb->Seek(CLogDB::Data(ssKey.begin(), ssKey.end()), true, key, value);
+    else
+        fFound = pdb->Seek(pcursor->vchKey, !pcursor->fStarted, key, value);
+    if (!fFound)
+        return false;
+    pcursor->vchKey = key;
+    pcursor->fStarted = true;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((char*)&key[0], key.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    if (!value.empty()) {
+        ssValue.write((char*)&value[0], value.size());
+        memset(&value[0], 0, value.size());
+    }
+    return true;
+}
+
+bool CDB::TxnBegin()
+{
+    if (!pdb || activeTxn)
+        return false;
+    activeTxn = new CLogDB::Batch();
+    return true;
+}
+
+bool CDB::TxnCommit()
+{
+    if (!pdb || !activeTxn)
+        return false;
+    // The whole transaction is one commit with a single sync
+    bool fSuccess = pdb->Commit(*activeTxn, true);
+    WipeBatch(*activeTxn);
+    delete activeTxn;
+    activeTxn = NULL;
+    return fSuccess;
+}
+
+bool CDB::TxnAbort()
+{
+    if (!pdb || !activeTxn)
+        return false;
+    WipeBatch(*activeTxn);
+    delete activeTxn;
+    activeTxn = NULL;
+    return true;
+}
+
+void CDBEnv::FlushDb(const string& strFile)
+{
+    LOCK(cs_db);
+    map<string, CLogDB*>::iterator mi = mapDb.find(strFile);
+    if (mi == mapDb.end())
+        return;
+    mi->second->Sync();
+    if (mi->second->NeedsCompaction())
+        mi->second->Compact();
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
-        if (mapDb[strFile] != NULL) {
+        map<string, CLogDB*>::iterator mi = mapDb.find(strFile);
+        if (mi != mapDb.end()) {
             // Close the database handle
-            Db* pdb = mapDb[strFile];
-            pdb->close(0);
-            delete pdb;
-            mapDb[strFile] = NULL;
+            delete mi->second;
+            mapDb.erase(mi);
         }
     }
 }
@@ -348,8 +511,9 @@ bool CDBEnv::RemoveDb(const string& strFile)
     this->CloseDb(strFile);
 
     LOCK(cs_db);
-    int rc = dbenv.dbremove(NULL, strFile.c_str(), NULL, DB_AUTO_COMMIT);
-    return (rc == 0);
+    if (fMockDb)
+        return true;
+    return boost::filesystem::remove(boost::filesystem::path(strPath) / strFile);
 }
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
@@ -358,75 +522,17 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
         {
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0) {
-                // Flush log data to the dat file
-                bitdb.CloseDb(strFile);
-                bitdb.CheckpointLSN(strFile);
-                bitdb.mapFileUseCount.erase(strFile);
-
-                bool fSuccess = true;
                 LogPrintf("CDB::Rewrite : Rewriting %s...\n", strFile);
-                string strFileRes = strFile + ".rewrite";
+                bool fSuccess;
                 { // surround usage of db with extra {}
-                    CDB db(strFile.c_str(), "r");
-                    Db* pdbCopy = new Db(&bitdb.dbenv, 0);
-
-                    int ret = pdbCopy->open(NULL, // Txn pointer
-                        strFileRes.c_str(),       // Filename
-                        "main",                   // Logical db name
-                        DB_BTREE,                 // Database type
-                        DB_CREATE,                // Flags
-                        0);
-                    if (ret > 0) {
-                        LogPrintf("CDB::Rewrite : Can't create database file %s\n", strFileRes);
-                        fSuccess = false;
-                    }
-
-                    Dbc* pcursor = db.GetCursor();
-                    if (pcursor)
-                        while (fSuccess) {
-                            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-                            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-                            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
-                            if (ret == DB_NOTFOUND) {
-                                pcursor->close();
-                                break;
-                            } else if (ret != 0) {
-                                pcursor->close();
-                                fSuccess = false;
-                                break;
-                            }
-                            if (pszSkip &&
-                                strncmp(&ssKey[0], pszSkip, std::min(ssKey.size(), strlen(pszSkip))) == 0)
-                                continue;
-                            if (strncmp(&ssKey[0], "\x07version", 8) == 0) {
-                                // Update version:
-                                ssValue.clear();
-                                ssValue << CLIENT_VERSION;
-                            }
-                            Dbt datKey(&ssKey[0], ssKey.size());
-                            Dbt datValue(&ssValue[0], ssValue.size());
-                            int ret2 = pdbCopy->put(NULL, &datKey, &datValue, DB_NOOVERWRITE);
-                            if (ret2 > 0)
-                                fSuccess = false;
-                        }
-                    if (fSuccess) {
-                        db.Close();
-                        bitdb.CloseDb(strFile);
-                        if (pdbCopy->close(0))
-                            fSuccess = false;
-                        delete pdbCopy;
-                    }
-                }
-                if (fSuccess) {
-                    Db dbA(&bitdb.dbenv, 0);
-                    if (dbA.remove(strFile.c_str(), NULL, 0))
-                        fSuccess = false;
-                    Db dbB(&bitdb.dbenv, 0);
-                    if (dbB.rename(strFileRes.c_str(), NULL, strFile.c_str(), 0))
-                        fSuccess = false;
+                    CDB db(strFile.c_str(), "r+", false);
+                    // Compaction drops every superseded record, including
+                    // the unencrypted keys replaced by encrypting the wallet
+                    fSuccess = db.WriteVersion(CLIENT_VERSION) && db.pdb->Compact(pszSkip);
                 }
+                bitdb.mapFileUseCount.erase(strFile);
                 if (!fSuccess)
-                    LogPrintf("CDB::Rewrite : Failed to rewrite database file %s\n", strFileRes);
+                    LogPrintf("CDB::Rewrite : Failed to rewrite database file %s\n", strFile);
                 return fSuccess;
             }
         }
@@ -439,7 +545,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 void CDBEnv::Flush(bool fShutdown)
 {
     int64_t nStart = GetTimeMillis();
-    // Flush log data to the actual data file on all files that are not in use
+    // Write and compact all files that are not in use
     LogPrint("db", "CDBEnv::Flush : Flush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " database not started");
     if (!fDbEnvInit)
         return;
@@ -451,27 +557,16 @@ void CDBEnv::Flush(bool fShutdown)
             int nRefCount = (*mi).second;
             LogPrint("db", "CDBEnv::Flush : Flushing %s (refcount = %d)...\n", strFile, nRefCount);
             if (nRefCount == 0) {
-                // Move log data to the dat file
-                CloseDb(strFile);
-                LogPrint("db", "CDBEnv::Flush : %s checkpoint\n", strFile);
-                dbenv.txn_checkpoint(0, 0, 0);
-                LogPrint("db", "CDBEnv::Flush : %s detach\n", strFile);
-                if (!fMockDb)
-                    dbenv.lsn_reset(strFile.c_str(), 0);
-                LogPrint("db", "CDBEnv::Flush : %s closed\n", strFile);
+                FlushDb(strFile);
+                if (fShutdown)
+                    CloseDb(strFile);
+                LogPrint("db", "CDBEnv::Flush : %s flushed\n", strFile);
                 mapFileUseCount.erase(mi++);
             } else
                 mi++;
         }
         LogPrint("db", "CDBEnv::Flush : Flush(%s)%s took %15dms\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " database not started", GetTimeMillis() - nStart);
-        if (fShutdown) {
-            char** listp;
-            if (mapFileUseCount.empty()) {
-                dbenv.log_archive(&listp, DB_ARCH_REMOVE);
-                Close();
-                if (!fMockDb)
-                    boost::filesystem::remove_all(boost::filesystem::path(strPath) / "database");
-            }
-        }
+        if (fShutdown && mapFileUseCount.empty())
+            Close();
     }
 }
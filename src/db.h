@@ -7,6 +7,7 @@
 #define BITCOIN_DB_H
 
 #include "clientversion.h"
+#include "logdb.h"
 #include "serialize.h"
 #include "streams.h"
 #include "sync.h"
@@ -18,8 +19,6 @@
 
 #include <boost/filesystem/path.hpp>
 
-#include <db_cxx.h>
-
 class CDiskBlockIndex;
 class COutPoint;
 
@@ -27,6 +26,11 @@ struct CBlockLocator;
 
 extern unsigned int nWalletDBUpdated;
 
+/**
+ * Keeps the wallet files open as append-only logs (see logdb.h). Wallets
+ * written by earlier versions are BerkeleyDB files and are converted once by
+ * ImportBerkeleyDB.
+ */
 class CDBEnv
 {
 private:
@@ -36,13 +40,10 @@ private:
     // shutdown problems/crashes caused by a static initialized internal pointer.
     std::string strPath;
 
-    void EnvShutdown();
-
 public:
     mutable CCriticalSection cs_db;
-    DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
-    std::map<std::string, Db*> mapDb;
+    std::map<std::string, CLogDB*> mapDb;
 
     CDBEnv();
     ~CDBEnv();
@@ -61,7 +62,7 @@ public:
     VerifyResult Verify(std::string strFile, bool (*recoverFunc)(CDBEnv& dbenv, std::string strFile));
     /**
      * Salvage data from a file that Verify says is bad.
-     * fAggressive sets the DB_AGGRESSIVE flag (see berkeley DB->verify() method documentation).
+     * fAggressive skips damaged commits instead of stopping at the first one.
      * Appends binary key/value pairs to vResult, returns true if successful.
      * NOTE: reads the entire database into memory, so cannot be used
      * for huge databases.
@@ -69,34 +70,44 @@ public:
     typedef std::pair<std::vector<unsigned char>, std::vector<unsigned char> > KeyValPair;
     bool Salvage(std::string strFile, bool fAggressive, std::vector<KeyValPair>& vResult);
 
+    /** Whether strFile is a BerkeleyDB file that ImportBerkeleyDB has to convert. */
+    bool IsBerkeleyDB(const std::string& strFile);
+    /**
+     * Convert the BerkeleyDB file strFile into a log in place, keeping the
+     * original as strFile.{timestamp}.bdb. A file BerkeleyDB can't read is
+     * salvaged, and fSalvaged is set.
+     */
+    bool ImportBerkeleyDB(const std::string& strFile, bool& fSalvaged);
+
     bool Open(const boost::filesystem::path& path);
     void Close();
     void Flush(bool fShutdown);
-    void CheckpointLSN(const std::string& strFile);
+    /** Write strFile to disk and compact it if enough of it is superseded. */
+    void FlushDb(const std::string& strFile);
 
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
-
-    DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
-    {
-        DbTxn* ptxn = NULL;
-        int ret = dbenv.txn_begin(NULL, &ptxn, flags);
-        if (!ptxn || ret != 0)
-            return NULL;
-        return ptxn;
-    }
 };
 
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Position of a CDB cursor: the key it returned last */
+struct CDBCursor {
+    std::vector<unsigned char> vchKey;
+    bool fStarted;
+
+    CDBCursor() : fStarted(false) {}
+};
+
+/** RAII class that provides access to a wallet database */
 class CDB
 {
 protected:
-    Db* pdb;
+    CLogDB* pdb;
     std::string strFile;
-    DbTxn* activeTxn;
+    /** Writes of the open transaction, committed together */
+    CLogDB::Batch* activeTxn;
     bool fReadOnly;
     bool fFlushOnClose;
 
@@ -111,6 +122,11 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool ReadData(const CDataStream& ssKey, std::vector<unsigned char>& vchValue);
+    bool WriteData(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseData(const CDataStream& ssKey);
+    bool ExistsData(const CDataStream& ssKey);
+
 protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
@@ -122,28 +138,25 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
-        Dbt datValue;
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pdb->get(activeTxn, &datKey, &datValue, 0);
-        memset(datKey.get_data(), 0, datKey.get_size());
-        if (datValue.get_data() == NULL)
+        std::vector<unsigned char> vchValue;
+        if (!ReadData(ssKey, vchValue))
             return false;
 
         // Unserialize value
+        bool fSuccess = true;
         try {
-            CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(vchValue, SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch (const std::exception&) {
-            return false;
+            fSuccess = false;
         }
 
-        // Clear and free memory
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datValue.get_data());
-        return (ret == 0);
+        // Clear memory in case it was a private key
+        if (!vchValue.empty())
+            memset(&vchValue[0], 0, vchValue.size());
+        return fSuccess;
     }
 
     template <typename K, typename T>
@@ -158,21 +171,14 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value; //bad_alloc here
-        Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
-        int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
-
-        // Clear memory in case it was a private key
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        return (ret == 0);
+        return WriteData(ssKey, ssValue, fOverwrite);
     }
 
     template <typename K>
@@ -187,14 +193,9 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
-        int ret = pdb->del(activeTxn, &datKey, 0);
-
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        return (ret == 0 || ret == DB_NOTFOUND);
+        return EraseData(ssKey);
     }
 
     template <typename K>
@@ -207,93 +208,29 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
-        int ret = pdb->exists(activeTxn, &datKey, 0);
-
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        return (ret == 0);
+        return ExistsData(ssKey);
     }
 
-    Dbc* GetCursor()
+    /** Cursors see committed records only, like BerkeleyDB cursors opened outside a transaction */
+    CDBCursor* GetCursor()
     {
         if (!pdb)
             return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
-        if (ret != 0)
-            return NULL;
-        return pcursor;
+        return new CDBCursor();
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
-    {
-        // Read at cursor
-        Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
-        Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
-        }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
-    }
+    /**
+     * Read the record after the cursor, or with fSetRange the first record at
+     * or after ssKey. Returns false after the last record.
+     */
+    bool ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool fSetRange = false);
 
 public:
-    bool TxnBegin()
-    {
-        if (!pdb || activeTxn)
-            return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
-        if (!ptxn)
-            return false;
-        activeTxn = ptxn;
-        return true;
-    }
-
-    bool TxnCommit()
-    {
-        if (!pdb || !activeTxn)
-            return false;
-        int ret = activeTxn->commit(0);
-        activeTxn = NULL;
-        return (ret == 0);
-    }
-
-    bool TxnAbort()
-    {
-        if (!pdb || !activeTxn)
-            return false;
-        int ret = activeTxn->abort();
-        activeTxn = NULL;
-        return (ret == 0);
-    }
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
 
     bool ReadVersion(int& nVersion)
     {
@@ -17,6 +17,8 @@
 #include "ui_interface.h"
 
 #include <boost/algorithm/string.hpp> // boost::trim
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 
 /** Simple one-shot callback timer to be used by the RPC mechanism to e.g.
  * re-lock the wellet.
@@ -55,6 +57,98 @@ private:
 };
 
 
+/** A JSON-RPC batch whose elements are executed by any HTTP worker that
+ * claims them. The worker that received the batch claims elements too, so the
+ * batch completes even if no helper ever gets to run.
+ */
+class JSONRPCBatch
+{
+public:
+    JSONRPCBatch(const UniValue& vReqIn) : vReq(vReqIn), vReply(vReqIn.size()), nNext(0), nDone(0)
+    {
+    }
+
+    /** Execute unclaimed elements until there are none left */
+    void Run()
+    {
+        while (true) {
+            size_t nIndex;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNext >= vReq.size())
+                    return;
+                nIndex = nNext++;
+            }
+            UniValue reply = JSONRPCExecOne(vReq[nIndex]);
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                vReply[nIndex] = reply;
+                nDone++;
+            }
+            cond.notify_all();
+        }
+    }
+
+    /** Wait for elements claimed by other workers, then serialize the replies in request order */
+    std::string Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nDone < vReq.size())
+            cond.wait(lock);
+        UniValue ret(UniValue::VARR);
+        for (size_t i = 0; i < vReply.size(); i++)
+            ret.push_back(vReply[i]);
+        return ret.write() + "\n";
+    }
+
+private:
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    const UniValue vReq;
+    std::vector<UniValue> vReply;
+    size_t nNext;
+    size_t nDone;
+};
+
+/** Work item that lends an HTTP worker thread to a JSON-RPC batch */
+class JSONRPCBatchWorkItem : public HTTPClosure
+{
+public:
+    JSONRPCBatchWorkItem(const boost::shared_ptr<JSONRPCBatch>& batch) : batch(batch)
+    {
+    }
+    void operator()()
+    {
+        batch->Run();
+    }
+
+private:
+    boost::shared_ptr<JSONRPCBatch> batch;
+};
+
+/** Execute a batch, spreading its elements over idle HTTP worker threads.
+ * Helpers are only queued while the work queue has room; calls of one batch
+ * may therefore complete in any order, as JSON-RPC 2.0 permits.
+ */
+static std::string JSONRPCExecBatchParallel(const UniValue& vReq)
+{
+    boost::shared_ptr<JSONRPCBatch> batch(new JSONRPCBatch(vReq));
+
+    HTTPWorkQueueStats stats;
+    if (vReq.size() > 1 && GetHTTPWorkQueueStats(stats)) {
+        size_t nHelpers = std::min(vReq.size() - 1, (size_t)std::max(stats.nThreads - 1, 0));
+        for (size_t i = 0; i < nHelpers; i++) {
+            std::unique_ptr<JSONRPCBatchWorkItem> item(new JSONRPCBatchWorkItem(batch));
+            if (!HTTPEnqueueWork(item.get()))
+                break;
+            item.release(); /* queue took ownership */
+        }
+    }
+
+    batch->Run();
+    return batch->Wait();
+}
+
 /* Pre-base64-encoded authentication token */
 static std::string strRPCUserColonPass;
 /* Stored RPC timer interface (for unregistration) */
@@ -89,6 +183,44 @@ static bool RPCAuthorized(const std::string& strAuth)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
+static void JSONStreamErrorReply(HTTPRequest* req, HTTPReplyStream& stream, const UniValue& objError, const JSONRequest& jreq)
+{
+    if (!stream.Started()) {
+        JSONErrorReply(req, objError, jreq.id);
+        return;
+    }
+    // Too late for an error reply; the client sees a truncated body
+    LogPrintf("%s: %s failed after part of the reply was sent\n", __func__, jreq.strMethod);
+    stream.End();
+}
+
+/** Execute a request for a method with a streaming variant, sending the
+ * reply while it is produced instead of building it in memory first.
+ */
+static bool HTTPReq_JSONRPCStream(HTTPRequest* req, const JSONRequest& jreq)
+{
+    HTTPReplyStream stream(req, "application/json");
+    UniValueStreamWriter writer(boost::bind(&HTTPReplyStream::Write, &stream, _1));
+    try {
+        writer.beginObject();
+        writer.key("result");
+        tableRPC.executeStream(jreq.strMethod, jreq.params, writer);
+        writer.key("error");
+        writer.value(NullUniValue);
+        writer.key("id");
+        writer.value(jreq.id);
+        writer.endObject();
+    } catch (const UniValue& objError) {
+        JSONStreamErrorReply(req, stream, objError, jreq);
+        return false;
+    } catch (const std::exception& e) {
+        JSONStreamErrorReply(req, stream, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq);
+        return false;
+    }
+    stream.End(writer.release() + "\n");
+    return true;
+}
+
 static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
 {
     // JSONRPC handles only POST
@@ -122,11 +254,19 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         if (!valRequest.read(req->ReadBody()))
             throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
+        // Return immediately if in warmup
+        std::string strWarmupStatus;
+        if (RPCIsInWarmup(&strWarmupStatus))
+            throw JSONRPCError(RPC_IN_WARMUP, strWarmupStatus);
+
         std::string strReply;
         // singleton request
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
+            if (tableRPC.canStream(jreq.strMethod))
+                return HTTPReq_JSONRPCStream(req, jreq);
+
             UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
 
             // Send reply
@@ -134,7 +274,7 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
 
         // array of requests
         } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(valRequest.get_array());
+            strReply = JSONRPCExecBatchParallel(valRequest.get_array());
         else
             throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
@@ -152,6 +292,28 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
 
 static bool InitRPCAuthentication()
 {
+    if (((mapArgs["-rpcpassword"] == "") ||
+            (mapArgs["-rpcuser"] == mapArgs["-rpcpassword"])) &&
+        Params().RequireRPCPassword()) {
+        unsigned char rand_pwd[32];
+        GetRandBytes(rand_pwd, 32);
+        uiInterface.ThreadSafeMessageBox(strprintf(
+                                             _("To use luxd, or the -server option to lux-qt, you must set an rpcpassword in the configuration file:\n"
+                                               "%s\n"
+                                               "It is recommended you use the following random password:\n"
+                                               "rpcuser=luxrpc\n"
+                                               "rpcpassword=%s\n"
+                                               "(you do not need to remember this password)\n"
+                                               "The username and password MUST NOT be the same.\n"
+                                               "If the file does not exist, create it with owner-readable-only file permissions.\n"
+                                               "It is also recommended to set alertnotify so you are notified of problems;\n"
+                                               "for example: alertnotify=echo %%s | mail -s \"LUX Alert\" admin@foo.com\n"),
+                                             GetConfigFile().string(),
+                                             EncodeBase58(&rand_pwd[0], &rand_pwd[0] + 32)),
+            "", CClientUIInterface::MSG_ERROR | CClientUIInterface::SECURE);
+        return false;
+    }
+
     if (mapArgs["-rpcpassword"] == "")
     {
         LogPrintf("No rpcpassword set - using random cookie authentication\n");
@@ -197,3 +359,43 @@ void StopHTTPRPC()
     }
 }
 
+UniValue getrpcinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getrpcinfo\n"
+            "\nReturns the state of the HTTP work queue and per-method call statistics.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"workqueue\": {              (json object) absent if the HTTP server is not running\n"
+            "    \"depth\": n,               (numeric) requests waiting for a worker thread\n"
+            "    \"maxdepth\": n,            (numeric) -rpcworkqueue; further requests are answered with 503\n"
+            "    \"threads\": n,             (numeric) running worker threads\n"
+            "    \"rejected\": n             (numeric) requests answered with 503 so far\n"
+            "  },\n"
+            "  \"methods\": {\n"
+            "    \"method\": {               (json object) one entry per method called since startup\n"
+            "      \"calls\": n,             (numeric) number of calls\n"
+            "      \"errors\": n,            (numeric) number of calls that returned an error\n"
+            "      \"avg_us\": n,            (numeric) mean execution time in microseconds\n"
+            "      \"max_us\": n,            (numeric) longest execution time in microseconds\n"
+            "      \"latency\": {...}        (json object) number of calls per execution time bucket\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getrpcinfo", "") + HelpExampleRpc("getrpcinfo", ""));
+
+    UniValue ret(UniValue::VOBJ);
+    HTTPWorkQueueStats stats;
+    if (GetHTTPWorkQueueStats(stats)) {
+        UniValue queue(UniValue::VOBJ);
+        queue.push_back(Pair("depth", (uint64_t)stats.nDepth));
+        queue.push_back(Pair("maxdepth", (uint64_t)stats.nMaxDepth));
+        queue.push_back(Pair("threads", stats.nThreads));
+        queue.push_back(Pair("rejected", stats.nRejected));
+        ret.push_back(Pair("workqueue", queue));
+    }
+    ret.push_back(Pair("methods", RPCGetCallStats()));
+    return ret;
+}
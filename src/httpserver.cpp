@@ -13,6 +13,7 @@
 #include "sync.h"
 #include "ui_interface.h"
 
+#include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -163,6 +164,18 @@ public:
         boost::unique_lock<boost::mutex> lock(cs);
         return queue.size();
     }
+    /** Return maximum depth of queue */
+    size_t MaxDepth()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return maxDepth;
+    }
+    /** Return number of running worker threads */
+    int NumThreads()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return numThreads;
+    }
 };
 
 struct HTTPPathHandler
@@ -187,6 +200,8 @@ struct evhttp* eventHTTP = 0;
 static std::vector<CSubNet> rpc_allow_subnets;
 //! Work queue for handling longer requests off the event loop thread
 static WorkQueue<HTTPClosure>* workQueue = 0;
+//! Requests turned away because the work queue was full
+static std::atomic<uint64_t> nWorkQueueRejected(0);
 //! Handlers for (sub)paths
 std::vector<HTTPPathHandler> pathHandlers;
 std::vector<evhttp_bound_socket *> boundSockets;
@@ -292,8 +307,12 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
         assert(workQueue);
         if (workQueue->Enqueue(item.get()))
             item.release(); /* if true, queue took ownership */
-        else
-            item->req->WriteReply(HTTP_INTERNAL, "Work queue depth exceeded");
+        else {
+            // Tell the client to back off rather than queueing without bound
+            nWorkQueueRejected++;
+            LogPrint("http", "Work queue depth exceeded, rejecting request for %s\n", strURI);
+            item->req->WriteReply(HTTP_SERVUNAVAIL, "Work queue depth exceeded");
+        }
     } else {
         hreq->WriteReply(HTTP_NOTFOUND);
     }
@@ -475,6 +494,7 @@ void StopHTTPServer()
         LogPrint("http", "Waiting for HTTP worker threads to exit\n");
         workQueue->WaitExit();
         delete workQueue;
+        workQueue = 0;
     }
     MilliSleep(500); // Avoid race condition while the last HTTP-thread is exiting
     if (eventBase) {
@@ -511,6 +531,24 @@ struct event_base* EventBase()
     return eventBase;
 }
 
+bool HTTPEnqueueWork(HTTPClosure* item)
+{
+    if (!workQueue)
+        return false;
+    return workQueue->Enqueue(item);
+}
+
+bool GetHTTPWorkQueueStats(HTTPWorkQueueStats& stats)
+{
+    if (!workQueue)
+        return false;
+    stats.nDepth = workQueue->Depth();
+    stats.nMaxDepth = workQueue->MaxDepth();
+    stats.nThreads = workQueue->NumThreads();
+    stats.nRejected = nWorkQueueRejected;
+    return true;
+}
+
 static void httpevent_callback_fn(evutil_socket_t, short, void* data)
 {
     // Static handler: simply call inner handler
@@ -538,12 +576,17 @@ void HTTPEvent::trigger(struct timeval* tv)
         evtimer_add(ev, tv); // trigger after timeval passed
 }
 HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
-                                                       replySent(false)
+                                                       replySent(false),
+                                                       replyStarted(false)
 {
 }
 HTTPRequest::~HTTPRequest()
 {
-    if (!replySent) {
+    if (replyStarted && !replySent) {
+        // A streamed reply that was abandoned midway still has to be completed
+        LogPrintf("%s: Unfinished chunked reply\n", __func__);
+        EndReplyChunked();
+    } else if (!replySent) {
         // Keep track of whether reply was sent to avoid request leaks
         LogPrintf("%s: Unhandled request\n", __func__);
         WriteReply(HTTP_INTERNAL, "Unhandled request");
@@ -596,7 +639,7 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
 {
-    assert(!replySent && req);
+    assert(!replySent && !replyStarted && req);
     // Send event to main http thread to send reply message
     struct evbuffer* evb = evhttp_request_get_output_buffer(req);
     assert(evb);
@@ -608,6 +651,74 @@ void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
     req = 0; // transferred back to main thread
 }
 
+/** Send one chunk of a streamed reply, in the main http thread */
+static void http_send_reply_chunk(struct evhttp_request* req, struct evbuffer* evb)
+{
+    // If the client went away, evhttp has detached the request from its
+    // connection and this is a no-op; the request is freed by the final
+    // evhttp_send_reply_end.
+    evhttp_send_reply_chunk(req, evb);
+    evbuffer_free(evb);
+}
+
+void HTTPRequest::StartReplyChunked(int nStatus)
+{
+    assert(!replySent && !replyStarted && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+        boost::bind(evhttp_send_reply_start, req, nStatus, (const char*)NULL));
+    ev->trigger(0);
+    replyStarted = true;
+}
+
+void HTTPRequest::WriteReplyChunk(const std::string& strChunk)
+{
+    assert(replyStarted && !replySent && req);
+    if (strChunk.empty())
+        return; // an empty chunk would terminate the body
+    struct evbuffer* evb = evbuffer_new();
+    assert(evb);
+    evbuffer_add(evb, strChunk.data(), strChunk.size());
+    // Events triggered from one thread run in order, so chunks cannot overtake each other
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(http_send_reply_chunk, req, evb));
+    ev->trigger(0);
+}
+
+void HTTPRequest::EndReplyChunked()
+{
+    assert(replyStarted && !replySent && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(evhttp_send_reply_end, req));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // transferred back to main thread
+}
+
+HTTPReplyStream::HTTPReplyStream(HTTPRequest* req, const std::string& strContentType) : req(req),
+                                                                                       strContentType(strContentType),
+                                                                                       fStarted(false)
+{
+}
+
+void HTTPReplyStream::Write(const std::string& strChunk)
+{
+    if (!fStarted) {
+        req->WriteHeader("Content-Type", strContentType);
+        req->StartReplyChunked(HTTP_OK);
+        fStarted = true;
+    }
+    req->WriteReplyChunk(strChunk);
+}
+
+void HTTPReplyStream::End(const std::string& strLast)
+{
+    if (!fStarted) {
+        req->WriteHeader("Content-Type", strContentType);
+        req->WriteReply(HTTP_OK, strLast);
+        return;
+    }
+    req->WriteReplyChunk(strLast);
+    req->EndReplyChunked();
+}
+
 CService HTTPRequest::GetPeer()
 {
     evhttp_connection* con = evhttp_request_get_connection(req);
@@ -50,6 +50,26 @@ void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
  */
 struct event_base* EventBase();
 
+class HTTPClosure;
+
+/** Queue a closure on the HTTP worker threads.
+ * Returns true if the queue took ownership of item; false if the queue is
+ * full or the server is not running, in which case the caller keeps it.
+ */
+bool HTTPEnqueueWork(HTTPClosure* item);
+
+/** Snapshot of the HTTP work queue */
+struct HTTPWorkQueueStats
+{
+    size_t nDepth;
+    size_t nMaxDepth;
+    int nThreads;
+    uint64_t nRejected;
+};
+
+/** Fill stats; returns false if the HTTP server is not initialized */
+bool GetHTTPWorkQueueStats(HTTPWorkQueueStats& stats);
+
 /** In-flight HTTP request.
  * Thin C++ wrapper around evhttp_request.
  */
@@ -58,6 +78,7 @@ class HTTPRequest
 private:
     struct evhttp_request* req;
     bool replySent;
+    bool replyStarted;
 
 public:
     HTTPRequest(struct evhttp_request* req);
@@ -113,6 +134,49 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Start a reply whose body follows in WriteReplyChunk calls, using
+     * chunked transfer encoding (HTTP/1.0 clients get a plain body and
+     * the connection is closed after it).
+     *
+     * @note Call WriteHeader before this, and finish with EndReplyChunked
+     * instead of WriteReply.
+     */
+    void StartReplyChunked(int nStatus);
+
+    /** Send part of the body of a reply started with StartReplyChunked. */
+    void WriteReplyChunk(const std::string& strChunk);
+
+    /**
+     * Complete a reply started with StartReplyChunked.
+     *
+     * @note As with WriteReply, do not call any other HTTPRequest methods after this.
+     */
+    void EndReplyChunked();
+};
+
+/** Reply body of unknown length, sent as it is produced.
+ * The status line and headers are only sent with the first chunk, so a
+ * reply that fails before then can still be answered with an error, and
+ * a reply that fits in a single chunk is sent without chunked encoding.
+ */
+class HTTPReplyStream
+{
+public:
+    HTTPReplyStream(HTTPRequest* req, const std::string& strContentType);
+
+    /** Send part of the body; the first call sends status 200 and the headers */
+    void Write(const std::string& strChunk);
+    /** Send the remainder of the body and complete the reply */
+    void End(const std::string& strLast = "");
+    /** Whether any of the body has been sent, after which an error can no longer be reported */
+    bool Started() const { return fStarted; }
+
+private:
+    HTTPRequest* req;
+    std::string strContentType;
+    bool fStarted;
 };
 
 /** Event handler closure.
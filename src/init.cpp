@@ -14,11 +14,16 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilterindex.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
+#include "httprpc.h"
+#include "httpserver.h"
+#include "instantx.h"
 #include "key.h"
 #include "main.h"
 #include "stake.h"
@@ -29,6 +34,7 @@
 #include "rpcserver.h"
 #include "script/standard.h"
 #include "scheme.h"
+#include "snapshot.h"
 #include "spork.h"
 #include "txdb.h"
 #include "script/sigcache.h"
@@ -42,6 +48,7 @@
 #include "wallet.h"
 #include "walletdb.h"
 #include "miner.h"
+#include <db_cxx.h>
 #endif
 
 #include <fstream>
@@ -163,6 +170,7 @@ public:
 static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 static std::unique_ptr<ECCVerifyHandle> globalVerifyHandle;
+static std::vector<BlockFilterType> vEnabledFilterTypes;
 
 /** Preparing steps before shutting down or restarting the wallet */
 void PrepareShutdown()
@@ -181,7 +189,14 @@ void PrepareShutdown()
     /// module was initialized.
     RenameThread("lux-shutoff");
     mempool.AddTransactionsUpdated(1);
-    StopRPCThreads();
+    InterruptHTTPServer();
+    InterruptHTTPRPC();
+    InterruptRPC();
+    InterruptREST();
+    StopHTTPRPC();
+    StopREST();
+    StopRPC();
+    StopHTTPServer();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(false);
@@ -212,6 +227,8 @@ void PrepareShutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsdbwriter;
+        pcoinsdbwriter = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -221,6 +238,7 @@ void PrepareShutdown()
         delete globalState.release();
         globalSealEngine.reset();
     }
+    DestroyBlockFilterIndexes();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(true);
@@ -324,6 +342,23 @@ void OnRPCPreCommand(const CRPCCommand& cmd)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 }
 
+static bool AppInitServers()
+{
+    RPCServer::OnStopped(&OnRPCStopped);
+    RPCServer::OnPreCommand(&OnRPCPreCommand);
+    if (!InitHTTPServer())
+        return false;
+    if (!StartRPC())
+        return false;
+    if (!StartHTTPRPC())
+        return false;
+    if (GetBoolArg("-rest", false) && !StartREST())
+        return false;
+    if (!StartHTTPServer())
+        return false;
+    return true;
+}
+
 std::string HelpMessage(HelpMessageMode mode)
 {
     // When adding new options to the categories, please keep and ensure alphabetical ordering.
@@ -331,6 +366,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -alerts                " + strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS);
+    strUsage += "  -assumevalid=<hex>     " + strprintf(_("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification; takes effect once its header is known (0 to verify all, default: %s)"), Params(CBaseChainParams::MAIN).GetConsensus().defaultAssumeValid.GetHex()) + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
     strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 500) + "\n";
     strUsage += "  -checklevel=<n>        " + strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3) + "\n";
@@ -343,7 +379,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
+    strUsage += "  -loadtxoutset=<file>   " + _("Bootstrap an empty chainstate (e.g. with -reindex-chainstate) from a dumptxoutset file; block data up to its block must be present") + " " + _("on startup") + "\n";
+    strUsage += "  -loadtxoutsethash=<hex> " + _("Expected hash_serialized of the -loadtxoutset file, taken from gettxoutsetinfo on a trusted node") + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -minimumchainwork=<hex> " + strprintf(_("Minimum work of the best header chain before -assumevalid applies (default: %s)"), Params(CBaseChainParams::MAIN).GetConsensus().nMinimumChainWork.GetHex()) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"), "luxd.pid") + "\n";
@@ -361,10 +400,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -txindex               " + strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0) + "\n";
 
     strUsage += "  -logevents             " + strprintf(_("Maintain a full EVM log index, used by searchlogs and gettransactionreceipt rpc calls (default: %u)"), false) + "\n";
+    strUsage += "  -blockfilterindex=<type> " + strprintf(_("Maintain an index of compact filters by block (default: %s, values: %s)."), "0", ListBlockFilterTypes()) + " " +
+                                              _("If <type> is not supplied or if <type> = 1, indexes for all known types are enabled.") + " " +
+                                              _("The contract filter type requires -logevents.") + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
     strUsage += "  -banscore=<n>          " + strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), 100) + "\n";
+    strUsage += "  -peerblockfilters      " + strprintf(_("Serve compact block filters to peers per BIP 157 (default: %u)"), DEFAULT_PEERBLOCKFILTERS) + "\n";
     strUsage += "  -bantime=<n>           " + strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), 86400) + "\n";
     strUsage += "  -bind=<addr>           " + _("Bind to given address and always listen on it. Use [host]:port notation for IPv6") + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
@@ -377,6 +420,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -maxconnections=<n>    " + strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125) + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000) + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000) + "\n";
+    strUsage += "  -maxuploadtarget=<n>   " + strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET) + "\n";
     strUsage += "  -onion=<ip:port>       " + strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)") + "\n";
     strUsage += "  -permitbaremultisig    " + strprintf(_("Relay non-P2SH multisig (default: %u)"), 1) + "\n";
@@ -432,7 +476,6 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "\n" + _("Debugging/Testing options:") + "\n";
     if (GetBoolArg("-help-debug", false)) {
         strUsage += "  -checkpoints           " + strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1) + "\n";
-        strUsage += "  -dblogsize=<n>         " + strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100) + "\n";
         strUsage += "  -disablesafemode       " + strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0) + "\n";
         strUsage += "  -testsafemode          " + strprintf(_("Force safe mode (default: %u)"), 0) + "\n";
         strUsage += "  -dropmessagestest=<n>  " + _("Randomly drop 1 of every <n> network messages") + "\n";
@@ -464,7 +507,6 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -printtoconsole        " + strprintf(_("Send trace/debug info to console instead of debug.log file (default: %u)"), 0) + "\n";
     if (GetBoolArg("-help-debug", false)) {
         strUsage += "  -printpriority         " + strprintf(_("Log transaction priority and fee per kB when mining blocks (default: %u)"), 0) + "\n";
-        strUsage += "  -privdb                " + strprintf(_("Sets the DB_PRIVATE flag in the wallet db environment (default: %u)"), 1) + "\n";
         strUsage += "  -regtest               " + _("Enter regression test mode, which uses a special chain in which blocks can be solved instantly.") + "\n";
         strUsage += "                         " + _("This is intended for regression testing tools and app development.") + "\n";
         strUsage += "                         " + _("In this mode -genproclimit controls how many blocks are generated immediately.") + "\n";
@@ -508,14 +550,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + strprintf(_("Listen for JSON-RPC connections on <port> (default: %u or testnet: %u)"), 51473, 51475) + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified source. Valid for <ip> are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24). This option can be specified multiple times") + "\n";
-    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), 4) + "\n";
-    strUsage += "  -rpckeepalive          " + strprintf(_("RPC support for HTTP persistent connections (default: %d)"), 1) + "\n";
-
-    strUsage += "\n" + _("RPC SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n";
-    strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
-    strUsage += "  -rpcsslcertificatechainfile=<file.cert>  " + strprintf(_("Server certificate file (default: %s)"), "server.cert") + "\n";
-    strUsage += "  -rpcsslprivatekeyfile=<file.pem>         " + strprintf(_("Server private key (default: %s)"), "server.pem") + "\n";
-    strUsage += "  -rpcsslciphers=<ciphers>                 " + strprintf(_("Acceptable ciphers (default: %s)"), "TLSv1.2+HIGH:TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!3DES:@STRENGTH") + "\n";
+    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_HTTP_THREADS) + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls; requests beyond it are answered with HTTP 503 (default: %d)"), DEFAULT_HTTP_WORKQUEUE) + "\n";
+    strUsage += "  -rpcservertimeout=<n>  " + strprintf(_("Timeout during HTTP requests (default: %d)"), DEFAULT_HTTP_SERVER_TIMEOUT) + "\n";
 
     return strUsage;
 }
@@ -583,18 +620,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE* file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
-        }
+        ReindexBlockFiles(chainparams);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -668,8 +694,7 @@ bool InitSanityCheck(void)
     globalVerifyHandle.reset(new ECCVerifyHandle());
 
     if (!ECC_InitSanityCheck()) {
-        InitError("OpenSSL appears to lack support for elliptic curve cryptography. For more "
-                  "information, visit https://en.bitcoin.it/wiki/OpenSSL_and_EC_Libraries");
+        InitError("Elliptic curve cryptography sanity check failure. Aborting.");
         return false;
     }
     if (!glibc_sanity_test() || !glibcxx_sanity_test())
@@ -835,9 +860,35 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
     if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
         nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
 
+    if (mapArgs.count("-blockfilterindex") && GetArg("-blockfilterindex", "") != "0") {
+        std::vector<std::string> vNames = mapMultiArgs["-blockfilterindex"];
+        if (std::find(vNames.begin(), vNames.end(), "1") != vNames.end() ||
+            std::find(vNames.begin(), vNames.end(), "") != vNames.end()) {
+            vEnabledFilterTypes = AllBlockFilterTypes();
+        } else {
+            BOOST_FOREACH (const std::string& strName, vNames) {
+                BlockFilterType filterType;
+                if (!BlockFilterTypeByName(strName, filterType))
+                    return InitError(strprintf(_("Unknown -blockfilterindex value %s."), strName));
+                if (std::find(vEnabledFilterTypes.begin(), vEnabledFilterTypes.end(), filterType) == vEnabledFilterTypes.end())
+                    vEnabledFilterTypes.push_back(filterType);
+            }
+        }
+        if (std::find(vEnabledFilterTypes.begin(), vEnabledFilterTypes.end(), BLOCK_FILTER_CONTRACT) != vEnabledFilterTypes.end() &&
+            !GetBoolArg("-logevents", false))
+            return InitError(_("The contract block filter index requires -logevents."));
+    }
+
+    // Basic filters are the only type BIP 157 clients know how to ask for
+    if (GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS) &&
+        std::find(vEnabledFilterTypes.begin(), vEnabledFilterTypes.end(), BLOCK_FILTER_BASIC) == vEnabledFilterTypes.end())
+        return InitError(_("Cannot set -peerblockfilters without -blockfilterindex."));
+
     if (GetArg("-prune", 0)) {
         if (GetBoolArg("-txindex", false))
             return InitError(_("Prune mode is incompatible with -txindex."));
+        if (!vEnabledFilterTypes.empty())
+            return InitError(_("Prune mode is incompatible with -blockfilterindex."));
 #ifdef ENABLE_WALLET
         if (!GetBoolArg("-disablewallet", false)) {
             if (SoftSetBoolArg("-disablewallet", true))
@@ -874,6 +925,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
+    hashAssumeValid = uint256S(GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
+    nMinimumChainWork = uint256S(GetArg("-minimumchainwork", chainparams.GetConsensus().nMinimumChainWork.GetHex()));
+    if (hashAssumeValid != 0)
+        LogPrintf("Assuming ancestors of block %s have valid signatures (minimum chain work %s).\n", hashAssumeValid.GetHex(), nMinimumChainWork.GetHex());
+    else
+        LogPrintf("Validating signatures for all blocks.\n");
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
     if (nScriptCheckThreads <= 0)
@@ -981,8 +1039,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
     if (GetBoolArg("-peerbloomfilters", false))
         nLocalServices = ServiceFlags(nLocalServices | NODE_BLOOM);
 
+    fPeerBlockFilters = GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS);
+    if (fPeerBlockFilters)
+        nLocalServices = ServiceFlags(nLocalServices | NODE_COMPACT_FILTERS);
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
+    // Pick the SHA-256 backend before anything else hashes; it checks itself against the portable one
+    std::string strSHA256Algo = SHA256AutoDetect();
+
     // Sanity check
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. Luxcore is shutting down."));
@@ -1011,8 +1076,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("LUX version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using the '%s' SHA256 implementation\n", strSHA256Algo);
 #ifdef ENABLE_WALLET
-    LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
+    LogPrintf("Using BerkeleyDB version %s to convert older wallets\n", DbEnv::version(0, 0, 0));
 #endif
 
     ////////////////////////////////////////////////////////////////////// // lux
@@ -1051,9 +1117,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
      */
     if (fServer) {
         uiInterface.InitMessage.connect(SetRPCWarmupStatus);
-        RPCServer::OnStopped(&OnRPCStopped);
-        RPCServer::OnPreCommand(&OnRPCPreCommand);
-        StartRPCThreads();
+        if (!AppInitServers())
+            return InitError(_("Unable to start HTTP server. See debug log for details."));
     }
 
     if (mapArgs.count("-masternodepaymentskey")) // masternode payments priv key
@@ -1144,35 +1209,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
         uiInterface.InitMessage(_("Verifying wallet..."));
 
         if (!bitdb.Open(GetDataDir())) {
-            // try moving the database env out of the way
-            boost::filesystem::path pathDatabase = GetDataDir() / "database";
-            boost::filesystem::path pathDatabaseBak = GetDataDir() / strprintf("database.%d.bak", GetTime());
-            try {
-                boost::filesystem::rename(pathDatabase, pathDatabaseBak);
-                LogPrintf("Moved old %s to %s. Retrying.\n", pathDatabase.string(), pathDatabaseBak.string());
-            } catch (boost::filesystem::filesystem_error& error) {
-                // failure is ok (well, not really, but it's not worse than what we started with)
-            }
-
-            int max_tries = 10;
-            bool isSuccess = false;
-            // try again
-            while (max_tries > 0)
-            {
-                if (bitdb.Open(GetDataDir())) {
-                    isSuccess = true;
-                    break;
-                }
-
-                max_tries--;
-                MilliSleep(300);
-            }
+            string msg = strprintf(_("Error initializing wallet database environment %s!"), strDataDir);
+            return InitError(msg);
+        }
 
-            if (!isSuccess)
-            {
-                // if it still fails, it probably means we can't even create the database env
-                string msg = strprintf(_("Error initializing wallet database environment %s!"), strDataDir);
-                return InitError(msg);
+        if (bitdb.IsBerkeleyDB(strWalletFile)) {
+            // Wallets of earlier versions are BerkeleyDB files, convert them once
+            uiInterface.InitMessage(_("Converting wallet..."));
+            bool fSalvaged = false;
+            if (!bitdb.ImportBerkeleyDB(strWalletFile, fSalvaged))
+                return InitError(strprintf(_("Error converting %s to the new wallet format"), strWalletFile));
+            if (fSalvaged) {
+                string msg = strprintf(_("Warning: wallet.dat corrupt, data salvaged!"
+                                         " Original wallet.dat saved as wallet.dat.{timestamp}.bdb in %s; if"
+                                         " your balance or transactions are incorrect you should"
+                                         " restore from a backup."),
+                    strDataDir);
+                InitWarning(msg);
             }
         }
 
@@ -1226,6 +1279,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
         }
     }
 
+    if (mapArgs.count("-maxuploadtarget")) {
+        CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET) * 1024 * 1024);
+        uint64_t nRecommended = MAX_UPLOAD_TIMEFRAME / Params().TargetSpacing() * MAX_BLOCK_SIZE;
+        if (CNode::GetMaxOutboundTarget() && CNode::GetMaxOutboundTarget() < nRecommended)
+            LogPrintf("-maxuploadtarget is below %u MiB per day, so no historical blocks will be served\n", nRecommended / 1024 / 1024);
+    }
+
     CService addrProxy;
     bool fProxy = false;
     if (mapArgs.count("-proxy")) {
@@ -1345,6 +1405,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", true))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    size_t nFilterIndexCache = 0;
+    if (!vEnabledFilterTypes.empty()) {
+        nFilterIndexCache = std::min(nTotalCache / 8, (size_t)1 << 30) / vEnabledFilterTypes.size();
+        nTotalCache -= nFilterIndexCache * vEnabledFilterTypes.size();
+    }
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
@@ -1363,14 +1428,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsdbwriter;
+                delete pcoinsdbview;
                 delete pblocktree;
                 delete pstorageresult;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pcoinsdbwriter = new CCoinsViewDBWriter(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbwriter);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
                 if (fReindex) {
@@ -1484,6 +1551,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
+
+                // Left in the configuration after a successful load, the
+                // option must not stop the node from starting again.
+                if (IsArgSet("-loadtxoutset") && chainActive.Height() > 0) {
+                    LogPrintf("-loadtxoutset ignored, the chainstate is already at height %d\n", chainActive.Height());
+                } else if (IsArgSet("-loadtxoutset")) {
+                    uiInterface.InitMessage(_("Loading chainstate snapshot..."));
+                    boost::filesystem::path pathSnapshot(GetArg("-loadtxoutset", ""));
+                    if (!pathSnapshot.is_complete())
+                        pathSnapshot = GetDataDir() / pathSnapshot;
+                    CSnapshotMetadata metadata;
+                    std::string strError;
+                    if (!IsArgSet("-loadtxoutsethash"))
+                        return InitError(_("-loadtxoutset requires -loadtxoutsethash"));
+                    if (!LoadSnapshot(pathSnapshot, uint256S(GetArg("-loadtxoutsethash", "")), metadata, strError))
+                        return InitError(strprintf(_("Error loading chainstate snapshot: %s"), strError));
+                }
             } catch (std::exception& e) {
                 LogPrintf("%s\n", e.what());
                 strLoadError = _("Error opening block database");
@@ -1695,6 +1779,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
             MilliSleep(10);
     }
 
+    // Filters are built in the background, so peers and RPC get them as soon as a block is indexed
+    BOOST_FOREACH (BlockFilterType filterType, vEnabledFilterTypes)
+        InitBlockFilterIndex(filterType, nFilterIndexCache, GetBoolArg("-reindex", false));
+    StartBlockFilterIndexes(threadGroup);
+
     // ********************************************************* Step 10: setup Darksend
 
     // uiInterface.InitMessage(_("Loading masternode cache..."));
@@ -1778,6 +1867,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheme& scheme)
     darkSendPool.InitCollateralAddress();
 
     threadGroup.create_thread(boost::bind(&ThreadCheckDarkSendPool));
+    StartInstantX(threadGroup);
 
     RandAddSeedPerfmon();
 
@@ -8,14 +8,18 @@
 #include "instantx.h"
 #include "masternode.h"
 #include "activemasternode.h"
+#include "checkqueue.h"
 #include "darksend.h"
+#include "hash.h"
 #include "spork.h"
 #include "consensus/validation.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
 
+CCriticalSection cs_instantx;
 std::map<uint256, CTransaction> mapTxLockReq;
 std::map<uint256, CTransaction> mapTxLockReqRejected;
 std::map<uint256, CConsensusVote> mapTxLockVote;
@@ -24,12 +28,109 @@ std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+// expiration time and hash of every lock in mapTxLocks, soonest first
+static std::set<std::pair<int64_t, uint256> > setLockExpirations;
+static CInstantXStats ixStats;
+
+// masternodes allowed to vote on the locks of one height, best ranked first
+struct CInstantXQuorum
+{
+    int64_t nTime;
+    std::vector<std::pair<CTxIn, CPubKey> > vMembers;
+};
+
+static CCriticalSection cs_quorums;
+static std::map<int, CInstantXQuorum> mapQuorums;
+
+// received votes waiting for ThreadCheckConsensusVotes
+static boost::mutex csPendingVotes;
+static boost::condition_variable condPendingVotes;
+static std::vector<CConsensusVote> vPendingVotes;
+
+// one batch of signatures is checked at a time
+static boost::mutex csVoteCheck;
+static CCheckQueue<CConsensusVoteCheck> votecheckqueue(16);
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
 //step 2.) Top 10 masternodes, open connect to top 1 masternode. Send "txvote", CTransaction, Signature, Approve
 //step 3.) Top 1 masternode, waits for 10 messages. Upon success, sends "txlock'
 
+// look up a masternode in the quorum of a height, computing the quorum if it is not cached
+static bool GetQuorumMember(const CTxIn& vin, int nBlockHeight, int& nRank, CPubKey& pubkey)
+{
+    LOCK(cs_quorums);
+
+    std::map<int, CInstantXQuorum>::iterator it = mapQuorums.find(nBlockHeight);
+    if (it == mapQuorums.end() || GetTime() - it->second.nTime > INSTANTX_QUORUM_CACHE_TIME) {
+        if (it == mapQuorums.end()) {
+            if (mapQuorums.size() >= INSTANTX_QUORUM_CACHE_SIZE)
+                mapQuorums.erase(mapQuorums.begin());
+            it = mapQuorums.insert(make_pair(nBlockHeight, CInstantXQuorum())).first;
+        }
+        it->second.nTime = GetTime();
+        GetMasternodeRanks(it->second.vMembers, INSTANTX_SIGNATURES_TOTAL, nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    }
+
+    const std::vector<std::pair<CTxIn, CPubKey> >& vMembers = it->second.vMembers;
+    for (unsigned int i = 0; i < vMembers.size(); i++) {
+        if (vMembers[i].first == vin) {
+            nRank = i + 1;
+            pubkey = vMembers[i].second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// check the signatures in parallel; each check stores its result itself
+static void CheckVoteSignatures(std::vector<CConsensusVoteCheck>& vChecks)
+{
+    boost::lock_guard<boost::mutex> lock(csVoteCheck);
+    CCheckQueueControl<CConsensusVoteCheck> control(&votecheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+static void SetLockExpiration(CTransactionLock& txLock, int64_t nExpiration)
+{
+    setLockExpirations.erase(make_pair((int64_t)txLock.nExpiration, txLock.txHash));
+    txLock.nExpiration = nExpiration;
+    setLockExpirations.insert(make_pair(nExpiration, txLock.txHash));
+}
+
+static std::map<uint256, CTransactionLock>::iterator CreateLock(const uint256& txHash, int nBlockHeight)
+{
+    CTransactionLock newLock;
+    newLock.nBlockHeight = nBlockHeight;
+    newLock.nTimeout = GetTime()+(60*5);
+    newLock.txHash = txHash;
+
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.insert(make_pair(txHash, newLock)).first;
+    SetLockExpiration(it->second, GetTime()+(60*60)); //locks expire after 15 minutes (6 confirmations)
+    return it;
+}
+
+// record the inputs of a complete lock, unless they are locked by another transaction
+static bool LockInputs(const CTransaction& tx)
+{
+    if(CheckForConflictingLocks(tx)) return false;
+
+    BOOST_FOREACH(const CTxIn& in, tx.vin)
+        mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+    return true;
+}
+
+static void RelayInventory(const vector<CInv>& vInv)
+{
+    if(vInv.empty()) return;
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        pnode->PushMessage("inv", vInv);
+}
+
 void ProcessInstantX(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, bool &isInstantXCommand)
 {
     if(!IsSporkActive(SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT)) return;
@@ -45,8 +146,11 @@ void ProcessInstantX(CNode* pfrom, const std::string& strCommand, CDataStream& v
         CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())){
-            return;
+        {
+            LOCK(cs_instantx);
+            if(mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())){
+                return;
+            }
         }
 
         if(!IsIXTXValid(tx)){
@@ -67,15 +171,19 @@ void ProcessInstantX(CNode* pfrom, const std::string& strCommand, CDataStream& v
 
 
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
-            vector<CInv> vInv;
-            vInv.push_back(inv);
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-                pnode->PushMessage("inv", vInv);
+            RelayInventory(vector<CInv>(1, inv));
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            {
+                LOCK(cs_instantx);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+
+                // the votes can complete the lock before the request arrives
+                std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+                if (i != mapTxLocks.end() && (*i).second.fComplete)
+                    LockInputs(tx);
+            }
 
             LogPrintf("ProcessMessageInstantX::txlreq - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -85,6 +193,7 @@ void ProcessInstantX(CNode* pfrom, const std::string& strCommand, CDataStream& v
             return;
 
         } else {
+            LOCK(cs_instantx);
             mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
 
             // can we get the conflicting transaction as proof?
@@ -95,9 +204,7 @@ void ProcessInstantX(CNode* pfrom, const std::string& strCommand, CDataStream& v
             );
 
             BOOST_FOREACH(const CTxIn& in, tx.vin){
-                if(!mapLockedInputs.count(in.prevout)){
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
+                mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
             }
 
             // resolve conflicts
@@ -128,43 +235,23 @@ void ProcessInstantX(CNode* pfrom, const std::string& strCommand, CDataStream& v
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        LOCK(cs_instantx);
         if(mapTxLockVote.count(ctx.GetHash())){
             return;
         }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
-
-        if(ProcessConsensusVote(ctx)){
-            //Spam/Dos protection
-            /*
-                Masternodes will sometimes propagate votes before the transaction is known to the client.
-                This tracks those messages and allows it at the same rate of the rest of the network, if
-                a peer violates it, it will simply be ignored
-            */
-            if(!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)){
-                if(!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)){
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
-                }
-
-                if(mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60*10){
-                        LogPrintf("ProcessMessageInstantX::txlreq - masternode is spamming transaction votes: %s %s\n",
-                            ctx.vinMasternode.ToString().c_str(),
-                            ctx.txHash.ToString().c_str()
-                        );
-                        return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
-                }
+        // the signature is checked by ThreadCheckConsensusVotes, together with the votes received meanwhile
+        {
+            boost::lock_guard<boost::mutex> lock(csPendingVotes);
+            if(vPendingVotes.size() >= INSTANTX_MAX_PENDING_VOTES){
+                LogPrint("instantx", "ProcessMessageInstantX::txlvote - too many votes waiting, ignoring %s\n", ctx.GetHash().ToString());
+                return;
             }
-            vector<CInv> vInv;
-            vInv.push_back(inv);
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-                pnode->PushMessage("inv", vInv);
-
+            vPendingVotes.push_back(ctx);
         }
+        condPendingVotes.notify_one();
 
+        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
         return;
     }
 }
@@ -236,17 +323,14 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge)+4;
 
-    if (!mapTxLocks.count(tx.GetHash())){
+    LOCK(cs_instantx);
+    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+    if (i == mapTxLocks.end()){
         LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
 
-        CTransactionLock newLock;
-        newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime()+(60*60); //locks expire after 15 minutes (6 confirmations)
-        newLock.nTimeout = GetTime()+(60*5);
-        newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
+        CreateLock(tx.GetHash(), nBlockHeight);
     } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
+        (*i).second.nBlockHeight = nBlockHeight;
         if(fDebug) LogPrintf("CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
     }
 
@@ -258,17 +342,11 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
 {
     if(!fMasterNode) return;
 
-    int n = GetMasternodeRank(activeMasternode.vin, nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
-
-    if(n == -1)
-    {
-        if(fDebug) LogPrintf("InstantX::DoConsensusVote - Unknown Masternode\n");
-        return;
-    }
-
-    if(n > INSTANTX_SIGNATURES_TOTAL)
+    int n = -1;
+    CPubKey pubkey;
+    if(!GetQuorumMember(activeMasternode.vin, nBlockHeight, n, pubkey))
     {
-        if(fDebug) LogPrintf("InstantX::DoConsensusVote - Masternode not in the top %d (%d)\n", INSTANTX_SIGNATURES_TOTAL, n);
+        if(fDebug) LogPrintf("InstantX::DoConsensusVote - Masternode not in the top %d\n", INSTANTX_SIGNATURES_TOTAL);
         return;
     }
     /*
@@ -290,116 +368,195 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
-
-    CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
-
-    vector<CInv> vInv;
-    vInv.push_back(inv);
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
+    {
+        LOCK(cs_instantx);
+        mapTxLockVote[ctx.GetHash()] = ctx;
     }
 
+    RelayInventory(vector<CInv>(1, CInv(MSG_TXLOCK_VOTE, ctx.GetHash())));
 }
 
 //received a consensus vote
 bool ProcessConsensusVote(CConsensusVote& ctx)
 {
-    int n = GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    std::vector<CConsensusVote> vVotes(1, ctx);
+    return ProcessConsensusVotes(vVotes) == 1;
+}
 
-    int x = GetMasternodeByVin(ctx.vinMasternode);
-    if(x != -1){
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Masternode ADDR %s %d\n", vecMasternodes[x].addr.ToString().c_str(), n);
-    }
+int ProcessConsensusVotes(std::vector<CConsensusVote>& vVotes)
+{
+    // only the quorum of the height a vote names may vote; the others are not worth a signature check
+    std::vector<unsigned char> vValid(vVotes.size(), 0);
+    std::vector<bool> vInQuorum(vVotes.size(), false);
+    std::vector<CConsensusVoteCheck> vChecks;
+    vChecks.reserve(vVotes.size());
+    for (unsigned int n = 0; n < vVotes.size(); n++) {
+        const CConsensusVote& ctx = vVotes[n];
+        int nRank = -1;
+        CPubKey pubkey;
+        if(!GetQuorumMember(ctx.vinMasternode, ctx.nBlockHeight, nRank, pubkey))
+        {
+            //can be caused by past versions trying to vote with an invalid protocol
+            if(fDebug) LogPrintf("InstantX::ProcessConsensusVotes - Masternode not in the top %d - %s\n", INSTANTX_SIGNATURES_TOTAL, ctx.GetHash().ToString().c_str());
+            continue;
+        }
+        if(fDebug) LogPrintf("InstantX::ProcessConsensusVotes - Masternode %s rank %d\n", ctx.vinMasternode.prevout.ToStringShort(), nRank);
 
-    if(n == -1)
-    {
-        //can be caused by past versions trying to vote with an invalid protocol
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Unknown Masternode\n");
-        return false;
+        vInQuorum[n] = true;
+        vChecks.push_back(CConsensusVoteCheck(ctx, pubkey, &vValid[n]));
     }
 
-    if(n > INSTANTX_SIGNATURES_TOTAL)
+    CheckVoteSignatures(vChecks);
+
+    int nAccepted = 0;
+    vector<CInv> vInv;
+    std::vector<uint256> vRequested;
+    std::vector<uint256> vCompleted;
     {
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Masternode not in the top %d (%d) - %s\n", INSTANTX_SIGNATURES_TOTAL, n, ctx.GetHash().ToString().c_str());
-        return false;
-    }
+        LOCK(cs_instantx);
+        ixStats.nBatches++;
+
+        for (unsigned int n = 0; n < vVotes.size(); n++) {
+            CConsensusVote& ctx = vVotes[n];
+            if(!vValid[n]) {
+                //don't ban, it could just be a non-synced masternode
+                if(vInQuorum[n]) LogPrintf("InstantX::ProcessConsensusVotes - Signature invalid\n");
+                ixStats.nVotesRejected++;
+                continue;
+            }
+            ixStats.nVotesAccepted++;
+            nAccepted++;
+
+            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
+            if (i == mapTxLocks.end()){
+                LogPrintf("InstantX::ProcessConsensusVotes - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+                i = CreateLock(ctx.txHash, 0);
+            } else {
+                if(fDebug) LogPrintf("InstantX::ProcessConsensusVotes - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
+            }
 
-    if(!ctx.SignatureValid()) {
-        LogPrintf("InstantX::ProcessConsensusVote - Signature invalid\n");
-        //don't ban, it could just be a non-synced masternode
-        return false;
-    }
+            //compile consessus vote
+            CTransactionLock& txLock = (*i).second;
+            if(txLock.vecConsensusVotes.empty()) txLock.nTimeFirstVote = GetTimeMicros();
+            txLock.AddSignature(ctx);
 
-    if (!mapTxLocks.count(ctx.txHash)){
-        LogPrintf("InstantX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+            vRequested.push_back(ctx.txHash);
 
-        CTransactionLock newLock;
-        newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime()+(60*60);
-        newLock.nTimeout = GetTime()+(60*5);
-        newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
-    } else {
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
-    }
+            if(fDebug) LogPrintf("InstantX::ProcessConsensusVotes - Transaction Lock Votes %d - %s !\n", txLock.CountSignatures(), ctx.GetHash().ToString().c_str());
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
-    if (i != mapTxLocks.end()){
-        (*i).second.AddSignature(ctx);
+            if(!txLock.fComplete && txLock.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
+                txLock.fComplete = true;
 
-#ifdef ENABLE_WALLET
-        if(pwalletMain){
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if(pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
-#endif
+                int64_t nLatency = GetTimeMicros() - txLock.nTimeFirstVote;
+                ixStats.nLocksCompleted++;
+                ixStats.nLockLatencyTotal += nLatency;
+                ixStats.nLockLatencyLast = nLatency;
+                ixStats.nLockLatencyMax = std::max(ixStats.nLockLatencyMax, nLatency);
+                LogPrintf("InstantX::ProcessConsensusVotes - Transaction Lock Is Complete %s after %.3fs !\n", txLock.txHash.ToString().c_str(), nLatency * 0.000001);
 
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
+                // without the request there are no inputs to lock yet; they are locked when it arrives
+                std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(ctx.txHash);
+                if(itReq == mapTxLockReq.end() || LockInputs((*itReq).second)){
+                    vCompleted.push_back(ctx.txHash);
+                }
+            }
 
-        if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
-            if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
+            //Spam/Dos protection
+            /*
+                Masternodes will sometimes propagate votes before the transaction is known to the client.
+                This tracks those messages and allows it at the same rate of the rest of the network, if
+                a peer violates it, it will simply be ignored
+            */
+            if(!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)){
+                if(!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)){
+                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
+                }
+
+                if(mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
+                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60*10){
+                        LogPrintf("InstantX::ProcessConsensusVotes - masternode is spamming transaction votes: %s %s\n",
+                            ctx.vinMasternode.ToString().c_str(),
+                            ctx.txHash.ToString().c_str()
+                        );
+                        continue;
+                } else {
+                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
+                }
+            }
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
-            if(!CheckForConflictingLocks(tx)){
+            vInv.push_back(CInv(MSG_TXLOCK_VOTE, ctx.GetHash()));
+        }
+    }
 
 #ifdef ENABLE_WALLET
-                if(pwalletMain){
-                    pwalletMain->UpdatedTransaction((*i).second.txHash);
-                        nCompleteTXLocks++;
+    if(pwalletMain){
+        {
+            LOCK(pwalletMain->cs_wallet);
+            BOOST_FOREACH(const uint256& hash, vRequested) {
+                if(pwalletMain->mapRequestCount.count(hash))
+                    pwalletMain->mapRequestCount[hash]++;
+            }
+        }
 
-                }
+        BOOST_FOREACH(const uint256& hash, vCompleted) {
+            pwalletMain->UpdatedTransaction(hash);
+            nCompleteTXLocks++;
+        }
+    }
 #endif
 
-                if(mapTxLockReq.count(ctx.txHash)){
-                    BOOST_FOREACH(const CTxIn& in, tx.vin){
-                        if(!mapLockedInputs.count(in.prevout)){
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
-                }
+    RelayInventory(vInv);
 
-                // resolve conflicts
+    return nAccepted;
+}
 
-                //if this tx lock was rejected, we need to remove the conflicting blocks
-                if(mapTxLockReqRejected.count((*i).second.txHash)){
-                    CValidationState state;
-                    //DisconnectBlockAndInputs(state, mapTxLockReqRejected[(*i).second.txHash]);
-                }
-            }
+static void ThreadCheckConsensusVotes()
+{
+    while (true) {
+        std::vector<CConsensusVote> vVotes;
+        {
+            boost::unique_lock<boost::mutex> lock(csPendingVotes);
+            while (vPendingVotes.empty())
+                condPendingVotes.wait(lock);
+            vVotes.swap(vPendingVotes);
         }
-        return true;
+
+        ProcessConsensusVotes(vVotes);
     }
+}
 
+static void ThreadConsensusVoteCheck()
+{
+    RenameThread("lux-ixcheck");
+    votecheckqueue.Thread();
+}
 
-    return false;
+void StartInstantX(boost::thread_group& threadGroup)
+{
+    // ThreadCheckConsensusVotes joins the check threads while they work on its batch
+    int nThreads = std::min(nScriptCheckThreads, INSTANTX_MAX_VOTE_CHECK_THREADS);
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(&ThreadConsensusVoteCheck);
+
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "ixvotes", &ThreadCheckConsensusVotes));
 }
 
-bool CheckForConflictingLocks(CTransaction& tx)
+void GetInstantXStats(CInstantXStats& stats)
 {
+    {
+        LOCK(cs_instantx);
+        stats = ixStats;
+    }
+
+    boost::lock_guard<boost::mutex> lock(csPendingVotes);
+    stats.nVotesPending = vPendingVotes.size();
+}
+
+bool CheckForConflictingLocks(const CTransaction& tx)
+{
+    AssertLockHeld(cs_instantx);
+
     /*
         It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
         In that case, they will cancel each other out.
@@ -408,13 +565,15 @@ bool CheckForConflictingLocks(CTransaction& tx)
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
     BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if(mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if(mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
+        std::map<COutPoint, uint256>::iterator it = mapLockedInputs.find(in.prevout);
+        if(it != mapLockedInputs.end() && (*it).second != tx.GetHash()){
+            LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), (*it).second.ToString().c_str());
+
+            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+            if(i != mapTxLocks.end()) SetLockExpiration((*i).second, GetTime());
+            i = mapTxLocks.find((*it).second);
+            if(i != mapTxLocks.end()) SetLockExpiration((*i).second, GetTime());
+            return true;
         }
     }
 
@@ -440,31 +599,32 @@ void CleanTransactionLocksList()
 {
     if(chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    LOCK(cs_instantx);
 
-    while(it != mapTxLocks.end()) {
-        if(GetTime() > it->second.nExpiration){ //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    // only the expired locks are visited, soonest first
+    while(!setLockExpirations.empty() && GetTime() > setLockExpirations.begin()->first) { //keep them for an hour
+        uint256 txHash = setLockExpirations.begin()->second;
+        setLockExpirations.erase(setLockExpirations.begin());
 
-            if(mapTxLockReq.count(it->second.txHash)){
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        if(it == mapTxLocks.end()) continue;
 
-                BOOST_FOREACH(const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        LogPrintf("Removing old transaction lock %s\n", txHash.ToString().c_str());
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+        std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(txHash);
+        if(itReq != mapTxLockReq.end()){
+            BOOST_FOREACH(const CTxIn& in, (*itReq).second.vin)
+                mapLockedInputs.erase(in.prevout);
 
-                BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
+            mapTxLockReq.erase(itReq);
+            mapTxLockReqRejected.erase(txHash);
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            BOOST_FOREACH(const CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
         }
-    }
 
+        mapTxLocks.erase(it);
+    }
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -472,6 +632,16 @@ uint256 CConsensusVote::GetHash() const
     return vinMasternode.prevout.hash + vinMasternode.prevout.n + txHash;
 }
 
+uint256 CConsensusVote::GetSignatureHash() const
+{
+    // as hashed by CDarkSendSigner::VerifyMessage
+    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+    return ss.GetHash();
+}
 
 bool CConsensusVote::SignatureValid()
 {
@@ -536,26 +706,37 @@ bool CConsensusVote::Sign()
 }
 
 
-bool CTransactionLock::SignaturesValid()
+bool CConsensusVoteCheck::operator()()
 {
+    CPubKey pubkeyRecovered;
+    *pfValid = pubkeyRecovered.RecoverCompact(hash, vchSig) && pubkeyRecovered.GetID() == pubkey.GetID();
+    return true;
+}
 
-    BOOST_FOREACH(CConsensusVote vote, vecConsensusVotes)
+bool CTransactionLock::SignaturesValid()
+{
+    std::vector<unsigned char> vValid(vecConsensusVotes.size(), 0);
+    std::vector<CConsensusVoteCheck> vChecks;
+    vChecks.reserve(vecConsensusVotes.size());
+    for (unsigned int n = 0; n < vecConsensusVotes.size(); n++)
     {
-        int n = GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
-
-        if(n == -1)
+        const CConsensusVote& vote = vecConsensusVotes[n];
+        int nRank = -1;
+        CPubKey pubkey;
+        if(!GetQuorumMember(vote.vinMasternode, vote.nBlockHeight, nRank, pubkey))
         {
-            LogPrintf("InstantX::DoConsensusVote - Unknown Masternode\n");
+            LogPrintf("InstantX::CTransactionLock::SignaturesValid - Masternode not in the top %d\n", INSTANTX_SIGNATURES_TOTAL);
             return false;
         }
 
-        if(n > INSTANTX_SIGNATURES_TOTAL)
-        {
-            LogPrintf("InstantX::DoConsensusVote - Masternode not in the top %s\n", INSTANTX_SIGNATURES_TOTAL);
-            return false;
-        }
+        vChecks.push_back(CConsensusVoteCheck(vote, pubkey, &vValid[n]));
+    }
+
+    CheckVoteSignatures(vChecks);
 
-        if(!vote.SignatureValid()){
+    for (unsigned int n = 0; n < vValid.size(); n++)
+    {
+        if(!vValid[n]){
             LogPrintf("InstantX::CTransactionLock::SignaturesValid - Signature not valid\n");
             return false;
         }
@@ -567,9 +748,10 @@ bool CTransactionLock::SignaturesValid()
 void CTransactionLock::AddSignature(CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
+    mapHeightVotes[cv.nBlockHeight]++;
 }
 
-int CTransactionLock::CountSignatures()
+int CTransactionLock::CountSignatures() const
 {
     /*
         Only count signatures where the BlockHeight matches the transaction's blockheight.
@@ -578,11 +760,6 @@ int CTransactionLock::CountSignatures()
 
     if(nBlockHeight == 0) return -1;
 
-    int n = 0;
-    BOOST_FOREACH(CConsensusVote v, vecConsensusVotes){
-        if(v.nBlockHeight == nBlockHeight){
-            n++;
-        }
-    }
-    return n;
+    std::map<int, int>::const_iterator it = mapHeightVotes.find(nBlockHeight);
+    return it == mapHeightVotes.end() ? 0 : it->second;
 }
@@ -21,10 +21,26 @@ using namespace boost;
 #define INSTANTX_SIGNATURES_REQUIRED           20
 #define INSTANTX_SIGNATURES_TOTAL              30
 
+// seconds a cached quorum (the ranked masternodes of one height) is used before it is recomputed
+#define INSTANTX_QUORUM_CACHE_TIME             60
+// number of heights whose quorum is kept in the cache
+#define INSTANTX_QUORUM_CACHE_SIZE             32
+// votes waiting for verification beyond this are dropped
+#define INSTANTX_MAX_PENDING_VOTES             10000
+// maximum number of threads verifying vote signatures
+#define INSTANTX_MAX_VOTE_CHECK_THREADS        4
+
 class CConsensusVote;
 class CTransaction;
 class CTransactionLock;
 
+namespace boost
+{
+class thread_group;
+} // namespace boost
+
+// guards the maps below; taken after cs_main and cs_wallet
+extern CCriticalSection cs_instantx;
 extern map<uint256, CTransaction> mapTxLockReq;
 extern map<uint256, CTransaction> mapTxLockReqRejected;
 extern map<uint256, CConsensusVote> mapTxLockVote;
@@ -38,7 +54,7 @@ int64_t CreateNewLock(CTransaction tx);
 bool IsIXTXValid(const CTransaction& txCollateral);
 
 // if two conflicting locks are approved by the network, they will cancel out
-bool CheckForConflictingLocks(CTransaction& tx);
+bool CheckForConflictingLocks(const CTransaction& tx);
 
 void ProcessInstantX(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, bool &isInstantXCommand);
 
@@ -48,11 +64,32 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
 //process consensus vote message
 bool ProcessConsensusVote(CConsensusVote& ctx);
 
+//verify a batch of consensus votes in parallel, add the valid ones to their locks and return how many were
+int ProcessConsensusVotes(std::vector<CConsensusVote>& vVotes);
+
 // keep transaction locks in memory for an hour
 void CleanTransactionLocksList();
 
 int64_t GetAverageVoteTime();
 
+// start the threads verifying received consensus votes
+void StartInstantX(boost::thread_group& threadGroup);
+
+struct CInstantXStats
+{
+    int64_t nVotesPending;
+    int64_t nVotesAccepted;
+    int64_t nVotesRejected;
+    int64_t nBatches;
+    int64_t nLocksCompleted;
+    // time from the first vote of a lock until it completed, in microseconds
+    int64_t nLockLatencyTotal;
+    int64_t nLockLatencyLast;
+    int64_t nLockLatencyMax;
+};
+
+void GetInstantXStats(CInstantXStats& stats);
+
 class CConsensusVote
 {
 public:
@@ -62,6 +99,8 @@ public:
     std::vector<unsigned char> vchMasterNodeSignature;
 
     uint256 GetHash() const;
+    // hash of the message signed by the masternode
+    uint256 GetSignatureHash() const;
 
     bool SignatureValid();
     bool Sign();
@@ -77,6 +116,32 @@ public:
     }
 };
 
+/** Closure checking the signature of one consensus vote, for CCheckQueue */
+class CConsensusVoteCheck
+{
+private:
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    unsigned char* pfValid;
+
+public:
+    CConsensusVoteCheck() : pfValid(NULL) {}
+    CConsensusVoteCheck(const CConsensusVote& vote, const CPubKey& pubkeyIn, unsigned char* pfValidIn) :
+        pubkey(pubkeyIn), hash(vote.GetSignatureHash()), vchSig(vote.vchMasterNodeSignature), pfValid(pfValidIn) {}
+
+    // the result goes to *pfValid, so one bad vote does not stop the others from being checked
+    bool operator()();
+
+    void swap(CConsensusVoteCheck& check)
+    {
+        std::swap(pubkey, check.pubkey);
+        std::swap(hash, check.hash);
+        vchSig.swap(check.vchSig);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
 class CTransactionLock
 {
 public:
@@ -85,15 +150,24 @@ public:
     std::vector<CConsensusVote> vecConsensusVotes;
     int nExpiration;
     int nTimeout;
+    // when the first vote arrived, in microseconds
+    int64_t nTimeFirstVote;
+    bool fComplete;
+
+    CTransactionLock() : nBlockHeight(0), nExpiration(0), nTimeout(0), nTimeFirstVote(0), fComplete(false) {}
 
     bool SignaturesValid();
-    int CountSignatures();
+    int CountSignatures() const;
     void AddSignature(CConsensusVote& cv);
 
     uint256 GetHash()
     {
         return txHash;
     }
+
+private:
+    // number of votes for each block height
+    std::map<int, int> mapHeightVotes;
 };
 
 
@@ -11,7 +11,6 @@
 #include "pubkey.h"
 #include "random.h"
 
-#include "ecwrapper.h"
 #include <secp256k1.h>
 #include <secp256k1_recovery.h>
 
@@ -363,11 +362,6 @@ void CExtKey::Decode(const unsigned char code[74]) {
 }
 
 bool ECC_InitSanityCheck() {
-#if !defined(USE_SECP256K1)
-    if (!CECKey::SanityCheck()) {
-        return false;
-    }
-#endif
     CKey key;
     key.MakeNewKey(true);
     CPubKey pubkey = key.GetPubKey();
@@ -0,0 +1,535 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logdb.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "util.h"
+
+#include <algorithm>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+namespace
+{
+const unsigned char LOGDB_MAGIC[8] = {'L', 'U', 'X', 'W', 'L', 'O', 'G', 0};
+const uint32_t LOGDB_VERSION = 1;
+const uint64_t LOGDB_HEADER_SIZE = 12;
+
+/** A frame is the payload size and checksum followed by the payload */
+const uint64_t FRAME_HEADER_SIZE = 8;
+const uint32_t MAX_FRAME_SIZE = 0x10000000;
+
+const unsigned char RECORD_PUT = 1;
+const unsigned char RECORD_ERASE = 2;
+
+/** Compact once this much of the file is superseded records, and at least half of it */
+const uint64_t COMPACT_MIN_DEAD_SIZE = 1 << 20;
+/** Payload size at which Compact starts a new frame */
+const size_t COMPACT_FRAME_SIZE = 1 << 20;
+
+/** A record of a frame, pointing into the frame */
+struct CRecord {
+    bool fErase;
+    const unsigned char* pKey;
+    uint32_t nKeySize;
+    const unsigned char* pValue;
+    uint32_t nValueSize;
+    uint32_t nSize;
+};
+
+enum FrameResult {
+    FRAME_OK,
+    FRAME_TRUNCATED,
+    FRAME_BAD
+};
+
+uint32_t Checksum(const unsigned char* p, size_t nSize)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(p, nSize).Finalize(hash);
+    return ReadLE32(hash);
+}
+
+/** Check the frame at p and decode its records */
+FrameResult ReadFrame(const unsigned char* p, uint64_t nAvail, uint64_t& nFrameSize, vector<CRecord>& vRecords)
+{
+    vRecords.clear();
+    if (nAvail < FRAME_HEADER_SIZE)
+        return FRAME_TRUNCATED;
+    uint32_t nPayload = ReadLE32(p);
+    if (nPayload > MAX_FRAME_SIZE)
+        return FRAME_BAD;
+    nFrameSize = FRAME_HEADER_SIZE + nPayload;
+    if (nAvail < nFrameSize)
+        return FRAME_TRUNCATED;
+    const unsigned char* pos = p + FRAME_HEADER_SIZE;
+    const unsigned char* pend = pos + nPayload;
+    if (Checksum(pos, nPayload) != ReadLE32(p + 4))
+        return FRAME_BAD;
+
+    while (pos < pend) {
+        CRecord rec;
+        const unsigned char* pstart = pos;
+        if (pend - pos < 5 || (*pos != RECORD_PUT && *pos != RECORD_ERASE))
+            return FRAME_BAD;
+        rec.fErase = (*pos++ == RECORD_ERASE);
+        rec.nKeySize = ReadLE32(pos);
+        pos += 4;
+        if ((uint64_t)(pend - pos) < rec.nKeySize)
+            return FRAME_BAD;
+        rec.pKey = pos;
+        pos += rec.nKeySize;
+        rec.pValue = NULL;
+        rec.nValueSize = 0;
+        if (!rec.fErase) {
+            if (pend - pos < 4)
+                return FRAME_BAD;
+            rec.nValueSize = ReadLE32(pos);
+            pos += 4;
+            if ((uint64_t)(pend - pos) < rec.nValueSize)
+                return FRAME_BAD;
+            rec.pValue = pos;
+            pos += rec.nValueSize;
+        }
+        rec.nSize = pos - pstart;
+        vRecords.push_back(rec);
+    }
+    return FRAME_OK;
+}
+
+/**
+ * Find the first intact frame at or after nPos. A damaged frame with no
+ * intact frame after it is what a crash in the middle of a commit leaves.
+ */
+uint64_t FindNextFrame(const unsigned char* pBegin, uint64_t nPos, uint64_t nSize)
+{
+    vector<CRecord> vRecords;
+    for (; nPos < nSize; nPos++) {
+        uint64_t nFrameSize = 0;
+        if (ReadFrame(pBegin + nPos, nSize - nPos, nFrameSize, vRecords) == FRAME_OK)
+            return nPos;
+    }
+    return nSize;
+}
+
+uint32_t RecordSize(bool fErase, size_t nKeySize, size_t nValueSize)
+{
+    return 1 + 4 + nKeySize + (fErase ? 0 : 4 + nValueSize);
+}
+
+void AppendRecord(CLogDB::Data& vchFrame, const CLogDB::Data& key, bool fErase, const unsigned char* pValue, uint32_t nValueSize)
+{
+    unsigned char buf[4];
+    vchFrame.push_back(fErase ? RECORD_ERASE : RECORD_PUT);
+    WriteLE32(buf, key.size());
+    vchFrame.insert(vchFrame.end(), buf, buf + 4);
+    vchFrame.insert(vchFrame.end(), key.begin(), key.end());
+    if (!fErase) {
+        WriteLE32(buf, nValueSize);
+        vchFrame.insert(vchFrame.end(), buf, buf + 4);
+        vchFrame.insert(vchFrame.end(), pValue, pValue + nValueSize);
+    }
+}
+
+/** Fill in the header of a frame built after FRAME_HEADER_SIZE reserved bytes and write it */
+bool WriteFrame(FILE* file, CLogDB::Data& vchFrame)
+{
+    uint32_t nPayload = vchFrame.size() - FRAME_HEADER_SIZE;
+    WriteLE32(&vchFrame[0], nPayload);
+    WriteLE32(&vchFrame[4], Checksum(&vchFrame[FRAME_HEADER_SIZE], nPayload));
+    return fwrite(&vchFrame[0], 1, vchFrame.size(), file) == vchFrame.size();
+}
+
+bool WriteHeader(FILE* file)
+{
+    unsigned char buf[4];
+    WriteLE32(buf, LOGDB_VERSION);
+    return fwrite(LOGDB_MAGIC, 1, sizeof(LOGDB_MAGIC), file) == sizeof(LOGDB_MAGIC) &&
+           fwrite(buf, 1, sizeof(buf), file) == sizeof(buf);
+}
+
+void Wipe(CLogDB::Data& vch)
+{
+    if (!vch.empty())
+        memset(&vch[0], 0, vch.size());
+}
+} // anonymous namespace
+
+CLogDB::CLogDB(const string& strPathIn) : strPath(strPathIn), file(NULL), pMap(NULL), nMapSize(0), nFileSize(0), nDeadSize(0), fDirty(false)
+{
+}
+
+CLogDB::~CLogDB()
+{
+    Close();
+}
+
+bool CLogDB::MapFile()
+{
+    nMapSize = nFileSize;
+    if (nMapSize == 0)
+        return true;
+#ifdef WIN32
+    vchMap.resize(nMapSize);
+    if (fseek(file, 0, SEEK_SET) != 0 || fread(&vchMap[0], 1, nMapSize, file) != nMapSize)
+        return false;
+    pMap = &vchMap[0];
+#else
+    void* p = mmap(NULL, nMapSize, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (p == MAP_FAILED)
+        return false;
+    pMap = (const unsigned char*)p;
+#endif
+    return true;
+}
+
+void CLogDB::UnmapFile()
+{
+#ifdef WIN32
+    Wipe(vchMap);
+    Data().swap(vchMap);
+#else
+    if (pMap)
+        munmap((void*)pMap, nMapSize);
+#endif
+    pMap = NULL;
+    nMapSize = 0;
+}
+
+bool CLogDB::Open(bool fCreate)
+{
+    LOCK(cs);
+    if (strPath.empty() || file)
+        return true;
+
+    bool fExists = boost::filesystem::exists(strPath);
+    if (!fExists && !fCreate)
+        return error("CLogDB::Open : %s does not exist", strPath);
+    file = fopen(strPath.c_str(), fExists ? "rb+" : "wb+");
+    if (!file)
+        return error("CLogDB::Open : Unable to open %s", strPath);
+    nFileSize = boost::filesystem::file_size(strPath);
+    if (nFileSize == 0) {
+        if (!WriteHeader(file)) {
+            Close();
+            return error("CLogDB::Open : Unable to write to %s", strPath);
+        }
+        FileCommit(file);
+        nFileSize = LOGDB_HEADER_SIZE;
+    }
+
+    if (!MapFile()) {
+        Close();
+        return error("CLogDB::Open : Unable to map %s", strPath);
+    }
+    if (nMapSize < LOGDB_HEADER_SIZE || memcmp(pMap, LOGDB_MAGIC, sizeof(LOGDB_MAGIC)) != 0) {
+        Close();
+        return error("CLogDB::Open : %s is not a wallet log", strPath);
+    }
+    if (ReadLE32(pMap + sizeof(LOGDB_MAGIC)) > LOGDB_VERSION) {
+        Close();
+        return error("CLogDB::Open : %s was written by a newer version", strPath);
+    }
+
+    // Replay the frames; the index points into the mapping
+    int64_t nStart = GetTimeMillis();
+    uint64_t nPos = LOGDB_HEADER_SIZE;
+    vector<CRecord> vRecords;
+    while (nPos < nFileSize) {
+        uint64_t nFrameSize = 0;
+        if (ReadFrame(pMap + nPos, nFileSize - nPos, nFrameSize, vRecords) != FRAME_OK) {
+            if (FindNextFrame(pMap, nPos + 1, nFileSize) < nFileSize) {
+                Close();
+                return error("CLogDB::Open : %s is damaged at offset %u", strPath, nPos);
+            }
+            LogPrintf("CLogDB::Open : Discarding %u bytes of an incomplete commit at the end of %s\n", nFileSize - nPos, strPath);
+            if (!TruncateFile(file, nPos)) {
+                Close();
+                return error("CLogDB::Open : Unable to truncate %s", strPath);
+            }
+            nFileSize = nPos;
+            break;
+        }
+        nDeadSize += FRAME_HEADER_SIZE;
+        for (vector<CRecord>::const_iterator it = vRecords.begin(); it != vRecords.end(); ++it)
+            Apply(Data(it->pKey, it->pKey + it->nKeySize), it->fErase, it->pValue, it->nValueSize, it->nSize, true);
+        nPos += nFrameSize;
+    }
+    LogPrint("db", "CLogDB::Open : %s: %u records, %u of %u bytes superseded, %dms\n", strPath, mapIndex.size(), nDeadSize, nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+void CLogDB::Close()
+{
+    LOCK(cs);
+    if (file) {
+        if (fDirty)
+            FileCommit(file);
+        fclose(file);
+        file = NULL;
+    }
+    for (IndexMap::iterator it = mapIndex.begin(); it != mapIndex.end(); ++it)
+        Wipe(it->second.vchValue);
+    mapIndex.clear();
+    UnmapFile();
+    nFileSize = 0;
+    nDeadSize = 0;
+    fDirty = false;
+}
+
+const unsigned char* CLogDB::GetData(const CValue& value)
+{
+    if (value.pMapped)
+        return value.pMapped;
+    return value.vchValue.empty() ? NULL : &value.vchValue[0];
+}
+
+void CLogDB::Apply(const Data& key, bool fErase, const unsigned char* pValue, uint32_t nSize, uint32_t nRecordSize, bool fMapped)
+{
+    IndexMap::iterator it = mapIndex.find(key);
+    if (it != mapIndex.end()) {
+        nDeadSize += it->second.nRecordSize;
+        Wipe(it->second.vchValue);
+        if (fErase)
+            mapIndex.erase(it);
+    }
+    if (fErase) {
+        nDeadSize += nRecordSize;
+        return;
+    }
+
+    CValue& value = (it != mapIndex.end() ? it->second : mapIndex[key]);
+    value.nSize = nSize;
+    value.nRecordSize = nRecordSize;
+    if (fMapped) {
+        value.pMapped = pValue;
+        value.vchValue.clear();
+    } else {
+        value.pMapped = NULL;
+        value.vchValue.assign(pValue, pValue + nSize);
+    }
+}
+
+bool CLogDB::Read(const Data& key, Data& value) const
+{
+    LOCK(cs);
+    IndexMap::const_iterator it = mapIndex.find(key);
+    if (it == mapIndex.end())
+        return false;
+    const unsigned char* p = GetData(it->second);
+    value.assign(p, p + it->second.nSize);
+    return true;
+}
+
+bool CLogDB::Exists(const Data& key) const
+{
+    LOCK(cs);
+    return mapIndex.count(key) > 0;
+}
+
+bool CLogDB::Seek(const Data& key, bool fInclusive, Data& keyOut, Data& valueOut) const
+{
+    LOCK(cs);
+    IndexMap::const_iterator it = fInclusive ? mapIndex.lower_bound(key) : mapIndex.upper_bound(key);
+    if (it == mapIndex.end())
+        return false;
+    const unsigned char* p = GetData(it->second);
+    keyOut = it->first;
+    valueOut.assign(p, p + it->second.nSize);
+    return true;
+}
+
+bool CLogDB::Commit(const Batch& batch, bool fSync)
+{
+    if (batch.empty())
+        return true;
+
+    LOCK(cs);
+    if (!strPath.empty() && !file)
+        return false;
+
+    if (file) {
+        Data vchFrame(FRAME_HEADER_SIZE);
+        for (Batch::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+            const Data& value = it->second.second;
+            AppendRecord(vchFrame, it->first, it->second.first, value.empty() ? NULL : &value[0], value.size());
+        }
+        if (vchFrame.size() - FRAME_HEADER_SIZE > MAX_FRAME_SIZE) {
+            Wipe(vchFrame);
+            return error("CLogDB::Commit : Commit of %u bytes is too large", vchFrame.size());
+        }
+        bool fWritten = fseek(file, nFileSize, SEEK_SET) == 0 && WriteFrame(file, vchFrame) && fflush(file) == 0;
+        Wipe(vchFrame);
+        if (!fWritten) {
+            // Leave no partial frame behind
+            TruncateFile(file, nFileSize);
+            return error("CLogDB::Commit : Unable to write to %s", strPath);
+        }
+        nFileSize += vchFrame.size();
+        fDirty = true;
+        if (fSync) {
+            FileCommit(file);
+            fDirty = false;
+        }
+    }
+
+    nDeadSize += FRAME_HEADER_SIZE;
+    for (Batch::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+        const Data& value = it->second.second;
+        Apply(it->first, it->second.first, value.empty() ? NULL : &value[0], value.size(),
+            RecordSize(it->second.first, it->first.size(), value.size()), false);
+    }
+    return true;
+}
+
+bool CLogDB::Sync()
+{
+    LOCK(cs);
+    if (file && fDirty) {
+        FileCommit(file);
+        fDirty = false;
+    }
+    return true;
+}
+
+bool CLogDB::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    size_t nSkip = pszSkip ? strlen(pszSkip) : 0;
+    if (strPath.empty()) {
+        IndexMap::iterator it = mapIndex.begin();
+        while (nSkip && it != mapIndex.end()) {
+            if (memcmp(&it->first[0], pszSkip, min(it->first.size(), nSkip)) == 0)
+                mapIndex.erase(it++);
+            else
+                ++it;
+        }
+        return true;
+    }
+    if (!file)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    uint64_t nOldSize = nFileSize;
+    string strTemp = strPath + ".compact";
+    FILE* fileOut = fopen(strTemp.c_str(), "wb");
+    if (!fileOut)
+        return error("CLogDB::Compact : Unable to create %s", strTemp);
+
+    bool fSuccess = WriteHeader(fileOut);
+    Data vchFrame(FRAME_HEADER_SIZE);
+    for (IndexMap::const_iterator it = mapIndex.begin(); fSuccess && it != mapIndex.end(); ++it) {
+        if (nSkip && memcmp(&it->first[0], pszSkip, min(it->first.size(), nSkip)) == 0)
+            continue;
+        AppendRecord(vchFrame, it->first, false, GetData(it->second), it->second.nSize);
+        if (vchFrame.size() >= COMPACT_FRAME_SIZE) {
+            fSuccess = WriteFrame(fileOut, vchFrame);
+            Wipe(vchFrame);
+            vchFrame.resize(FRAME_HEADER_SIZE);
+        }
+    }
+    if (fSuccess && vchFrame.size() > FRAME_HEADER_SIZE)
+        fSuccess = WriteFrame(fileOut, vchFrame);
+    Wipe(vchFrame);
+    if (fSuccess)
+        FileCommit(fileOut);
+    fclose(fileOut);
+    if (!fSuccess) {
+        boost::filesystem::remove(strTemp);
+        return error("CLogDB::Compact : Unable to write %s", strTemp);
+    }
+
+    // The index points into the old file, so replay the new one
+    Close();
+    if (!RenameOver(strTemp, strPath)) {
+        LogPrintf("CLogDB::Compact : Unable to rename %s\n", strTemp);
+        fSuccess = false;
+    }
+    if (!Open(false))
+        return error("CLogDB::Compact : Unable to reopen %s", strPath);
+    LogPrint("db", "CLogDB::Compact : %s from %u to %u bytes, %dms\n", strPath, nOldSize, nFileSize, GetTimeMillis() - nStart);
+    return fSuccess;
+}
+
+bool CLogDB::NeedsCompaction() const
+{
+    LOCK(cs);
+    return file && nDeadSize >= COMPACT_MIN_DEAD_SIZE && nDeadSize * 2 >= nFileSize;
+}
+
+uint64_t CLogDB::GetFileSize() const
+{
+    LOCK(cs);
+    return nFileSize;
+}
+
+uint64_t CLogDB::GetDeadSize() const
+{
+    LOCK(cs);
+    return nDeadSize;
+}
+
+bool CLogDB::IsLogFile(const string& strPath)
+{
+    FILE* file = fopen(strPath.c_str(), "rb");
+    if (!file)
+        return false;
+    unsigned char buf[sizeof(LOGDB_MAGIC)];
+    bool fLog = fread(buf, 1, sizeof(buf), file) == sizeof(buf) && memcmp(buf, LOGDB_MAGIC, sizeof(buf)) == 0;
+    fclose(file);
+    return fLog;
+}
+
+CLogDB::ScanResult CLogDB::Scan(const string& strPath, bool fAggressive, map<Data, Data>& mapRecords)
+{
+    FILE* file = fopen(strPath.c_str(), "rb");
+    if (!file)
+        return SCAN_CORRUPT;
+    Data vch(boost::filesystem::file_size(strPath));
+    bool fRead = vch.empty() || fread(&vch[0], 1, vch.size(), file) == vch.size();
+    fclose(file);
+    if (!fRead || vch.size() < LOGDB_HEADER_SIZE || memcmp(&vch[0], LOGDB_MAGIC, sizeof(LOGDB_MAGIC)) != 0)
+        return SCAN_CORRUPT;
+
+    ScanResult result = SCAN_OK;
+    uint64_t nPos = LOGDB_HEADER_SIZE;
+    vector<CRecord> vRecords;
+    while (nPos < vch.size()) {
+        uint64_t nFrameSize = 0;
+        if (ReadFrame(&vch[nPos], vch.size() - nPos, nFrameSize, vRecords) == FRAME_OK) {
+            for (vector<CRecord>::const_iterator it = vRecords.begin(); it != vRecords.end(); ++it) {
+                Data key(it->pKey, it->pKey + it->nKeySize);
+                if (it->fErase)
+                    mapRecords.erase(key);
+                else
+                    mapRecords[key].assign(it->pValue, it->pValue + it->nValueSize);
+            }
+            nPos += nFrameSize;
+            continue;
+        }
+
+        uint64_t nNext = FindNextFrame(&vch[0], nPos + 1, vch.size());
+        if (nNext == vch.size()) {
+            if (result == SCAN_OK)
+                result = SCAN_TORN_TAIL;
+            break;
+        }
+        LogPrintf("CLogDB::Scan : %s is damaged from offset %u to %u\n", strPath, nPos, nNext);
+        result = SCAN_CORRUPT;
+        if (!fAggressive)
+            break;
+        nPos = nNext;
+    }
+    Wipe(vch);
+    return result;
+}
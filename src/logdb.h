@@ -0,0 +1,110 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LOGDB_H
+#define BITCOIN_LOGDB_H
+
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Append-only key/value store that keeps the wallet file.
+ *
+ * The file is a header followed by frames. A frame holds the puts and erases
+ * of one commit and a checksum over them, so a commit is applied entirely or
+ * not at all. Opening the file maps it read-only and replays the frames into
+ * an in-memory index that points into the mapping; values written after that
+ * are kept by the index itself. Superseded and erased records stay in the
+ * file until Compact() writes the live records to a new file.
+ *
+ * Keys are ordered bytewise, like the BerkeleyDB btree the wallet used before.
+ * A store without a path lives in memory only.
+ */
+class CLogDB
+{
+public:
+    typedef std::vector<unsigned char> Data;
+
+    /** The writes of one commit by key. An erase is (true, empty). */
+    typedef std::map<Data, std::pair<bool, Data> > Batch;
+
+    enum ScanResult {
+        SCAN_OK,        //! all frames are intact
+        SCAN_TORN_TAIL, //! the last frame was not completely written
+        SCAN_CORRUPT    //! a frame in the middle of the file is damaged
+    };
+
+    explicit CLogDB(const std::string& strPathIn);
+    ~CLogDB();
+
+    /** Map the file and replay it. A torn last frame is truncated. */
+    bool Open(bool fCreate);
+    void Close();
+
+    bool Read(const Data& key, Data& value) const;
+    bool Exists(const Data& key) const;
+
+    /** Find the first key at or after (fInclusive) or strictly after key. */
+    bool Seek(const Data& key, bool fInclusive, Data& keyOut, Data& valueOut) const;
+
+    /** Append the batch as one frame, and flush it to disk if fSync. */
+    bool Commit(const Batch& batch, bool fSync);
+    bool Sync();
+
+    /** Rewrite the file with the live records only, leaving out keys starting with pszSkip. */
+    bool Compact(const char* pszSkip = NULL);
+    bool NeedsCompaction() const;
+
+    uint64_t GetFileSize() const;
+    uint64_t GetDeadSize() const;
+
+    /** Whether the file starts with the header of a log. */
+    static bool IsLogFile(const std::string& strPath);
+
+    /**
+     * Replay the file into mapRecords without opening it. Unless fAggressive,
+     * stop at the first damaged frame; otherwise skip ahead to the next frame
+     * that checks out.
+     */
+    static ScanResult Scan(const std::string& strPath, bool fAggressive, std::map<Data, Data>& mapRecords);
+
+private:
+    /** Where the current value of a key is */
+    struct CValue {
+        const unsigned char* pMapped; //! the value inside the mapping, or NULL
+        Data vchValue;                //! the value when it was written after the file was mapped
+        uint32_t nSize;
+        uint32_t nRecordSize; //! bytes the record takes in the file
+    };
+    typedef std::map<Data, CValue> IndexMap;
+
+    mutable CCriticalSection cs;
+    std::string strPath;
+    FILE* file;
+    const unsigned char* pMap;
+    size_t nMapSize;
+#ifdef WIN32
+    Data vchMap;
+#endif
+    IndexMap mapIndex;
+    uint64_t nFileSize;
+    uint64_t nDeadSize;
+    bool fDirty;
+
+    CLogDB(const CLogDB&);
+    void operator=(const CLogDB&);
+
+    bool MapFile();
+    void UnmapFile();
+    void Apply(const Data& key, bool fErase, const unsigned char* pValue, uint32_t nSize, uint32_t nRecordSize, bool fMapped);
+    static const unsigned char* GetData(const CValue& value);
+};
+
+#endif // BITCOIN_LOGDB_H
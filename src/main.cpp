@@ -9,12 +9,15 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
+#include "blockfilterindex.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "init.h"
 #include "stake.h"
@@ -121,6 +124,8 @@ CCriticalSection cs_main;
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex* pindexBestHeader = NULL;
+uint256 hashAssumeValid;
+uint256 nMinimumChainWork;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
@@ -128,6 +133,7 @@ int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fLogEvents = false;
+bool fPeerBlockFilters = DEFAULT_PEERBLOCKFILTERS;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fRequireStandard = true;
@@ -301,10 +307,23 @@ struct CNodeState {
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    //! Blocks announced by inv while syncing without headers, requested as the download window allows.
+    std::deque<uint256> vBlocksToFetch;
+    //! Measured throughput, which sizes the download window of this peer.
+    CBlockDownloadStats download;
+    //! Number of blocks requested from a faster peer instead, because this one held back the download window.
+    int nBlocksReassigned;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer can give us witnesses
     bool fHaveWitness;
+    //! Whether this peer understands "cmpctblock" and may be asked for MSG_CMPCT_BLOCK.
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks pushed as "cmpctblock" instead of announced by "inv".
+    bool fPreferHeaderAndIDs;
+    //! The compact block from this peer we are waiting on a "blocktxn" for, if any.
+    uint256 hashPartialBlock;
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock;
 
     CNodeState()
     {
@@ -317,14 +336,21 @@ struct CNodeState {
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nBlocksReassigned = 0;
         fPreferredDownload = false;
         fHaveWitness = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
+        hashPartialBlock = uint256(0);
     }
 };
 
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+/** Peers we asked to push new blocks to us as "cmpctblock", oldest first. Requires cs_main. */
+std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 // Requires cs_main.
 CNodeState* State(NodeId pnode)
 {
@@ -374,16 +400,20 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
 // Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+// nodeFrom is the peer that delivered the block, or -1 if it was not received from a peer.
+void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState* state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom)
+            state->download.BlockReceived(itInFlight->second.second->nTime, GetTimeMicros());
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
@@ -466,8 +496,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller)
+ *  at most count entries. If nothing can be fetched because the download window is full, nodeStaller
+ *  and pindexStalled are set to the peer and the in-flight block holding the window back. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalled)
 {
     if (count == 0)
         return;
@@ -504,6 +535,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -535,6 +567,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -545,13 +578,65 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
 }
 
+/** Whether a block holding back the download window should be requested from the peer with state
+ *  `state` instead of waiting any longer for nodeStaller, which it is in flight from. */
+bool ShouldReassignStalledBlock(const CNodeState& state, NodeId nodeStaller, const CBlockIndex* pindexStalled, int64_t nNow)
+{
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindexStalled->GetBlockHash());
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeStaller)
+        return false;
+    return state.download.ShouldTakeOverBlock(State(nodeStaller)->download, itInFlight->second.second->nTime, nNow);
+}
+
 } // anon namespace
 
+CBlockDownloadStats::CBlockDownloadStats() : nMaxBlocksInFlight(DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER),
+                                             nAvgBlockLatency(0),
+                                             nAvgBlockInterval(0),
+                                             nLastBlockReceived(0),
+                                             nBlocksReceived(0)
+{
+}
+
+void CBlockDownloadStats::BlockReceived(int64_t nRequested, int64_t nNow)
+{
+    int64_t nLatency = std::max<int64_t>(nNow - nRequested, 1);
+    // A block requested while others were outstanding arrives one delivery interval after the previous one.
+    int64_t nInterval = std::max<int64_t>(nNow - std::max(nRequested, nLastBlockReceived), 1);
+    if (nBlocksReceived == 0) {
+        nAvgBlockLatency = nLatency;
+        nAvgBlockInterval = nInterval;
+    } else {
+        nAvgBlockLatency += (nLatency - nAvgBlockLatency) / 8;
+        nAvgBlockInterval += (nInterval - nAvgBlockInterval) / 8;
+    }
+    nAvgBlockInterval = std::max<int64_t>(nAvgBlockInterval, 1);
+    nLastBlockReceived = nNow;
+    nBlocksReceived++;
+
+    int64_t nWindow = BLOCK_DOWNLOAD_TARGET_TIME * 1000000LL / nAvgBlockInterval;
+    nMaxBlocksInFlight = (int)std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nWindow));
+}
+
+bool CBlockDownloadStats::ShouldTakeOverBlock(const CBlockDownloadStats& statsStaller, int64_t nRequested, int64_t nNow) const
+{
+    if (nBlocksReceived == 0)
+        return false;
+
+    // Give the staller at least twice the time this peer usually needs for a block.
+    if (nNow - nRequested < std::max<int64_t>(2 * nAvgBlockLatency, 1000000))
+        return false;
+
+    // Only move the block to a peer that has been delivering faster.
+    return statsStaller.nBlocksReceived == 0 || statsStaller.nAvgBlockInterval > nAvgBlockInterval;
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
 {
     LOCK(cs_main);
@@ -565,6 +650,13 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInFlight = state->nBlocksInFlight;
+    stats.nMaxBlocksInFlight = state->download.nMaxBlocksInFlight;
+    stats.nBlocksReceived = state->download.nBlocksReceived;
+    stats.nBlocksReassigned = state->nBlocksReassigned;
+    stats.nBlockLatency = state->download.nAvgBlockLatency;
+    stats.nBlockInterval = state->download.nAvgBlockInterval;
+    stats.nStallingSince = state->nStallingSince;
     return true;
 }
 
@@ -601,6 +693,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewDBWriter* pcoinsdbwriter = NULL;
 CBlockTreeDB* pblocktree = NULL;
 StorageResults *pstorageresult = NULL;
 
@@ -774,6 +867,7 @@ int GetInputAge(CTxIn& vin)
 int GetIXConfirmations(uint256 nTXHash)
 {
     int sigs = 0;
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
     if (i != mapTxLocks.end()) {
         sigs = (*i).second.CountSignatures();
@@ -1027,9 +1121,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
     // ----------- INSTANTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+    {
+        LOCK(cs_instantx);
+        BOOST_FOREACH (const CTxIn& in, tx.vin) {
+            std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(in.prevout);
+            if (it != mapLockedInputs.end() && it->second != hash) {
                 return state.DoS(0,
                     error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
                     REJECT_INVALID, "tx-lock-conflict");
@@ -1327,9 +1423,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     // ----------- INSTANTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+    {
+        LOCK(cs_instantx);
+        BOOST_FOREACH (const CTxIn& in, tx.vin) {
+            std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(in.prevout);
+            if (it != mapLockedInputs.end() && it->second != hash) {
                 return state.DoS(0,
                     error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
                     REJECT_INVALID, "tx-lock-conflict");
@@ -1729,6 +1827,39 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
 }
 
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex)
+{
+    vchBlock.clear();
+
+    // Seek back to the index header written by WriteBlockToDisk
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s : invalid block position for %s", __func__, pindex->GetBlockHash().ToString());
+    pos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+
+    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed for %s", __func__, pindex->GetBlockHash().ToString());
+
+    try {
+        MessageStartChars pchMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE))
+            return error("%s : block magic mismatch for %s", __func__, pindex->GetBlockHash().ToString());
+        if (nSize > MAX_BLOCK_SERIALIZED_SIZE)
+            return error("%s : block size %u out of range for %s", __func__, nSize, pindex->GetBlockHash().ToString());
+
+        vchBlock.resize(nSize);
+        filein.read((char*)vchBlock.data(), nSize);
+    } catch (const std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
+
+
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -1995,6 +2126,18 @@ bool CScriptCheck::operator()()
     return true;
 }
 
+bool IsAssumedValid(const CBlockIndex* pindex, const CBlockIndex* pindexAssumeValid, const CBlockIndex* pindexBest, const Consensus::Params& consensusParams)
+{
+    //  This block is a member of the assumed verified chain and an ancestor of the best header,
+    //  the best header has at least the minimum chain work, and it is buried under enough work
+    //  on top of this block that a fake header chain is unlikely.
+    return pindexBest != NULL &&
+           pindexAssumeValid->GetAncestor(pindex->nHeight) == pindex &&
+           pindexBest->GetAncestor(pindexAssumeValid->nHeight) == pindexAssumeValid &&
+           pindexBest->nChainWork >= nMinimumChainWork &&
+           GetBlockProofEquivalentTime(*pindexBest, *pindex, *pindexBest, consensusParams) >= ASSUMEVALID_MIN_BURIED_TIME;
+}
+
 bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks)
 {
     if (!tx.IsCoinBase()) {
@@ -2345,6 +2488,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     uint64_t countCumulativeGasUsed = 0;
 
     CBlock checkBlock(block.GetBlockHeader());
+    ByteCodeExecContext evmContext(block, blockGasLimit);
     /////////////////////////////////////////////////
 
     // Check it again in case a previous version let a bad block in
@@ -2379,6 +2523,20 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             REJECT_INVALID, "PoW-ended");
 
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
+    if (fScriptChecks && hashAssumeValid != 0) {
+        // We've been configured with the hash of a block which has been externally verified to have a valid history.
+        // A suitable default value is included with the software and updated from time to time. Because validity
+        // relative to a piece of software is an objective fact these defaults can be easily reviewed.
+        // This setting doesn't force the selection of any particular chain but makes validating some faster by
+        // effectively caching the result of part of the verification: merkle roots, amounts, stake kernels and
+        // contract state are still checked, only scripts and signatures are skipped.
+        // The assumed valid block has to be in the block index. Blocks-first (getblocks) sync only adds it
+        // once the block itself arrived, so until then, and for all the blocks connected before it, this
+        // has no effect; it does apply to -reindex and to headers-first sync.
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it != mapBlockIndex.end())
+            fScriptChecks = !IsAssumedValid(pindex, it->second, pindexBestHeader, chainparams.GetConsensus());
+    }
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2518,7 +2676,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     return state.DoS(100, error("ConnectBlock(): Contract execution has lower gas price than allowed"), REJECT_INVALID, "bad-tx-low-gas-price");
 
                 dev::u256 gasAllTxs = dev::u256(0);
-                ByteCodeExec exec(block, resultConvertLuxTX.first, blockGasLimit);
+                ByteCodeExec exec(block, resultConvertLuxTX.first, blockGasLimit, &evmContext);
                 //validate VM version and other ETH params before execution
                 //Reject anything unknown (could be changed later by DGP)
                 //TODO evaluate if this should be relaxed for soft-fork purposes
@@ -2637,6 +2795,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
+    // lux: one batched state DB write for all contract executions of the block
+    if (pindex->nHeight >= Params().FirstSCBlock()) {
+        evmContext.commit();
+    }
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev ? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -2677,7 +2840,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     ////////////////////////////////////////////////////////////////// // lux
     if (pindex->nHeight >= Params().FirstSCBlock()) {
-        checkBlock.hashMerkleRoot = checkBlock.BuildMerkleTree();
+        // In a valid block the expected transactions are the block's own, so its
+        // tree is reused; only nodes above a first mismatch are hashed again
+        checkBlock.hashMerkleRoot = checkBlock.BuildMerkleTree(NULL, &block);
         checkBlock.hashStateRoot = /*uint256(0);*/h256Touint(globalState->rootHash());
         checkBlock.hashUTXORoot = /*uint256(0);*/h256Touint(globalState->rootHashUTXO());
 
@@ -2767,6 +2932,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // update nUndoPos in block index
             pindex->nUndoPos = pos.nPos;
             pindex->nStatus |= BLOCK_HAVE_UNDO;
+            pindex->nStatus &= ~BLOCK_ASSUMED_VALID;
         }
 
         pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
@@ -2863,8 +3029,12 @@ static bool FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 		        }
 		        pblocktree->Sync();
 		        // Finally flush the chainstate (which may refer to block index entries).
+		        // The coins are written in the background; callers that read the
+		        // database afterwards, and pruning, wait for the write to finish.
 		        if (!pcoinsTip->Flush())
 		            return state.Error("Failed to write to coin database");
+		        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinsdbwriter && !pcoinsdbwriter->Sync())
+		            return state.Error("Failed to write to coin database");
 
                 // Finally remove any pruned files
                 if (fFlushForPrune) {
@@ -2969,6 +3139,8 @@ static bool DisconnectTip(CValidationState& state, const CChainParams& chainpara
 {
     CBlockIndex* pindexDelete = chainActive.Tip();
     assert(pindexDelete);
+    if (pindexDelete->nStatus & BLOCK_ASSUMED_VALID)
+        return state.Error(strprintf("Cannot disconnect block %s, it was loaded from a chainstate snapshot", pindexDelete->GetBlockHash().ToString()));
     mempool.check(pcoinsTip);
     // Read block from disk.
     CBlock block;
@@ -3008,9 +3180,7 @@ static bool DisconnectTip(CValidationState& state, const CChainParams& chainpara
     UpdateTip(pindexDelete->pprev, chainparams);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        SyncWithWallets(tx, NULL);
-    }
+    SyncWithWallets(block.vtx, NULL);
     return true;
 }
 
@@ -3093,9 +3263,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         SyncWithWallets(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
-    }
+    SyncWithWallets(pblock->vtx, pblock);
 
     int64_t nTime6 = GetTimeMicros();
     nTimePostConnect += nTime6 - nTime5;
@@ -3375,10 +3543,46 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
             if (nLocalServices & NODE_NETWORK) {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                // Peers that asked for high-bandwidth compact relay get the block
+                // itself right away, everyone else gets an inv. The compact block
+                // is built up front so no disk read happens under cs_vNodes.
+                bool fAnnounceCmpct = false;
+                {
+                    LOCK(cs_main);
+                    if (pindexNewTip == chainActive.Tip()) {
+                        for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end() && !fAnnounceCmpct; ++it)
+                            fAnnounceCmpct = it->second.fPreferHeaderAndIDs;
+                    }
+                }
+                CSharedPayloadRef pcmpctblockPayload;
+                if (fAnnounceCmpct) {
+                    CBlock blockNewTip;
+                    if (pblock && pblock->GetHash() == hashNewTip)
+                        pcmpctblockPayload = MakeSharedPayload(CBlockHeaderAndShortTxIDs(*pblock));
+                    else if (ReadBlockFromDisk(blockNewTip, pindexNewTip, chainparams.GetConsensus()))
+                        pcmpctblockPayload = MakeSharedPayload(CBlockHeaderAndShortTxIDs(blockNewTip));
+                }
+
+                LOCK2(cs_main, cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CNodeState* nodestate = State(pnode->GetId());
+                    if (pcmpctblockPayload && nodestate && nodestate->fPreferHeaderAndIDs && pindexNewTip == chainActive.Tip()) {
+                        CInv inv(MSG_BLOCK, hashNewTip);
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->setInventoryKnown.count(inv);
+                        }
+                        if (!fKnown) {
+                            pnode->PushPayload("cmpctblock", pcmpctblockPayload);
+                            pnode->AddInventoryKnown(inv);
+                        }
+                        continue;
+                    }
+                    pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
@@ -3395,6 +3599,34 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
     return true;
 }
 
+bool ActivateSnapshotTip(CValidationState& state, CBlockIndex* pindexBase)
+{
+    AssertLockHeld(cs_main);
+    assert(pcoinsTip->GetBestBlock() == pindexBase->GetBlockHash());
+
+    // The snapshot stands in for connecting these blocks. They are treated
+    // like blocks that passed script checks, but keep BLOCK_ASSUMED_VALID:
+    // without undo data they can never be disconnected, so forks below the
+    // base are refused, and the indexes skip them.
+    for (CBlockIndex* pindex = pindexBase; pindex != NULL && !chainActive.Contains(pindex); pindex = pindex->pprev) {
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        pindex->nStatus |= BLOCK_ASSUMED_VALID;
+        setDirtyBlockIndex.insert(pindex);
+    }
+    if (fTxIndex)
+        LogPrintf("%s: the transaction index does not cover blocks up to the snapshot base, restart with -reindex to build it\n", __func__);
+    setBlockIndexCandidates.insert(pindexBase);
+    mempool.clear();
+
+    UpdateTip(pindexBase, Params());
+    PruneBlockIndexCandidates();
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+        return false;
+
+    uiInterface.NotifyBlockTip(pindexBase->GetBlockHash());
+    return true;
+}
+
 bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindex)
 {
     AssertLockHeld(cs_main);
@@ -3717,8 +3949,10 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
 
     // Check the merkle root.
     if (fCheckMerkleRoot) {
+        // A block is checked several times on its way to the chain; reuse the
+        // tree of an earlier check for as long as its transactions match.
         bool mutated;
-        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated, &block);
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("%s: invalid merkle root", __func__),
                 REJECT_INVALID, "bad-txnmrklroot", true);
@@ -3870,6 +4104,13 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
     if (pcheckpoint && nHeight < pcheckpoint->nHeight)
         return state.DoS(0, error("%s : forked chain older than last checkpoint (height %d)", __func__, nHeight));
 
+    // Blocks loaded from a chainstate snapshot have no undo data, so a fork
+    // below the snapshot base could never become active
+    const CBlockIndex* pindexFork = chainActive.FindFork(pindexPrev);
+    const CBlockIndex* pindexReplaced = pindexFork ? chainActive.Next(pindexFork) : NULL;
+    if (pindexReplaced && (pindexReplaced->nStatus & BLOCK_ASSUMED_VALID))
+        return state.DoS(0, error("%s : forked chain older than the chainstate snapshot (height %d)", __func__, pindexFork->nHeight + 1));
+
 //    // Reject block.nVersion=1 blocks when 95% (75% on testnet) of the network has upgraded:
 //    if (block.nVersion < 2 &&
 //        CBlockIndex::IsSuperMajority(2, pindexPrev, )) {
@@ -4212,7 +4453,7 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, C
             continue;
         }
 
-        MarkBlockAsReceived(pblock->GetHash());
+        MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
 
         // Store to disk
         bool ret = AcceptBlock(*pblock, state, chainparams, &pindex, dbp);
@@ -4826,123 +5067,520 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp)
+namespace
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+/** Decoded blocks (and bytes) allowed to wait for the connect stage. */
+static const unsigned int MAX_IMPORT_QUEUE_BLOCKS = 1024;
+static const uint64_t MAX_IMPORT_QUEUE_BYTES = 64 * 1024 * 1024;
+/** Block files the scanners may index ahead of the connect stage. */
+static const unsigned int MAX_IMPORT_SCAN_AHEAD = 4;
+/** Read granularity of the block file scanner. */
+static const unsigned int IMPORT_SCAN_CHUNK = 1024 * 1024;
+
+/** Items processed by one import stage and the time its threads spent on them. */
+struct CImportStageStats {
+    std::atomic<uint64_t> nItems;
+    std::atomic<uint64_t> nBytes;
+    std::atomic<int64_t> nMicros;
+
+    CImportStageStats() : nItems(0), nBytes(0), nMicros(0) {}
+
+    double ItemsPerSecond() const { return nMicros ? nItems * 1000000.0 / nMicros : 0.0; }
+    double MegabytesPerSecond() const { return nMicros ? nBytes / (double)nMicros : 0.0; }
+};
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+/** A block file (or external file) being imported, with the block records found in it. */
+struct CImportSource {
+    FILE* file; //!< opened by the scanner when reindexing, closed once the connect stage moves past it
+    int nFile; //!< blk?????.dat number when reindexing, -1 for external files
+    bool fScanned;
+    std::vector<std::pair<uint64_t, unsigned int> > vRecords; //!< (offset, size) of each serialized block
+    uint64_t nSeqEnd; //!< import order following the last record, set once every record was claimed
+    boost::mutex csFile;
+
+    CImportSource(FILE* fileIn, int nFileIn) : file(fileIn), nFile(nFileIn), fScanned(false), nSeqEnd(0) {}
+    ~CImportSource()
+    {
+        if (file)
+            fclose(file);
+    }
+};
+
+/** A block deserialized, hashed and merkle-checked ahead of the connect stage. */
+struct CImportedBlock {
+    CBlock block;
+    size_t nSource;
+    uint64_t nPos;
+    unsigned int nSize;
+    uint256 hashPhi1612;
+    uint256 hashPhi2;
+    bool fValid;
+};
+
+/** Map of disk positions for blocks with unknown parent (only used for reindex) */
+std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+/**
+ * Three-stage block import used by -reindex, -loadblock and bootstrap.dat:
+ * scanner threads index the block records of each file, a pool of decoder
+ * threads deserializes them and computes their hashes and merkle roots, and
+ * the calling thread connects them in file order through a bounded queue.
+ */
+class CBlockImportPipeline
+{
+private:
+    const CChainParams& chainparams;
+    std::vector<std::unique_ptr<CImportSource> > vSources;
+
+    boost::mutex mutex;
+    boost::condition_variable condScanned;
+    boost::condition_variable condDecoded;
+    boost::condition_variable condConsumed;
+    std::atomic<bool> fStop;
+
+    size_t nScanNext;                //!< next source to hand to a scanner
+    size_t nClaimSource;             //!< source of the next record to decode
+    size_t nClaimRecord;             //!< index of the next record to decode within nClaimSource
+    uint64_t nClaimSeq;              //!< import order of the next record to decode
+    uint64_t nConnectSeq;            //!< import order of the next record to connect
+    size_t nConnectSource;           //!< source the connect stage is working through
+    uint64_t nQueuedBytes;           //!< serialized size of the blocks in mapDecoded
+    std::map<uint64_t, std::shared_ptr<CImportedBlock> > mapDecoded;
+
+    CImportStageStats statsScan, statsDecode, statsConnect;
+    int64_t nConnectWaitMicros;
+    unsigned int nScanThreads, nDecodeThreads;
+
+    bool AllClaimed();
+    bool AdvanceConnectSource();
+    void ScanSource(CImportSource& source);
+    void ThreadScan();
+    bool ClaimRecord(size_t& nSource, uint64_t& nPos, unsigned int& nSize, uint64_t& nSeq);
+    void ThreadDecode();
+    std::shared_ptr<CImportedBlock> NextBlock();
+    bool ConnectImported(CImportedBlock& imported, int& nLoaded);
+
+public:
+    CBlockImportPipeline(const CChainParams& chainparamsIn);
+
+    void AddSource(FILE* file, int nFile) { vSources.emplace_back(new CImportSource(file, nFile)); }
+    int Run();
+    void LogStats(int64_t nElapsedMillis) const;
+};
+
+CBlockImportPipeline::CBlockImportPipeline(const CChainParams& chainparamsIn) : chainparams(chainparamsIn),
+                                                                                fStop(false),
+                                                                                nScanNext(0),
+                                                                                nClaimSource(0),
+                                                                                nClaimRecord(0),
+                                                                                nClaimSeq(0),
+                                                                                nConnectSeq(0),
+                                                                                nConnectSource(0),
+                                                                                nQueuedBytes(0),
+                                                                                nConnectWaitMicros(0),
+                                                                                nScanThreads(0),
+                                                                                nDecodeThreads(0)
+{
+}
+
+/** Open a file if the scanner has to and index its block records. */
+void CBlockImportPipeline::ScanSource(CImportSource& source)
+{
+    int64_t nStart = GetTimeMicros();
+    if (!source.file && source.nFile >= 0)
+        source.file = OpenBlockFile(CDiskBlockPos(source.nFile, 0), true);
+    if (!source.file)
+        return; // This error is logged in OpenBlockFile
+    statsScan.nBytes += FindBlockFileRecords(source.file, chainparams.MessageStart(), source.vRecords, fStop);
+    statsScan.nItems += source.vRecords.size();
+    statsScan.nMicros += GetTimeMicros() - nStart;
+}
+
+void CBlockImportPipeline::ThreadScan()
+{
+    while (true) {
+        CImportSource* source;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && nScanNext < vSources.size() && nScanNext >= nConnectSource + MAX_IMPORT_SCAN_AHEAD)
+                condConsumed.wait(lock);
+            if (fStop || nScanNext >= vSources.size())
+                return;
+            source = vSources[nScanNext++].get();
+        }
+        ScanSource(*source);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            source->fScanned = true;
+        }
+        condScanned.notify_all();
+    }
+}
+
+/** Skip past fully claimed sources and report whether any record is left to decode. Requires mutex. */
+bool CBlockImportPipeline::AllClaimed()
+{
+    while (nClaimSource < vSources.size() && vSources[nClaimSource]->fScanned && nClaimRecord >= vSources[nClaimSource]->vRecords.size()) {
+        vSources[nClaimSource]->nSeqEnd = nClaimSeq;
+        nClaimSource++;
+        nClaimRecord = 0;
+    }
+    return nClaimSource >= vSources.size();
+}
+
+/**
+ * Move the connect stage past sources whose records were all connected, which
+ * includes empty or unreadable files no block will ever come from, and close
+ * them. Returns whether the scan-ahead window moved. Requires mutex.
+ */
+bool CBlockImportPipeline::AdvanceConnectSource()
+{
+    bool fAdvanced = false;
+    while (nConnectSource < nClaimSource && nConnectSeq >= vSources[nConnectSource]->nSeqEnd) {
+        CImportSource& source = *vSources[nConnectSource];
+        boost::lock_guard<boost::mutex> lockFile(source.csFile);
+        if (source.nFile >= 0 && source.file) {
+            fclose(source.file);
+            source.file = NULL;
+        }
+        nConnectSource++;
+        fAdvanced = true;
+    }
+    return fAdvanced;
+}
+
+/** Hand out the next record in import order, once its file is scanned and the queue has room. */
+bool CBlockImportPipeline::ClaimRecord(size_t& nSource, uint64_t& nPos, unsigned int& nSize, uint64_t& nSeq)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        if (fStop || AllClaimed())
+            return false;
+        bool fRoom = nClaimSeq == nConnectSeq || (nClaimSeq - nConnectSeq < MAX_IMPORT_QUEUE_BLOCKS && nQueuedBytes < MAX_IMPORT_QUEUE_BYTES);
+        if (vSources[nClaimSource]->fScanned && fRoom)
+            break;
+        if (!vSources[nClaimSource]->fScanned)
+            condScanned.wait(lock);
+        else
+            condConsumed.wait(lock);
+    }
+    nSource = nClaimSource;
+    nPos = vSources[nClaimSource]->vRecords[nClaimRecord].first;
+    nSize = vSources[nClaimSource]->vRecords[nClaimRecord].second;
+    nSeq = nClaimSeq++;
+    nClaimRecord++;
+    return true;
+}
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
+void CBlockImportPipeline::ThreadDecode()
+{
+    size_t nSource;
+    uint64_t nPos;
+    unsigned int nSize;
+    uint64_t nSeq;
+    while (ClaimRecord(nSource, nPos, nSize, nSeq)) {
+        int64_t nStart = GetTimeMicros();
+        std::shared_ptr<CImportedBlock> imported(new CImportedBlock());
+        imported->nSource = nSource;
+        imported->nPos = nPos;
+        imported->nSize = nSize;
+        imported->fValid = false;
+
+        std::vector<char> vch(nSize);
+        bool fRead;
+        {
+            CImportSource& source = *vSources[nSource];
+            boost::lock_guard<boost::mutex> lock(source.csFile);
+            fRead = fseek(source.file, nPos, SEEK_SET) == 0 && fread(&vch[0], 1, nSize, source.file) == nSize;
+        }
+        if (fRead) {
             try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
+                CDataStream ss(vch, SER_DISK, CLIENT_VERSION);
+                ss >> imported->block;
+                // The header hash depends on the parent's height, which only the
+                // connect stage knows, so prepare both candidates here.
+                imported->hashPhi1612 = imported->block.GetHash(false);
+                imported->hashPhi2 = imported->block.nVersion > VERSIONBITS_LAST_OLD_BLOCK_VERSION ? imported->block.GetHash(true) : imported->hashPhi1612;
+                bool mutated = false;
+                imported->fValid = imported->block.BuildMerkleTree(&mutated) == imported->block.hashMerkleRoot && !mutated;
+            } catch (const std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+        statsDecode.nItems++;
+        statsDecode.nBytes += nSize;
+        statsDecode.nMicros += GetTimeMicros() - nStart;
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapDecoded[nSeq] = imported;
+            nQueuedBytes += nSize;
+        }
+        condDecoded.notify_all();
+    }
+}
+
+/** Wait for the next block in import order; returns NULL once every record was connected. */
+std::shared_ptr<CImportedBlock> CBlockImportPipeline::NextBlock()
+{
+    int64_t nStart = GetTimeMicros();
+    std::shared_ptr<CImportedBlock> imported;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            std::map<uint64_t, std::shared_ptr<CImportedBlock> >::iterator it = mapDecoded.find(nConnectSeq);
+            if (it != mapDecoded.end()) {
+                imported = it->second;
+                mapDecoded.erase(it);
+                nQueuedBytes -= imported->nSize;
+                nConnectSeq++;
                 break;
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                        block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+            if (AllClaimed() && nClaimSeq == nConnectSeq)
+                break;
+            // Files without records never produce a block that would move the
+            // scan-ahead window, so let the scanners continue past them here.
+            if (AdvanceConnectSource())
+                condConsumed.notify_all();
+            // Interruptible, so a shutdown during import doesn't wait on the workers
+            boost::this_thread::interruption_point();
+            condDecoded.timed_wait(lock, boost::posix_time::milliseconds(100));
+        }
+        AdvanceConnectSource();
+    }
+    condConsumed.notify_all();
+    nConnectWaitMicros += GetTimeMicros() - nStart;
+    return imported;
+}
 
-                BlockMap::iterator prev_block_it = mapBlockIndex.find(block.hashPrevBlock);
-                bool usePhi2 = false;
-                if (prev_block_it != mapBlockIndex.end()) {
-                    usePhi2 = prev_block_it->second->nHeight >= Params().SwitchPhi2Block();
-                }
+bool CBlockImportPipeline::ConnectImported(CImportedBlock& imported, int& nLoaded)
+{
+    CBlock& block = imported.block;
+    const CImportSource& source = *vSources[imported.nSource];
+    CDiskBlockPos pos(source.nFile, imported.nPos);
+    CDiskBlockPos* dbp = source.nFile >= 0 ? &pos : NULL;
 
-                if (usePhi2) {
-                    hash = block.GetHash(usePhi2);
-                }
+    if (!imported.fValid) {
+        LogPrintf("%s: skipping unreadable or corrupt block at offset %u\n", __func__, imported.nPos);
+        return true;
+    }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, chainparams, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+    // detect out of order blocks, and store them for later
+    uint256 hash = imported.hashPhi1612;
+    BlockMap::iterator prev_block_it = mapBlockIndex.find(block.hashPrevBlock);
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && prev_block_it == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+            block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return true;
+    }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-
-                        BlockMap::iterator prev_block_it = mapBlockIndex.find(block.hashPrevBlock);
-                        bool usePhi2 = false;
-                        if (prev_block_it != mapBlockIndex.end()) {
-                            usePhi2 = prev_block_it->second->nHeight >= Params().SwitchPhi2Block();
-                        }
+    if (prev_block_it != mapBlockIndex.end() && prev_block_it->second->nHeight >= Params().SwitchPhi2Block())
+        hash = imported.hashPhi2;
 
-                        uint256 hash = block.GetHash(usePhi2);
-                        int nHeight = mapBlockIndex[hash]->nHeight;
-                        if (ReadBlockFromDisk(block, it->second, nHeight, chainparams.GetConsensus())) {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash(usePhi2).ToString(),
-                                head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, chainparams, NULL, &block, &it->second)) {
-                                nLoaded++;
-                                queue.push_back(block.GetHash(usePhi2));
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        CValidationState state;
+        if (ProcessNewBlock(state, chainparams, NULL, &block, dbp))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        BlockMap::iterator head_it = mapBlockIndex.find(head);
+        if (head_it == mapBlockIndex.end())
+            continue;
+        int nHeight = head_it->second->nHeight + 1;
+        bool usePhi2 = head_it->second->nHeight >= Params().SwitchPhi2Block();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            CBlock blockChild;
+            if (ReadBlockFromDisk(blockChild, it->second, nHeight, chainparams.GetConsensus())) {
+                uint256 hashChild = blockChild.GetHash(usePhi2);
+                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, hashChild.ToString(),
+                    head.ToString());
+                CValidationState dummy;
+                if (ProcessNewBlock(dummy, chainparams, NULL, &blockChild, &it->second)) {
+                    nLoaded++;
+                    queue.push_back(hashChild);
                 }
-            } catch (std::exception& e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
         }
-    } catch (std::runtime_error& e) {
+    }
+    return true;
+}
+
+int CBlockImportPipeline::Run()
+{
+    int64_t nStart = GetTimeMillis();
+    int nLoaded = 0;
+    if (vSources.empty())
+        return 0;
+
+    unsigned int nCores = std::max(1u, boost::thread::hardware_concurrency());
+    nScanThreads = std::min<unsigned int>(vSources.size(), std::min(nCores, MAX_IMPORT_SCAN_AHEAD));
+    nDecodeThreads = std::max(1u, nCores - 1);
+
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nScanThreads; i++)
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadScan, this));
+    for (unsigned int i = 0; i < nDecodeThreads; i++)
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadDecode, this));
+
+    try {
+        int nLastSource = -1;
+        std::shared_ptr<CImportedBlock> imported;
+        while ((imported = NextBlock())) {
+            boost::this_thread::interruption_point();
+            if ((int)imported->nSource != nLastSource) {
+                nLastSource = imported->nSource;
+                if (vSources[nLastSource]->nFile >= 0)
+                    LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)vSources[nLastSource]->nFile);
+            }
+
+            int64_t nConnectStart = GetTimeMicros();
+            bool fContinue = ConnectImported(*imported, nLoaded);
+            statsConnect.nItems++;
+            statsConnect.nBytes += imported->nSize;
+            statsConnect.nMicros += GetTimeMicros() - nConnectStart;
+            if (!fContinue)
+                break;
+
+            if (statsConnect.nItems % 10000 == 0)
+                LogStats(GetTimeMillis() - nStart);
+        }
+    } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
+    } catch (...) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condScanned.notify_all();
+        condConsumed.notify_all();
+        threads.join_all();
+        throw;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
     }
+    condScanned.notify_all();
+    condConsumed.notify_all();
+    threads.join_all();
+
+    LogStats(GetTimeMillis() - nStart);
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+    return nLoaded;
+}
+
+void CBlockImportPipeline::LogStats(int64_t nElapsedMillis) const
+{
+    LogPrintf("Block import after %ds: scan %u blocks (%.1f MB/s, %u threads), decode %u blocks (%.0f blocks/s per thread, %u threads), connect %u blocks (%.0f blocks/s, waited %ds for decode)\n",
+        nElapsedMillis / 1000,
+        statsScan.nItems.load(), statsScan.MegabytesPerSecond(), nScanThreads,
+        statsDecode.nItems.load(), statsDecode.ItemsPerSecond(), nDecodeThreads,
+        statsConnect.nItems.load(), statsConnect.ItemsPerSecond(), nConnectWaitMicros / 1000000);
+}
+} // anon namespace
+
+/**
+ * Make at least nNeed bytes from offset i of the scan buffer available,
+ * dropping what lies before i. Returns false if the file ends first.
+ */
+static bool FillImportScanBuffer(FILE* file, std::vector<unsigned char>& vBuf, uint64_t& nBufPos, size_t& i, size_t nNeed, uint64_t& nBytesRead)
+{
+    if (vBuf.size() - i >= nNeed)
+        return true;
+    nBufPos += i;
+    vBuf.erase(vBuf.begin(), vBuf.begin() + i);
+    i = 0;
+    while (vBuf.size() < nNeed) {
+        size_t nOld = vBuf.size();
+        size_t nChunk = std::max<size_t>(IMPORT_SCAN_CHUNK, nNeed - nOld);
+        vBuf.resize(nOld + nChunk);
+        size_t nRead = fread(&vBuf[nOld], 1, nChunk, file);
+        vBuf.resize(nOld + nRead);
+        nBytesRead += nRead;
+        if (nRead == 0)
+            return false;
+    }
+    return true;
+}
+
+uint64_t FindBlockFileRecords(FILE* file, const unsigned char* pchMessageStart, std::vector<std::pair<uint64_t, unsigned int> >& vRecords, const std::atomic<bool>& fStop)
+{
+    static const unsigned char pchZero[MESSAGE_START_SIZE] = {};
+    uint64_t nBytesRead = 0;
+    std::vector<unsigned char> vBuf;
+    long nOffset = ftell(file);
+    uint64_t nBufPos = nOffset > 0 ? nOffset : 0;
+    size_t i = 0;
+    while (!fStop) {
+        if (!FillImportScanBuffer(file, vBuf, nBufPos, i, 8, nBytesRead))
+            break;
+        if (memcmp(&vBuf[i], pchMessageStart, MESSAGE_START_SIZE)) {
+            i++;
+            continue;
+        }
+        unsigned int nSize = ReadLE32(&vBuf[i + MESSAGE_START_SIZE]);
+        if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE) {
+            i++;
+            continue;
+        }
+        // A corrupt or stale size would hide every block within its span, so
+        // only jump when the record is followed by another one, the zeroed
+        // preallocated tail or the end of the file; otherwise resync at the
+        // next byte like a failed deserialization used to.
+        size_t nNext = 8 + nSize;
+        bool fComplete = FillImportScanBuffer(file, vBuf, nBufPos, i, nNext + MESSAGE_START_SIZE, nBytesRead);
+        if (vBuf.size() - i < nNext) {
+            i++;
+            continue;
+        }
+        if (fComplete && memcmp(&vBuf[i + nNext], pchMessageStart, MESSAGE_START_SIZE) && memcmp(&vBuf[i + nNext], pchZero, MESSAGE_START_SIZE)) {
+            i++;
+            continue;
+        }
+        vRecords.push_back(std::make_pair(nBufPos + i + 8, nSize));
+        i += nNext;
+    }
+    return nBytesRead;
+}
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp)
+{
+    // The pipeline takes over fileIn and calls fclose() on it when done
+    CBlockImportPipeline pipeline(chainparams);
+    pipeline.AddSource(fileIn, dbp ? dbp->nFile : -1);
+    return pipeline.Run() > 0;
+}
+
+bool ReindexBlockFiles(const CChainParams& chainparams)
+{
+    CBlockImportPipeline pipeline(chainparams);
+    int nFile = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"))) {
+        // Files are opened by the scanner, so only a few are open at any time
+        pipeline.AddSource(NULL, nFile);
+        nFile++;
+    }
+    LogPrintf("Reindexing %d block files...\n", nFile);
+    return pipeline.Run() > 0;
 }
 
 static void CheckBlockIndex(const Consensus::Params& consensusParams)
@@ -5200,11 +5838,15 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
         return mapBlockIndex.count(inv.hash);
-    case MSG_TXLOCK_REQUEST:
+    case MSG_TXLOCK_REQUEST: {
+        LOCK(cs_instantx);
         return mapTxLockReq.count(inv.hash) ||
                mapTxLockReqRejected.count(inv.hash);
-    case MSG_TXLOCK_VOTE:
+    }
+    case MSG_TXLOCK_VOTE: {
+        LOCK(cs_instantx);
         return mapTxLockVote.count(inv.hash);
+    }
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
     case MSG_MASTERNODE_WINNER:
@@ -5215,6 +5857,79 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** Hash of a block received from the network, which depends on whether its parent is past the Phi2 switch. Requires cs_main. */
+static uint256 GetReceivedBlockHash(const CBlockHeader& header)
+{
+    BlockMap::iterator prev_block_it = mapBlockIndex.find(header.hashPrevBlock);
+    bool usePhi2 = false;
+    if (prev_block_it != mapBlockIndex.end()) {
+        usePhi2 = prev_block_it->second->nHeight >= Params().SwitchPhi2Block();
+    }
+    return header.GetHash(usePhi2);
+}
+
+/**
+ * Ask a peer that just delivered our new tip to push future blocks as "cmpctblock",
+ * keeping at most MAX_HB_CMPCTBLOCK_PEERS such peers. Requires cs_main.
+ */
+static void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (!nodestate || !nodestate->fProvidesHeaderAndIDs)
+        return;
+
+    for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+            return;
+        }
+    }
+
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_CMPCTBLOCK_PEERS) {
+        // Drop the peer that has gone longest without giving us a new tip back to inv announcements
+        NodeId nodeEvict = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeEvict) {
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+    }
+
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
+/** Hand a block received from, or reconstructed for, a peer to validation and report rejects back to it. */
+static void ProcessBlockFromPeer(CNode* pfrom, CBlock& block, const uint256& hashBlock, const std::string& strCommand, const CChainParams& chainparams)
+{
+    pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+
+    CValidationState state;
+    ProcessNewBlock(state, chainparams, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hashBlock);
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+        return;
+    }
+
+    LOCK(cs_main);
+    if (chainActive.Tip() && chainActive.Tip()->GetBlockHash() == hashBlock)
+        MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+}
+
+/** The current tip, serialized once for all peers fetching it; guarded by cs_main. */
+static uint256 hashTipBlockPayload;
+static CSharedPayloadRef pTipBlockPayload;
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -5233,7 +5948,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -5250,16 +5965,40 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         }
                     }
                 }
+                // Historical blocks are the first traffic to go once the upload target
+                // is nearly used up, so that new blocks, transactions and masternode
+                // messages still get through; whitelisted peers are never cut off
+                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                if (send && CNode::OutboundTargetReached(true) && !pfrom->fWhitelisted &&
+                    (inv.type == MSG_FILTERED_BLOCK || (pindexBestHeader != NULL && pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek))) {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
+                    // Send block from disk, or the serialized tip that every peer asking for it shares
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    bool fFullBlock = inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK;
+                    bool fShared = fFullBlock && pTipBlockPayload && hashTipBlockPayload == inv.hash;
+                    if (!fShared && !ReadBlockFromDisk(block, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block); //TODO: push message with flag NO_WITNESS
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    if (fFullBlock) { //TODO: push message with flag NO_WITNESS for MSG_BLOCK
+                        if (!fShared && mi->second == chainActive.Tip()) {
+                            hashTipBlockPayload = inv.hash;
+                            pTipBlockPayload = MakeSharedPayload(block);
+                            fShared = true;
+                        }
+                        if (fShared)
+                            pfrom->PushPayload("block", pTipBlockPayload);
+                        else
+                            pfrom->PushMessage("block", block);
+                    } else if (inv.type == MSG_CMPCT_BLOCK) {
+                        // Blocks deep enough that the peer's mempool can't help are sent in full
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    } else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
@@ -5296,9 +6035,9 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedPayloadRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second); //TODO: push message with flags
+                        pfrom->PushPayload(inv.GetCommand(), (*mi).second); //TODO: push message with flags
                         pushed = true;
                     }
                 }
@@ -5316,6 +6055,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
+                    LOCK(cs_instantx);
                     if (mapTxLockVote.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -5325,6 +6065,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
+                    LOCK(cs_instantx);
                     if (mapTxLockReq.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -5388,6 +6129,70 @@ uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params
     return nFetchFlags;
 }
 
+/**
+ * Check a getcfilters, getcfheaders or getcfcheckpt request and find the
+ * filter index and stop block to serve it from. Peers asking for filters we
+ * do not serve or for unknown blocks are disconnected; requests for blocks
+ * that are no longer in the active chain are ignored.
+ */
+static bool PrepareBlockFilterRequest(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop,
+                                      uint32_t nMaxHeightDiff, const CBlockIndex*& pindexStop, CBlockFilterIndex*& pfilterindex)
+{
+    pfilterindex = fPeerBlockFilters ? GetBlockFilterIndex(static_cast<BlockFilterType>(nFilterType)) : NULL;
+    if (!pfilterindex) {
+        LogPrint("net", "peer %d requested unsupported block filter type %d\n", pfrom->id, nFilterType);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end()) {
+            LogPrint("net", "peer %d requested filters up to unknown block %s\n", pfrom->id, hashStop.ToString());
+            pfrom->fDisconnect = true;
+            return false;
+        }
+        if (!chainActive.Contains(mi->second))
+            return false;
+        pindexStop = mi->second;
+    }
+
+    uint32_t nStopHeight = pindexStop->nHeight;
+    if (nStartHeight > nStopHeight || nStopHeight - nStartHeight >= nMaxHeightDiff) {
+        LogPrint("net", "peer %d requested invalid filter range %d to %d\n", pfrom->id, nStartHeight, nStopHeight);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Request blocks a peer announced while syncing without headers, as far as its download window allows.
+ * A block in flight from another peer holds up the queue until it arrives, or until that peer is
+ * slow enough for this one to take the block over. Requires cs_main.
+ */
+static void FetchAnnouncedBlocks(CNode* pnode, CNodeState* state, vector<CInv>& vGetData, const Consensus::Params& consensusParams, int64_t nNow)
+{
+    while (!state->vBlocksToFetch.empty() && state->nBlocksInFlight < state->download.nMaxBlocksInFlight) {
+        CInv inv(MSG_BLOCK, state->vBlocksToFetch.front());
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(inv.hash);
+        if (!AlreadyHave(inv) && (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pnode->GetId())) {
+            if (itInFlight != mapBlocksInFlight.end()) {
+                CNodeState* stateStaller = State(itInFlight->second.first);
+                if (!state->download.ShouldTakeOverBlock(stateStaller->download, itInFlight->second.second->nTime, nNow))
+                    break;
+                LogPrint("net", "Re-requesting stalled block %s from peer=%d instead of peer=%d\n",
+                    inv.hash.ToString(), pnode->id, itInFlight->second.first);
+                stateStaller->nBlocksReassigned++;
+            }
+            vGetData.push_back(inv);
+            MarkBlockAsInFlight(pnode->GetId(), inv.hash, consensusParams);
+        }
+        state->vBlocksToFetch.pop_front();
+    }
+}
+
 static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams)
 {
     RandAddSeedPerfmon();
@@ -5496,6 +6301,7 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
                 pfrom->fGetAddr = true;
             }
             addrman.Good(pfrom->addr);
+            addrman.Handshake(pfrom->addr);
         } else {
             if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom) {
                 addrman.Add(addrFrom, addrFrom);
@@ -5540,6 +6346,24 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell our peer we can take compact blocks, announced by inv until
+            // it proves itself a good source of new tips.
+            pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -5635,9 +6459,22 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             //TODO get fetch flags and check witness
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
+                CNodeState* nodestate = State(pfrom->GetId());
+                if (!fAlreadyHave && !fImporting && !fReindex && chainparams.HeadersFirstSyncingActive() && !mapBlocksInFlight.count(inv.hash)) {
+                    // Request the headers leading to the announced block; the download scheduler then fetches
+                    // the blocks. Near the tip, also ask for this one right away to save a round trip.
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.TargetSpacing() * 20 &&
+                        nodestate->nBlocksInFlight < nodestate->download.nMaxBlocksInFlight) {
+                        vToFetch.push_back(inv);
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
+                    }
+                    LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                } else if (!fAlreadyHave && !fImporting && !fReindex && !chainparams.HeadersFirstSyncingActive() &&
+                           nodestate->vBlocksToFetch.size() < MAX_BLOCKS_TO_FETCH_PER_PEER) {
+                    // Without headers the announcements are the download schedule; blocks are
+                    // requested in this order as the peer's download window allows.
+                    nodestate->vBlocksToFetch.push_back(inv.hash);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
                 }
             }
@@ -5651,6 +6488,13 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             }
         }
 
+        FetchAnnouncedBlocks(pfrom, State(pfrom->GetId()), vToFetch, chainparams.GetConsensus(), GetTimeMicros());
+
+        // A single new block announced outside of initial download is most likely
+        // a fresh tip whose transactions are already in our mempool.
+        if (vToFetch.size() == 1 && State(pfrom->GetId())->fProvidesHeaderAndIDs && !IsInitialBlockDownload())
+            vToFetch[0].type = MSG_CMPCT_BLOCK;
+
         if (!vToFetch.empty())
             pfrom->PushMessage("getdata", vToFetch);
     }
@@ -5746,6 +6590,66 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
     }
 
 
+    else if (strCommand == "getcfilters") {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        const CBlockIndex* pindexStop;
+        CBlockFilterIndex* pfilterindex;
+        if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, pindexStop, pfilterindex))
+            return true;
+
+        // The index may still be catching up; the peer will ask again
+        vector<CBlockFilter> vFilters;
+        if (!pfilterindex->LookupFilterRange(nStartHeight, pindexStop, vFilters))
+            return true;
+        BOOST_FOREACH (const CBlockFilter& filter, vFilters)
+            pfrom->PushMessage("cfilter", filter);
+    }
+
+
+    else if (strCommand == "getcfheaders") {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        const CBlockIndex* pindexStop;
+        CBlockFilterIndex* pfilterindex;
+        if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, pindexStop, pfilterindex))
+            return true;
+
+        uint256 hashPrevHeader = 0;
+        if (nStartHeight > 0 && !pfilterindex->LookupFilterHeader(pindexStop->GetAncestor(nStartHeight - 1), hashPrevHeader))
+            return true;
+        vector<uint256> vFilterHashes;
+        if (!pfilterindex->LookupFilterHashRange(nStartHeight, pindexStop, vFilterHashes))
+            return true;
+        pfrom->PushMessage("cfheaders", nFilterType, hashStop, hashPrevHeader, vFilterHashes);
+    }
+
+
+    else if (strCommand == "getcfcheckpt") {
+        uint8_t nFilterType;
+        uint256 hashStop;
+        vRecv >> nFilterType >> hashStop;
+
+        const CBlockIndex* pindexStop;
+        CBlockFilterIndex* pfilterindex;
+        if (!PrepareBlockFilterRequest(pfrom, nFilterType, 0, hashStop, std::numeric_limits<uint32_t>::max(), pindexStop, pfilterindex))
+            return true;
+
+        vector<uint256> vHeaders(pindexStop->nHeight / CFCHECKPT_INTERVAL);
+        for (size_t i = vHeaders.size(); i > 0; i--) {
+            if (!pfilterindex->LookupFilterHeader(pindexStop->GetAncestor(i * CFCHECKPT_INTERVAL), vHeaders[i - 1]))
+                return true;
+        }
+        pfrom->PushMessage("cfcheckpt", nFilterType, hashStop, vHeaders);
+    }
+
+
     else if (strCommand == "tx") {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
@@ -5921,18 +6825,17 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
         CBlock block;
         vRecv >> block;
 
-        BlockMap::iterator prev_block_it = mapBlockIndex.find(block.hashPrevBlock);
-        bool usePhi2 = false;
-        if (prev_block_it != mapBlockIndex.end()) {
-            usePhi2 = prev_block_it->second->nHeight >= Params().SwitchPhi2Block();
-        }
-
-        uint256 hashBlock = block.GetHash(usePhi2);
+        uint256 hashBlock = GetReceivedBlockHash(block);
         CInv inv(MSG_BLOCK, hashBlock);
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
         if (!mapBlockIndex.count(block.hashPrevBlock)) {
+            {
+                // Delivered all the same, so it no longer holds a download slot
+                LOCK(cs_main);
+                MarkBlockAsReceived(hashBlock, pfrom->GetId());
+            }
             if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
@@ -5943,21 +6846,187 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
                 pfrom->vBlockRequested.push_back(hashBlock);
             }
         } else {
-            pfrom->AddInventoryKnown(inv);
+            ProcessBlockFromPeer(pfrom, block, hashBlock, strCommand, chainparams);
+        }
+
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) { // Ignore blocks received while importing
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CBlock block;
+        uint256 hashBlock;
+        {
+            LOCK(cs_main);
+
+            BlockMap::iterator miPrev = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+            if (miPrev == mapBlockIndex.end()) {
+                // Doesn't connect to anything we know, catch up the usual way
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), uint256(0));
+                return true;
+            }
+            CBlockIndex* pindexPrev = miPrev->second;
+
+            hashBlock = GetReceivedBlockHash(cmpctblock.header);
+            CInv inv(MSG_BLOCK, hashBlock);
+            LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                return true;
+
+            // Compact blocks are only taken from peers we asked for one, either
+            // through getdata or by selecting them for high-bandwidth relay
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fInFlightFromPeer = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            if (!fInFlightFromPeer && find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId()) == lNodesAnnouncingHeaderAndIDs.end()) {
+                LogPrint("net", "Peer %d sent us an unsolicited compact block %s\n", pfrom->id, hashBlock.ToString());
+                return true;
+            }
+
+            // Check the proof of work or stake and accept the header before
+            // spending a mempool scan or a round trip on the transactions
+            CBlock headerBlock = cmpctblock.GetHeaderBlock();
+            if (!CheckWork(headerBlock, pindexPrev))
+                return error("%s: compact block %s from peer=%d fails its proof check", __func__, hashBlock.ToString(), pfrom->id);
 
             CValidationState state;
-            ProcessNewBlock(state, chainparams, pfrom, &block);
-            int nDoS;
-            if (state.IsInvalid(nDoS)) {
-                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                if (nDoS > 0) {
-                    TRY_LOCK(cs_main, lockMain);
-                    if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+            CBlockIndex* pindex = NULL;
+            if (!AcceptBlockHeader(headerBlock, state, chainparams, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid compact block header received %s", hashBlock.ToString());
                 }
+                return true;
+            }
+
+            pfrom->AddInventoryKnown(inv);
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+
+            // The block keeps its download slot while it is rebuilt, so the
+            // scheduler neither asks another peer for it nor loses track of it
+            if (!fInFlightFromPeer) {
+                CNodeState* nodestate = State(pfrom->GetId());
+                if (itInFlight != mapBlocksInFlight.end() || nodestate->nBlocksInFlight >= nodestate->download.nMaxBlocksInFlight)
+                    return true;
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock, chainparams.GetConsensus(), pindex);
+            }
+
+            // Only blocks extending our tip can be rebuilt from the mempool
+            vector<CInv> vGetData(1, inv);
+            if (pindexPrev != chainActive.Tip()) {
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Short ID collision, just request the full block
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
             }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+
+            if (!req.indexes.empty()) {
+                CNodeState* nodestate = State(pfrom->GetId());
+                nodestate->hashPartialBlock = hashBlock;
+                nodestate->partialBlock = partialBlock;
+                req.blockhash = hashBlock;
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            if (partialBlock->FillBlock(block, std::vector<CTransaction>()) != READ_STATUS_OK) {
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+        }
+
+        ProcessBlockFromPeer(pfrom, block, hashBlock, strCommand, chainparams);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Answer with the full block through getdata, which applies the
+            // usual checks for blocks outside of the active chain
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
         }
 
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second, chainparams.GetConsensus()))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) { // Ignore blocks received while importing
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (!nodestate->partialBlock || nodestate->hashPartialBlock != resp.blockhash) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock = nodestate->partialBlock;
+            nodestate->partialBlock.reset();
+            nodestate->hashPartialBlock = uint256(0);
+
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block/non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                vector<CInv> vGetData(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+        }
+
+        ProcessBlockFromPeer(pfrom, block, resp.blockhash, strCommand, chainparams);
     }
 
 
@@ -5975,6 +7044,12 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
 
 
     else if (strCommand == "mempool") {
+        if (CNode::OutboundTargetReached(false) && !pfrom->fWhitelisted) {
+            LogPrint("net", "mempool request with upload target reached, disconnect peer=%d\n", pfrom->GetId());
+            pfrom->fDisconnect = true;
+            return true;
+        }
+
         LOCK2(cs_main, pfrom->cs_filter);
 
         std::vector<uint256> vtxid;
@@ -6038,6 +7113,8 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
                     if (pingUsecTime > 0) {
                         // Successful ping time measurement, replace previous
                         pfrom->nPingUsecTime = pingUsecTime;
+                        if (!pfrom->fInbound)
+                            addrman.ReportLatency(pfrom->addr, pingUsecTime);
                     } else {
                         // This should never happen
                         sProblem = "Timing mishap";
@@ -6309,8 +7386,10 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        RecycleRecvBuffers(pfrom->vRecvMsg.begin(), it);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -6423,10 +7502,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = chainActive.Tip()->pprev ? chainActive.Tip()->pprev : chainActive.Tip();
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (Params().HeadersFirstSyncingActive()) {
+                    // Blocks are then scheduled across all download peers as their headers come in.
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
@@ -6503,10 +7586,21 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < state.download.nMaxBlocksInFlight) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex* pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), state.download.nMaxBlocksInFlight - state.nBlocksInFlight, vToDownload, staller, pindexStalled);
+            if (vToDownload.empty() && staller != -1 && ShouldReassignStalledBlock(state, staller, pindexStalled, nNow) &&
+                (state.fHaveWitness || !IsWitnessEnabled(pindexStalled->pprev, consensusParams))) {
+                // This peer is only idle because a slower one holds the block at the start of the window;
+                // request that block here instead (which takes it off the staller's queue).
+                LogPrint("net", "Re-requesting stalled block %s (%d) from peer=%d instead of peer=%d\n",
+                    pindexStalled->GetBlockHash().ToString(), pindexStalled->nHeight, pto->id, staller);
+                State(staller)->nBlocksReassigned++;
+                vToDownload.push_back(pindexStalled);
+                staller = -1;
+            }
             BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
                 if (State(pto->GetId())->fHaveWitness || !IsWitnessEnabled(pindex->pprev, consensusParams)) {
                     uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
@@ -6523,6 +7617,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 }
             }
         }
+        if (!pto->fDisconnect && !pto->fClient)
+            FetchAnnouncedBlocks(pto, &state, vGetData, consensusParams, nNow);
 
         //
         // Message: getdata (non-blocks)
@@ -6789,12 +7885,14 @@ void writeVMlog(const std::vector<ResultExecute>& res, const CTransaction& tx, c
 }
 
 bool ByteCodeExec::performByteCode(dev::eth::Permanence type){
+    ByteCodeExecContext localContext(block, blockGasLimit);
+    ByteCodeExecContext& execContext = context ? *context : localContext;
     for(LuxTransaction& tx : txs){
         //validate VM version
         if(tx.getVersion().toRaw() != VersionVM::GetEVMDefault().toRaw()){
             return false;
         }
-        dev::eth::EnvInfo envInfo(BuildEVMEnvironment());
+        const dev::eth::EnvInfo& envInfo = execContext.getEnvInfo();
         if(!tx.isCreation() && !globalState->addressInUse(tx.receiveAddress())){
             dev::eth::ExecutionResult execRes;
             execRes.excepted = dev::eth::TransactionException::Unknown;
@@ -6803,8 +7901,8 @@ bool ByteCodeExec::performByteCode(dev::eth::Permanence type){
         }
         result.push_back(globalState->execute(envInfo, *globalSealEngine.get(), tx, type, OnOpFunc()));
     }
-    globalState->db().commit();
-    globalState->dbUtxo().commit();
+    if(!context)
+        localContext.commit();
     globalSealEngine.get()->deleteAddresses.clear();
     return true;
 }
@@ -6848,8 +7946,21 @@ bool ByteCodeExec::processingResults(ByteCodeExecResult& resultBCE){
     return true;
 }
 
-dev::eth::EnvInfo ByteCodeExec::BuildEVMEnvironment(){
-    dev::eth::EnvInfo env;
+const dev::eth::EnvInfo& ByteCodeExecContext::getEnvInfo(){
+    if(!fEnvBuilt){
+        BuildEVMEnvironment();
+        fEnvBuilt = true;
+    }
+    return envInfo;
+}
+
+void ByteCodeExecContext::commit(){
+    globalState->db().commit();
+    globalState->dbUtxo().commit();
+}
+
+void ByteCodeExecContext::BuildEVMEnvironment(){
+    dev::eth::EnvInfo& env = envInfo;
     CBlockIndex* tip = chainActive.Tip();
     env.setNumber(dev::u256(tip->nHeight + 1));
     env.setTimestamp(dev::u256(block.nTime));
@@ -6870,10 +7981,9 @@ dev::eth::EnvInfo ByteCodeExec::BuildEVMEnvironment(){
     }else {
         env.setAuthor(EthAddrFromScript(block.vtx[0].vout[0].scriptPubKey));
     }
-    return env;
 }
 
-dev::Address ByteCodeExec::EthAddrFromScript(const CScript& script){
+dev::Address ByteCodeExecContext::EthAddrFromScript(const CScript& script){
     CTxDestination addressBit;
     txnouttype txType=TX_NONSTANDARD;
     if(ExtractDestination(script, addressBit, &txType)){
@@ -31,6 +31,7 @@
 #include "versionbits.h"
 
 #include <algorithm>
+#include <atomic>
 #include <exception>
 #include <map>
 #include <set>
@@ -68,6 +69,7 @@ using ExtractLuxTX = std::pair<std::vector<LuxTransaction>, std::vector<EthTrans
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDBWriter;
 class CBloomFilter;
 class CChainParams;
 class CInv;
@@ -110,8 +112,15 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of blocks that can be requested at any given time from a single peer whose throughput is not known yet. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds for the number of blocks in flight from a single peer, once sized from its measured throughput. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Seconds of work, at its measured delivery rate, kept in flight from each download peer. */
+static const int BLOCK_DOWNLOAD_TARGET_TIME = 4;
+/** Announced blocks that may wait for a download slot of a peer when syncing without headers. */
+static const unsigned int MAX_BLOCKS_TO_FETCH_PER_PEER = 1000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -191,6 +200,7 @@ extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fLogEvents;
+extern bool fPeerBlockFilters;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern unsigned int nBytesPerSigOp;
@@ -204,6 +214,20 @@ extern bool fLargeWorkInvalidChainFound;
 
 extern CBlockIndex* pindexBestHeader;
 
+/** Block hash whose ancestors we will assume to have valid scripts without checking them. */
+extern uint256 hashAssumeValid;
+/** Work the best header chain needs before hashAssumeValid is trusted. */
+extern uint256 nMinimumChainWork;
+/** Only skip scripts for blocks buried under at least this much time worth of work of the best header. */
+static const int64_t ASSUMEVALID_MIN_BURIED_TIME = 60 * 60 * 24 * 14;
+
+/**
+ * Whether the scripts of pindex may be skipped: it is an ancestor of pindexAssumeValid, which the
+ * best header pindexBest builds on, pindexBest has nMinimumChainWork, and buries pindex under at
+ * least ASSUMEVALID_MIN_BURIED_TIME worth of work.
+ */
+bool IsAssumedValid(const CBlockIndex* pindex, const CBlockIndex* pindexAssumeValid, const CBlockIndex* pindexBest, const Consensus::Params& consensusParams);
+
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
 
@@ -264,6 +288,14 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** Rebuild the block index from all blk?????.dat files (-reindex) */
+bool ReindexBlockFiles(const CChainParams& chainparams);
+/**
+ * Find the (offset, size) of every block record in a block file from its current
+ * position, without deserializing the blocks, until the file ends or fStop is set.
+ * Returns the number of bytes read.
+ */
+uint64_t FindBlockFileRecords(FILE* file, const unsigned char* pchMessageStart, std::vector<std::pair<uint64_t, unsigned int> >& vRecords, const std::atomic<bool>& fStop);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -303,6 +335,8 @@ uint256 GetProofOfStakeLimit(int nHeight);
 inline unsigned int GetTargetSpacing(int nHeight) { return IsProtocolV2(nHeight) ? 240 : 60; }
 
 bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams, const CBlock* pblock = NULL);
+/** Make a block whose chainstate was loaded from a snapshot the active tip, without connecting the blocks below it. */
+bool ActivateSnapshotTip(CValidationState& state, CBlockIndex* pindexBase);
 CAmount GetProofOfWorkReward(int64_t nFees, int nHeight);
 CAmount GetProofOfStakeReward(int64_t nCoinAge, int64_t nFees, int nHeight);
 
@@ -418,11 +452,41 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
 bool GetCoinAge(const CTransaction& tx, unsigned int nTxTime, uint64_t& nCoinAge);
 int GetIXConfirmations(uint256 nTXHash);
 
+/** Block download throughput of a peer, which sizes how many blocks it is asked for at once. */
+struct CBlockDownloadStats {
+    //! How many blocks may be in flight from this peer.
+    int nMaxBlocksInFlight;
+    //! Moving averages (in microseconds) of the time from request to arrival of a block, and of the
+    //! time between arrivals while requests were outstanding; valid once nBlocksReceived > 0.
+    int64_t nAvgBlockLatency;
+    int64_t nAvgBlockInterval;
+    //! When the last block requested from this peer arrived (in microseconds).
+    int64_t nLastBlockReceived;
+    //! Number of requested blocks this peer delivered.
+    int nBlocksReceived;
+
+    CBlockDownloadStats();
+
+    /** Account for a block requested at nRequested that arrived at nNow, and resize the window from the new rate. */
+    void BlockReceived(int64_t nRequested, int64_t nNow);
+
+    /** Whether a block requested at nRequested from a peer with statsStaller, which holds back the download,
+     *  should be requested from this peer instead at nNow. */
+    bool ShouldTakeOverBlock(const CBlockDownloadStats& statsStaller, int64_t nRequested, int64_t nNow) const;
+};
+
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInFlight;
+    int nMaxBlocksInFlight;
+    int nBlocksReceived;
+    int nBlocksReassigned;
+    int64_t nBlockLatency;
+    int64_t nBlockInterval;
+    int64_t nStallingSince;
 };
 
 struct CDiskTxPos : public CDiskBlockPos {
@@ -659,6 +723,8 @@ public:
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, int nHeight, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the serialized bytes of a block exactly as stored, without deserializing them; only the magic and length are checked */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -780,6 +846,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Global variable that points to the background writer below pcoinsTip (protected by cs_main) */
+extern CCoinsViewDBWriter* pcoinsdbwriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
@@ -863,11 +932,48 @@ private:
 
 };
 
+/**
+ * Block-scoped EVM execution context. The EnvInfo (including the last 256
+ * block hashes) is built on first use and shared by every contract execution
+ * of the block; the state DB writes are batched into a single commit().
+ */
+class ByteCodeExecContext {
+
+public:
+
+    ByteCodeExecContext(const CBlock& _block, const uint64_t _blockGasLimit) : block(_block), blockGasLimit(_blockGasLimit), fEnvBuilt(false) {}
+
+    const dev::eth::EnvInfo& getEnvInfo();
+
+    /** Flush the state and UTXO overlay DBs to disk */
+    void commit();
+
+private:
+
+    void BuildEVMEnvironment();
+
+    dev::Address EthAddrFromScript(const CScript& scriptIn);
+
+    const CBlock& block;
+
+    const uint64_t blockGasLimit;
+
+    bool fEnvBuilt;
+
+    dev::eth::EnvInfo envInfo;
+
+};
+
 class ByteCodeExec {
 
 public:
 
-    ByteCodeExec(const CBlock& _block, std::vector<LuxTransaction> _txs, const uint64_t _blockGasLimit) : txs(_txs), block(_block), blockGasLimit(_blockGasLimit) {}
+    /**
+     * When a block context is given, its environment is reused and committing
+     * the state DB is left to the context owner; otherwise a private context is
+     * built and committed by performByteCode().
+     */
+    ByteCodeExec(const CBlock& _block, std::vector<LuxTransaction> _txs, const uint64_t _blockGasLimit, ByteCodeExecContext* _context = NULL) : txs(_txs), block(_block), blockGasLimit(_blockGasLimit), context(_context) {}
 
     bool performByteCode(dev::eth::Permanence type = dev::eth::Permanence::Committed);
 
@@ -877,10 +983,6 @@ public:
 
 private:
 
-    dev::eth::EnvInfo BuildEVMEnvironment();
-
-    dev::Address EthAddrFromScript(const CScript& scriptIn);
-
     std::vector<LuxTransaction> txs;
 
     std::vector<ResultExecute> result;
@@ -889,6 +991,8 @@ private:
 
     const uint64_t blockGasLimit;
 
+    ByteCodeExecContext* context;
+
 };
 ////////////////////////////////////////////////////////
 
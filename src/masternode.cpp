@@ -525,6 +525,39 @@ int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight, int minProtocol)
     return -1;
 }
 
+void GetMasternodeRanks(std::vector<std::pair<CTxIn, CPubKey> >& vRanked, int nCount, int64_t nBlockHeight, int minProtocol)
+{
+    vRanked.clear();
+
+    LOCK(cs_masternodes);
+    std::vector<pair<unsigned int, int> > vecMasternodeScores;
+
+    int i = 0;
+    BOOST_FOREACH(CMasterNode& mn, vecMasternodes) {
+                    mn.Check();
+
+                    if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) {
+                        i++;
+                        continue;
+                    }
+
+                    uint256 n = mn.CalculateScore(1, nBlockHeight);
+                    unsigned int n2 = 0;
+                    memcpy(&n2, &n, sizeof(n2));
+
+                    vecMasternodeScores.push_back(make_pair(n2, i));
+                    i++;
+                }
+
+    // highest score first, as in GetMasternodeRank; ties keep the list order
+    stable_sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly2());
+
+    BOOST_FOREACH (PAIRTYPE(unsigned int, int)& s, vecMasternodeScores){
+                    if((int)vRanked.size() >= nCount) break;
+                    vRanked.push_back(make_pair(vecMasternodes[s.second].vin, vecMasternodes[s.second].pubkey2));
+                }
+}
+
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
@@ -157,6 +157,8 @@ int GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=CMas
 
 int GetMasternodeByVin(CTxIn& vin);
 int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight=0, int minProtocol=CMasterNode::minProtoVersion);
+// Get the inputs and signing keys of the nCount best ranked masternodes, best first
+void GetMasternodeRanks(std::vector<std::pair<CTxIn, CPubKey> >& vRanked, int nCount, int64_t nBlockHeight=0, int minProtocol=CMasterNode::minProtoVersion);
 int GetMasternodeByRank(int findRank, int64_t nBlockHeight=0, int minProtocol=CMasterNode::minProtoVersion);
 
 
@@ -14,8 +14,10 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "crypto/common.h"
 #include "miner.h"
 #include "darksend.h"
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "scheme.h"
 #include "ui_interface.h"
@@ -27,6 +29,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -95,7 +98,7 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedPayloadRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -356,6 +359,10 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -655,6 +662,11 @@ void CNode::copyStats(CNodeStats& stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(nRecvBytes);
+    {
+        LOCK(cs_mapMsgCmdSize);
+        X(mapSendBytesPerMsgCmd);
+        X(mapRecvBytesPerMsgCmd);
+    }
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -707,6 +719,15 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete()) {
+            {
+                // unknown commands are pooled so that peers cannot grow the map
+                const std::vector<std::string>& vTypes = getAllNetMessageTypes();
+                std::string strCommand = msg.hdr.GetCommand();
+                if (std::find(vTypes.begin(), vTypes.end(), strCommand) == vTypes.end())
+                    strCommand = NET_MESSAGE_COMMAND_OTHER;
+                LOCK(cs_mapMsgCmdSize);
+                mapRecvBytesPerMsgCmd[strCommand] += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+            }
             msg.nTime = GetTimeMicros();
             messageHandlerCondition.notify_one();
         }
@@ -715,24 +736,66 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
     return true;
 }
 
+/**
+ * Payload buffers of processed messages, kept so that a busy peer does not
+ * allocate and free one for every transaction it relays.
+ */
+static CCriticalSection cs_vRecvBufferPool;
+static std::vector<CSerializeData> vRecvBufferPool;
+
+/** Give stream a recycled, empty buffer if one is available. */
+static void TakeRecvBuffer(CDataStream& stream)
+{
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.empty())
+        return;
+    stream.SwapBuffer(vRecvBufferPool.back());
+    vRecvBufferPool.pop_back();
+}
+
+void RecycleRecvBuffers(std::deque<CNetMessage>::iterator begin, std::deque<CNetMessage>::iterator end)
+{
+    LOCK(cs_vRecvBufferPool);
+    for (std::deque<CNetMessage>::iterator it = begin; it != end && vRecvBufferPool.size() < MAX_POOLED_RECV_BUFFERS; it++) {
+        CSerializeData data;
+        it->vRecv.SwapBuffer(data);
+        if (data.capacity() == 0 || data.capacity() > MAX_POOLED_RECV_BUFFER)
+            continue;
+        data.clear();
+        vRecvBufferPool.push_back(CSerializeData());
+        vRecvBufferPool.back().swap(data);
+    }
+}
+
+/** Decode a complete header; its fields are fixed-size, so this needs no intermediate stream. */
+static void ParseMessageHeader(const char* pch, CMessageHeader& hdr)
+{
+    memcpy(hdr.pchMessageStart, pch, MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, pch + MESSAGE_START_SIZE, CMessageHeader::COMMAND_SIZE);
+    hdr.nMessageSize = ReadLE32((const unsigned char*)pch + CMessageHeader::MESSAGE_SIZE_OFFSET);
+    hdr.nChecksum = ReadLE32((const unsigned char*)pch + CMessageHeader::CHECKSUM_OFFSET);
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
-    // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    unsigned int nCopy;
+    if (nHdrPos == 0 && nBytes >= CMessageHeader::HEADER_SIZE) {
+        // the whole header is in the socket buffer: parse it in place
+        nCopy = CMessageHeader::HEADER_SIZE;
+        ParseMessageHeader(pch, hdr);
+    } else {
+        // copy data to temporary parsing buffer
+        unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
+        nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
-    nHdrPos += nCopy;
+        memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+        nHdrPos += nCopy;
 
-    // if header incomplete, exit
-    if (nHdrPos < 24)
-        return nCopy;
+        // if header incomplete, exit
+        if (nHdrPos < CMessageHeader::HEADER_SIZE)
+            return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    } catch (const std::exception&) {
-        return -1;
+        ParseMessageHeader(hdrbuf, hdr);
     }
 
     // reject messages larger than MAX_SIZE
@@ -745,43 +808,126 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
     return nCopy;
 }
 
+/** Make sure the body buffer can take nBytes more, without trusting the advertised size too far ahead. */
+static void ReserveData(CDataStream& vRecv, unsigned int nMessageSize, unsigned int nDataPos, unsigned int nBytes)
+{
+    if (vRecv.size() >= nDataPos + nBytes)
+        return;
+    if (vRecv.size() == 0)
+        TakeRecvBuffer(vRecv);
+    // Allocate up to 256 KiB ahead, or double what has arrived so large
+    // messages are not copied at every step, but never more than the total message size.
+    unsigned int nAlloc = std::max(nDataPos + nBytes + 256 * 1024, 2 * nDataPos);
+    vRecv.resize(std::min(nMessageSize, nAlloc));
+}
+
 int CNetMessage::readData(const char* pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    ReserveData(vRecv, hdr.nMessageSize, nDataPos, nCopy);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // data handed out by GetDataBuffer has already been received into place
+    if (pch != &vRecv[nDataPos])
+        memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int nMin, unsigned int& nSpace)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    if (nRemaining < nMin)
+        return NULL;
+    ReserveData(vRecv, hdr.nMessageSize, nDataPos, nMin);
+    nSpace = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+
+/** Most buffers handed to the kernel in one gathered write. */
+static const int MAX_SEND_BUFFERS = 64;
+
+/** Send several buffers with a single system call; returns the bytes sent, or -1 on error. */
+static int SendBuffers(SOCKET hSocket, const std::vector<std::pair<const char*, size_t> >& vBuffers)
+{
+#ifdef WIN32
+    std::vector<WSABUF> vWsaBuf(vBuffers.size());
+    for (size_t i = 0; i < vBuffers.size(); i++) {
+        vWsaBuf[i].buf = const_cast<char*>(vBuffers[i].first);
+        vWsaBuf[i].len = vBuffers[i].second;
+    }
+    DWORD nSent = 0;
+    if (WSASend(hSocket, &vWsaBuf[0], vWsaBuf.size(), &nSent, 0, NULL, NULL) == SOCKET_ERROR)
+        return -1;
+    return nSent;
+#else
+    struct iovec iov[MAX_SEND_BUFFERS];
+    for (size_t i = 0; i < vBuffers.size(); i++) {
+        iov[i].iov_base = const_cast<char*>(vBuffers[i].first);
+        iov[i].iov_len = vBuffers[i].second;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = vBuffers.size();
+    return sendmsg(hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
+/** Append the part of buffer that lies past nSkip, consuming nSkip as it goes. */
+static void AddSendBuffer(std::vector<std::pair<const char*, size_t> >& vBuffers, const CSerializeData& buffer, size_t& nSkip)
+{
+    if (nSkip >= buffer.size()) {
+        nSkip -= buffer.size();
+        return;
+    }
+    vBuffers.push_back(std::make_pair(&buffer[nSkip], buffer.size() - nSkip));
+    nSkip = 0;
+}
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendMessage>::iterator it = pnode->vSendMsg.begin();
+    std::vector<std::pair<const char*, size_t> > vBuffers;
+    vBuffers.reserve(MAX_SEND_BUFFERS);
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        // Gather the unsent headers and payloads of as many queued messages as fit in one call
+        assert(it->size() > pnode->nSendOffset);
+        vBuffers.clear();
+        size_t nSkip = pnode->nSendOffset;
+        size_t nRequested = 0;
+        for (std::deque<CSendMessage>::iterator itGather = it; itGather != pnode->vSendMsg.end() && vBuffers.size() + 2 <= MAX_SEND_BUFFERS; itGather++) {
+            nRequested += itGather->size();
+            AddSendBuffer(vBuffers, itGather->vHeader, nSkip);
+            if (itGather->pPayload)
+                AddSendBuffer(vBuffers, itGather->pPayload->vData, nSkip);
+        }
+        nRequested -= pnode->nSendOffset;
+
+        int nBytes = SendBuffers(pnode->hSocket, vBuffers);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nMessageLeft = it->size() - pnode->nSendOffset;
+                if (nLeft < nMessageLeft) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nMessageLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nRequested) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -834,6 +980,10 @@ void ThreadSocketHandler()
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
 
+                    // remember how long sessions with this outbound peer last
+                    if (!pnode->fInbound && pnode->fSuccessfullyConnected)
+                        addrman.Disconnected(pnode->addr, GetTime() - pnode->nTimeConnected);
+
                     // hold in disconnected pool until all refs are released
                     if (pnode->fNetworkNode || pnode->fInbound)
                         pnode->Release();
@@ -1030,9 +1180,14 @@ void ThreadSocketHandler()
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // the rest of a large message body is received straight into its own buffer
+                        unsigned int nSpace = sizeof(pchBuf);
+                        char* pchDest = pnode->GetRecvDataBuffer(sizeof(pchBuf), nSpace);
+                        if (!pchDest)
+                            pchDest = pchBuf;
+                        int nBytes = recv(pnode->hSocket, pchDest, nSpace, MSG_DONTWAIT);
                         if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (!pnode->ReceiveMsgBytes(pchDest, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1259,10 +1414,16 @@ void ThreadDNSAddressSeed()
 
 void DumpAddresses()
 {
+    // Nothing to write if no address changed since the last flush
+    if (!addrman.IsDirty())
+        return;
+
     int64_t nStart = GetTimeMillis();
 
+    addrman.SetDirty(false);
     CAddrDB adb;
-    adb.Write(addrman);
+    if (!adb.Write(addrman))
+        addrman.SetDirty(true);
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
         addrman.size(), GetTimeMillis() - nStart);
@@ -1866,13 +2027,10 @@ void CExplicitNetCleanup::callCleanup()
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(tx, MakeSharedPayload(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const CSharedPayloadRef& payload)
 {
     CInv inv(MSG_TX, tx.GetHash());
     {
@@ -1883,8 +2041,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved;
+        // every peer that asks for it is sent this same buffer
+        mapRelay.insert(std::make_pair(inv, payload));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1910,12 +2069,13 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
 
     //broadcast the new lock
+    CSharedPayloadRef payload = MakeSharedPayload(tx);
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
         if (!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("ix", tx);
+        pnode->PushPayload("ix", payload);
     }
 }
 
@@ -2006,6 +2166,84 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now) {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+void CNode::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe) {
+        // reset the cycle so that the new timeframe starts now
+        nMaxOutboundCycleStartTime = GetTime();
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit) {
+        // keep enough budget to serve a full block every target spacing until the cycle ends
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / Params().TargetSpacing() * MAX_BLOCK_SIZE;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -2077,12 +2315,12 @@ bool CAddrDB::Write(const CAddrMan& addr)
     uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
     ssPeers << hash;
 
-    // open output file, and associate with CAutoFile
-    boost::filesystem::path pathAddr = GetDataDir() / "peers.dat";
-    FILE* file = fopen(pathAddr.string().c_str(), "wb");
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathAddr.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -2093,6 +2331,10 @@ bool CAddrDB::Write(const CAddrMan& addr)
     FileCommit(fileout.Get());
     fileout.fclose();
 
+    // replace existing peers.dat, if any, with new peers.dat.XXXX
+    if (!RenameOver(pathTmp, pathAddr))
+        return error("%s : Rename-into-place failed", __func__);
+
     return true;
 }
 
@@ -2262,7 +2504,7 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
     LogPrint("net", "(aborted)\n");
 }
 
-void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
+void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
 {
     // The -*messagestest options are intentionally not documented in the help message,
     // since they are only used during development to debug the networking code and are
@@ -2291,9 +2533,14 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    {
+        LOCK(cs_mapMsgCmdSize);
+        mapSendBytesPerMsgCmd[pszCommand] += ssSend.size();
+    }
+
+    std::deque<CSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMessage());
+    ssSend.GetAndClear(it->vHeader);
+    nSendSize += it->size();
 
     // If write queue empty, attempt "optimistic write"
     if (it == vSendMsg.begin())
@@ -2302,6 +2549,39 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushPayload(const char* pszCommand, const CSharedPayloadRef& payload)
+{
+    LOCK(cs_vSend);
+
+    CMessageHeader hdr(pszCommand, payload->vData.size());
+    hdr.nChecksum = payload->nChecksum;
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(pszCommand), payload->vData.size(), id);
+
+    std::deque<CSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMessage());
+    ssHeader.GetAndClear(it->vHeader);
+    it->pPayload = payload;
+    nSendSize += it->size();
+
+    {
+        LOCK(cs_mapMsgCmdSize);
+        mapSendBytesPerMsgCmd[pszCommand] += it->size();
+    }
+
+    // If write queue empty, attempt "optimistic write"
+    if (it == vSendMsg.begin())
+        SocketSendData(this);
+}
+
+CSharedPayload::CSharedPayload(CDataStream::const_iterator pbegin, CDataStream::const_iterator pend) : vData(pbegin, pend)
+{
+    uint256 hash = Hash(vData.begin(), vData.end());
+    nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+}
+
 //
 // CBanListDB
 //
@@ -67,6 +67,10 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** The default for -maxuploadtarget. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The length of the -maxuploadtarget accounting cycle (in seconds) */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -141,9 +145,12 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
 
+class CSharedPayload;
+typedef std::shared_ptr<const CSharedPayload> CSharedPayloadRef;
+
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedPayloadRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -162,6 +169,11 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
+
+/** Bucket for received messages whose command is not in getAllNetMessageTypes() */
+#define NET_MESSAGE_COMMAND_OTHER "*other*"
+
 class CNodeStats
 {
 public:
@@ -177,6 +189,8 @@ public:
     int nStartingHeight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -184,12 +198,53 @@ public:
 };
 
 
+/**
+ * A message payload that is serialized, and checksummed, once and then shared
+ * read-only by the send queue of every peer it goes to. Only the 24-byte
+ * message header is built per peer.
+ */
+class CSharedPayload
+{
+public:
+    CSerializeData vData;
+    unsigned int nChecksum;
+
+    CSharedPayload(CDataStream::const_iterator pbegin, CDataStream::const_iterator pend);
+};
+
+/** Serialize obj for the network into a payload that can be queued to any number of peers. */
+template <typename T>
+CSharedPayloadRef MakeSharedPayload(const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    return std::make_shared<const CSharedPayload>(ss.begin(), ss.end());
+}
+
+/** A message waiting in a peer's send queue: its header, followed by a shared payload if any. */
+class CSendMessage
+{
+public:
+    CSerializeData vHeader; // the whole message when pPayload is null
+    CSharedPayloadRef pPayload;
+
+    size_t size() const
+    {
+        return vHeader.size() + (pPayload ? pPayload->vData.size() : 0);
+    }
+};
+
+/** Largest receive buffer kept for reuse once its message has been processed. */
+static const unsigned int MAX_POOLED_RECV_BUFFER = 256 * 1024;
+/** Number of receive buffers kept for reuse. */
+static const unsigned int MAX_POOLED_RECV_BUFFERS = 64;
+
 class CNetMessage
 {
 public:
     bool in_data; // parsing header (false) or data (true)
 
-    CDataStream hdrbuf; // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr; // complete header
     unsigned int nHdrPos;
 
@@ -198,9 +253,8 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -216,14 +270,23 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    /**
+     * Space for the rest of the message body, so that it can be received into
+     * place; NULL if fewer than nMin bytes are still expected. At most 256 KiB
+     * beyond what has arrived is allocated, whatever the header claims.
+     */
+    char* GetDataBuffer(unsigned int nMin, unsigned int& nSpace);
 };
 
+/** Hand the payload buffers of processed messages back for reuse by later ones. */
+void RecycleRecvBuffers(std::deque<CNetMessage>::iterator begin, std::deque<CNetMessage>::iterator end);
+
 
 typedef enum BanReason
 {
@@ -299,13 +362,17 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
+    // Bytes per message command, header included; guarded by cs_mapMsgCmdSize
+    CCriticalSection cs_mapMsgCmdSize;
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
     int nRecvVersion;
 
     int64_t nLastSend;
@@ -399,6 +466,12 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // outbound limit & stats, guarded by cs_totalBytesSent
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+
     CCriticalSection cs_nRefCount;
 
     CNode(const CNode&);
@@ -429,6 +502,15 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    /** Buffer the next recv() can write to directly, if a large message body is still arriving. */
+    char* GetRecvDataBuffer(unsigned int nMin, unsigned int& nSpace)
+    {
+        if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+            return NULL;
+        return vRecvMsg.back().GetDataBuffer(nMin, nSpace);
+    }
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -498,16 +580,19 @@ public:
     void AbortMessage() UNLOCK_FUNCTION(cs_vSend);
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
-    void EndMessage() UNLOCK_FUNCTION(cs_vSend);
+    void EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend);
 
     void PushVersion();
 
 
+    /** Queue a payload built by MakeSharedPayload without serializing it again. */
+    void PushPayload(const char* pszCommand, const CSharedPayloadRef& payload);
+
     void PushMessage(const char* pszCommand)
     {
         try {
             BeginMessage(pszCommand);
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -520,7 +605,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -533,7 +618,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -546,7 +631,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -559,7 +644,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -572,7 +657,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4 << a5;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -585,7 +670,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4 << a5 << a6;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -598,7 +683,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -611,7 +696,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -624,7 +709,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << (unsigned long)a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -637,7 +722,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -650,7 +735,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10 << a11;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -663,7 +748,7 @@ public:
         try {
             BeginMessage(pszCommand);
             ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10 << a11 << a12;
-            EndMessage();
+            EndMessage(pszCommand);
         } catch (...) {
             AbortMessage();
             throw;
@@ -743,6 +828,25 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! set the max outbound target in bytes per MAX_UPLOAD_TIMEFRAME; 0 disables it
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //! set the timeframe of the max outbound target
+    static void SetMaxOutboundTimeframe(uint64_t timeframe);
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! check if the outbound target is reached
+    // if historicalBlockServingLimit is true, this already returns true while
+    // there is only enough budget left to serve new blocks until the cycle ends
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //! bytes left in the current max outbound cycle; 0 if there is no limit
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! seconds left in the current max outbound cycle; 0 if there is no limit
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 class CExplicitNetCleanup
@@ -753,7 +857,7 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const CSharedPayloadRef& payload);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
@@ -11,6 +11,7 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <limits>
 #include <math.h>
 
 // Lux modified: find last block index up to pindex
@@ -96,3 +97,22 @@ uint256 GetBlockProof(const CBlockIndex& block)
     // or ~bnTarget / (nTarget+1) + 1.
     return (~bnTarget / (bnTarget + 1)) + 1;
 }
+
+int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip, const Consensus::Params& params)
+{
+    uint256 r;
+    int sign = 1;
+    if (to.nChainWork > from.nChainWork) {
+        r = to.nChainWork - from.nChainWork;
+    } else {
+        r = from.nChainWork - to.nChainWork;
+        sign = -1;
+    }
+    uint256 bnTipProof = GetBlockProof(tip);
+    if (bnTipProof == 0)
+        return sign * std::numeric_limits<int64_t>::max();
+    r = r * uint256(params.nPowTargetSpacing) / bnTipProof;
+    if (r.bits() > 63)
+        return sign * std::numeric_limits<int64_t>::max();
+    return sign * r.GetLow64();
+}
@@ -5,6 +5,7 @@
 
 #include "primitives/block.h"
 
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "script/standard.h"
 #include "script/sign.h"
@@ -22,7 +23,16 @@ uint256 CBlockHeader::GetHash(bool phi2block) const {
     }
 }
 
-uint256 CBlock::BuildMerkleTree(bool* fMutated) const
+/** Number of nodes in the in-memory merkle tree of a block with nLeaves transactions */
+static size_t MerkleTreeSize(size_t nLeaves)
+{
+    size_t nNodes = nLeaves;
+    for (size_t nSize = nLeaves; nSize > 1; nSize = (nSize + 1) / 2)
+        nNodes += (nSize + 1) / 2;
+    return nNodes;
+}
+
+uint256 CBlock::BuildMerkleTree(bool* fMutated, const CBlock* pblockReuse) const
 {
     /* WARNING! If you're reading this because you're learning about crypto
        and/or designing a new system that will use merkle trees, keep in mind
@@ -59,25 +69,59 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
        known ways of changing the transactions without affecting the merkle
        root.
     */
+    // The tree to reuse nodes from; when rebuilding our own, keep the old one aside
+    std::vector<uint256> vOldTree;
+    const std::vector<uint256>* pvReuse = NULL;
+    size_t nReuseSize = 0;
+    if (pblockReuse == this) {
+        vOldTree.swap(vMerkleTree);
+        pvReuse = &vOldTree;
+    } else if (pblockReuse) {
+        pvReuse = &pblockReuse->vMerkleTree;
+    }
+    if (pvReuse && pvReuse->size() == MerkleTreeSize(pblockReuse->vtx.size()))
+        nReuseSize = pblockReuse->vtx.size();
+
     vMerkleTree.clear();
     vMerkleTree.reserve(vtx.size() * 2 + 16); // Safe upper bound for the number of total nodes.
     for (std::vector<CTransaction>::const_iterator it(vtx.begin()); it != vtx.end(); ++it)
         vMerkleTree.push_back(it->GetHash());
-    int j = 0;
+
+    // Number of leading nodes of the current level that are equal in both
+    // trees; a node above two of them is the same in both trees too.
+    size_t nShared = 0;
+    while (nShared < vtx.size() && nShared < nReuseSize && vMerkleTree[nShared] == (*pvReuse)[nShared] &&
+           (*pvReuse)[nShared] == pblockReuse->vtx[nShared].GetHash())
+        nShared++;
+
+    size_t j = 0, jReuse = 0;
     bool mutated = false;
-    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        size_t nNext = (nSize + 1) / 2;
+        vMerkleTree.resize(j + nSize + nNext);
+
+        // A level identical to the other tree's, including an odd last node, gives an identical next level
+        size_t nCopy = (nShared == nSize && nSize == nReuseSize) ? nNext : nShared / 2;
+        for (size_t i = 0; i < nCopy; i++)
+            vMerkleTree[j + nSize + i] = (*pvReuse)[jReuse + nReuseSize + i];
+
+        // Hash the remaining pairs with one multi-way call, then an odd last node with itself
+        size_t nPairs = nSize / 2;
+        if (nPairs > nCopy)
+            SHA256D64(vMerkleTree[j + nSize + nCopy].begin(), vMerkleTree[j + 2 * nCopy].begin(), nPairs - nCopy);
+        if ((nSize & 1) && nCopy < nNext)
+            vMerkleTree[j + nSize + nNext - 1] = Hash(BEGIN(vMerkleTree[j + nSize - 1]), END(vMerkleTree[j + nSize - 1]),
+                                                      BEGIN(vMerkleTree[j + nSize - 1]), END(vMerkleTree[j + nSize - 1]));
+
+        if (!(nSize & 1) && vMerkleTree[j + nSize - 2] == vMerkleTree[j + nSize - 1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
         }
         j += nSize;
+        jReuse += nReuseSize;
+        nReuseSize = (nReuseSize + 1) / 2;
+        nShared = nCopy;
     }
     if (fMutated) {
         *fMutated = mutated;
@@ -165,7 +165,10 @@ public:
     // If non-NULL, *mutated is set to whether mutation was detected in the merkle
     // tree (a duplication of transactions in the block leading to an identical
     // merkle root).
-    uint256 BuildMerkleTree(bool* mutated = NULL) const;
+    // If pblockReuse is non-NULL, nodes of its in-memory tree that only depend on
+    // leading transactions it shares with this block are copied instead of
+    // rehashed; pass this block to reuse the tree of an earlier call.
+    uint256 BuildMerkleTree(bool* mutated = NULL, const CBlock* pblockReuse = NULL) const;
 
     std::vector<uint256> GetMerkleBranch(int nIndex) const;
     static uint256 CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMerkleBranch, int nIndex);
@@ -31,7 +31,20 @@ static const char* ppszTypeName[] =
         "mn quorum",
         "mn announce",
         "mn ping",
-        "dstx"};
+        "dstx",
+        "cmpctblock"};
+
+static const char* ppszNetMessageTypes[] =
+    {
+        "version", "verack", "addr", "getaddr", "inv", "getdata", "notfound",
+        "getblocks", "getheaders", "headers", "block", "merkleblock", "tx",
+        "mempool", "ping", "pong", "reject", "alert",
+        "filterload", "filteradd", "filterclear",
+        "sendcmpct", "cmpctblock", "getblocktxn", "blocktxn",
+        "getcfilters", "cfilter", "getcfheaders", "cfheaders", "getcfcheckpt", "cfcheckpt",
+        "ix", "txlreq", "txlvote", "spork", "getsporks", "mnw", "mnget",
+        "dsa", "dsc", "dsee", "dseep", "dseg", "dsf", "dsi", "dsq", "dss", "dssu", "dssub"};
+static const std::vector<std::string> allNetMessageTypesVec(ppszNetMessageTypes, ppszNetMessageTypes + ARRAYLEN(ppszNetMessageTypes));
 
 CMessageHeader::CMessageHeader()
 {
@@ -148,3 +161,8 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+const std::vector<std::string>& getAllNetMessageTypes()
+{
+    return allNetMessageTypesVec;
+}
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -78,6 +79,9 @@ enum ServiceFlags : uint64_t {
     // Indicates that a node can be asked for blocks and transactions including
     // witness data.
     NODE_WITNESS = (1 << 3),
+    // NODE_COMPACT_FILTERS means the node will serve basic block filters
+    // (BIP 157/158) in reply to getcfilters, getcfheaders and getcfcheckpt.
+    NODE_COMPACT_FILTERS = (1 << 6),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
@@ -141,6 +145,9 @@ enum GetDataMsg
     MSG_TXLOCK_VOTE,
     MSG_SPORK,
     MSG_MASTERNODE_WINNER,
+    // Defined in BIP152, numbered after the masternode and darksend types
+    // named in ppszTypeName. Only valid in getdata, answered with "cmpctblock".
+    MSG_CMPCT_BLOCK = 17,
     MSG_WITNESS_BLOCK = MSG_BLOCK | MSG_WITNESS_FLAG,
     MSG_WITNESS_TX = MSG_TX | MSG_WITNESS_FLAG,
     MSG_FILTERED_WITNESS_BLOCK = MSG_FILTERED_BLOCK | MSG_WITNESS_FLAG,
@@ -176,4 +183,7 @@ public:
     uint256 hash;
 };
 
+/** All message commands this node sends or handles, for per-command traffic accounting. */
+const std::vector<std::string>& getAllNetMessageTypes();
+
 #endif // BITCOIN_PROTOCOL_H
@@ -282,11 +282,11 @@ void BitcoinCore::initialize()
     try {
         qDebug() << __func__ << ": Running AppInit2 in thread";
         int rv = AppInit2(threadGroup, scheme);
-        if (rv) {
-            /* Start a dummy RPC thread if no RPC thread is active yet
-             * to handle timeouts.
+        if (rv && !IsRPCRunning()) {
+            /* Without -server, the console is the only RPC client;
+             * mark RPC as running so long-polling calls work from it.
              */
-            StartDummyRPCThread();
+            StartRPC();
         }
         emit initializeResult(rv);
     } catch (std::exception& e) {
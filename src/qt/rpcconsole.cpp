@@ -32,6 +32,7 @@
 #include <QSignalMapper>
 #include <QThread>
 #include <QTime>
+#include <QTimer>
 #include <QStringList>
 #include <QSettings>
 
@@ -94,6 +95,39 @@ signals:
     void reply(int category, const QString& command);
 };
 
+/** Class for handling RPC timers
+ * (used for e.g. re-locking the wallet after a timeout)
+ */
+class QtRPCTimerBase : public QObject, public RPCTimerBase
+{
+    Q_OBJECT
+public:
+    QtRPCTimerBase(boost::function<void(void)>& func, int64_t millis) : func(func)
+    {
+        timer.setSingleShot(true);
+        connect(&timer, SIGNAL(timeout()), this, SLOT(timeout()));
+        timer.start(millis);
+    }
+    ~QtRPCTimerBase() {}
+private slots:
+    void timeout() { func(); }
+
+private:
+    QTimer timer;
+    boost::function<void(void)> func;
+};
+
+class QtRPCTimerInterface : public RPCTimerInterface
+{
+public:
+    ~QtRPCTimerInterface() {}
+    const char* Name() { return "Qt"; }
+    RPCTimerBase* NewTimer(boost::function<void(void)>& func, int64_t millis)
+    {
+        return new QtRPCTimerBase(func, millis);
+    }
+};
+
 #include "rpcconsole.moc"
 
 /**
@@ -377,7 +411,8 @@ RPCConsole::RPCConsole(QWidget* parent) : QDialog(parent),
                                           clientModel(0),
                                           historyPtr(0),
                                           cachedNodeid(-1),
-                                          contextMenu(0)
+                                          contextMenu(0),
+                                          rpcTimerInterface(0)
 {
     ui->setupUi(this);
     GUIUtil::restoreWindowGeometry("nRPCConsoleWindow", this->size(), this);
@@ -417,6 +452,10 @@ RPCConsole::RPCConsole(QWidget* parent) : QDialog(parent),
     ui->berkeleyDBVersion->hide();
 #endif
 
+    // Register RPC timer interface
+    rpcTimerInterface = new QtRPCTimerInterface();
+    RPCRegisterTimerInterface(rpcTimerInterface);
+
     startExecutor();
     setTrafficGraphRange(INITIAL_TRAFFIC_GRAPH_MINS);
 
@@ -431,6 +470,8 @@ RPCConsole::~RPCConsole()
 {
     GUIUtil::saveWindowGeometry("nRPCConsoleWindow", this);
     emit stopExecutor();
+    RPCUnregisterTimerInterface(rpcTimerInterface);
+    delete rpcTimerInterface;
     delete ui;
 }
 
@@ -13,6 +13,7 @@
 #include <QDialog>
 class QMenu;
 class ClientModel;
+class RPCTimerInterface;
 
 namespace Ui
 {
@@ -150,6 +151,7 @@ private:
     NodeId cachedNodeid;
     int consoleFontSize;
     QMenu *contextMenu;
+    RPCTimerInterface *rpcTimerInterface;
 };
 
 #endif // BITCOIN_QT_RPCCONSOLE_H
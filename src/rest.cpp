@@ -3,9 +3,12 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "httprpc.h"
+#include "httpserver.h"
 #include "main.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "rest.h"
 #include "rpcserver.h"
 #include "streams.h"
 #include "sync.h"
@@ -13,11 +16,14 @@
 #include "version.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 
 #include "univalue/univalue.h"
 
 using namespace std;
 
+/** Largest number of headers returned by a single /rest/headers request. */
+static const size_t MAX_REST_HEADERS_RESULTS = 2000;
 
 enum RetFormat {
     RF_UNDEF,
@@ -36,23 +42,17 @@ static const struct {
     {RF_JSON, "json"},
 };
 
-class RestErr
-{
-public:
-    enum HTTPStatusCode status;
-    string message;
-};
-
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
 extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
+extern void blockToJSON(UniValueStreamWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
+extern UniValue blockHeaderToJSON(const CBlock& block, const CBlockIndex* blockindex);
 
-static RestErr RESTERR(enum HTTPStatusCode status, string message)
+static bool RESTERR(HTTPRequest* req, enum HTTPStatusCode status, string message)
 {
-    RestErr re;
-    re.status = status;
-    re.message = message;
-    return re;
+    req->WriteHeader("Content-Type", "text/plain");
+    req->WriteReply(status, message + "\r\n");
+    return false;
 }
 
 static enum RetFormat ParseDataFormat(vector<string>& params, const string strReq)
@@ -92,99 +92,109 @@ static bool ParseHashStr(const string& strReq, uint256& v)
     return true;
 }
 
-static bool rest_block(AcceptedConnection* conn,
-    string& strReq,
-    map<string, string>& mapHeaders,
-    bool fRun,
+static bool CheckWarmup(HTTPRequest* req)
+{
+    std::string statusmessage;
+    if (RPCIsInWarmup(&statusmessage))
+        return RESTERR(req, HTTP_SERVICE_UNAVAILABLE, "Service temporarily unavailable: " + statusmessage);
+    return true;
+}
+
+static bool rest_block(HTTPRequest* req,
+    const std::string& strURIPart,
     bool showTxDetails)
 {
+    if (!CheckWarmup(req))
+        return false;
     vector<string> params;
-    enum RetFormat rf = ParseDataFormat(params, strReq);
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
 
     string hashStr = params[0];
     uint256 hash;
     if (!ParseHashStr(hashStr, hash))
-        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
     CBlock block;
+    std::vector<unsigned char> vchBlock;
     const Consensus::Params consensusParams = Params().GetConsensus();
     CBlockIndex* pblockindex = NULL;
     {
         LOCK(cs_main);
         if (mapBlockIndex.count(hash) == 0)
-            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
 
         pblockindex = mapBlockIndex[hash];
-        if (!ReadBlockFromDisk(block, pblockindex, consensusParams))
-            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available");
+
+        // The binary and hex forms are the stored bytes, which are already in
+        // network format, so they are sent without a decode/encode round trip.
+        if (rf == RF_BINARY || rf == RF_HEX) {
+            if (!ReadRawBlockFromDisk(vchBlock, pblockindex))
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        } else if (!ReadBlockFromDisk(block, pblockindex, consensusParams))
+            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
-        string binaryBlock = ssBlock.str();
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryBlock.size(), "application/octet-stream") << binaryBlock << std::flush;
+        string binaryBlock(vchBlock.begin(), vchBlock.end());
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryBlock);
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        string strHex = HexStr(vchBlock.begin(), vchBlock.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
         return true;
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        HTTPReplyStream stream(req, "application/json");
+        UniValueStreamWriter writer(boost::bind(&HTTPReplyStream::Write, &stream, _1));
+        blockToJSON(writer, block, pblockindex, showTxDetails);
+        stream.End(writer.release() + "\n");
         return true;
     }
 
     default: {
-        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
     }
     }
 
     // not reached
-    return true; // continue to process further HTTP reqs on this cxn
+    return true;
 }
 
-static bool rest_block_extended(AcceptedConnection* conn,
-    string& strReq,
-    map<string, string>& mapHeaders,
-    bool fRun)
+static bool rest_block_extended(HTTPRequest* req, const std::string& strURIPart)
 {
-    return rest_block(conn, strReq, mapHeaders, fRun, true);
+    return rest_block(req, strURIPart, true);
 }
 
-static bool rest_block_notxdetails(AcceptedConnection* conn,
-    string& strReq,
-    map<string, string>& mapHeaders,
-    bool fRun)
+static bool rest_block_notxdetails(HTTPRequest* req, const std::string& strURIPart)
 {
-    return rest_block(conn, strReq, mapHeaders, fRun, false);
+    return rest_block(req, strURIPart, false);
 }
 
-static bool rest_tx(AcceptedConnection* conn,
-    string& strReq,
-    map<string, string>& mapHeaders,
-    bool fRun)
+static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
 {
+    if (!CheckWarmup(req))
+        return false;
     vector<string> params;
-    enum RetFormat rf = ParseDataFormat(params, strReq);
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
 
     string hashStr = params[0];
     uint256 hash;
     if (!ParseHashStr(hashStr, hash))
-        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
     const Consensus::Params consensusParams = Params().GetConsensus();
     CTransaction tx;
     uint256 hashBlock = uint256();
     if (!GetTransaction(hash, tx, consensusParams, hashBlock, true))
-        throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+        return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
 
     CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
     ssTx << tx;
@@ -192,13 +202,15 @@ static bool rest_tx(AcceptedConnection* conn,
     switch (rf) {
     case RF_BINARY: {
         string binaryTx = ssTx.str();
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryTx.size(), "application/octet-stream") << binaryTx << std::flush;
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryTx);
         return true;
     }
 
     case RF_HEX: {
         string strHex = HexStr(ssTx.begin(), ssTx.end()) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
         return true;
     }
 
@@ -206,53 +218,543 @@ static bool rest_tx(AcceptedConnection* conn,
         UniValue objTx(UniValue::VOBJ);
         TxToJSON(tx, hashBlock, objTx);
         string strJSON = objTx.write() + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true;
+}
+
+static bool rest_headers(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>.<ext>.");
+
+    long count = strtol(path[0].c_str(), NULL, 10);
+    if (count < 1 || (size_t)count > MAX_REST_HEADERS_RESULTS)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Header count out of range: " + path[0]);
+
+    string hashStr = path[1];
+    uint256 hash;
+    if (!ParseHashStr(hashStr, hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+
+    // Headers come straight from the block index, no block file is touched
+    vector<const CBlockIndex*> headers;
+    headers.reserve(count);
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        const CBlockIndex* pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
+        while (pindex != NULL && chainActive.Contains(pindex)) {
+            headers.push_back(pindex);
+            if (headers.size() == (size_t)count)
+                break;
+            pindex = chainActive.Next(pindex);
+        }
+    }
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_FOREACH (const CBlockIndex* pindex, headers)
+            ssHeader << pindex->GetBlockHeader();
+
+        if (rf == RF_BINARY) {
+            string binaryHeader = ssHeader.str();
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, binaryHeader);
+        } else {
+            string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK, strHex);
+        }
+        return true;
+    }
+
+    case RF_JSON: {
+        UniValue jsonHeaders(UniValue::VARR);
+        {
+            LOCK(cs_main);
+            BOOST_FOREACH (const CBlockIndex* pindex, headers)
+                jsonHeaders.push_back(blockHeaderToJSON(CBlock(pindex->GetBlockHeader()), pindex));
+        }
+        string strJSON = jsonHeaders.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true;
+}
+
+static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue chainInfoObject = getblockchaininfo(UniValue(UniValue::VARR), false);
+        string strJSON = chainInfoObject.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true;
+}
+
+static bool rest_mempool_info(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue mempoolInfoObject = getmempoolinfo(UniValue(UniValue::VARR), false);
+        string strJSON = mempoolInfoObject.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
         return true;
     }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true;
+}
+
+static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue verbose(UniValue::VARR);
+        verbose.push_back(true);
 
+        HTTPReplyStream stream(req, "application/json");
+        UniValueStreamWriter writer(boost::bind(&HTTPReplyStream::Write, &stream, _1));
+        getrawmempoolstream(verbose, writer);
+        stream.End(writer.release() + "\n");
+        return true;
+    }
     default: {
-        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
     }
     }
 
     // not reached
-    return true; // continue to process further HTTP reqs on this cxn
+    return true;
+}
+
+bool ParseGetUTXOsRequest(const std::vector<std::string>& uriParts, const std::string& strBody, bool fAllowBody, bool& fCheckMemPool, std::vector<COutPoint>& vOutPoints, std::string& strError)
+{
+    fCheckMemPool = false;
+    vOutPoints.clear();
+    if (strBody.empty() && uriParts.empty()) {
+        strError = "Error: empty request";
+        return false;
+    }
+
+    if (!uriParts.empty()) {
+        // inputs are sent over the URI scheme (/rest/getutxos/checkmempool/txid1-n/txid2-n/...)
+        if (uriParts[0] == "checkmempool")
+            fCheckMemPool = true;
+
+        for (size_t i = (fCheckMemPool) ? 1 : 0; i < uriParts.size(); i++) {
+            uint256 txid;
+            int32_t nOutput;
+            std::string strTxid = uriParts[i].substr(0, uriParts[i].find("-"));
+            std::string strOutput = uriParts[i].substr(uriParts[i].find("-") + 1);
+
+            if (!ParseInt32(strOutput, &nOutput) || nOutput < 0 || !ParseHashStr(strTxid, txid)) {
+                strError = "Parse error";
+                return false;
+            }
+
+            vOutPoints.push_back(COutPoint(txid, (uint32_t)nOutput));
+        }
+
+        if (vOutPoints.empty()) {
+            strError = "Error: empty request";
+            return false;
+        }
+    }
+
+    if (!fAllowBody) {
+        if (vOutPoints.empty()) {
+            strError = "Error: empty request";
+            return false;
+        }
+    } else if (!strBody.empty()) {
+        // don't allow sending input over URI and HTTP RAW DATA
+        if (!vOutPoints.empty()) {
+            strError = "Combination of URI scheme inputs and raw post data is not allowed";
+            return false;
+        }
+        try {
+            CDataStream oss(strBody.data(), strBody.data() + strBody.size(), SER_NETWORK, PROTOCOL_VERSION);
+            oss >> fCheckMemPool;
+            oss >> vOutPoints;
+        } catch (const std::ios_base::failure& e) {
+            // abort in case of unreadable binary data
+            strError = "Parse error";
+            return false;
+        }
+    }
+
+    // limit max outpoints
+    if (vOutPoints.size() > MAX_GETUTXOS_OUTPOINTS) {
+        strError = strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", MAX_GETUTXOS_OUTPOINTS, vOutPoints.size());
+        return false;
+    }
+    return true;
+}
+
+void GetUTXOs(const std::vector<COutPoint>& vOutPoints, bool fCheckMemPool, std::vector<unsigned char>& bitmap, std::vector<CCoin>& outs)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    bitmap.assign((vOutPoints.size() + 7) / 8, 0);
+    for (size_t i = 0; i < vOutPoints.size(); i++) {
+        const COutPoint& outpoint = vOutPoints[i];
+        CCoins coins;
+        bool fFound = false;
+        if (fCheckMemPool) {
+            // Unconfirmed outputs are taken from the mempool and anything
+            // the mempool already spends is reported as spent.
+            CTransactionRef ptx = mempool.get(outpoint.hash);
+            if (ptx) {
+                coins = CCoins(*ptx, MEMPOOL_HEIGHT);
+                fFound = true;
+            }
+        }
+        if (!fFound)
+            fFound = pcoinsTip->GetCoins(outpoint.hash, coins);
+
+        if (fFound && coins.IsAvailable(outpoint.n) && !(fCheckMemPool && mempool.isSpent(outpoint))) {
+            bitmap[i / 8] |= (1 << (i % 8));
+            // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
+            // n is valid but points to an already spent output (IsNull).
+            CCoin coin;
+            coin.nTxVer = coins.nVersion;
+            coin.nHeight = coins.nHeight;
+            coin.out = coins.vout.at(outpoint.n);
+            outs.push_back(coin);
+        }
+    }
+}
+
+static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    vector<string> uriParts;
+    if (params[0].length() > 1) {
+        std::string strUriParams = params[0].substr(1);
+        boost::split(uriParts, strUriParams, boost::is_any_of("/"));
+    }
+
+    std::string strBody = req->ReadBody();
+    switch (rf) {
+    case RF_HEX: {
+        // convert hex to bin, continue then with bin part
+        std::vector<unsigned char> vBody = ParseHex(strBody);
+        strBody.assign(vBody.begin(), vBody.end());
+        break;
+    }
+    case RF_BINARY:
+    case RF_JSON:
+        break;
+    default:
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+
+    // input-format = output-format, rest/getutxos/bin requires binary input, gives binary output, ...
+    bool fCheckMemPool = false;
+    vector<COutPoint> vOutPoints;
+    std::string strError;
+    if (!ParseGetUTXOsRequest(uriParts, strBody, rf != RF_JSON, fCheckMemPool, vOutPoints, strError))
+        return RESTERR(req, HTTP_BAD_REQUEST, strError);
+
+    // check spentness and form a bitmap
+    vector<unsigned char> bitmap;
+    vector<CCoin> outs;
+    int nChainHeight;
+    uint256 hashChainTip;
+    {
+        LOCK2(cs_main, mempool.cs);
+        GetUTXOs(vOutPoints, fCheckMemPool, bitmap, outs);
+        nChainHeight = chainActive.Height();
+        hashChainTip = chainActive.Tip()->GetBlockHash();
+    }
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        // serialize data, in the same layout as BIP64
+        CDataStream ssGetUTXOResponse(SER_NETWORK, PROTOCOL_VERSION);
+        ssGetUTXOResponse << nChainHeight << hashChainTip << bitmap << outs;
+
+        if (rf == RF_BINARY) {
+            string ssGetUTXOResponseString = ssGetUTXOResponse.str();
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, ssGetUTXOResponseString);
+        } else {
+            string strHex = HexStr(ssGetUTXOResponse.begin(), ssGetUTXOResponse.end()) + "\n";
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK, strHex);
+        }
+        return true;
+    }
+
+    case RF_JSON: {
+        UniValue objGetUTXOResponse(UniValue::VOBJ);
+
+        // pack in some essentials, more or less the same output as BIP64
+        objGetUTXOResponse.push_back(Pair("chainHeight", nChainHeight));
+        objGetUTXOResponse.push_back(Pair("chaintipHash", hashChainTip.GetHex()));
+        // a binary string representation of the bitmap, human-readable for json output
+        std::string bitmapStringRepresentation;
+        for (size_t i = 0; i < vOutPoints.size(); i++)
+            bitmapStringRepresentation.append(bitmap[i / 8] & (1 << (i % 8)) ? "1" : "0");
+        objGetUTXOResponse.push_back(Pair("bitmap", bitmapStringRepresentation));
+
+        UniValue utxos(UniValue::VARR);
+        BOOST_FOREACH (const CCoin& coin, outs) {
+            UniValue utxo(UniValue::VOBJ);
+            utxo.push_back(Pair("txvers", (int32_t)coin.nTxVer));
+            utxo.push_back(Pair("height", (int32_t)coin.nHeight));
+            utxo.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
+
+            // include the script in a json output
+            UniValue o(UniValue::VOBJ);
+            ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
+            utxo.push_back(Pair("scriptPubKey", o));
+            utxos.push_back(utxo);
+        }
+        objGetUTXOResponse.push_back(Pair("utxos", utxos));
+
+        string strJSON = objGetUTXOResponse.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true;
+}
+
+static bool rest_contract_storage(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    string addressStr = params[0];
+    if (!IsHex(addressStr) || addressStr.size() != 40)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid contract address: " + addressStr);
+    dev::Address address(addressStr);
+
+    std::map<dev::h256, std::pair<dev::u256, dev::u256> > storage;
+    {
+        LOCK(cs_main);
+        if (!globalState->addressInUse(address))
+            return RESTERR(req, HTTP_NOT_FOUND, addressStr + " not found");
+        storage = globalState->storage(address);
+    }
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        // Entry count followed by (hashed key, key, value) triples
+        CDataStream ssStorage(SER_NETWORK, PROTOCOL_VERSION);
+        WriteCompactSize(ssStorage, storage.size());
+        for (std::map<dev::h256, std::pair<dev::u256, dev::u256> >::const_iterator it = storage.begin(); it != storage.end(); ++it)
+            ssStorage << h256Touint(it->first) << u256Touint(it->second.first) << u256Touint(it->second.second);
+
+        if (rf == RF_BINARY) {
+            string binaryStorage = ssStorage.str();
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, binaryStorage);
+        } else {
+            string strHex = HexStr(ssStorage.begin(), ssStorage.end()) + "\n";
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK, strHex);
+        }
+        return true;
+    }
+
+    case RF_JSON: {
+        HTTPReplyStream stream(req, "application/json");
+        UniValueStreamWriter writer(boost::bind(&HTTPReplyStream::Write, &stream, _1));
+        writer.beginObject();
+        for (std::map<dev::h256, std::pair<dev::u256, dev::u256> >::const_iterator it = storage.begin(); it != storage.end(); ++it) {
+            UniValue entry(UniValue::VOBJ);
+            entry.push_back(Pair(dev::h256(it->second.first).hex(), dev::h256(it->second.second).hex()));
+            writer.key(it->first.hex());
+            writer.value(entry);
+        }
+        writer.endObject();
+        stream.End(writer.release() + "\n");
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+
+    // not reached
+    return true;
+}
+
+static UniValue ReceiptToJSON(const TransactionReceiptInfo& receipt)
+{
+    UniValue entry(UniValue::VOBJ);
+    entry.push_back(Pair("blockHash", receipt.blockHash.GetHex()));
+    entry.push_back(Pair("blockNumber", uint64_t(receipt.blockNumber)));
+    entry.push_back(Pair("transactionHash", receipt.transactionHash.GetHex()));
+    entry.push_back(Pair("transactionIndex", uint64_t(receipt.transactionIndex)));
+    entry.push_back(Pair("from", receipt.from.hex()));
+    entry.push_back(Pair("to", receipt.to.hex()));
+    entry.push_back(Pair("cumulativeGasUsed", receipt.cumulativeGasUsed));
+    entry.push_back(Pair("gasUsed", receipt.gasUsed));
+    entry.push_back(Pair("contractAddress", receipt.contractAddress.hex()));
+    std::stringstream ss;
+    ss << receipt.excepted;
+    entry.push_back(Pair("excepted", ss.str()));
+
+    UniValue logEntries(UniValue::VARR);
+    BOOST_FOREACH (const dev::eth::LogEntry& log, receipt.logs) {
+        UniValue logEntry(UniValue::VOBJ);
+        logEntry.push_back(Pair("address", log.address.hex()));
+        UniValue topics(UniValue::VARR);
+        BOOST_FOREACH (const dev::h256& topic, log.topics)
+            topics.push_back(topic.hex());
+        logEntry.push_back(Pair("topics", topics));
+        logEntry.push_back(Pair("data", HexStr(log.data)));
+        logEntries.push_back(logEntry);
+    }
+    entry.push_back(Pair("log", logEntries));
+    return entry;
+}
+
+static bool rest_receipt(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    string hashStr = params[0];
+    uint256 hash;
+    if (!ParseHashStr(hashStr, hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+
+    switch (rf) {
+    case RF_JSON: {
+        std::vector<TransactionReceiptInfo> receipts;
+        {
+            LOCK(cs_main);
+            receipts = pstorageresult->getResult(uintToh256(hash));
+        }
+        if (receipts.empty())
+            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+
+        UniValue result(UniValue::VARR);
+        BOOST_FOREACH (const TransactionReceiptInfo& receipt, receipts)
+            result.push_back(ReceiptToJSON(receipt));
+        string strJSON = result.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true;
 }
 
 static const struct {
     const char* prefix;
-    bool (*handler)(AcceptedConnection* conn,
-        string& strURI,
-        map<string, string>& mapHeaders,
-        bool fRun);
+    bool (*handler)(HTTPRequest* req, const std::string& strReq);
 } uri_prefixes[] = {
     {"/rest/tx/", rest_tx},
     {"/rest/block/notxdetails/", rest_block_notxdetails},
     {"/rest/block/", rest_block_extended},
+    {"/rest/headers/", rest_headers},
+    {"/rest/chaininfo", rest_chaininfo},
+    {"/rest/mempool/info", rest_mempool_info},
+    {"/rest/mempool/contents", rest_mempool_contents},
+    {"/rest/getutxos", rest_getutxos},
+    {"/rest/contract/storage/", rest_contract_storage},
+    {"/rest/receipt/", rest_receipt},
 };
 
-bool HTTPReq_REST(AcceptedConnection* conn,
-    string& strURI,
-    map<string, string>& mapHeaders,
-    bool fRun)
+bool StartREST()
 {
-    try {
-        std::string statusmessage;
-        if (RPCIsInWarmup(&statusmessage))
-            throw RESTERR(HTTP_SERVICE_UNAVAILABLE, "Service temporarily unavailable: " + statusmessage);
-
-        for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++) {
-            unsigned int plen = strlen(uri_prefixes[i].prefix);
-            if (strURI.substr(0, plen) == uri_prefixes[i].prefix) {
-                string strReq = strURI.substr(plen);
-                return uri_prefixes[i].handler(conn, strReq, mapHeaders, fRun);
-            }
-        }
-    } catch (RestErr& re) {
-        conn->stream() << HTTPReply(re.status, re.message + "\r\n", false, false, "text/plain") << std::flush;
-        return false;
-    }
+    for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
+        RegisterHTTPHandler(uri_prefixes[i].prefix, false, uri_prefixes[i].handler);
+    return true;
+}
 
-    conn->stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
-    return false;
+void InterruptREST()
+{
+}
+
+void StopREST()
+{
+    for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
+        UnregisterHTTPHandler(uri_prefixes[i].prefix, false);
 }
@@ -0,0 +1,50 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_REST_H
+#define BITCOIN_REST_H
+
+#include "primitives/transaction.h"
+#include "serialize.h"
+
+#include <string>
+#include <vector>
+
+/** Largest number of outpoints looked up by a single /rest/getutxos request. */
+static const size_t MAX_GETUTXOS_OUTPOINTS = 15;
+
+/** An unspent output as returned by /rest/getutxos (BIP64). */
+struct CCoin {
+    uint32_t nTxVer; // Don't call this nVersion, that name has a special meaning inside IMPLEMENT_SERIALIZE
+    uint32_t nHeight;
+    CTxOut out;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nTxVer);
+        READWRITE(nHeight);
+        READWRITE(out);
+    }
+};
+
+/**
+ * Parse the outpoints of a /rest/getutxos request, given either in the URI
+ * (checkmempool/txid-n/...) or, if fAllowBody, as a BIP64 serialized body.
+ * Returns false with strError set if the request is empty or malformed, or
+ * asks for more than MAX_GETUTXOS_OUTPOINTS outpoints.
+ */
+bool ParseGetUTXOsRequest(const std::vector<std::string>& uriParts, const std::string& strBody, bool fAllowBody, bool& fCheckMemPool, std::vector<COutPoint>& vOutPoints, std::string& strError);
+
+/**
+ * Set bit i of bitmap for every unspent outpoint i, and append those outputs
+ * to outs in order. With fCheckMemPool, outputs of mempool transactions count
+ * and outputs the mempool spends don't. Requires cs_main and mempool.cs.
+ */
+void GetUTXOs(const std::vector<COutPoint>& vOutPoints, bool fCheckMemPool, std::vector<unsigned char>& bitmap, std::vector<CCoin>& outs);
+
+#endif // BITCOIN_REST_H
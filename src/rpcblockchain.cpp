@@ -5,11 +5,13 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "blockfilterindex.h"
 #include "checkpoints.h"
 #include "consensus/validation.h"
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpcserver.h"
+#include "snapshot.h"
 #include "sync.h"
 #include "util.h"
 
@@ -52,19 +54,39 @@ double GetDifficulty(const CBlockIndex* blockindex)
 }
 
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+/** Fields of blockToJSON that precede (head) and follow (tail) the transaction list */
+static void blockFieldsToJSON(const CBlock& block, const CBlockIndex* blockindex, UniValue& head, UniValue& tail)
 {
-    UniValue result(UniValue::VOBJ);
-    result.push_back(Pair("hash", block.GetHash(blockindex->nHeight >= Params().SwitchPhi2Block()).GetHex()));
+    head.push_back(Pair("hash", block.GetHash(blockindex->nHeight >= Params().SwitchPhi2Block()).GetHex()));
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
     if (chainActive.Contains(blockindex))
         confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
+    head.push_back(Pair("confirmations", confirmations));
+    head.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
+    head.push_back(Pair("height", blockindex->nHeight));
+    head.push_back(Pair("version", block.nVersion));
+    head.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
+
+    tail.push_back(Pair("time", block.GetBlockTime()));
+    tail.push_back(Pair("nonce", (uint64_t)block.nNonce));
+    tail.push_back(Pair("bits", strprintf("%08x", block.nBits)));
+    tail.push_back(Pair("difficulty", GetDifficulty(blockindex)));
+    tail.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()?"proof-of-stake":"proof-of-work", blockindex->GeneratedStakeModifier()?" stake-modifier":"")));
+    tail.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
+
+    if (blockindex->pprev)
+        tail.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
+    CBlockIndex* pnext = chainActive.Next(blockindex);
+    if (pnext)
+        tail.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
+}
+
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    UniValue result(UniValue::VOBJ);
+    UniValue tail(UniValue::VOBJ);
+    blockFieldsToJSON(block, blockindex, result, tail);
     UniValue txs(UniValue::VARR);
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         if (txDetails) {
@@ -75,21 +97,32 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
             txs.push_back(tx.GetHash().GetHex());
     }
     result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", block.GetBlockTime()));
-    result.push_back(Pair("nonce", (uint64_t)block.nNonce));
-    result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()?"proof-of-stake":"proof-of-work", blockindex->GeneratedStakeModifier()?" stake-modifier":"")));
-    result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
-
-    if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex* pnext = chainActive.Next(blockindex);
-    if (pnext)
-        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
+    result.pushKVs(tail);
     return result;
 }
 
+/** Same output as blockToJSON, written one transaction at a time */
+void blockToJSON(UniValueStreamWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    UniValue head(UniValue::VOBJ);
+    UniValue tail(UniValue::VOBJ);
+    blockFieldsToJSON(block, blockindex, head, tail);
+    writer.beginObject();
+    writer.members(head);
+    writer.key("tx");
+    writer.beginArray();
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        if (txDetails) {
+            UniValue objTx(UniValue::VOBJ);
+            TxToJSON(tx, uint256(), objTx);
+            writer.value(objTx);
+        } else
+            writer.value(tx.GetHash().GetHex());
+    }
+    writer.endArray();
+    writer.members(tail);
+    writer.endObject();
+}
 
 UniValue blockHeaderToJSON(const CBlock& block, const CBlockIndex* blockindex)
 {
@@ -150,6 +183,33 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
 }
 
 
+/** Verbose getrawmempool entry; cs_main and mempool.cs must be held */
+static UniValue mempoolEntryToJSON(const CTxMemPoolEntry& e)
+{
+    UniValue info(UniValue::VOBJ);
+    info.push_back(Pair("size", (int)e.GetTxSize()));
+    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+    info.push_back(Pair("time", e.GetTime()));
+    info.push_back(Pair("height", (int)e.GetHeight()));
+    info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+    info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+    const CTransaction& tx = e.GetTx();
+    set<string> setDepends;
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (mempool.exists(txin.prevout.hash))
+            setDepends.insert(txin.prevout.hash.ToString());
+    }
+    UniValue depends(UniValue::VARR);
+
+    BOOST_FOREACH(const string& dep, setDepends)
+    {
+          depends.push_back(dep);
+    }
+
+    info.push_back(Pair("depends", depends));
+    return info;
+}
+
 UniValue getrawmempool(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -189,31 +249,8 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx) {
-            const uint256& hash = e.GetTx().GetHash();;
-            UniValue info(UniValue::VOBJ);
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
-            set<string> setDepends;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-            UniValue depends(UniValue::VARR);
-
-            BOOST_FOREACH(const string& dep, setDepends)
-            {
-                  depends.push_back(dep);
-            }
-
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
-        }
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
+            o.push_back(Pair(e.GetTx().GetHash().ToString(), mempoolEntryToJSON(e)));
         return o;
     } else {
         vector<uint256> vtxid;
@@ -227,6 +264,23 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     }
 }
 
+void getrawmempoolstream(const UniValue& params, UniValueStreamWriter& writer)
+{
+    // Only the verbose form is large enough to be worth streaming
+    if (params.size() != 1 || !params[0].get_bool()) {
+        writer.value(getrawmempool(params, false));
+        return;
+    }
+
+    LOCK2(cs_main, mempool.cs);
+    writer.beginObject();
+    BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx) {
+        writer.key(e.GetTx().GetHash().ToString());
+        writer.value(mempoolEntryToJSON(e));
+    }
+    writer.endObject();
+}
+
 UniValue getblockhashes(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2)
@@ -306,6 +360,22 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
+/** Read the block whose hash is given by param; cs_main must be held */
+static CBlockIndex* ReadBlockParam(const UniValue& param, CBlock& block)
+{
+    std::string strHash = param.get_str();
+    uint256 hash(strHash);
+
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CBlockIndex* pblockindex = mapBlockIndex[hash];
+
+    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    return pblockindex;
+}
+
 UniValue getblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -342,21 +412,12 @@ UniValue getblock(const UniValue& params, bool fHelp)
 
     LOCK(cs_main);
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(strHash);
-
     bool fVerbose = true;
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlockIndex* pblockindex = ReadBlockParam(params[0], block);
 
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -368,6 +429,21 @@ UniValue getblock(const UniValue& params, bool fHelp)
     return blockToJSON(block, pblockindex);
 }
 
+void getblockstream(const UniValue& params, UniValueStreamWriter& writer)
+{
+    // The hex form is a single string; only the object form is worth streaming
+    if (params.size() < 1 || params.size() > 2 || (params.size() > 1 && !params[1].get_bool())) {
+        writer.value(getblock(params, false));
+        return;
+    }
+
+    LOCK(cs_main);
+
+    CBlock block;
+    CBlockIndex* pblockindex = ReadBlockParam(params[0], block);
+    blockToJSON(writer, block, pblockindex);
+}
+
 UniValue getblockheader(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -394,21 +470,12 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
 
     LOCK(cs_main);
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(strHash);
-
     bool fVerbose = true;
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlockIndex* pblockindex = ReadBlockParam(params[0], block);
 
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -420,6 +487,58 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     return blockHeaderToJSON(block, pblockindex);
 }
 
+UniValue getblockfilter(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve a BIP 157 content filter for a particular block.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"     (string, required) The hash of the block\n"
+            "2. \"filtertype\"    (string, optional, default=basic) The type name of the filter (" + ListBlockFilterTypes() + ")\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"hex\",  (string) the hex-encoded filter data\n"
+            "  \"header\" : \"hex\"   (string) the hex-encoded filter header\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"basic\"") +
+            HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"basic\""));
+
+    uint256 hashBlock = ParseHashV(params[0], "blockhash");
+    std::string strFilterType = params.size() > 1 ? params[1].get_str() : BlockFilterTypeName(BLOCK_FILTER_BASIC);
+
+    BlockFilterType filterType;
+    if (!BlockFilterTypeByName(strFilterType, filterType))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+
+    CBlockFilterIndex* pfilterindex = GetBlockFilterIndex(filterType);
+    if (!pfilterindex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + strFilterType);
+
+    const CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+    }
+
+    CBlockFilter filter;
+    uint256 hashHeader;
+    if (!pfilterindex->LookupFilter(pblockindex, filter) || !pfilterindex->LookupFilterHeader(pblockindex, hashHeader)) {
+        if (pfilterindex->GetBestHeight() < pblockindex->nHeight)
+            throw JSONRPCError(RPC_MISC_ERROR, "Filter not found. Block filters are still in the process of being indexed.");
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Filter not found.");
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    ret.push_back(Pair("header", hashHeader.GetHex()));
+    return ret;
+}
+
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -458,6 +577,96 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+/** Snapshot paths are taken relative to the data directory unless absolute. */
+static boost::filesystem::path GetSnapshotPath(const std::string& strPath)
+{
+    boost::filesystem::path path(strPath);
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    return path;
+}
+
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the unspent transaction output set and the contract state at the current tip to a file.\n"
+            "The file can bootstrap another node with loadtxoutset. Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) Destination file, relative to the data directory unless absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"bestblock\": \"hex\",        (string) the block the snapshot was taken at\n"
+            "  \"height\": n,               (numeric) the height of that block\n"
+            "  \"txouts_transactions\": n,  (numeric) the number of transactions with unspent outputs\n"
+            "  \"state_entries\": n,        (numeric) the number of contract state entries\n"
+            "  \"hash_serialized\": \"hash\", (string) the coins hash, as reported by gettxoutsetinfo\n"
+            "  \"path\": \"path\"             (string) the file written\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("dumptxoutset", "\"utxo.dat\"") + HelpExampleRpc("dumptxoutset", "\"utxo.dat\""));
+
+    boost::filesystem::path path = GetSnapshotPath(params[0].get_str());
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CSnapshotMetadata metadata;
+    CSnapshotCommitment commitment;
+    std::string strError;
+    if (!DumpSnapshot(path, metadata, commitment, strError))
+        throw JSONRPCError(RPC_DATABASE_ERROR, strError);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("bestblock", metadata.hashBlock.GetHex()));
+    ret.push_back(Pair("height", metadata.nHeight));
+    ret.push_back(Pair("txouts_transactions", (int64_t)commitment.nCoins));
+    ret.push_back(Pair("state_entries", (int64_t)commitment.nStateEntries));
+    ret.push_back(Pair("hash_serialized", commitment.hashCoins.GetHex()));
+    ret.push_back(Pair("path", path.string()));
+    return ret;
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "loadtxoutset \"path\" \"hash\"\n"
+            "\nReplace an empty chainstate with a snapshot written by dumptxoutset.\n"
+            "The block index and block data up to the snapshot block must be present; the chainstate must be\n"
+            "empty, e.g. after restarting with -reindex-chainstate. Blocks below the snapshot are not reconnected:\n"
+            "they have no undo data, forks below the snapshot block are refused, and the transaction and filter\n"
+            "indexes do not cover them until the node is restarted with -reindex.\n"
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) Snapshot file, relative to the data directory unless absolute\n"
+            "2. \"hash\"    (string, required) Expected hash_serialized of gettxoutsetinfo at the snapshot block,\n"
+            "               taken from a node you trust\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"bestblock\": \"hex\",   (string) the new chain tip\n"
+            "  \"height\": n           (numeric) the height of the new chain tip\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("loadtxoutset", "\"utxo.dat\" \"hash\"") + HelpExampleRpc("loadtxoutset", "\"utxo.dat\", \"hash\""));
+
+    boost::filesystem::path path = GetSnapshotPath(params[0].get_str());
+    uint256 hashExpected = ParseHashV(params[1], "hash");
+
+    CSnapshotMetadata metadata;
+    std::string strError;
+    if (!LoadSnapshot(path, hashExpected, metadata, strError))
+        throw JSONRPCError(RPC_DATABASE_ERROR, strError);
+
+    CValidationState state;
+    if (!ActivateBestChain(state, Params()))
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("bestblock", metadata.hashBlock.GetHex()));
+    ret.push_back(Pair("height", metadata.nHeight));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -107,13 +107,45 @@ UniValue getpoolinfo(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "getpoolinfo\n"
-            "Returns an object containing anonymous pool-related information.");
+            "Returns an object containing anonymous pool-related information.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"current_masternode\": n,     (numeric) Index of the current masternode\n"
+            "  \"state\": n,                  (numeric) State of the pool\n"
+            "  \"entries\": n,                (numeric) Number of entries in the pool\n"
+            "  \"entries_accepted\": n,       (numeric) Number of accepted entries\n"
+            "  \"messages_pending\": n,       (numeric) Darksend messages waiting to be handled\n"
+            "  \"messages_processed\": n,     (numeric) Darksend messages handled\n"
+            "  \"messages_dropped\": n,       (numeric) Darksend messages dropped because too many were waiting\n"
+            "  \"message_time_max\": n,       (numeric) Longest time spent handling one message, in milliseconds\n"
+            "  \"sessions_started\": n,       (numeric) Mixing sessions started as a masternode\n"
+            "  \"sessions_completed\": n,     (numeric) Sessions that relayed their transaction\n"
+            "  \"sessions_failed\": n,        (numeric) Sessions that timed out or were rejected\n"
+            "  \"queue_time_avg\": n,         (numeric) Average time of completed sessions from the first user to signing, in milliseconds\n"
+            "  \"signing_time_avg\": n,       (numeric) Average time of completed sessions from signing to relay, in milliseconds\n"
+            "  \"last_session_time\": n       (numeric) Duration of the last completed session, in milliseconds\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getpoolinfo", "") + HelpExampleRpc("getpoolinfo", ""));
+
+    CDarkSendStats stats;
+    GetDarkSendStats(stats);
 
     UniValue obj(UniValue::VOBJ);
     obj.push_back(Pair("current_masternode",        GetCurrentMasterNode()));
     obj.push_back(Pair("state",        darkSendPool.GetState()));
     obj.push_back(Pair("entries",      darkSendPool.GetEntriesCount()));
     obj.push_back(Pair("entries_accepted",      darkSendPool.GetCountEntriesAccepted()));
+    obj.push_back(Pair("messages_pending",      stats.nMessagesPending));
+    obj.push_back(Pair("messages_processed",    stats.nMessagesProcessed));
+    obj.push_back(Pair("messages_dropped",      stats.nMessagesDropped));
+    obj.push_back(Pair("message_time_max",      stats.nMessageTimeMax / 1000));
+    obj.push_back(Pair("sessions_started",      stats.nSessionsStarted));
+    obj.push_back(Pair("sessions_completed",    stats.nSessionsCompleted));
+    obj.push_back(Pair("sessions_failed",       stats.nSessionsFailed));
+    obj.push_back(Pair("queue_time_avg",        stats.nSessionsCompleted ? stats.nQueueTimeTotal / stats.nSessionsCompleted : 0));
+    obj.push_back(Pair("signing_time_avg",      stats.nSessionsCompleted ? stats.nSigningTimeTotal / stats.nSessionsCompleted : 0));
+    obj.push_back(Pair("last_session_time",     stats.nLastSessionTime));
     return obj;
 }
 
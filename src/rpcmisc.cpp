@@ -8,6 +8,7 @@
 #include "base58.h"
 #include "clientversion.h"
 #include "init.h"
+#include "instantx.h"
 #include "main.h"
 #include "stake.h"
 #include "net.h"
@@ -268,6 +269,48 @@ UniValue spork(const UniValue& params, bool fHelp)
         HelpRequiringPassphrase());
 }
 
+UniValue getinstantxinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getinstantxinfo\n"
+            "\nReturns statistics of the InstantX transaction locks.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"locks\": n,                 (numeric) Number of transaction locks in memory\n"
+            "  \"lockedinputs\": n,          (numeric) Number of inputs locked by complete locks\n"
+            "  \"votespending\": n,          (numeric) Number of received votes waiting for their signature check\n"
+            "  \"votesaccepted\": n,         (numeric) Number of votes with a valid signature from the quorum\n"
+            "  \"votesrejected\": n,         (numeric) Number of votes from outside the quorum or with an invalid signature\n"
+            "  \"batches\": n,               (numeric) Number of vote batches verified\n"
+            "  \"lockscompleted\": n,        (numeric) Number of locks that reached the required signatures\n"
+            "  \"latencyavg\": n,            (numeric) Average time from the first vote of a lock until it completed, in seconds\n"
+            "  \"latencylast\": n,           (numeric) The same for the last completed lock\n"
+            "  \"latencymax\": n             (numeric) The same for the slowest completed lock\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getinstantxinfo", "") + HelpExampleRpc("getinstantxinfo", ""));
+
+    CInstantXStats stats;
+    GetInstantXStats(stats);
+
+    UniValue obj(UniValue::VOBJ);
+    {
+        LOCK(cs_instantx);
+        obj.push_back(Pair("locks", (int64_t)mapTxLocks.size()));
+        obj.push_back(Pair("lockedinputs", (int64_t)mapLockedInputs.size()));
+    }
+    obj.push_back(Pair("votespending", stats.nVotesPending));
+    obj.push_back(Pair("votesaccepted", stats.nVotesAccepted));
+    obj.push_back(Pair("votesrejected", stats.nVotesRejected));
+    obj.push_back(Pair("batches", stats.nBatches));
+    obj.push_back(Pair("lockscompleted", stats.nLocksCompleted));
+    obj.push_back(Pair("latencyavg", stats.nLocksCompleted ? stats.nLockLatencyTotal * 0.000001 / stats.nLocksCompleted : 0.0));
+    obj.push_back(Pair("latencylast", stats.nLockLatencyLast * 0.000001));
+    obj.push_back(Pair("latencymax", stats.nLockLatencyMax * 0.000001));
+    return obj;
+}
+
 UniValue validateaddress(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -100,7 +100,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"bytessent_per_msg\": {\n"
+            "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
+            "       ...\n"
+            "    },\n"
+            "    \"bytesrecv_per_msg\": {\n"
+            "       \"addr\": n,              (numeric) The total bytes received aggregated by message type\n"
+            "       ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -150,12 +159,93 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
+        UniValue sendPerMsgCmd(UniValue::VOBJ);
+        BOOST_FOREACH (const mapMsgCmdSize::value_type& i, stats.mapSendBytesPerMsgCmd) {
+            if (i.second > 0)
+                sendPerMsgCmd.push_back(Pair(i.first, i.second));
+        }
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsgCmd));
+
+        UniValue recvPerMsgCmd(UniValue::VOBJ);
+        BOOST_FOREACH (const mapMsgCmdSize::value_type& i, stats.mapRecvBytesPerMsgCmd) {
+            if (i.second > 0)
+                recvPerMsgCmd.push_back(Pair(i.first, i.second));
+        }
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
+
         ret.push_back(obj);
     }
 
     return ret;
 }
 
+UniValue getblockdownloadinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockdownloadinfo\n"
+            "\nReturns the state of the block download scheduler.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"headersfirst\": true|false,  (boolean) Whether blocks are scheduled from headers across peers, rather than requested from getblocks inventory\n"
+            "  \"window\": n,                 (numeric) How many blocks past the last one we have in common with a peer may be requested\n"
+            "  \"inflight\": n,               (numeric) Number of blocks in flight from all peers\n"
+            "  \"peers\": [\n"
+            "    {\n"
+            "      \"id\": n,                 (numeric) Peer index\n"
+            "      \"addr\":\"host:port\",    (string) The ip address and port of the peer\n"
+            "      \"inflight\": n,           (numeric) Number of blocks in flight from this peer\n"
+            "      \"maxinflight\": n,        (numeric) How many blocks may be in flight from this peer, sized from its throughput\n"
+            "      \"received\": n,           (numeric) Number of requested blocks this peer delivered\n"
+            "      \"latency\": n,            (numeric) Average time from request to arrival of a block, in seconds\n"
+            "      \"blockspersec\": n,       (numeric) Blocks this peer delivers per second while requests are outstanding\n"
+            "      \"reassigned\": n,         (numeric) Blocks requested from a faster peer instead, because this one held back the window\n"
+            "      \"stalling\": n            (numeric) Seconds this peer has been holding back the download window (if it is)\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getblockdownloadinfo", "") + HelpExampleRpc("getblockdownloadinfo", ""));
+
+    LOCK(cs_main);
+
+    vector<CNodeStats> vstats;
+    CopyNodeStats(vstats);
+
+    int64_t nNow = GetTimeMicros();
+    int nInFlight = 0;
+    UniValue peers(UniValue::VARR);
+    BOOST_FOREACH (const CNodeStats& stats, vstats) {
+        CNodeStateStats statestats;
+        if (!GetNodeStateStats(stats.nodeid, statestats))
+            continue;
+        nInFlight += statestats.nBlocksInFlight;
+
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("id", stats.nodeid));
+        obj.push_back(Pair("addr", stats.addrName));
+        obj.push_back(Pair("inflight", statestats.nBlocksInFlight));
+        obj.push_back(Pair("maxinflight", statestats.nMaxBlocksInFlight));
+        obj.push_back(Pair("received", statestats.nBlocksReceived));
+        if (statestats.nBlocksReceived > 0) {
+            obj.push_back(Pair("latency", statestats.nBlockLatency * 0.000001));
+            obj.push_back(Pair("blockspersec", 1000000.0 / statestats.nBlockInterval));
+        }
+        obj.push_back(Pair("reassigned", statestats.nBlocksReassigned));
+        if (statestats.nStallingSince)
+            obj.push_back(Pair("stalling", (nNow - statestats.nStallingSince) * 0.000001));
+        peers.push_back(obj);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("headersfirst", Params().HeadersFirstSyncingActive()));
+    ret.push_back(Pair("window", (int)BLOCK_DOWNLOAD_WINDOW));
+    ret.push_back(Pair("inflight", nInFlight));
+    ret.push_back(Pair("peers", peers));
+    return ret;
+}
+
 UniValue addnode(const UniValue& params, bool fHelp)
 {
     string strCommand;
@@ -336,7 +426,16 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\":\n"
+            "  {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -345,6 +444,15 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
 
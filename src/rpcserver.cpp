@@ -23,37 +23,46 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
-#include <boost/asio/ssl.hpp>
 #include <boost/bind.hpp>
-#include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
-#include <boost/iostreams/concepts.hpp>
-#include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/signals2/signal.hpp>
 
 using namespace boost;
-using namespace boost::asio;
 using namespace std;
 
-static std::string strRPCUserColonPass;
-
 static bool fRPCRunning = false;
 static bool fRPCInWarmup = true;
 static std::string rpcWarmupStatus("RPC server started");
 static CCriticalSection cs_rpcWarmup;
 
+/* Timer-creating functions */
 static std::vector<RPCTimerInterface*> timerInterfaces;
+/* Map of name to timer. */
+static std::map<std::string, boost::shared_ptr<RPCTimerBase> > deadlineTimers;
+static CCriticalSection cs_rpcTimers;
+
+/** Upper bounds, in microseconds, of the latency buckets kept per RPC method; the last bucket is open-ended */
+static const int64_t RPC_LATENCY_BUCKET_LIMITS[] = {1000, 10000, 100000, 1000000, 10000000};
+static const unsigned int RPC_LATENCY_BUCKETS = ARRAYLEN(RPC_LATENCY_BUCKET_LIMITS) + 1;
+
+/** Call statistics of one RPC method */
+struct CRPCCallStats {
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    uint64_t vBuckets[RPC_LATENCY_BUCKETS];
+
+    CRPCCallStats() : nCalls(0), nErrors(0), nTotalMicros(0), nMaxMicros(0)
+    {
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+};
 
-//! These are created by StartRPCThreads, destroyed in StopRPCThreads
-static asio::io_service* rpc_io_service = NULL;
-static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
-static ssl::context* rpc_ssl_context = NULL;
-static boost::thread_group* rpc_worker_group = NULL;
-static boost::asio::io_service::work* rpc_dummy_work = NULL;
-static std::vector<CSubNet> rpc_allow_subnets; //!< List of subnets to allow RPC connections from
-static std::vector<boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
+static std::map<std::string, CRPCCallStats> mapRPCCallStats;
+static CCriticalSection cs_rpcCallStats;
 
 static struct CRPCSignals
 {
@@ -272,12 +281,14 @@ static const CRPCCommand vRPCCommands[] =
         {"control", "getinfo", &getinfo, true, false, false}, /* uses wallet if enabled */
         {"control", "help", &help, true, true, false},
         {"control", "stop", &stop, true, true, false},
+        {"control", "getrpcinfo", &getrpcinfo, true, true, false},
 
         /* P2P networking */
         {"network", "getnetworkinfo", &getnetworkinfo, true, false, false},
         {"network", "addnode", &addnode, true, true, false},
         //{"network", "disconnectnode", &disconnectnode, true, true, false},
         {"network", "getaddednodeinfo", &getaddednodeinfo, true, true, false},
+        {"network", "getblockdownloadinfo", &getblockdownloadinfo, true, false, false},
         {"network", "getconnectioncount", &getconnectioncount, true, false, false},
         {"network", "getnettotals", &getnettotals, true, true, false},
         {"network", "getpeerinfo", &getpeerinfo, true, false, false},
@@ -295,12 +306,15 @@ static const CRPCCommand vRPCCommands[] =
         {"blockchain", "getblockhash", &getblockhash, true, false, false},
         {"blockchain", "getblockhashes", &getblockhashes, true, false, false},
         {"blockchain", "getblockheader", &getblockheader, false, false, false},
+        {"blockchain", "getblockfilter", &getblockfilter, true, false, false},
         {"blockchain", "getchaintips", &getchaintips, true, false, false},
         {"blockchain", "getdifficulty", &getdifficulty, true, false, false},
         {"blockchain", "getmempoolinfo", &getmempoolinfo, true, true, false},
         {"blockchain", "getrawmempool", &getrawmempool, true, false, false},
         {"blockchain", "gettxout", &gettxout, true, false, false},
         {"blockchain", "gettxoutsetinfo", &gettxoutsetinfo, true, false, false},
+        {"blockchain", "dumptxoutset", &dumptxoutset, true, true, false},
+        {"blockchain", "loadtxoutset", &loadtxoutset, true, true, false},
         {"blockchain", "verifychain", &verifychain, true, false, false},
         {"blockchain", "invalidateblock", &invalidateblock, true, true, false},
         {"blockchain", "reconsiderblock", &reconsiderblock, true, true, false},
@@ -357,6 +371,8 @@ static const CRPCCommand vRPCCommands[] =
         //{"lux", "mnfinalbudget", &mnfinalbudget, true, true, false},
         //{"lux", "mnsync", &mnsync, true, true, false},
         {"lux", "spork", &spork, true, true, false},
+        {"lux", "getinstantxinfo", &getinstantxinfo, true, false, false},
+        {"lux", "getpoolinfo", &getpoolinfo, true, false, false},
 #ifdef ENABLE_WALLET
         //{"lux", "darksend", &darksend, false, false, true}, /* not threadSafe because of SendMoney */
 
@@ -410,6 +426,19 @@ static const CRPCCommand vRPCCommands[] =
 #endif // ENABLE_WALLET
 };
 
+/**
+ * Methods with large results that can also be written straight to the
+ * HTTP reply. The streaming variant must produce the same result as the
+ * method itself; help and the remaining checks stay with the method.
+ */
+static const struct {
+    const char* name;
+    rpcstreamfn_type actor;
+} vRPCStreamCommands[] = {
+    {"getblock", &getblockstream},
+    {"getrawmempool", &getrawmempoolstream},
+};
+
 CRPCTable::CRPCTable()
 {
     unsigned int vcidx;
@@ -419,6 +448,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < ARRAYLEN(vRPCStreamCommands); vcidx++)
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = vRPCStreamCommands[vcidx].actor;
 }
 
 const CRPCCommand* CRPCTable::operator[](string name) const
@@ -430,30 +461,6 @@ const CRPCCommand* CRPCTable::operator[](string name) const
 }
 
 
-bool HTTPAuthorized(map<string, string>& mapHeaders)
-{
-    string strAuth = mapHeaders["authorization"];
-    if (strAuth.substr(0, 6) != "Basic ")
-        return false;
-    string strUserPass64 = strAuth.substr(6);
-    boost::trim(strUserPass64);
-    string strUserPass = DecodeBase64(strUserPass64);
-    return TimingResistantEqual(strUserPass, strRPCUserColonPass);
-}
-
-void ErrorReply(std::ostream& stream, const UniValue& objError, const UniValue& id)
-{
-    // Send error reply from json-rpc error object
-    int nStatus = HTTP_INTERNAL_SERVER_ERROR;
-    int code = find_value(objError, "code").get_int();
-    if (code == RPC_INVALID_REQUEST)
-        nStatus = HTTP_BAD_REQUEST;
-    else if (code == RPC_METHOD_NOT_FOUND)
-        nStatus = HTTP_NOT_FOUND;
-    string strReply = JSONRPCReply(NullUniValue, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
-}
-
 CNetAddr BoostAsioToCNetAddr(boost::asio::ip::address address)
 {
     CNetAddr netaddr;
@@ -471,328 +478,29 @@ CNetAddr BoostAsioToCNetAddr(boost::asio::ip::address address)
     return netaddr;
 }
 
-bool ClientAllowed(const boost::asio::ip::address& address)
-{
-    CNetAddr netaddr = BoostAsioToCNetAddr(address);
-    BOOST_FOREACH (const CSubNet& subnet, rpc_allow_subnets)
-        if (subnet.Match(netaddr))
-            return true;
-    return false;
-}
-
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+bool StartRPC()
 {
-public:
-    AcceptedConnectionImpl(
-        asio::io_service& io_service,
-        ssl::context& context,
-        bool fUseSSL) : sslStream(io_service, context),
-                        _d(sslStream, fUseSSL),
-                        _stream(_d)
-    {
-    }
-
-    virtual std::iostream& stream()
-    {
-        return _stream;
-    }
-
-    virtual std::string peer_address_to_string() const
-    {
-        return peer.address().to_string();
-    }
-
-    virtual void close()
-    {
-        _stream.close();
-    }
-
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
-
-private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream<SSLIOStreamDevice<Protocol> > _stream;
-};
-
-void ServiceConnection(AcceptedConnection* conn);
-
-//! Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr<basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-    ssl::context& context,
-    bool fUseSSL,
-    boost::shared_ptr<AcceptedConnection> conn,
-    const boost::system::error_code& error);
-
-/**
- * Sets up I/O resources to accept and handle a new connection.
- */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr<basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-    ssl::context& context,
-    const bool fUseSSL)
-{
-    // Accept connection
-    boost::shared_ptr<AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
-
-    acceptor->async_accept(
-        conn->sslStream.lowest_layer(),
-        conn->peer,
-        boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
-            acceptor,
-            boost::ref(context),
-            fUseSSL,
-            conn,
-            _1));
-}
-
-
-/**
- * Accept and handle incoming connection.
- */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr<basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-    ssl::context& context,
-    const bool fUseSSL,
-    boost::shared_ptr<AcceptedConnection> conn,
-    const boost::system::error_code& error)
-{
-    // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
-    if (error != asio::error::operation_aborted && acceptor->is_open())
-        RPCListen(acceptor, context, fUseSSL);
-
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast<AcceptedConnectionImpl<ip::tcp>*>(conn.get());
-
-    if (error) {
-        // TODO: Actually handle errors
-        LogPrintf("%s: Error: %s\n", __func__, error.message());
-    }
-    // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
-    // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address())) {
-        // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-        if (!fUseSSL)
-            conn->stream() << HTTPError(HTTP_FORBIDDEN, false) << std::flush;
-        conn->close();
-    } else {
-        ServiceConnection(conn.get());
-        conn->close();
-    }
-}
-
-static ip::tcp::endpoint ParseEndpoint(const std::string& strEndpoint, int defaultPort)
-{
-    std::string addr;
-    int port = defaultPort;
-    SplitHostPort(strEndpoint, port, addr);
-    return ip::tcp::endpoint(asio::ip::address::from_string(addr), port);
-}
-
-void StartRPCThreads()
-{
-    rpc_allow_subnets.clear();
-    rpc_allow_subnets.push_back(CSubNet("127.0.0.0/8")); // always allow IPv4 local subnet
-    rpc_allow_subnets.push_back(CSubNet("::1"));         // always allow IPv6 localhost
-    if (mapMultiArgs.count("-rpcallowip")) {
-        const vector<string>& vAllow = mapMultiArgs["-rpcallowip"];
-        BOOST_FOREACH (string strAllow, vAllow) {
-            CSubNet subnet(strAllow);
-            if (!subnet.IsValid()) {
-                uiInterface.ThreadSafeMessageBox(
-                    strprintf("Invalid -rpcallowip subnet specification: %s. Valid are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24).", strAllow),
-                    "", CClientUIInterface::MSG_ERROR);
-                StartShutdown();
-                return;
-            }
-            rpc_allow_subnets.push_back(subnet);
-        }
-    }
-    std::string strAllowed;
-    BOOST_FOREACH (const CSubNet& subnet, rpc_allow_subnets)
-        strAllowed += subnet.ToString() + " ";
-    LogPrint("rpc", "Allowing RPC connections from: %s\n", strAllowed);
-
-    strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
-    if (((mapArgs["-rpcpassword"] == "") ||
-            (mapArgs["-rpcuser"] == mapArgs["-rpcpassword"])) &&
-        Params().RequireRPCPassword()) {
-        unsigned char rand_pwd[32];
-        GetRandBytes(rand_pwd, 32);
-        uiInterface.ThreadSafeMessageBox(strprintf(
-                                             _("To use luxd, or the -server option to lux-qt, you must set an rpcpassword in the configuration file:\n"
-                                               "%s\n"
-                                               "It is recommended you use the following random password:\n"
-                                               "rpcuser=luxrpc\n"
-                                               "rpcpassword=%s\n"
-                                               "(you do not need to remember this password)\n"
-                                               "The username and password MUST NOT be the same.\n"
-                                               "If the file does not exist, create it with owner-readable-only file permissions.\n"
-                                               "It is also recommended to set alertnotify so you are notified of problems;\n"
-                                               "for example: alertnotify=echo %%s | mail -s \"LUX Alert\" admin@foo.com\n"),
-                                             GetConfigFile().string(),
-                                             EncodeBase58(&rand_pwd[0], &rand_pwd[0] + 32)),
-            "", CClientUIInterface::MSG_ERROR | CClientUIInterface::SECURE);
-        StartShutdown();
-        return;
-    }
-
-    assert(rpc_io_service == NULL);
-    rpc_io_service = new asio::io_service();
-    rpc_ssl_context = new ssl::context(*rpc_io_service, ssl::context::sslv23);
-
-    const bool fUseSSL = GetBoolArg("-rpcssl", false);
-
-    if (fUseSSL) {
-        rpc_ssl_context->set_options(ssl::context::no_sslv2 | ssl::context::no_sslv3);
-
-        filesystem::path pathCertFile(GetArg("-rpcsslcertificatechainfile", "server.cert"));
-        if (!pathCertFile.is_complete()) pathCertFile = filesystem::path(GetDataDir()) / pathCertFile;
-        if (filesystem::exists(pathCertFile))
-            rpc_ssl_context->use_certificate_chain_file(pathCertFile.string());
-        else
-            LogPrintf("ThreadRPCServer ERROR: missing server certificate file %s\n", pathCertFile.string());
-
-        filesystem::path pathPKFile(GetArg("-rpcsslprivatekeyfile", "server.pem"));
-        if (!pathPKFile.is_complete()) pathPKFile = filesystem::path(GetDataDir()) / pathPKFile;
-        if (filesystem::exists(pathPKFile))
-            rpc_ssl_context->use_private_key_file(pathPKFile.string(), ssl::context::pem);
-        else
-            LogPrintf("ThreadRPCServer ERROR: missing server private key file %s\n", pathPKFile.string());
-
-        string strCiphers = GetArg("-rpcsslciphers", "TLSv1.2+HIGH:TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!3DES:@STRENGTH");
-        SSL_CTX_set_cipher_list(rpc_ssl_context->impl(), strCiphers.c_str());
-    }
-
-    std::vector<ip::tcp::endpoint> vEndpoints;
-    bool bBindAny = false;
-    int defaultPort = GetArg("-rpcport", BaseParams().RPCPort());
-    if (!mapArgs.count("-rpcallowip")) // Default to loopback if not allowing external IPs
-    {
-        vEndpoints.push_back(ip::tcp::endpoint(asio::ip::address_v6::loopback(), defaultPort));
-        vEndpoints.push_back(ip::tcp::endpoint(asio::ip::address_v4::loopback(), defaultPort));
-        if (mapArgs.count("-rpcbind")) {
-            LogPrintf("WARNING: option -rpcbind was ignored because -rpcallowip was not specified, refusing to allow everyone to connect\n");
-        }
-    } else if (mapArgs.count("-rpcbind")) // Specific bind address
-    {
-        BOOST_FOREACH (const std::string& addr, mapMultiArgs["-rpcbind"]) {
-            try {
-                vEndpoints.push_back(ParseEndpoint(addr, defaultPort));
-            } catch (const boost::system::system_error&) {
-                uiInterface.ThreadSafeMessageBox(
-                    strprintf(_("Could not parse -rpcbind value %s as network address"), addr),
-                    "", CClientUIInterface::MSG_ERROR);
-                StartShutdown();
-                return;
-            }
-        }
-    } else { // No specific bind address specified, bind to any
-        vEndpoints.push_back(ip::tcp::endpoint(asio::ip::address_v6::any(), defaultPort));
-        vEndpoints.push_back(ip::tcp::endpoint(asio::ip::address_v4::any(), defaultPort));
-        // Prefer making the socket dual IPv6/IPv4 instead of binding
-        // to both addresses seperately.
-        bBindAny = true;
-    }
-
-    bool fListening = false;
-    std::string strerr;
-    std::string straddress;
-    BOOST_FOREACH (const ip::tcp::endpoint& endpoint, vEndpoints) {
-        try {
-            asio::ip::address bindAddress = endpoint.address();
-            straddress = bindAddress.to_string();
-            LogPrintf("Binding RPC on address %s port %i (IPv4+IPv6 bind any: %i)\n", straddress, endpoint.port(), bBindAny);
-            boost::system::error_code v6_only_error;
-            boost::shared_ptr<ip::tcp::acceptor> acceptor(new ip::tcp::acceptor(*rpc_io_service));
-
-            acceptor->open(endpoint.protocol());
-            acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-
-            // Try making the socket dual IPv6/IPv4 when listening on the IPv6 "any" address
-            acceptor->set_option(boost::asio::ip::v6_only(
-                                     !bBindAny || bindAddress != asio::ip::address_v6::any()),
-                v6_only_error);
-
-            acceptor->bind(endpoint);
-            acceptor->listen(socket_base::max_connections);
-
-            RPCListen(acceptor, *rpc_ssl_context, fUseSSL);
-
-            rpc_acceptors.push_back(acceptor);
-            fListening = true;
-            rpc_acceptors.push_back(acceptor);
-            // If dual IPv6/IPv4 bind successful, skip binding to IPv4 separately
-            if (bBindAny && bindAddress == asio::ip::address_v6::any() && !v6_only_error)
-                break;
-        } catch (boost::system::system_error& e) {
-            LogPrintf("ERROR: Binding RPC on address %s port %i failed: %s\n", straddress, endpoint.port(), e.what());
-            strerr = strprintf(_("An error occurred while setting up the RPC address %s port %u for listening: %s"), straddress, endpoint.port(), e.what());
-        }
-    }
-
-    if (!fListening) {
-        uiInterface.ThreadSafeMessageBox(strerr, "", CClientUIInterface::MSG_ERROR);
-        StartShutdown();
-        return;
-    }
-
-    rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    LogPrint("rpc", "Starting RPC\n");
     fRPCRunning = true;
+    g_rpcSignals.Started();
+    return true;
 }
 
-void StartDummyRPCThread()
-{
-    if (rpc_io_service == NULL) {
-        rpc_io_service = new asio::io_service();
-        /* Create dummy "work" to keep the thread from exiting when no timeouts active,
-         * see http://www.boost.org/doc/libs/1_51_0/doc/html/boost_asio/reference/io_service.html#boost_asio.reference.io_service.stopping_the_io_service_from_running_out_of_work */
-        rpc_dummy_work = new asio::io_service::work(*rpc_io_service);
-        rpc_worker_group = new boost::thread_group();
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
-        fRPCRunning = true;
-    }
-}
-
-void StopRPCThreads()
+void InterruptRPC()
 {
-    if (rpc_io_service == NULL) return;
+    LogPrint("rpc", "Interrupting RPC\n");
     // Set this to false first, so that longpolling loops will exit when woken up
     fRPCRunning = false;
+}
 
-    // First, cancel all timers and acceptors
-    // This is not done automatically by ->stop(), and in some cases the destructor of
-    // asio::io_service can hang if this is skipped.
-    boost::system::error_code ec;
-    BOOST_FOREACH (const boost::shared_ptr<ip::tcp::acceptor>& acceptor, rpc_acceptors) {
-        acceptor->cancel(ec);
-        if (ec)
-            LogPrintf("%s: Warning: %s when cancelling acceptor", __func__, ec.message());
-    }
-    rpc_acceptors.clear();
-    BOOST_FOREACH (const PAIRTYPE(std::string, boost::shared_ptr<deadline_timer>) & timer, deadlineTimers) {
-        timer.second->cancel(ec);
-        if (ec)
-            LogPrintf("%s: Warning: %s when cancelling timer", __func__, ec.message());
+void StopRPC()
+{
+    LogPrint("rpc", "Stopping RPC\n");
+    {
+        LOCK(cs_rpcTimers);
+        deadlineTimers.clear();
     }
-    deadlineTimers.clear();
-
-    rpc_io_service->stop();
     g_rpcSignals.Stopped();
-    if (rpc_worker_group != NULL)
-        rpc_worker_group->join_all();
-    delete rpc_dummy_work;
-    rpc_dummy_work = NULL;
-    delete rpc_worker_group;
-    rpc_worker_group = NULL;
-    delete rpc_ssl_context;
-    rpc_ssl_context = NULL;
-    delete rpc_io_service;
-    rpc_io_service = NULL;
 }
 
 bool IsRPCRunning()
@@ -821,12 +529,6 @@ bool RPCIsInWarmup(std::string* outStatus)
     return fRPCInWarmup;
 }
 
-void RPCRunHandler(const boost::system::error_code& err, boost::function<void(void)> func)
-{
-    if (!err)
-        func();
-}
-
 void RPCRegisterTimerInterface(RPCTimerInterface *iface)
 {
     timerInterfaces.push_back(iface);
@@ -841,14 +543,13 @@ void RPCUnregisterTimerInterface(RPCTimerInterface *iface)
 
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds)
 {
-    assert(rpc_io_service != NULL);
-
-    if (deadlineTimers.count(name) == 0) {
-        deadlineTimers.insert(make_pair(name,
-            boost::shared_ptr<deadline_timer>(new deadline_timer(*rpc_io_service))));
-    }
-    deadlineTimers[name]->expires_from_now(posix_time::seconds(nSeconds));
-    deadlineTimers[name]->async_wait(boost::bind(RPCRunHandler, _1, func));
+    LOCK(cs_rpcTimers);
+    if (timerInterfaces.empty())
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "No timer handler registered for RPC");
+    deadlineTimers.erase(name);
+    RPCTimerInterface* timerInterface = timerInterfaces.back();
+    LogPrint("rpc", "queue run of timer %s in %i seconds (using %s)\n", name, nSeconds, timerInterface->Name());
+    deadlineTimers.insert(std::make_pair(name, boost::shared_ptr<RPCTimerBase>(timerInterface->NewTimer(func, nSeconds * 1000))));
 }
 
 void JSONRequest::parse(const UniValue& valRequest)
@@ -882,7 +583,7 @@ void JSONRequest::parse(const UniValue& valRequest)
 }
 
 
-static UniValue JSONRPCExecOne(const UniValue& req)
+UniValue JSONRPCExecOne(const UniValue& req)
 {
     UniValue rpc_result(UniValue::VOBJ);
 
@@ -911,121 +612,94 @@ string JSONRPCExecBatch(const UniValue& vReq)
     return ret.write() + "\n";
 }
 
-static bool HTTPReq_JSONRPC(AcceptedConnection* conn,
-    string& strRequest,
-    map<string, string>& mapHeaders,
-    bool fRun)
+static void RecordRPCCall(const std::string& strMethod, int64_t nMicros, bool fError)
 {
-    // Check authorization
-    if (mapHeaders.count("authorization") == 0) {
-        conn->stream() << HTTPError(HTTP_UNAUTHORIZED, false) << std::flush;
-        return false;
-    }
+    unsigned int nBucket = 0;
+    while (nBucket < RPC_LATENCY_BUCKETS - 1 && nMicros >= RPC_LATENCY_BUCKET_LIMITS[nBucket])
+        nBucket++;
 
-    if (!HTTPAuthorized(mapHeaders)) {
-        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-        /* Deter brute-forcing
-           If this results in a DoS the user really
-           shouldn't have their RPC port exposed. */
-        MilliSleep(250);
+    LOCK(cs_rpcCallStats);
+    CRPCCallStats& stats = mapRPCCallStats[strMethod];
+    stats.nCalls++;
+    if (fError)
+        stats.nErrors++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+    stats.vBuckets[nBucket]++;
+}
 
-        conn->stream() << HTTPError(HTTP_UNAUTHORIZED, false) << std::flush;
-        return false;
-    }
+UniValue CRPCTable::execute(const std::string& strMethod, const UniValue& params) const
+{
+    // Find method
+    const CRPCCommand* pcmd = tableRPC[strMethod];
+    if (!pcmd)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    g_rpcSignals.PreCommand(*pcmd);
 
-    JSONRequest jreq;
+    UniValue result;
+    int64_t nStart = GetTimeMicros();
     try {
-        // Parse request
-        UniValue valRequest;
-        if (!valRequest.read(strRequest))
-            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
-
-        // Return immediately if in warmup
-        {
-            LOCK(cs_rpcWarmup);
-            if (fRPCInWarmup)
-                throw JSONRPCError(RPC_IN_WARMUP, rpcWarmupStatus);
-        }
-
-        string strReply;
-
-        // singleton request
-        if (valRequest.isObject()) {
-            jreq.parse(valRequest);
-
-            UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
-
-            // Send reply
-            strReply = JSONRPCReply(result, NullUniValue, jreq.id);
-
-            // array of requests
-        } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(valRequest.get_array());
-        else
-            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, strReply.size()) << strReply << std::flush;
-    } catch (UniValue& objError) {
-        ErrorReply(conn->stream(), objError, jreq.id);
-        return false;
+        // Execute
+        result = pcmd->actor(params, false);
     } catch (std::exception& e) {
-        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-        return false;
+        RecordRPCCall(pcmd->name, GetTimeMicros() - nStart, true);
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    } catch (...) {
+        RecordRPCCall(pcmd->name, GetTimeMicros() - nStart, true);
+        throw;
     }
-    return true;
+    RecordRPCCall(pcmd->name, GetTimeMicros() - nStart, false);
+    g_rpcSignals.PostCommand(*pcmd);
+    return result;
 }
 
-void ServiceConnection(AcceptedConnection* conn)
-{
-    bool fRun = true;
-    while (fRun && !ShutdownRequested()) {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
-
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
-
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto, MAX_SIZE);
-
-        // HTTP Keep-Alive is false; close connection immediately
-        if ((mapHeaders["connection"] == "close") || (!GetBoolArg("-rpckeepalive", true)))
-            fRun = false;
-
-        // Process via JSON-RPC API
-        if (strURI == "/") {
-            if (!HTTPReq_JSONRPC(conn, strRequest, mapHeaders, fRun))
-                break;
-
-            // Process via HTTP REST API
-        } else if (strURI.substr(0, 6) == "/rest/" && GetBoolArg("-rest", false)) {
-            if (!HTTPReq_REST(conn, strURI, mapHeaders, fRun))
-                break;
-
-        } else {
-            conn->stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
-            break;
-        }
+UniValue RPCGetCallStats()
+{
+    static const char* const strBucketNames[RPC_LATENCY_BUCKETS] = {"<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s"};
+
+    UniValue ret(UniValue::VOBJ);
+    LOCK(cs_rpcCallStats);
+    BOOST_FOREACH (const PAIRTYPE(std::string, CRPCCallStats) & item, mapRPCCallStats) {
+        const CRPCCallStats& stats = item.second;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("calls", stats.nCalls));
+        obj.push_back(Pair("errors", stats.nErrors));
+        obj.push_back(Pair("avg_us", stats.nCalls ? stats.nTotalMicros / (int64_t)stats.nCalls : 0));
+        obj.push_back(Pair("max_us", stats.nMaxMicros));
+        UniValue histogram(UniValue::VOBJ);
+        for (unsigned int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+            histogram.push_back(Pair(strBucketNames[i], stats.vBuckets[i]));
+        obj.push_back(Pair("latency", histogram));
+        ret.push_back(Pair(item.first, obj));
     }
+    return ret;
 }
 
-UniValue CRPCTable::execute(const std::string& strMethod, const UniValue& params) const
+bool CRPCTable::canStream(const std::string& strMethod) const
+{
+    return mapStreamCommands.count(strMethod) && tableRPC[strMethod];
+}
+
+void CRPCTable::executeStream(const std::string& strMethod, const UniValue& params, UniValueStreamWriter& writer) const
 {
-    // Find method
     const CRPCCommand* pcmd = tableRPC[strMethod];
-    if (!pcmd)
+    std::map<std::string, rpcstreamfn_type>::const_iterator it = mapStreamCommands.find(strMethod);
+    if (!pcmd || it == mapStreamCommands.end())
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
     g_rpcSignals.PreCommand(*pcmd);
 
+    int64_t nStart = GetTimeMicros();
     try {
         // Execute
-        return pcmd->actor(params, false);
-
+        it->second(params, writer);
     } catch (std::exception& e) {
+        RecordRPCCall(pcmd->name, GetTimeMicros() - nStart, true);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    } catch (...) {
+        RecordRPCCall(pcmd->name, GetTimeMicros() - nStart, true);
+        throw;
     }
+    RecordRPCCall(pcmd->name, GetTimeMicros() - nStart, false);
     g_rpcSignals.PostCommand(*pcmd);
 }
 
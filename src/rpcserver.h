@@ -43,16 +43,6 @@ public:
     void parse(const UniValue& valRequest);
 };
 
-class AcceptedConnection
-{
-public:
-    virtual ~AcceptedConnection() {}
-
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
-
 class JSONRPCRequest
 {
 public:
@@ -67,16 +57,15 @@ public:
     void parse(const UniValue& valRequest);
 };
 
-/** Start RPC threads */
-void StartRPCThreads();
 /**
- * Alternative to StartRPCThreads for the GUI, when no server is
- * used. The RPC thread in this case is only used to handle timeouts.
- * If real RPC threads have already been started this is a no-op.
+ * Start the RPC dispatcher. Transports (the HTTP server, the GUI console)
+ * hand calls to tableRPC; this only marks RPC as running.
  */
-void StartDummyRPCThread();
-/** Stop RPC threads */
-void StopRPCThreads();
+bool StartRPC();
+/** Interrupt RPC: long-polling calls return as soon as they wake up */
+void InterruptRPC();
+/** Stop RPC and cancel pending RPCRunLater timers */
+void StopRPC();
 /** Query whether RPC is running */
 bool IsRPCRunning();
 
@@ -113,8 +102,8 @@ void RPCTypeCheckObj(const UniValue& o,
     bool fAllowNull = false);
 
 /**
- * Run func nSeconds from now. Uses boost deadline timers.
- * Overrides previous timer <name> (if any).
+ * Run func nSeconds from now, using the most recently registered
+ * RPCTimerInterface. Overrides previous timer <name> (if any).
  */
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
@@ -122,6 +111,8 @@ void RPCRunLater(const std::string& name, boost::function<void(void)> func, int6
 extern CNetAddr BoostAsioToCNetAddr(boost::asio::ip::address address);
 
 typedef UniValue (*rpcfn_type)(const UniValue& params, bool fHelp);
+/** Variant of an RPC method that writes its result to a stream instead of returning it */
+typedef void (*rpcstreamfn_type)(const UniValue& params, UniValueStreamWriter& writer);
 
 class CRPCCommand
 {
@@ -174,6 +165,7 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, rpcstreamfn_type> mapStreamCommands;
 
 public:
     CRPCTable();
@@ -189,6 +181,17 @@ public:
      */
     UniValue execute(const std::string& method, const UniValue& params) const;
 
+    /** Whether method can write its result straight to a UniValueStreamWriter */
+    bool canStream(const std::string& method) const;
+
+    /**
+     * Execute a method that has a streaming variant, writing exactly one
+     * JSON value to writer.
+     * @throws an exception (UniValue) when an error happens; output may
+     * already have been written at that point.
+     */
+    void executeStream(const std::string& method, const UniValue& params, UniValueStreamWriter& writer) const;
+
     /**
     * Returns a list of registered commands
     * @returns List of registered commands.
@@ -226,6 +229,7 @@ extern UniValue ping(const UniValue& params, bool fHelp);
 extern UniValue addnode(const UniValue& params, bool fHelp);
 //extern UniValue disconnectnode(const UniValue& params, bool fHelp);
 extern UniValue getaddednodeinfo(const UniValue& params, bool fHelp);
+extern UniValue getblockdownloadinfo(const UniValue& params, bool fHelp);
 extern UniValue getnettotals(const UniValue& params, bool fHelp);
 extern UniValue setban(const UniValue& params, bool fHelp);
 extern UniValue listbanned(const UniValue& params, bool fHelp);
@@ -328,10 +332,15 @@ extern UniValue getdifficulty(const UniValue& params, bool fHelp);
 extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getmempoolinfo(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
+extern void getrawmempoolstream(const UniValue& params, UniValueStreamWriter& writer);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
 extern UniValue getblock(const UniValue& params, bool fHelp);
+extern void getblockstream(const UniValue& params, UniValueStreamWriter& writer);
 extern UniValue getblockheader(const UniValue& params, bool fHelp);
+extern UniValue getblockfilter(const UniValue& params, bool fHelp);
 extern UniValue gettxoutsetinfo(const UniValue& params, bool fHelp);
+extern UniValue dumptxoutset(const UniValue& params, bool fHelp);
+extern UniValue loadtxoutset(const UniValue& params, bool fHelp);
 extern UniValue gettxout(const UniValue& params, bool fHelp);
 extern UniValue verifychain(const UniValue& params, bool fHelp);
 extern UniValue getchaintips(const UniValue& params, bool fHelp);
@@ -340,6 +349,8 @@ extern UniValue invalidateblock(const UniValue& params, bool fHelp);
 extern UniValue reconsiderblock(const UniValue& params, bool fHelp);
 extern UniValue darksend(const UniValue& params, bool fHelp);
 extern UniValue spork(const UniValue& params, bool fHelp);
+extern UniValue getinstantxinfo(const UniValue& params, bool fHelp);
+extern UniValue getpoolinfo(const UniValue& params, bool fHelp);
 extern UniValue masternode(const UniValue& params, bool fHelp);
 //extern UniValue masternodelist(const UniValue& params, bool fHelp);
 //extern UniValue mnbudget(const UniValue& params, bool fHelp);
@@ -347,11 +358,14 @@ extern UniValue masternode(const UniValue& params, bool fHelp);
 //extern UniValue mnfinalbudget(const UniValue& params, bool fHelp);
 //extern UniValue mnsync(const UniValue& params, bool fHelp);
 
-// in rest.cpp
-extern bool HTTPReq_REST(AcceptedConnection* conn,
-    std::string& strURI,
-    std::map<std::string, std::string>& mapHeaders,
-    bool fRun);
+extern UniValue getrpcinfo(const UniValue& params, bool fHelp); // in httprpc.cpp
+
+/** Execute one JSON-RPC request object and return its reply object; never throws */
+UniValue JSONRPCExecOne(const UniValue& req);
+/** Execute a JSON-RPC batch serially and return the serialized reply array */
 std::string JSONRPCExecBatch(const UniValue& vReq);
 
+/** Per-method call counts, error counts and latency histograms, as reported by getrpcinfo */
+UniValue RPCGetCallStats();
+
 #endif // BITCOIN_RPCSERVER_H
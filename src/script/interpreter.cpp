@@ -1192,6 +1192,21 @@ uint256 GetOutputsHash(const CTransaction& txTo) {
     return ss.GetHash();
 }
 
+/** Hash the legacy SIGHASH_ALL serialization of txTo for input nIn using the precomputed midstates */
+uint256 GetLegacySignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData& cache)
+{
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
+
+    CHashWriter ss(SER_GETHASH, 0, cache.vLegacyMidstates[nIn]);
+    txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+    size_t nOffset = cache.vLegacyInputOffsets[nIn + 1];
+    if (nOffset < cache.vchLegacyInputs.size())
+        ss.write((const char*)&cache.vchLegacyInputs[nOffset], cache.vchLegacyInputs.size() - nOffset);
+    ss.write((const char*)&cache.vchLegacyOutputs[0], cache.vchLegacyOutputs.size());
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
 } // anon namespace
 
 PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
@@ -1203,6 +1218,35 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
         hashOutputs = GetOutputsHash(txTo);
         ready = true;
     }
+
+    if (txTo.vin.size() >= LEGACY_SIGHASH_CACHE_MIN_INPUTS) {
+        CDataStream ssInputs(SER_GETHASH, 0);
+        vLegacyInputOffsets.reserve(txTo.vin.size() + 1);
+        for (const auto& txin : txTo.vin) {
+            vLegacyInputOffsets.push_back(ssInputs.size());
+            ssInputs << txin.prevout << CScriptBase() << txin.nSequence;
+        }
+        vLegacyInputOffsets.push_back(ssInputs.size());
+        vchLegacyInputs.assign(ssInputs.begin(), ssInputs.end());
+
+        CDataStream ssOutputs(SER_GETHASH, 0);
+        ::WriteCompactSize(ssOutputs, txTo.vout.size());
+        for (const auto& txout : txTo.vout)
+            ssOutputs << txout;
+        vchLegacyOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+
+        CDataStream ssHeader(SER_GETHASH, 0);
+        ssHeader << txTo.nVersion << txTo.nTime;
+        ::WriteCompactSize(ssHeader, txTo.vin.size());
+        CHash256 midstate;
+        midstate.Write((const unsigned char*)&ssHeader[0], ssHeader.size());
+        vLegacyMidstates.reserve(txTo.vin.size());
+        for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+            vLegacyMidstates.push_back(midstate);
+            midstate.Write(&vchLegacyInputs[vLegacyInputOffsets[i]], vLegacyInputOffsets[i + 1] - vLegacyInputOffsets[i]);
+        }
+        legacyReady = true;
+    }
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1264,6 +1308,12 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    // Only SIGHASH_ALL without ANYONECANPAY shares the serialization of the other inputs
+    if (cache && cache->legacyReady && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        return GetLegacySignatureHash(scriptCode, txTo, nIn, nHashType, *cache);
+    }
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
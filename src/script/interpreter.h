@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -120,11 +121,26 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
+/** Minimum number of inputs for which the legacy sighash midstates are precomputed */
+static const unsigned int LEGACY_SIGHASH_CACHE_MIN_INPUTS = 4;
+
 struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
     bool ready = false;
 
+    /**
+     * Legacy SIGHASH_ALL cache. Inputs other than the signed one are always
+     * serialized with a blank scriptSig, so the hash state after the header and
+     * inputs [0, n) is shared by every input n. The blank inputs and the outputs
+     * that follow it are kept serialized so they are only hashed, not rebuilt.
+     */
+    std::vector<CHash256> vLegacyMidstates;
+    std::vector<unsigned char> vchLegacyInputs;
+    std::vector<size_t> vLegacyInputOffsets;
+    std::vector<unsigned char> vchLegacyOutputs;
+    bool legacyReady = false;
+
     explicit PrecomputedTransactionData(const CTransaction& tx);
 };
 
@@ -0,0 +1,427 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "hash.h"
+#include "main.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <libdevcore/SHA3.h>
+
+namespace
+{
+ldb::DB* GetSnapshotStateDB(unsigned char nDB)
+{
+    if (nDB == SNAPSHOT_DB_STATE)
+        return globalState->db().db();
+    if (nDB == SNAPSHOT_DB_UTXO)
+        return globalState->dbUtxo().db();
+    return NULL;
+}
+
+struct CSnapshotCoinsEntry {
+    uint256 txid;
+    CCoins coins;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(coins);
+    }
+};
+
+/** Write a chunk of entries as: count, entries, hash of the entries. */
+template <typename Entry>
+void WriteSnapshotChunk(CAutoFile& fileout, const std::vector<Entry>& vEntries)
+{
+    CHashWriter hasher(SER_GETHASH, 0);
+    fileout << (uint32_t)vEntries.size();
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        fileout << vEntries[i];
+        hasher << vEntries[i];
+    }
+    fileout << hasher.GetHash();
+}
+
+/** Read one chunk written by WriteSnapshotChunk; an empty chunk ends the section. */
+template <typename Entry>
+bool ReadSnapshotChunk(CAutoFile& filein, std::vector<Entry>& vEntries, std::string& strError)
+{
+    vEntries.clear();
+    uint32_t nCount;
+    filein >> nCount;
+    if (nCount == 0)
+        return true;
+    if (nCount > SNAPSHOT_CHUNK_ENTRIES) {
+        strError = strprintf("Snapshot chunk of %u entries exceeds the limit of %u", nCount, SNAPSHOT_CHUNK_ENTRIES);
+        return false;
+    }
+    CHashWriter hasher(SER_GETHASH, 0);
+    vEntries.resize(nCount);
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        filein >> vEntries[i];
+        hasher << vEntries[i];
+    }
+    uint256 hashChunk;
+    filein >> hashChunk;
+    if (hashChunk != hasher.GetHash()) {
+        strError = "Snapshot chunk hash mismatch, the file is corrupt";
+        return false;
+    }
+    return true;
+}
+
+/** Check that the chainstate can be replaced by the snapshot and return its base block. */
+CBlockIndex* CheckSnapshotBase(const CSnapshotMetadata& metadata, std::string& strError)
+{
+    AssertLockHeld(cs_main);
+
+    BlockMap::iterator mi = mapBlockIndex.find(metadata.hashBlock);
+    if (mi == mapBlockIndex.end()) {
+        strError = strprintf("Snapshot base block %s is not in the block index", metadata.hashBlock.GetHex());
+        return NULL;
+    }
+    CBlockIndex* pindex = mi->second;
+    if (pindex->nHeight != metadata.nHeight) {
+        strError = strprintf("Snapshot base block height %d does not match the block index (%d)", metadata.nHeight, pindex->nHeight);
+        return NULL;
+    }
+    if (pindex->nStatus & BLOCK_FAILED_MASK) {
+        strError = "Snapshot base block is marked invalid";
+        return NULL;
+    }
+    if (pindex->nChainTx == 0 || !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+        strError = "Block data up to the snapshot base block is not available";
+        return NULL;
+    }
+    if (pindex->hashStateRoot != metadata.hashStateRoot || pindex->hashUTXORoot != metadata.hashUTXORoot) {
+        strError = "Snapshot contract state roots do not match the base block header";
+        return NULL;
+    }
+
+    // Only an empty chainstate is replaced; loading on top of connected
+    // blocks would leave coins and contract state of two chains mixed.
+    uint256 hashCoinsBest = pcoinsTip->GetBestBlock();
+    if (chainActive.Height() > 0 || (hashCoinsBest != 0 && hashCoinsBest != Params().GetConsensus().hashGenesisBlock)) {
+        strError = "The chainstate is not empty, restart with -reindex-chainstate to load a snapshot";
+        return NULL;
+    }
+    return pindex;
+}
+}
+
+bool IsAuthenticStateEntry(const CSnapshotStateEntry& entry, dev::h256& hashEntry)
+{
+    hashEntry = dev::sha3(entry.strValue);
+    if (entry.strKey.size() == hashEntry.size + 1 && (unsigned char)entry.strKey[hashEntry.size] != 0xff)
+        return false;
+    if (entry.strKey.size() != hashEntry.size && entry.strKey.size() != hashEntry.size + 1)
+        return false;
+    return memcmp(entry.strKey.data(), hashEntry.data(), hashEntry.size) == 0;
+}
+
+bool WriteSnapshot(const boost::filesystem::path& path, const CSnapshotMetadata& metadata, CCoinsViewCursor* pcursor, ldb::Iterator* const pstatecursor[SNAPSHOT_DB_COUNT], CSnapshotCommitment& commitment, std::string& strError)
+{
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        strError = strprintf("Cannot open %s for writing", pathTmp.string());
+        return false;
+    }
+
+    try {
+        fileout << metadata;
+
+        CHashWriter ssCoins(SER_GETHASH, PROTOCOL_VERSION);
+        ssCoins << metadata.hashBlock;
+        commitment = CSnapshotCommitment();
+        std::vector<CSnapshotCoinsEntry> vCoins;
+        vCoins.reserve(SNAPSHOT_CHUNK_ENTRIES);
+        for (; pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            CSnapshotCoinsEntry entry;
+            if (!pcursor->GetKey(entry.txid) || !pcursor->GetValue(entry.coins)) {
+                strError = "Unable to read coin database";
+                return false;
+            }
+            HashCoinsForStats(ssCoins, entry.txid, entry.coins);
+            commitment.nCoins++;
+            vCoins.push_back(entry);
+            if (vCoins.size() == SNAPSHOT_CHUNK_ENTRIES) {
+                WriteSnapshotChunk(fileout, vCoins);
+                vCoins.clear();
+            }
+        }
+        if (!vCoins.empty())
+            WriteSnapshotChunk(fileout, vCoins);
+        fileout << (uint32_t)0;
+        commitment.hashCoins = ssCoins.GetHash();
+
+        CHashWriter ssState(SER_GETHASH, 0);
+        std::vector<CSnapshotStateEntry> vState;
+        vState.reserve(SNAPSHOT_CHUNK_ENTRIES);
+        for (unsigned char nDB = 0; nDB < SNAPSHOT_DB_COUNT; nDB++) {
+            ldb::Iterator* it = pstatecursor[nDB];
+            for (it->SeekToFirst(); it->Valid(); it->Next()) {
+                boost::this_thread::interruption_point();
+                CSnapshotStateEntry entry;
+                entry.nDB = nDB;
+                entry.strKey = it->key().ToString();
+                entry.strValue = it->value().ToString();
+                ssState << entry;
+                commitment.nStateEntries++;
+                vState.push_back(entry);
+                if (vState.size() == SNAPSHOT_CHUNK_ENTRIES) {
+                    WriteSnapshotChunk(fileout, vState);
+                    vState.clear();
+                }
+            }
+            if (!it->status().ok()) {
+                strError = strprintf("Unable to read contract state: %s", it->status().ToString());
+                return false;
+            }
+        }
+        if (!vState.empty())
+            WriteSnapshotChunk(fileout, vState);
+        fileout << (uint32_t)0;
+        commitment.hashState = ssState.GetHash();
+
+        fileout << commitment;
+        FileCommit(fileout.Get());
+    } catch (const std::exception& e) {
+        strError = strprintf("Error writing snapshot file: %s", e.what());
+        return false;
+    }
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("Cannot rename %s to %s", pathTmp.string(), path.string());
+        return false;
+    }
+    return true;
+}
+
+bool ReadSnapshot(const boost::filesystem::path& path, CSnapshotMetadata& metadata, CSnapshotCommitment& commitment, CCoinsViewCache* pcoins, ldb::DB* const pstatedb[SNAPSHOT_DB_COUNT], std::string& strError)
+{
+    FILE* file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        strError = strprintf("Cannot open snapshot file %s", path.string());
+        return false;
+    }
+    bool fApply = pcoins != NULL && pstatedb != NULL;
+
+    try {
+        filein >> metadata;
+        if (memcmp(metadata.pchMessageStart, Params().MessageStart(), sizeof(metadata.pchMessageStart)) != 0) {
+            strError = "Snapshot was created for a different network";
+            return false;
+        }
+        if (metadata.nVersion != SNAPSHOT_VERSION) {
+            strError = strprintf("Unsupported snapshot version %d", metadata.nVersion);
+            return false;
+        }
+
+        CHashWriter ssCoins(SER_GETHASH, PROTOCOL_VERSION);
+        ssCoins << metadata.hashBlock;
+        uint64_t nCoins = 0;
+        uint256 txidLast;
+        std::vector<CSnapshotCoinsEntry> vCoins;
+        while (true) {
+            if (!ReadSnapshotChunk(filein, vCoins, strError))
+                return false;
+            if (vCoins.empty())
+                break;
+            CCoinsMap mapCoins;
+            for (size_t i = 0; i < vCoins.size(); i++) {
+                CSnapshotCoinsEntry& entry = vCoins[i];
+                // Entries come in database key order, which also rules out duplicates.
+                if (nCoins > 0 && memcmp(entry.txid.begin(), txidLast.begin(), txidLast.size()) <= 0) {
+                    strError = "Snapshot coins are not in database order";
+                    return false;
+                }
+                if (entry.coins.IsPruned()) {
+                    strError = strprintf("Snapshot contains spent coins for %s", entry.txid.GetHex());
+                    return false;
+                }
+                HashCoinsForStats(ssCoins, entry.txid, entry.coins);
+                txidLast = entry.txid;
+                nCoins++;
+                if (fApply) {
+                    CCoinsCacheEntry& cacheEntry = mapCoins[entry.txid];
+                    cacheEntry.coins.swap(entry.coins);
+                    cacheEntry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                }
+            }
+            if (fApply) {
+                // A null best block keeps the coins database marked as not
+                // belonging to any block until the load has completed.
+                pcoins->BatchWrite(mapCoins, uint256(0));
+                if (pcoins->GetCacheSize() > nCoinCacheSize && !pcoins->Flush()) {
+                    strError = "Failed to write to coin database";
+                    return false;
+                }
+            }
+        }
+
+        // The trie roots committed to by the base block must be among the
+        // state entries, the empty trie is created on demand. The commitment
+        // comes from the file itself, so every entry is also checked against
+        // its own hash before it is used.
+        const dev::h256 hashRoots[SNAPSHOT_DB_COUNT] = {uintToh256(metadata.hashStateRoot), uintToh256(metadata.hashUTXORoot)};
+        bool fFoundRoot[SNAPSHOT_DB_COUNT];
+        for (unsigned char nDB = 0; nDB < SNAPSHOT_DB_COUNT; nDB++)
+            fFoundRoot[nDB] = hashRoots[nDB] == dev::EmptyTrie;
+
+        CHashWriter ssState(SER_GETHASH, 0);
+        uint64_t nStateEntries = 0;
+        std::vector<CSnapshotStateEntry> vState;
+        while (true) {
+            if (!ReadSnapshotChunk(filein, vState, strError))
+                return false;
+            if (vState.empty())
+                break;
+            ldb::WriteBatch batch[SNAPSHOT_DB_COUNT];
+            for (size_t i = 0; i < vState.size(); i++) {
+                const CSnapshotStateEntry& entry = vState[i];
+                if (entry.nDB >= SNAPSHOT_DB_COUNT) {
+                    strError = strprintf("Snapshot contains an unknown state database %d", entry.nDB);
+                    return false;
+                }
+                dev::h256 hashEntry;
+                if (!IsAuthenticStateEntry(entry, hashEntry)) {
+                    strError = strprintf("Snapshot contract state entry %s does not match its value", HexStr(entry.strKey));
+                    return false;
+                }
+                ssState << entry;
+                nStateEntries++;
+                if (entry.strKey.size() == hashEntry.size && hashEntry == hashRoots[entry.nDB])
+                    fFoundRoot[entry.nDB] = true;
+                if (fApply)
+                    batch[entry.nDB].Put(entry.strKey, entry.strValue);
+            }
+            for (unsigned char nDB = 0; fApply && nDB < SNAPSHOT_DB_COUNT; nDB++) {
+                ldb::Status status = pstatedb[nDB]->Write(ldb::WriteOptions(), &batch[nDB]);
+                if (!status.ok()) {
+                    strError = strprintf("Failed to write contract state: %s", status.ToString());
+                    return false;
+                }
+            }
+        }
+
+        filein >> commitment;
+        if (commitment.nCoins != nCoins || commitment.hashCoins != ssCoins.GetHash() ||
+            commitment.nStateEntries != nStateEntries || commitment.hashState != ssState.GetHash()) {
+            strError = "Snapshot contents do not match its commitment";
+            return false;
+        }
+        if (!fFoundRoot[SNAPSHOT_DB_STATE] || !fFoundRoot[SNAPSHOT_DB_UTXO]) {
+            strError = "Snapshot does not contain the contract state of its base block";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Error reading snapshot file: %s", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool DumpSnapshot(const boost::filesystem::path& path, CSnapshotMetadata& metadata, CSnapshotCommitment& commitment, std::string& strError)
+{
+    boost::scoped_ptr<CCoinsViewCursor> pcursor;
+    boost::scoped_ptr<ldb::Iterator> pstatecursor[SNAPSHOT_DB_COUNT];
+    {
+        // Both databases are iterated as of this moment, so blocks may keep
+        // connecting while the file is being written.
+        LOCK(cs_main);
+        CBlockIndex* pindex = chainActive.Tip();
+        if (pindex == NULL || !globalState) {
+            strError = "No chainstate to dump";
+            return false;
+        }
+        FlushStateToDisk();
+        pcursor.reset(pcoinsTip->Cursor());
+        if (!pcursor || pcursor->GetBestBlock() != pindex->GetBlockHash()) {
+            strError = "Coin database is not at the chain tip";
+            return false;
+        }
+        for (unsigned char nDB = 0; nDB < SNAPSHOT_DB_COUNT; nDB++)
+            pstatecursor[nDB].reset(GetSnapshotStateDB(nDB)->NewIterator(ldb::ReadOptions()));
+
+        metadata.SetNull();
+        memcpy(metadata.pchMessageStart, Params().MessageStart(), sizeof(metadata.pchMessageStart));
+        metadata.hashBlock = pindex->GetBlockHash();
+        metadata.nHeight = pindex->nHeight;
+        metadata.hashStateRoot = pindex->hashStateRoot;
+        metadata.hashUTXORoot = pindex->hashUTXORoot;
+    }
+
+    ldb::Iterator* const pstatecursors[SNAPSHOT_DB_COUNT] = {pstatecursor[SNAPSHOT_DB_STATE].get(), pstatecursor[SNAPSHOT_DB_UTXO].get()};
+    if (!WriteSnapshot(path, metadata, pcursor.get(), pstatecursors, commitment, strError))
+        return false;
+    LogPrintf("%s: wrote %u coins and %u contract state entries at block %s (height %d) to %s\n", __func__,
+        commitment.nCoins, commitment.nStateEntries, metadata.hashBlock.GetHex(), metadata.nHeight, path.string());
+    return true;
+}
+
+bool LoadSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CSnapshotMetadata& metadata, std::string& strError)
+{
+    // First pass: verify the whole file before touching any database.
+    CSnapshotCommitment commitment;
+    if (!ReadSnapshot(path, metadata, commitment, NULL, NULL, strError))
+        return false;
+    if (commitment.hashCoins != hashExpected) {
+        strError = strprintf("Snapshot coins hash %s does not match the expected %s", commitment.hashCoins.GetHex(), hashExpected.GetHex());
+        return false;
+    }
+    LogPrintf("%s: verified snapshot of block %s (height %d): %u coins, %u contract state entries\n", __func__,
+        metadata.hashBlock.GetHex(), metadata.nHeight, commitment.nCoins, commitment.nStateEntries);
+
+    // Second pass: write. The chain lock is held throughout so no block can
+    // be connected on top of a partially loaded chainstate.
+    LOCK(cs_main);
+    CBlockIndex* pindex = CheckSnapshotBase(metadata, strError);
+    if (pindex == NULL)
+        return false;
+
+    CSnapshotMetadata metadataApplied;
+    ldb::DB* const pstatedb[SNAPSHOT_DB_COUNT] = {GetSnapshotStateDB(SNAPSHOT_DB_STATE), GetSnapshotStateDB(SNAPSHOT_DB_UTXO)};
+    if (!ReadSnapshot(path, metadataApplied, commitment, pcoinsTip, pstatedb, strError))
+        return false;
+    if (metadataApplied.hashBlock != metadata.hashBlock || commitment.hashCoins != hashExpected) {
+        strError = "Snapshot file changed while it was being loaded";
+        return false;
+    }
+
+    try {
+        globalState->setRoot(uintToh256(metadata.hashStateRoot));
+        globalState->setRootUTXO(uintToh256(metadata.hashUTXORoot));
+    } catch (const std::exception& e) {
+        strError = strprintf("Snapshot contract state is incomplete: %s", e.what());
+        return false;
+    }
+
+    pcoinsTip->SetBestBlock(metadata.hashBlock);
+    CValidationState state;
+    if (!ActivateSnapshotTip(state, pindex)) {
+        strError = strprintf("Failed to activate snapshot base block: %s", state.GetRejectReason());
+        return false;
+    }
+    LogPrintf("%s: chainstate loaded from snapshot, new tip %s (height %d)\n", __func__, metadata.hashBlock.GetHex(), metadata.nHeight);
+    return true;
+}
@@ -0,0 +1,161 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SNAPSHOT_H
+#define BITCOIN_SNAPSHOT_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+#include <libdevcore/FixedHash.h>
+#include <libdevcore/db.h>
+
+class CCoinsViewCache;
+class CCoinsViewCursor;
+
+/** Format version written into the header of a chainstate snapshot. */
+static const int SNAPSHOT_VERSION = 1;
+/** Entries per chunk; each chunk is followed by its own hash so that damage is reported where it happens. */
+static const unsigned int SNAPSHOT_CHUNK_ENTRIES = 10000;
+
+/** Contract state databases carried in the state section of a snapshot. */
+enum SnapshotStateDB {
+    SNAPSHOT_DB_STATE = 0,
+    SNAPSHOT_DB_UTXO = 1,
+    SNAPSHOT_DB_COUNT
+};
+
+/**
+ * Header of a chainstate snapshot: the block whose state it holds and the
+ * contract state roots committed to by that block's header.
+ */
+class CSnapshotMetadata
+{
+public:
+    unsigned char pchMessageStart[4];
+    int nVersion;
+    uint256 hashBlock;
+    int nHeight;
+    uint256 hashStateRoot;
+    uint256 hashUTXORoot;
+
+    CSnapshotMetadata()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+        nVersion = SNAPSHOT_VERSION;
+        hashBlock = 0;
+        nHeight = 0;
+        hashStateRoot = 0;
+        hashUTXORoot = 0;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(this->nVersion);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(hashStateRoot);
+        READWRITE(hashUTXORoot);
+    }
+};
+
+/**
+ * Trailer of a chainstate snapshot. hashCoins is computed exactly like the
+ * hash_serialized field of gettxoutsetinfo, so a snapshot can be checked
+ * against any trusted node synced to the same block.
+ */
+class CSnapshotCommitment
+{
+public:
+    uint64_t nCoins;
+    uint256 hashCoins;
+    uint64_t nStateEntries;
+    uint256 hashState;
+
+    CSnapshotCommitment() : nCoins(0), hashCoins(0), nStateEntries(0), hashState(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nCoins);
+        READWRITE(hashCoins);
+        READWRITE(nStateEntries);
+        READWRITE(hashState);
+    }
+};
+
+/** Raw key/value pair of one of the contract state databases. */
+class CSnapshotStateEntry
+{
+public:
+    unsigned char nDB;
+    std::string strKey;
+    std::string strValue;
+
+    CSnapshotStateEntry() : nDB(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nDB);
+        READWRITE(strKey);
+        READWRITE(strValue);
+    }
+};
+
+/**
+ * The state databases are content addressed: a trie node or code is stored
+ * under the sha3 of its value, a key preimage (aux entry) under that hash
+ * followed by 0xff. Returns whether the entry has such a key, and the hash.
+ */
+bool IsAuthenticStateEntry(const CSnapshotStateEntry& entry, dev::h256& hashEntry);
+
+/**
+ * Write the coins behind pcursor and the contract state databases behind
+ * pstatecursor to a snapshot file of the block described by metadata.
+ */
+bool WriteSnapshot(const boost::filesystem::path& path, const CSnapshotMetadata& metadata, CCoinsViewCursor* pcursor, ldb::Iterator* const pstatecursor[SNAPSHOT_DB_COUNT], CSnapshotCommitment& commitment, std::string& strError);
+
+/**
+ * Parse a snapshot file, checking every chunk hash, every contract state
+ * entry and the trailer. With pcoins and pstatedb set, the entries are also
+ * written to them as they are read.
+ */
+bool ReadSnapshot(const boost::filesystem::path& path, CSnapshotMetadata& metadata, CSnapshotCommitment& commitment, CCoinsViewCache* pcoins, ldb::DB* const pstatedb[SNAPSHOT_DB_COUNT], std::string& strError);
+
+/**
+ * Write the coins database and the contract state databases, as of the
+ * current tip, to a snapshot file. The chain lock is only held while the
+ * databases are flushed and their iterators are opened.
+ */
+bool DumpSnapshot(const boost::filesystem::path& path, CSnapshotMetadata& metadata, CSnapshotCommitment& commitment, std::string& strError);
+
+/**
+ * Bootstrap an empty chainstate from a snapshot file. The whole file is
+ * verified (chunk hashes, commitments, hashExpected, and the contract state
+ * roots of the base block header) before anything is written. The block
+ * index and block data up to the base block must already be present; the
+ * chain tip is then moved to the base block without reconnecting history,
+ * and the blocks up to it are marked BLOCK_ASSUMED_VALID.
+ */
+bool LoadSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CSnapshotMetadata& metadata, std::string& strError);
+
+#endif // BITCOIN_SNAPSHOT_H
@@ -286,6 +286,13 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    /** Exchange the underlying buffer with data, so that its storage can be reused elsewhere. */
+    void SwapBuffer(CSerializeData& data)
+    {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
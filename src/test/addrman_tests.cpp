@@ -0,0 +1,195 @@
+// Copyright (c) 2012-2013 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+/** CAddrMan with access to the entries, to look at their statistics */
+class CAddrManTest : public CAddrMan
+{
+public:
+    CAddrInfo* Find(const CNetAddr& addr)
+    {
+        return CAddrMan::Find(addr);
+    }
+};
+
+static CAddress MakeAddress(const std::string& strIP, unsigned short nPort = 8333)
+{
+    CAddress addr(CService(strIP, nPort), NODE_NETWORK);
+    addr.nTime = GetAdjustedTime();
+    return addr;
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_simple)
+{
+    CAddrManTest addrman;
+    CNetAddr source("252.2.2.2");
+
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    CAddress addr1 = MakeAddress("250.1.1.1");
+    BOOST_CHECK(addrman.Add(addr1, source));
+    BOOST_CHECK(!addrman.Add(addr1, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select() == addr1);
+
+    // Unroutable addresses are ignored
+    BOOST_CHECK(!addrman.Add(MakeAddress("192.168.1.1"), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+
+    // Moving an entry to tried keeps it selectable
+    addrman.Attempt(addr1);
+    addrman.Good(addr1);
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select() == addr1);
+
+    // Every selection is one of the known addresses
+    std::set<CService> setAdded;
+    setAdded.insert(addr1);
+    for (int i = 0; i < 50; i++) {
+        CAddress addr = MakeAddress(strprintf("250.1.%d.%d", i / 10 + 2, i % 10 + 1));
+        addrman.Add(addr, CNetAddr(strprintf("252.%d.2.2", i)));
+        setAdded.insert(addr);
+    }
+    BOOST_CHECK(addrman.size() > 1);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(setAdded.count(addrman.Select()));
+}
+
+BOOST_AUTO_TEST_CASE(addrman_connection_stats)
+{
+    CAddrManTest addrman;
+    CNetAddr source("252.2.2.2");
+    CAddress addrGood = MakeAddress("250.1.1.1");
+    CAddress addrBad = MakeAddress("250.2.1.1");
+    addrman.Add(addrGood, source);
+    addrman.Add(addrBad, source);
+
+    // A fresh entry is neither favored nor penalized
+    BOOST_CHECK_EQUAL(addrman.Find(addrGood)->GetQuality(), 1.0);
+
+    for (int i = 0; i < 4; i++) {
+        addrman.Attempt(addrGood);
+        addrman.Good(addrGood);
+        addrman.Handshake(addrGood);
+        addrman.ReportLatency(addrGood, 50000);
+        addrman.Disconnected(addrGood, 2 * 60 * 60);
+
+        addrman.Attempt(addrBad);
+        addrman.Attempt(addrBad);
+    }
+    addrman.Good(addrBad);
+    addrman.Handshake(addrBad);
+    addrman.ReportLatency(addrBad, 3000000);
+
+    const CAddrStats& statsGood = addrman.Find(addrGood)->GetStats();
+    BOOST_CHECK_EQUAL(statsGood.nConnAttempts, 4U);
+    BOOST_CHECK_EQUAL(statsGood.nHandshakes, 4U);
+    BOOST_CHECK_EQUAL(statsGood.nPingUsec, 50000);
+    BOOST_CHECK_EQUAL(statsGood.nUptime, 4 * 2 * 60 * 60);
+
+    // Latency is smoothed over several pings
+    addrman.ReportLatency(addrGood, 250000);
+    BOOST_CHECK_EQUAL(statsGood.nPingUsec, 100000);
+
+    double fQualityGood = addrman.Find(addrGood)->GetQuality();
+    double fQualityBad = addrman.Find(addrBad)->GetQuality();
+    BOOST_CHECK(fQualityGood > 1.0 && fQualityGood <= 4.5);
+    BOOST_CHECK(fQualityBad < 1.0 && fQualityBad >= 0.125);
+
+    // Reports about unknown addresses or other ports are ignored
+    addrman.ReportLatency(MakeAddress("250.1.1.1", 8334), 1);
+    addrman.Disconnected(MakeAddress("250.3.1.1"), 100);
+    BOOST_CHECK_EQUAL(statsGood.nPingUsec, 100000);
+
+    // Statistics decay once an address has had many attempts
+    for (int i = 0; i < ADDRMAN_STATS_MAX_ATTEMPTS; i++)
+        addrman.Attempt(addrGood);
+    BOOST_CHECK(statsGood.nConnAttempts <= ADDRMAN_STATS_MAX_ATTEMPTS);
+    BOOST_CHECK_EQUAL(statsGood.nHandshakes, 2U);
+
+    // An address that only connects to us is marked good, but can't raise its own quality
+    CAddress addrInbound = MakeAddress("250.4.1.1");
+    addrman.Add(addrInbound, source);
+    for (int i = 0; i < 4; i++)
+        addrman.Good(addrInbound);
+    BOOST_CHECK_EQUAL(addrman.Find(addrInbound)->GetStats().nHandshakes, 0U);
+    BOOST_CHECK_EQUAL(addrman.Find(addrInbound)->GetQuality(), 1.0);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrManTest addrman;
+    for (int i = 0; i < 200; i++) {
+        CAddress addr = MakeAddress(strprintf("250.%d.%d.1", i / 50 + 1, i % 50 + 1));
+        addrman.Add(addr, CNetAddr(strprintf("252.%d.2.2", i % 20)));
+        if (i % 4 == 0) {
+            addrman.Attempt(addr);
+            addrman.Good(addr);
+            addrman.Handshake(addr);
+            addrman.ReportLatency(addr, 1000 * (i + 1));
+            addrman.Disconnected(addr, i);
+        }
+    }
+    CAddress addrProbe = MakeAddress("250.1.5.1"); // i == 4
+    BOOST_CHECK(addrman.Find(addrProbe));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CDataStream ssOld(ss);
+
+    CAddrManTest addrman2;
+    ss >> addrman2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    const CAddrStats& stats = addrman2.Find(addrProbe)->GetStats();
+    BOOST_CHECK_EQUAL(stats.nConnAttempts, 1U);
+    BOOST_CHECK_EQUAL(stats.nHandshakes, 1U);
+    BOOST_CHECK_EQUAL(stats.nPingUsec, 5000);
+    BOOST_CHECK_EQUAL(stats.nUptime, 4);
+    BOOST_CHECK(addrman2.Select().IsValid());
+
+    // Files written before the statistics existed still load, without them
+    size_t nStatsSize = sizeof(int) + addrman.size() * ::GetSerializeSize(CAddrStats(), SER_DISK, CLIENT_VERSION);
+    ssOld.resize(ssOld.size() - nStatsSize);
+    CAddrManTest addrman3;
+    ssOld >> addrman3;
+    BOOST_CHECK_EQUAL(addrman3.size(), addrman.size());
+    BOOST_CHECK_EQUAL(addrman3.Find(addrProbe)->GetStats().nHandshakes, 0U);
+    BOOST_CHECK(!addrman3.IsDirty());
+}
+
+BOOST_AUTO_TEST_CASE(addrman_dirty)
+{
+    CAddrManTest addrman;
+    BOOST_CHECK(!addrman.IsDirty());
+
+    CAddress addr = MakeAddress("250.1.1.1");
+    addrman.Add(addr, CNetAddr("252.2.2.2"));
+    BOOST_CHECK(addrman.IsDirty());
+
+    addrman.SetDirty(false);
+    addrman.Select();
+    addrman.GetAddr();
+    BOOST_CHECK(!addrman.IsDirty());
+
+    // Relaying an address we already know without anything new leaves the table as it is
+    addrman.Add(addr, CNetAddr("252.2.2.2"));
+    addrman.Add(addr, CNetAddr("252.3.2.2"));
+    BOOST_CHECK(!addrman.IsDirty());
+
+    addrman.Good(addr);
+    BOOST_CHECK(addrman.IsDirty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+static CGCSFilter::Element RandomElement(size_t nSize)
+{
+    CGCSFilter::Element element(nSize);
+    for (size_t i = 0; i < nSize; i++)
+        element[i] = insecure_rand();
+    return element;
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    CGCSFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        included.insert(RandomElement(32));
+        excluded.insert(RandomElement(33));
+    }
+
+    CGCSFilter filter(CGCSFilter::Params(0, 0, 10, 1 << 10), included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    BOOST_FOREACH (const CGCSFilter::Element& element, included)
+        BOOST_CHECK(filter.Match(element));
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // With M = 1024 a hundred random queries should almost never hit
+    int nFalsePositives = 0;
+    BOOST_FOREACH (const CGCSFilter::Element& element, excluded)
+        nFalsePositives += filter.Match(element);
+    BOOST_CHECK(nFalsePositives < 5);
+
+    // Decoding restores the same set
+    CGCSFilter filter2(filter.GetParams(), filter.GetEncoded());
+    BOOST_CHECK_EQUAL(filter2.GetN(), 100U);
+    BOOST_FOREACH (const CGCSFilter::Element& element, included)
+        BOOST_CHECK(filter2.Match(element));
+
+    // Trailing garbage and truncation are rejected
+    std::vector<unsigned char> vchBad = filter.GetEncoded();
+    vchBad.push_back(0);
+    BOOST_CHECK_THROW(CGCSFilter(filter.GetParams(), vchBad), std::ios_base::failure);
+    vchBad.resize(vchBad.size() - 10);
+    BOOST_CHECK_THROW(CGCSFilter(filter.GetParams(), vchBad), std::ios_base::failure);
+
+    CGCSFilter empty(filter.GetParams(), CGCSFilter::ElementSet());
+    BOOST_CHECK_EQUAL(empty.GetN(), 0U);
+    BOOST_CHECK(!empty.MatchAny(included));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_bip158_vector)
+{
+    // Block 0 of the BIP 158 test vectors (Bitcoin testnet genesis)
+    uint256 hashBlock("0x000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943");
+    CGCSFilter::ElementSet elements;
+    elements.insert(ParseHex("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac"));
+
+    CBlockFilter filter(BLOCK_FILTER_BASIC, hashBlock, elements);
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncodedFilter()), "019dfca8");
+    BOOST_CHECK_EQUAL(filter.ComputeHeader(uint256(0)).GetHex(), "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+
+    // Wire round trip, as sent in a cfilter message
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << filter;
+    CBlockFilter filter2;
+    ss >> filter2;
+    BOOST_CHECK_EQUAL(filter2.GetFilterType(), BLOCK_FILTER_BASIC);
+    BOOST_CHECK(filter2.GetBlockHash() == hashBlock);
+    BOOST_CHECK(filter2.GetHash() == filter.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    CScript scriptIncluded1 = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptIncluded2 = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 2) << OP_EQUAL;
+    CScript scriptSpent = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptOpReturn = CScript() << OP_RETURN << std::vector<unsigned char>(4, 4);
+    CScript scriptExcluded = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 5) << OP_EQUAL;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(4);
+    tx.vout[0].scriptPubKey = scriptIncluded1;
+    tx.vout[1].scriptPubKey = scriptIncluded2;
+    tx.vout[2].scriptPubKey = scriptOpReturn;
+    tx.vout[3].scriptPubKey = CScript();
+
+    CBlock block;
+    block.vtx.resize(2);
+    block.vtx[0] = CMutableTransaction();
+    block.vtx[1] = tx;
+
+    CBlockUndo blockUndo;
+    blockUndo.vtxundo.resize(1);
+    blockUndo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1, scriptSpent)));
+    blockUndo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1, scriptOpReturn)));
+
+    CBlockFilter filter(block, blockUndo);
+    BOOST_CHECK(filter.GetBlockHash() == block.GetHash());
+    const CGCSFilter& gcs = filter.GetFilter();
+    BOOST_CHECK_EQUAL(gcs.GetN(), 3U);
+    BOOST_CHECK(gcs.Match(CGCSFilter::Element(scriptIncluded1.begin(), scriptIncluded1.end())));
+    BOOST_CHECK(gcs.Match(CGCSFilter::Element(scriptIncluded2.begin(), scriptIncluded2.end())));
+    BOOST_CHECK(gcs.Match(CGCSFilter::Element(scriptSpent.begin(), scriptSpent.end())));
+    BOOST_CHECK(!gcs.Match(CGCSFilter::Element(scriptOpReturn.begin(), scriptOpReturn.end())));
+    BOOST_CHECK(!gcs.Match(CGCSFilter::Element(scriptExcluded.begin(), scriptExcluded.end())));
+
+    // Headers chain: the same filter after a different header gives a different header
+    uint256 hashHeader1 = filter.ComputeHeader(uint256(0));
+    uint256 hashHeader2 = filter.ComputeHeader(hashHeader1);
+    BOOST_CHECK(hashHeader1 != hashHeader2);
+    uint256 hashFilter = filter.GetHash();
+    BOOST_CHECK(hashHeader2 == Hash(hashFilter.begin(), hashFilter.end(), hashHeader1.begin(), hashHeader1.end()));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_type_names)
+{
+    BlockFilterType filterType;
+    BOOST_CHECK(BlockFilterTypeByName("basic", filterType) && filterType == BLOCK_FILTER_BASIC);
+    BOOST_CHECK(BlockFilterTypeByName("contract", filterType) && filterType == BLOCK_FILTER_CONTRACT);
+    BOOST_CHECK(!BlockFilterTypeByName("extended", filterType));
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BLOCK_FILTER_BASIC), "basic");
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BLOCK_FILTER_INVALID), "");
+    BOOST_CHECK_EQUAL(ListBlockFilterTypes(), "basic, contract");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 
 #include <vector>
@@ -175,4 +176,41 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(coins_background_flush_test)
+{
+    CCoinsViewDB dbview(1 << 20, true, true);
+    CCoinsViewDBWriter writer(&dbview);
+    CCoinsViewCache cache(&writer);
+
+    uint256 txid = GetRandHash();
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txid);
+        coins->nVersion = 1;
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 42;
+    }
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    // Visible through the writer whether or not it reached the database yet.
+    CCoins coins;
+    BOOST_CHECK(writer.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.vout[0].nValue, 42);
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(!writer.IsWriting());
+    BOOST_CHECK(dbview.GetCoins(txid, coins));
+    BOOST_CHECK(dbview.GetBestBlock() == hashBlock);
+
+    // Spending it in the next generation removes it from the database.
+    cache.ModifyCoins(txid)->Clear();
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!writer.HaveCoins(txid));
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(!dbview.HaveCoins(txid));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
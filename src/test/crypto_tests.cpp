@@ -9,6 +9,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 
@@ -131,6 +132,23 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Every block count up to two full 8-way batches plus a remainder, in place and not.
+    for (int blocks = 1; blocks <= 19; blocks++) {
+        std::vector<unsigned char> in(64 * blocks), out(32 * blocks);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = insecure_rand() & 0xff;
+        SHA256D64(out.data(), in.data(), blocks);
+        for (int i = 0; i < blocks; i++) {
+            uint256 h = Hash(in.begin() + 64 * i, in.begin() + 64 * (i + 1));
+            BOOST_CHECK(memcmp(h.begin(), &out[32 * i], 32) == 0);
+        }
+        SHA256D64(in.data(), in.data(), blocks);
+        BOOST_CHECK(memcmp(in.data(), out.data(), out.size()) == 0);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -0,0 +1,87 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "darksend.h"
+#include "instantx.h"
+#include "key.h"
+#include "random.h"
+
+#include <boost/lexical_cast.hpp>
+#include <boost/test/unit_test.hpp>
+
+static CConsensusVote MakeVote(const uint256& txHash, int nBlockHeight, const CKey& key)
+{
+    CConsensusVote vote;
+    vote.vinMasternode = CTxIn(GetRandHash(), 0);
+    vote.txHash = txHash;
+    vote.nBlockHeight = nBlockHeight;
+
+    std::string strError;
+    std::string strMessage = txHash.ToString() + boost::lexical_cast<std::string>(nBlockHeight);
+    BOOST_CHECK(darkSendSigner.SignMessage(strMessage, strError, vote.vchMasterNodeSignature, key));
+    return vote;
+}
+
+BOOST_AUTO_TEST_SUITE(instantx_tests)
+
+BOOST_AUTO_TEST_CASE(consensus_vote_check)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    uint256 txHash = GetRandHash();
+
+    CConsensusVote vote = MakeVote(txHash, 100, key);
+
+    // The signature hash is the one the darksend signer signs and verifies
+    std::string strError;
+    BOOST_CHECK(darkSendSigner.VerifyMessage(key.GetPubKey(), vote.vchMasterNodeSignature, txHash.ToString() + "100", strError));
+
+    unsigned char fValid = 0;
+    BOOST_CHECK(CConsensusVoteCheck(vote, key.GetPubKey(), &fValid)());
+    BOOST_CHECK(fValid);
+
+    // A failed check is reported through the flag, not the return value
+    fValid = 1;
+    BOOST_CHECK(CConsensusVoteCheck(vote, keyOther.GetPubKey(), &fValid)());
+    BOOST_CHECK(!fValid);
+
+    // The signature covers the block height
+    vote.nBlockHeight = 101;
+    fValid = 1;
+    CConsensusVoteCheck check(vote, key.GetPubKey(), &fValid);
+    CConsensusVoteCheck checkSwapped;
+    checkSwapped.swap(check);
+    BOOST_CHECK(checkSwapped());
+    BOOST_CHECK(!fValid);
+}
+
+BOOST_AUTO_TEST_CASE(transaction_lock_count)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 txHash = GetRandHash();
+
+    CTransactionLock txLock;
+    txLock.txHash = txHash;
+    for (int i = 0; i < 5; i++) {
+        CConsensusVote vote = MakeVote(txHash, 100, key);
+        txLock.AddSignature(vote);
+    }
+    CConsensusVote voteOther = MakeVote(txHash, 99, key);
+    txLock.AddSignature(voteOther);
+
+    // Without the height of the request no vote counts
+    BOOST_CHECK_EQUAL(txLock.CountSignatures(), -1);
+
+    // Only votes for the height of the lock are counted
+    txLock.nBlockHeight = 100;
+    BOOST_CHECK_EQUAL(txLock.CountSignatures(), 5);
+    txLock.nBlockHeight = 99;
+    BOOST_CHECK_EQUAL(txLock.CountSignatures(), 1);
+    txLock.nBlockHeight = 98;
+    BOOST_CHECK_EQUAL(txLock.CountSignatures(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,265 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logdb.h"
+#include "util.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(logdb_tests)
+
+static CLogDB::Data Bytes(const std::string& str)
+{
+    return CLogDB::Data(str.begin(), str.end());
+}
+
+static std::string Str(const CLogDB::Data& vch)
+{
+    return std::string(vch.begin(), vch.end());
+}
+
+static bool Put(CLogDB& db, const std::string& strKey, const std::string& strValue)
+{
+    CLogDB::Batch batch;
+    batch[Bytes(strKey)] = std::make_pair(false, Bytes(strValue));
+    return db.Commit(batch, false);
+}
+
+static std::string Get(const CLogDB& db, const std::string& strKey)
+{
+    CLogDB::Data value;
+    if (!db.Read(Bytes(strKey), value))
+        return "<none>";
+    return Str(value);
+}
+
+static std::string TestPath(const std::string& strName)
+{
+    boost::filesystem::path path = GetDataDir() / strName;
+    boost::filesystem::remove(path);
+    return path.string();
+}
+
+static void AppendBytes(const std::string& strPath, const CLogDB::Data& vch)
+{
+    FILE* file = fopen(strPath.c_str(), "ab");
+    BOOST_REQUIRE(file);
+    fwrite(&vch[0], 1, vch.size(), file);
+    fclose(file);
+}
+
+static void FlipByte(const std::string& strPath, long nPos)
+{
+    FILE* file = fopen(strPath.c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    fseek(file, nPos, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, nPos, SEEK_SET);
+    fputc(c ^ 0xff, file);
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(logdb_replay)
+{
+    std::string strPath = TestPath("logdb_replay.dat");
+    {
+        CLogDB db(strPath);
+        BOOST_CHECK(!db.Open(false));
+        BOOST_REQUIRE(db.Open(true));
+        BOOST_CHECK(Put(db, "a", "1"));
+        BOOST_CHECK(Put(db, "b", "2"));
+        BOOST_CHECK(Put(db, "a", "3"));
+
+        // The writes and erases of a batch are one commit
+        CLogDB::Batch batch;
+        batch[Bytes("b")] = std::make_pair(true, CLogDB::Data());
+        batch[Bytes("c")] = std::make_pair(false, Bytes("4"));
+        batch[Bytes("d")] = std::make_pair(false, CLogDB::Data());
+        BOOST_CHECK(db.Commit(batch, true));
+        BOOST_CHECK_EQUAL(Get(db, "a"), "3");
+        BOOST_CHECK_EQUAL(Get(db, "b"), "<none>");
+        BOOST_CHECK(!db.Exists(Bytes("b")));
+        BOOST_CHECK(db.Exists(Bytes("d")));
+    }
+    BOOST_CHECK(CLogDB::IsLogFile(strPath));
+
+    // Reopening maps the file and replays it
+    CLogDB db(strPath);
+    BOOST_REQUIRE(db.Open(false));
+    BOOST_CHECK_EQUAL(Get(db, "a"), "3");
+    BOOST_CHECK_EQUAL(Get(db, "b"), "<none>");
+    BOOST_CHECK_EQUAL(Get(db, "c"), "4");
+    BOOST_CHECK_EQUAL(Get(db, "d"), "");
+    BOOST_CHECK(db.GetDeadSize() > 0);
+    BOOST_CHECK_EQUAL(db.GetFileSize(), boost::filesystem::file_size(strPath));
+
+    // Values read from the mapping and written since then are both found
+    BOOST_CHECK(Put(db, "e", "5"));
+    BOOST_CHECK_EQUAL(Get(db, "a"), "3");
+    BOOST_CHECK_EQUAL(Get(db, "e"), "5");
+}
+
+BOOST_AUTO_TEST_CASE(logdb_seek)
+{
+    CLogDB db("");
+    BOOST_REQUIRE(db.Open(false));
+    // Keys are ordered bytewise, as unsigned bytes
+    const char* vKeys[] = {"\x80", "a", "ab", "b", "\x01"};
+    for (unsigned int i = 0; i < sizeof(vKeys) / sizeof(vKeys[0]); i++)
+        BOOST_CHECK(Put(db, vKeys[i], vKeys[i]));
+
+    std::vector<std::string> vOrder;
+    CLogDB::Data key, value;
+    bool fFound = db.Seek(CLogDB::Data(), true, key, value);
+    while (fFound) {
+        vOrder.push_back(Str(key));
+        BOOST_CHECK(key == value);
+        fFound = db.Seek(key, false, key, value);
+    }
+    BOOST_REQUIRE_EQUAL(vOrder.size(), 5U);
+    BOOST_CHECK_EQUAL(vOrder[0], "\x01");
+    BOOST_CHECK_EQUAL(vOrder[1], "a");
+    BOOST_CHECK_EQUAL(vOrder[2], "ab");
+    BOOST_CHECK_EQUAL(vOrder[3], "b");
+    BOOST_CHECK_EQUAL(vOrder[4], "\x80");
+
+    BOOST_CHECK(db.Seek(Bytes("aa"), true, key, value));
+    BOOST_CHECK_EQUAL(Str(key), "ab");
+    BOOST_CHECK(db.Seek(Bytes("ab"), true, key, value));
+    BOOST_CHECK_EQUAL(Str(key), "ab");
+    BOOST_CHECK(!db.Seek(Bytes("\x80"), false, key, value));
+}
+
+BOOST_AUTO_TEST_CASE(logdb_torn_tail)
+{
+    std::string strPath = TestPath("logdb_torn.dat");
+    uint64_t nSize;
+    {
+        CLogDB db(strPath);
+        BOOST_REQUIRE(db.Open(true));
+        BOOST_CHECK(Put(db, "a", "1"));
+        BOOST_CHECK(Put(db, "b", "2"));
+        nSize = db.GetFileSize();
+    }
+
+    // A crash in the middle of a commit leaves part of a frame
+    unsigned char vPartial[] = {0x20, 0, 0, 0, 0x12, 0x34, 0x56, 0x78, 1, 1};
+    AppendBytes(strPath, CLogDB::Data(vPartial, vPartial + sizeof(vPartial)));
+    std::map<CLogDB::Data, CLogDB::Data> mapRecords;
+    BOOST_CHECK_EQUAL(CLogDB::Scan(strPath, false, mapRecords), CLogDB::SCAN_TORN_TAIL);
+    BOOST_CHECK_EQUAL(mapRecords.size(), 2U);
+    {
+        CLogDB db(strPath);
+        BOOST_REQUIRE(db.Open(false));
+        BOOST_CHECK_EQUAL(db.GetFileSize(), nSize);
+        BOOST_CHECK_EQUAL(boost::filesystem::file_size(strPath), nSize);
+        BOOST_CHECK_EQUAL(Get(db, "b"), "2");
+        BOOST_CHECK(Put(db, "c", "3"));
+        nSize = db.GetFileSize();
+    }
+
+    // Or a zero filled end
+    AppendBytes(strPath, CLogDB::Data(100, 0));
+    CLogDB db(strPath);
+    BOOST_REQUIRE(db.Open(false));
+    BOOST_CHECK_EQUAL(db.GetFileSize(), nSize);
+    BOOST_CHECK_EQUAL(Get(db, "c"), "3");
+}
+
+BOOST_AUTO_TEST_CASE(logdb_corrupt)
+{
+    std::string strPath = TestPath("logdb_corrupt.dat");
+    {
+        CLogDB db(strPath);
+        BOOST_REQUIRE(db.Open(true));
+        BOOST_CHECK(Put(db, "a", "1"));
+        BOOST_CHECK(Put(db, "b", "2"));
+        BOOST_CHECK(Put(db, "c", "3"));
+    }
+
+    // Damage the second commit: 12 bytes of file header, 8 bytes of frame
+    // header and 1 + 4 + 1 + 4 + 1 bytes of record per commit
+    FlipByte(strPath, 12 + 19 + 8 + 5);
+    CLogDB db(strPath);
+    BOOST_CHECK(!db.Open(false));
+
+    std::map<CLogDB::Data, CLogDB::Data> mapRecords;
+    BOOST_CHECK_EQUAL(CLogDB::Scan(strPath, false, mapRecords), CLogDB::SCAN_CORRUPT);
+    BOOST_CHECK_EQUAL(mapRecords.size(), 1U);
+
+    // The aggressive scan continues with the commit after the damage
+    mapRecords.clear();
+    BOOST_CHECK_EQUAL(CLogDB::Scan(strPath, true, mapRecords), CLogDB::SCAN_CORRUPT);
+    BOOST_CHECK_EQUAL(mapRecords.size(), 2U);
+    BOOST_CHECK(mapRecords.count(Bytes("a")));
+    BOOST_CHECK(mapRecords.count(Bytes("c")));
+
+    // A file that is not a log
+    std::string strOther = TestPath("logdb_other.dat");
+    AppendBytes(strOther, Bytes("not a wallet log"));
+    BOOST_CHECK(!CLogDB::IsLogFile(strOther));
+    CLogDB dbOther(strOther);
+    BOOST_CHECK(!dbOther.Open(false));
+}
+
+BOOST_AUTO_TEST_CASE(logdb_compact)
+{
+    std::string strPath = TestPath("logdb_compact.dat");
+    CLogDB db(strPath);
+    BOOST_REQUIRE(db.Open(true));
+    std::string strValue(1000, 'x');
+    for (int i = 0; i < 2000; i++)
+        BOOST_CHECK(Put(db, "a", strValue + std::to_string(i)));
+    BOOST_CHECK(Put(db, "pool1", "p"));
+    BOOST_CHECK(Put(db, "pool2", "p"));
+    BOOST_CHECK(Put(db, "b", "2"));
+    BOOST_CHECK(db.NeedsCompaction());
+
+    uint64_t nSize = db.GetFileSize();
+    BOOST_CHECK(db.Compact());
+    BOOST_CHECK(!db.NeedsCompaction());
+    BOOST_CHECK(db.GetFileSize() < nSize / 100);
+    BOOST_CHECK_EQUAL(db.GetFileSize(), boost::filesystem::file_size(strPath));
+    BOOST_CHECK_EQUAL(Get(db, "a"), strValue + "1999");
+    BOOST_CHECK_EQUAL(Get(db, "pool2"), "p");
+
+    // Compaction can leave out a key prefix, like the keypool on a rewrite
+    BOOST_CHECK(db.Compact("pool"));
+    BOOST_CHECK_EQUAL(Get(db, "pool1"), "<none>");
+    BOOST_CHECK_EQUAL(Get(db, "pool2"), "<none>");
+    BOOST_CHECK_EQUAL(Get(db, "b"), "2");
+    BOOST_CHECK(Put(db, "c", "3"));
+    db.Close();
+
+    BOOST_REQUIRE(db.Open(false));
+    BOOST_CHECK_EQUAL(Get(db, "a"), strValue + "1999");
+    BOOST_CHECK_EQUAL(Get(db, "c"), "3");
+    BOOST_CHECK(!boost::filesystem::exists(strPath + ".compact"));
+}
+
+BOOST_AUTO_TEST_CASE(walletdb_transaction)
+{
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CAccount account;
+    account.vchPubKey = CPubKey();
+
+    // Reads in a transaction see its writes, other handles don't until the commit
+    BOOST_REQUIRE(walletdb.TxnBegin());
+    BOOST_CHECK(walletdb.WriteAccount("logdb_a", account));
+    BOOST_CHECK(walletdb.ReadAccount("logdb_a", account));
+    BOOST_CHECK(!CWalletDB(pwalletMain->strWalletFile, "r").ReadAccount("logdb_a", account));
+    BOOST_CHECK(walletdb.TxnCommit());
+    BOOST_CHECK(CWalletDB(pwalletMain->strWalletFile, "r").ReadAccount("logdb_a", account));
+
+    // An aborted transaction leaves nothing
+    BOOST_REQUIRE(walletdb.TxnBegin());
+    BOOST_CHECK(walletdb.WriteAccount("logdb_b", account));
+    BOOST_CHECK(walletdb.TxnAbort());
+    BOOST_CHECK(!walletdb.ReadAccount("logdb_b", account));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
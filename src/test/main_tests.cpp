@@ -5,7 +5,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "primitives/transaction.h"
+#include "chainparams.h"
 #include "main.h"
+#include "pow.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 #include <boost/test/unit_test.hpp>
 
@@ -24,4 +30,226 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 2099999997690000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(block_download_window_test)
+{
+    CBlockDownloadStats stats;
+    BOOST_CHECK_EQUAL(stats.nMaxBlocksInFlight, DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A block every 100ms keeps BLOCK_DOWNLOAD_TARGET_TIME seconds worth of 40 blocks in flight
+    int64_t nNow = 1000000000;
+    for (int i = 0; i < 100; i++) {
+        stats.BlockReceived(nNow - 500000, nNow);
+        nNow += 100000;
+    }
+    BOOST_CHECK_EQUAL(stats.nBlocksReceived, 100);
+    BOOST_CHECK(stats.nAvgBlockLatency >= 499990 && stats.nAvgBlockLatency <= 500010);
+    BOOST_CHECK(stats.nMaxBlocksInFlight >= 39 && stats.nMaxBlocksInFlight <= 40);
+
+    // Slow and fast peers stay within the bounds
+    CBlockDownloadStats statsSlow, statsFast;
+    for (int i = 0; i < 20; i++) {
+        statsSlow.BlockReceived(nNow - 5000000, nNow);
+        nNow += 5000000;
+    }
+    BOOST_CHECK_EQUAL(statsSlow.nMaxBlocksInFlight, MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    for (int i = 0; i < 20; i++) {
+        statsFast.BlockReceived(nNow - 1000, nNow);
+        nNow += 1000;
+    }
+    BOOST_CHECK_EQUAL(statsFast.nMaxBlocksInFlight, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(block_download_takeover_test)
+{
+    CBlockDownloadStats statsNew, statsFast, statsSlow;
+    statsFast.nBlocksReceived = 10;
+    statsFast.nAvgBlockLatency = 800000;
+    statsFast.nAvgBlockInterval = 100000;
+    statsSlow.nBlocksReceived = 10;
+    statsSlow.nAvgBlockLatency = 3000000;
+    statsSlow.nAvgBlockInterval = 1000000;
+
+    // The staller gets twice the usual latency of the faster peer
+    int64_t nRequested = 1000000000;
+    BOOST_CHECK(!statsFast.ShouldTakeOverBlock(statsSlow, nRequested, nRequested + 1500000));
+    BOOST_CHECK(statsFast.ShouldTakeOverBlock(statsSlow, nRequested, nRequested + 1600000));
+
+    // ...but never less than a second
+    statsFast.nAvgBlockLatency = 100000;
+    BOOST_CHECK(!statsFast.ShouldTakeOverBlock(statsSlow, nRequested, nRequested + 900000));
+    BOOST_CHECK(statsFast.ShouldTakeOverBlock(statsSlow, nRequested, nRequested + 1000000));
+
+    // A staller that delivered nothing yet can be replaced, while a peer without
+    // measurements or a slower one never takes a block over
+    BOOST_CHECK(statsFast.ShouldTakeOverBlock(statsNew, nRequested, nRequested + 1000000));
+    BOOST_CHECK(!statsNew.ShouldTakeOverBlock(statsSlow, nRequested, nRequested + 60000000));
+    BOOST_CHECK(!statsSlow.ShouldTakeOverBlock(statsFast, nRequested, nRequested + 60000000));
+}
+
+BOOST_AUTO_TEST_CASE(assumevalid_test)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    const int nBuried = ASSUMEVALID_MIN_BURIED_TIME / params.nPowTargetSpacing;
+
+    // A chain whose tip is the assumed valid block, with constant difficulty
+    // so each block adds one target spacing worth of work
+    std::vector<CBlockIndex> vBlocks(nBuried + 100);
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nBits = 0x207fffff;
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].nChainWork = (i ? vBlocks[i - 1].nChainWork : 0) + GetBlockProof(vBlocks[i]);
+        vBlocks[i].BuildSkip();
+    }
+    const CBlockIndex* pindexAssumeValid = &vBlocks.back();
+    const CBlockIndex* pindexBest = &vBlocks.back();
+    const int nTip = pindexBest->nHeight;
+
+    uint256 nMinimumChainWorkSaved = nMinimumChainWork;
+    nMinimumChainWork = 0;
+
+    BOOST_CHECK(IsAssumedValid(&vBlocks[50], pindexAssumeValid, pindexBest, params));
+    BOOST_CHECK(!IsAssumedValid(&vBlocks[50], pindexAssumeValid, NULL, params));
+
+    // Scripts are checked for a block that is not an ancestor of the assumed valid block
+    CBlockIndex fork;
+    fork.nHeight = 50;
+    fork.nBits = 0x207fffff;
+    fork.pprev = &vBlocks[49];
+    fork.nChainWork = vBlocks[50].nChainWork;
+    fork.BuildSkip();
+    BOOST_CHECK(!IsAssumedValid(&fork, pindexAssumeValid, pindexBest, params));
+
+    // ...and when the best header does not build on the assumed valid block
+    BOOST_CHECK(!IsAssumedValid(&vBlocks[50], pindexAssumeValid, &vBlocks[nTip - 1], params));
+
+    // ...and when the best header chain has less than the minimum chain work
+    nMinimumChainWork = pindexBest->nChainWork + 1;
+    BOOST_CHECK(!IsAssumedValid(&vBlocks[50], pindexAssumeValid, pindexBest, params));
+    nMinimumChainWork = pindexBest->nChainWork;
+    BOOST_CHECK(IsAssumedValid(&vBlocks[50], pindexAssumeValid, pindexBest, params));
+    nMinimumChainWork = 0;
+
+    // ...and when the block is buried under less than two weeks worth of work
+    BOOST_CHECK(IsAssumedValid(&vBlocks[nTip - nBuried], pindexAssumeValid, pindexBest, params));
+    BOOST_CHECK(!IsAssumedValid(&vBlocks[nTip - nBuried + 1], pindexAssumeValid, pindexBest, params));
+    BOOST_CHECK(!IsAssumedValid(pindexBest, pindexAssumeValid, pindexBest, params));
+
+    nMinimumChainWork = nMinimumChainWorkSaved;
+}
+
+/** Append a block record (magic, size, then nSize bytes of fill) to vFile. */
+static void AppendBlockRecord(std::vector<unsigned char>& vFile, unsigned int nSize, unsigned char fill)
+{
+    const unsigned char* pchMessageStart = Params().MessageStart();
+    vFile.insert(vFile.end(), pchMessageStart, pchMessageStart + MESSAGE_START_SIZE);
+    for (int i = 0; i < 4; i++)
+        vFile.push_back((nSize >> (8 * i)) & 0xff);
+    vFile.insert(vFile.end(), nSize, fill);
+}
+
+static FILE* MakeTempFile(const std::vector<unsigned char>& vFile)
+{
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE_EQUAL(fwrite(&vFile[0], 1, vFile.size(), file), vFile.size());
+    rewind(file);
+    return file;
+}
+
+BOOST_AUTO_TEST_CASE(block_file_records_test)
+{
+    std::atomic<bool> fStop(false);
+    std::vector<unsigned char> vFile(5, 0x42);
+    AppendBlockRecord(vFile, 200, 0x11);
+    // A size below the smallest block is skipped
+    AppendBlockRecord(vFile, 10, 0x12);
+    // A stale size spanning the next records, whose end is neither a record,
+    // the zeroed tail nor the end of the file, must not hide them
+    uint64_t nStale = vFile.size();
+    const unsigned char* pchMessageStart = Params().MessageStart();
+    vFile.insert(vFile.end(), pchMessageStart, pchMessageStart + MESSAGE_START_SIZE);
+    unsigned int nStaleSize = 8 + 100 + 8 + 50;
+    for (int i = 0; i < 4; i++)
+        vFile.push_back((nStaleSize >> (8 * i)) & 0xff);
+    uint64_t nSecond = vFile.size() + 8;
+    AppendBlockRecord(vFile, 100, 0x13);
+    uint64_t nThird = vFile.size() + 8;
+    AppendBlockRecord(vFile, 120, 0x14);
+    // The preallocated tail of a block file
+    vFile.insert(vFile.end(), 1000, 0);
+
+    std::vector<std::pair<uint64_t, unsigned int> > vRecords;
+    FILE* file = MakeTempFile(vFile);
+    BOOST_CHECK_EQUAL(FindBlockFileRecords(file, pchMessageStart, vRecords, fStop), vFile.size());
+    fclose(file);
+    BOOST_REQUIRE_EQUAL(vRecords.size(), 3U);
+    BOOST_CHECK_EQUAL(vRecords[0].first, 5U + 8);
+    BOOST_CHECK_EQUAL(vRecords[0].second, 200U);
+    BOOST_CHECK_EQUAL(vRecords[1].first, nSecond);
+    BOOST_CHECK_EQUAL(vRecords[1].second, 100U);
+    BOOST_CHECK_EQUAL(vRecords[2].first, nThird);
+    BOOST_CHECK_EQUAL(vRecords[2].second, 120U);
+
+    // Scanning starts at the current position of the file
+    vRecords.clear();
+    file = MakeTempFile(vFile);
+    BOOST_REQUIRE(fseek(file, nStale, SEEK_SET) == 0);
+    FindBlockFileRecords(file, pchMessageStart, vRecords, fStop);
+    fclose(file);
+    BOOST_REQUIRE_EQUAL(vRecords.size(), 2U);
+    BOOST_CHECK_EQUAL(vRecords[0].first, nSecond);
+
+    // A record ending the file is found, a truncated one is not
+    vFile.resize(nThird + 120);
+    AppendBlockRecord(vFile, 300, 0x15);
+    vFile.resize(vFile.size() - 100);
+    vRecords.clear();
+    file = MakeTempFile(vFile);
+    FindBlockFileRecords(file, pchMessageStart, vRecords, fStop);
+    fclose(file);
+    BOOST_REQUIRE_EQUAL(vRecords.size(), 3U);
+    BOOST_CHECK_EQUAL(vRecords[2].first, nThird);
+
+    // A record that runs into the end of the file is found too
+    vFile.resize(nThird + 120);
+    vRecords.clear();
+    file = MakeTempFile(vFile);
+    FindBlockFileRecords(file, pchMessageStart, vRecords, fStop);
+    fclose(file);
+    BOOST_CHECK_EQUAL(vRecords.size(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(reindex_empty_block_files_test)
+{
+    // More files without a single block than the scanners may run ahead of
+    // the connect stage, followed by one holding only garbage
+    int nFirst = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFirst, 0), "blk")))
+        nFirst++;
+    int nFiles = 12;
+    for (int nFile = nFirst; nFile < nFirst + nFiles; nFile++) {
+        FILE* file = OpenBlockFile(CDiskBlockPos(nFile, 0));
+        BOOST_REQUIRE(file != NULL);
+        if (nFile == nFirst + nFiles - 1) {
+            std::vector<unsigned char> vJunk(1000, 0x5a);
+            fwrite(&vJunk[0], 1, vJunk.size(), file);
+        }
+        fclose(file);
+    }
+
+    // The import has to get through all of them instead of waiting forever
+    // for a block that moves the scan-ahead window
+    boost::thread thread(boost::bind(&ReindexBlockFiles, boost::cref(Params())));
+    bool fDone = thread.timed_join(boost::posix_time::seconds(60));
+    if (!fDone) {
+        thread.interrupt();
+        thread.join();
+    }
+    BOOST_CHECK(fDone);
+
+    for (int nFile = nFirst; nFile < nFirst + nFiles; nFile++)
+        boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
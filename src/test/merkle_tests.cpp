@@ -0,0 +1,117 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/merkle.h"
+#include "hash.h"
+#include "random.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(merkle_tests)
+
+/** Straightforward level-by-level merkle root, one Hash() per node. */
+static uint256 ReferenceMerkleRoot(std::vector<uint256> hashes, bool& mutated)
+{
+    mutated = false;
+    if (hashes.empty())
+        return uint256();
+    while (hashes.size() > 1) {
+        std::vector<uint256> next;
+        for (size_t pos = 0; pos < hashes.size(); pos += 2) {
+            const uint256& left = hashes[pos];
+            const uint256& right = pos + 1 < hashes.size() ? hashes[pos + 1] : hashes[pos];
+            if (pos + 1 < hashes.size() && left == right)
+                mutated = true;
+            next.push_back(Hash(left.begin(), left.end(), right.begin(), right.end()));
+        }
+        hashes.swap(next);
+    }
+    return hashes[0];
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root_matches_reference)
+{
+    for (int nLeaves = 0; nLeaves <= 40; nLeaves++) {
+        std::vector<uint256> leaves(nLeaves);
+        for (int i = 0; i < nLeaves; i++)
+            leaves[i] = GetRandHash();
+
+        bool fMutated = true, fMutatedRef = true;
+        uint256 root = ComputeMerkleRoot(leaves, &fMutated);
+        BOOST_CHECK(root == ReferenceMerkleRoot(leaves, fMutatedRef));
+        BOOST_CHECK(!fMutated && !fMutatedRef);
+
+        // Each leaf must be provable against the root.
+        for (int i = 0; i < nLeaves; i++)
+            BOOST_CHECK(ComputeMerkleRootFromBranch(leaves[i], ComputeMerkleBranch(leaves, i), i) == root);
+
+        // With an odd number of nodes one level up, repeating the last two
+        // leaves keeps the root (CVE-2012-2459) and has to be reported.
+        if (nLeaves % 4 == 2 && nLeaves > 2) {
+            std::vector<uint256> mutatedLeaves(leaves);
+            mutatedLeaves.push_back(leaves[nLeaves - 2]);
+            mutatedLeaves.push_back(leaves[nLeaves - 1]);
+            BOOST_CHECK(ComputeMerkleRoot(mutatedLeaves, &fMutated) == root);
+            BOOST_CHECK(ReferenceMerkleRoot(mutatedLeaves, fMutatedRef) == root);
+            BOOST_CHECK(fMutated && fMutatedRef);
+        }
+    }
+}
+
+static CBlock BlockWithTransactions(int nTx, int nSeed)
+{
+    CBlock block;
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = nSeed * 1000 + i;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(block_merkle_tree_reuse)
+{
+    for (int nTx = 0; nTx <= 33; nTx++) {
+        CBlock block = BlockWithTransactions(nTx, 0);
+        bool fMutated = true;
+        uint256 root = block.BuildMerkleTree(&fMutated);
+        BOOST_CHECK(root == BlockMerkleRoot(block));
+        BOOST_CHECK(!fMutated);
+        std::vector<uint256> vTree = block.vMerkleTree;
+
+        // Rebuilding from its own tree gives the same tree
+        BOOST_CHECK(block.BuildMerkleTree(&fMutated, &block) == root);
+        BOOST_CHECK(block.vMerkleTree == vTree);
+
+        // A stale tree is not trusted beyond the transactions that still match
+        if (nTx > 0) {
+            block.vtx.back() = BlockWithTransactions(1, 1).vtx[0];
+            BOOST_CHECK(block.BuildMerkleTree(NULL, &block) == BlockMerkleRoot(block));
+        }
+
+        // Other blocks sharing a prefix, shorter, longer, or diverging
+        for (int nOther = 0; nOther <= nTx + 3; nOther++) {
+            CBlock other = BlockWithTransactions(nTx, 0);
+            other.vtx.resize(std::min(nTx, nOther));
+            CBlock extra = BlockWithTransactions(nTx + 3, 2);
+            while ((int)other.vtx.size() < nOther)
+                other.vtx.push_back(extra.vtx[other.vtx.size()]);
+            BOOST_CHECK(other.BuildMerkleTree(NULL, &block) == BlockMerkleRoot(other));
+        }
+
+        // Duplicating the last two transactions is still detected with reuse
+        if (nTx % 4 == 2 && nTx > 2) {
+            CBlock duplicated = BlockWithTransactions(nTx, 0);
+            duplicated.BuildMerkleTree();
+            CBlock mutatedBlock(duplicated);
+            mutatedBlock.vtx.push_back(duplicated.vtx[nTx - 2]);
+            mutatedBlock.vtx.push_back(duplicated.vtx[nTx - 1]);
+            BOOST_CHECK(mutatedBlock.BuildMerkleTree(&fMutated, &duplicated) == duplicated.vMerkleTree.back());
+            BOOST_CHECK(fMutated);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
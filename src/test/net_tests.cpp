@@ -0,0 +1,254 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "random.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+/** A complete wire message: header with size and checksum, then payload. */
+static std::vector<char> MakeWireMessage(const char* pszCommand, const std::vector<char>& payload)
+{
+    CMessageHeader hdr(pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    std::vector<char> ret(ss.begin(), ss.end());
+    ret.insert(ret.end(), payload.begin(), payload.end());
+    return ret;
+}
+
+static std::vector<char> RandomPayload(size_t nSize)
+{
+    std::vector<char> ret(nSize);
+    for (size_t i = 0; i < nSize; i++)
+        ret[i] = insecure_rand();
+    return ret;
+}
+
+static void CheckMessage(const CNetMessage& msg, const char* pszCommand, const std::vector<char>& payload)
+{
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(memcmp(msg.hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) == 0);
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), pszCommand);
+    BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, payload.size());
+    BOOST_CHECK(std::vector<char>(msg.vRecv.begin(), msg.vRecv.end()) == payload);
+}
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes_chunked)
+{
+    std::vector<char> payload1 = RandomPayload(250), payload2 = RandomPayload(0), payload3 = RandomPayload(70000);
+    std::vector<char> wire = MakeWireMessage("tx", payload1);
+    std::vector<char> wire2 = MakeWireMessage("verack", payload2);
+    std::vector<char> wire3 = MakeWireMessage("block", payload3);
+    wire.insert(wire.end(), wire2.begin(), wire2.end());
+    wire.insert(wire.end(), wire3.begin(), wire3.end());
+
+    // Header split across reads, whole headers in one read, and everything at once
+    const unsigned int chunks[] = {1, 7, 23, 24, 25, 1000, (unsigned int)wire.size()};
+    BOOST_FOREACH (unsigned int nChunk, chunks) {
+        CAddress addr(CService("1.2.3.4", Params().GetDefaultPort()), NODE_NONE);
+        CNode node(INVALID_SOCKET, addr, "", true);
+        LOCK(node.cs_vRecvMsg);
+        for (size_t nPos = 0; nPos < wire.size(); nPos += nChunk)
+            BOOST_CHECK(node.ReceiveMsgBytes(&wire[nPos], std::min((size_t)nChunk, wire.size() - nPos)));
+
+        BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 3U);
+        CheckMessage(node.vRecvMsg[0], "tx", payload1);
+        CheckMessage(node.vRecvMsg[1], "verack", payload2);
+        CheckMessage(node.vRecvMsg[2], "block", payload3);
+        BOOST_CHECK_EQUAL(node.mapRecvBytesPerMsgCmd["tx"], 250U + CMessageHeader::HEADER_SIZE);
+        BOOST_CHECK_EQUAL(node.mapRecvBytesPerMsgCmd["block"], 70000U + CMessageHeader::HEADER_SIZE);
+        RecycleRecvBuffers(node.vRecvMsg.begin(), node.vRecvMsg.end());
+        node.vRecvMsg.clear();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes_in_place)
+{
+    std::vector<char> payload = RandomPayload(600000);
+    std::vector<char> wire = MakeWireMessage("block", payload);
+
+    CAddress addr(CService("1.2.3.4", Params().GetDefaultPort()), NODE_NONE);
+    CNode node(INVALID_SOCKET, addr, "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    unsigned int nSpace = 0;
+    BOOST_CHECK(node.GetRecvDataBuffer(1, nSpace) == NULL);
+    size_t nPos = CMessageHeader::HEADER_SIZE + 100;
+    BOOST_CHECK(node.ReceiveMsgBytes(&wire[0], nPos));
+
+    // Read the rest of the body the way the socket thread does, straight into the message
+    while (nPos < wire.size()) {
+        char* pchDest = node.GetRecvDataBuffer(1, nSpace);
+        BOOST_REQUIRE(pchDest != NULL);
+        // never more than what is left of this message, nor more than 256 KiB ahead
+        BOOST_CHECK(nSpace <= wire.size() - nPos);
+        BOOST_CHECK(nSpace <= std::max(nPos - CMessageHeader::HEADER_SIZE, (size_t)256 * 1024 + 1));
+        unsigned int nBytes = std::min(nSpace, 50000U);
+        memcpy(pchDest, &wire[nPos], nBytes);
+        BOOST_CHECK(node.ReceiveMsgBytes(pchDest, nBytes));
+        nPos += nBytes;
+    }
+
+    BOOST_CHECK(node.GetRecvDataBuffer(1, nSpace) == NULL);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+    CheckMessage(node.vRecvMsg[0], "block", payload);
+}
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes_oversized)
+{
+    CAddress addr(CService("1.2.3.4", Params().GetDefaultPort()), NODE_NONE);
+    CNode node(INVALID_SOCKET, addr, "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    CMessageHeader hdr("block", MAX_PROTOCOL_MESSAGE_LENGTH + 1);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    std::vector<char> wire(ss.begin(), ss.end());
+    BOOST_CHECK(!node.ReceiveMsgBytes(&wire[0], wire.size()));
+}
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes_unknown_command)
+{
+    CAddress addr(CService("1.2.3.4", Params().GetDefaultPort()), NODE_NONE);
+    CNode node(INVALID_SOCKET, addr, "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    std::vector<char> wire = MakeWireMessage("nosuchcmd", RandomPayload(10));
+    BOOST_CHECK(node.ReceiveMsgBytes(&wire[0], wire.size()));
+    BOOST_CHECK(!node.mapRecvBytesPerMsgCmd.count("nosuchcmd"));
+    BOOST_CHECK_EQUAL(node.mapRecvBytesPerMsgCmd[NET_MESSAGE_COMMAND_OTHER], wire.size());
+}
+
+BOOST_AUTO_TEST_CASE(outbound_target)
+{
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // Start a fresh cycle, then spend part of a budget that leaves no room for historical blocks
+    CNode::SetMaxOutboundTimeframe(MAX_UPLOAD_TIMEFRAME / 2);
+    CNode::SetMaxOutboundTimeframe(MAX_UPLOAD_TIMEFRAME);
+    CNode::SetMaxOutboundTarget(10 * 1024 * 1024);
+    CNode::RecordBytesSent(1024);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(CNode::GetOutboundTargetBytesLeft() <= 10 * 1024 * 1024 - 1024);
+    BOOST_CHECK(CNode::GetMaxOutboundTimeLeftInCycle() <= MAX_UPLOAD_TIMEFRAME);
+
+    CNode::RecordBytesSent(10 * 1024 * 1024);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    CNode::SetMaxOutboundTarget(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+}
+
+#ifndef WIN32
+/** Sum of the sizes of the messages still queued, which nSendSize has to match. */
+static size_t QueuedSize(const CNode& node)
+{
+    size_t nSize = 0;
+    BOOST_FOREACH (const CSendMessage& msg, node.vSendMsg)
+        nSize += msg.size();
+    return nSize;
+}
+
+BOOST_AUTO_TEST_CASE(socket_send_data_partial)
+{
+    // A socket with a small send buffer that the other end drains a little at
+    // a time, so the gathered writes keep coming back short
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int nSendBuffer = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &nSendBuffer, sizeof(nSendBuffer));
+    int nFlags = fcntl(fds[1], F_GETFL, 0);
+    BOOST_REQUIRE(fcntl(fds[1], F_SETFL, nFlags | O_NONBLOCK) != -1);
+
+    CAddress addr(CService("1.2.3.4", Params().GetDefaultPort()), NODE_NONE);
+    CNode node(fds[0], addr, "", true);
+    CNode nodeRecv(INVALID_SOCKET, addr, "", true);
+
+    std::vector<char> vBlock = RandomPayload(100000), vTx = RandomPayload(300);
+    CSharedPayloadRef pBlock = MakeSharedPayload(vBlock);
+    CSharedPayloadRef pTx = MakeSharedPayload(vTx);
+    node.PushPayload("block", pBlock);
+    // More messages than fit in one gathered write
+    for (int i = 0; i < 40; i++)
+        node.PushPayload("tx", pTx);
+    node.PushMessage("ping", (uint64_t)42);
+    BOOST_CHECK_EQUAL(pTx.use_count(), 41);
+
+    size_t nTotal = 0;
+    {
+        LOCK(node.cs_vSend);
+        nTotal = node.nSendBytes + node.nSendSize - node.nSendOffset;
+    }
+
+    bool fShortWrite = false;
+    size_t nReceived = 0;
+    for (int nRound = 0; nRound < 100000; nRound++) {
+        {
+            LOCK(node.cs_vSend);
+            SocketSendData(&node);
+
+            BOOST_CHECK_EQUAL(node.nSendSize, QueuedSize(node));
+            BOOST_CHECK_EQUAL(node.nSendBytes + node.nSendSize - node.nSendOffset, nTotal);
+            if (node.vSendMsg.empty()) {
+                BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+                break;
+            }
+            BOOST_CHECK(node.nSendOffset < node.vSendMsg.front().size());
+            fShortWrite |= node.nSendOffset > 0;
+
+            // The block payload goes as soon as the socket took all of its bytes
+            if (node.vSendMsg.front().pPayload != pBlock)
+                BOOST_CHECK_EQUAL(pBlock.use_count(), 1);
+        }
+
+        char buf[3000];
+        ssize_t nRead = recv(fds[1], buf, sizeof(buf), 0);
+        if (nRead > 0) {
+            LOCK(nodeRecv.cs_vRecvMsg);
+            BOOST_REQUIRE(nodeRecv.ReceiveMsgBytes(buf, nRead));
+            nReceived += nRead;
+        }
+    }
+
+    char buf[3000];
+    ssize_t nRead;
+    while ((nRead = recv(fds[1], buf, sizeof(buf), 0)) > 0) {
+        LOCK(nodeRecv.cs_vRecvMsg);
+        BOOST_REQUIRE(nodeRecv.ReceiveMsgBytes(buf, nRead));
+        nReceived += nRead;
+    }
+    close(fds[1]);
+
+    BOOST_CHECK(fShortWrite);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(nReceived, nTotal);
+    BOOST_CHECK_EQUAL(pBlock.use_count(), 1);
+    BOOST_CHECK_EQUAL(pTx.use_count(), 1);
+
+    // The peer sees every message whole and in order
+    LOCK(nodeRecv.cs_vRecvMsg);
+    BOOST_REQUIRE_EQUAL(nodeRecv.vRecvMsg.size(), 42U);
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION), ssTx(SER_NETWORK, PROTOCOL_VERSION), ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << vBlock;
+    ssTx << vTx;
+    ssPing << (uint64_t)42;
+    CheckMessage(nodeRecv.vRecvMsg[0], "block", std::vector<char>(ssBlock.begin(), ssBlock.end()));
+    for (int i = 1; i <= 40; i++)
+        CheckMessage(nodeRecv.vRecvMsg[i], "tx", std::vector<char>(ssTx.begin(), ssTx.end()));
+    CheckMessage(nodeRecv.vRecvMsg[41], "ping", std::vector<char>(ssPing.begin(), ssPing.end()));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
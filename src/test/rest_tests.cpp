@@ -0,0 +1,208 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rest.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(rest_tests)
+
+static std::string SerializeRequest(bool fCheckMemPool, const std::vector<COutPoint>& vOutPoints)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << fCheckMemPool << vOutPoints;
+    return ss.str();
+}
+
+static std::vector<std::string> UriParts(const std::vector<COutPoint>& vOutPoints, bool fCheckMemPool)
+{
+    std::vector<std::string> uriParts;
+    if (fCheckMemPool)
+        uriParts.push_back("checkmempool");
+    for (size_t i = 0; i < vOutPoints.size(); i++)
+        uriParts.push_back(vOutPoints[i].hash.GetHex() + "-" + std::to_string(vOutPoints[i].n));
+    return uriParts;
+}
+
+static std::vector<COutPoint> RandomOutPoints(size_t nCount)
+{
+    std::vector<COutPoint> vOutPoints;
+    for (size_t i = 0; i < nCount; i++)
+        vOutPoints.push_back(COutPoint(GetRandHash(), i));
+    return vOutPoints;
+}
+
+BOOST_AUTO_TEST_CASE(getutxos_parse_uri)
+{
+    bool fCheckMemPool;
+    std::vector<COutPoint> vOutPoints, vExpected = RandomOutPoints(3);
+    std::string strError;
+
+    BOOST_CHECK(ParseGetUTXOsRequest(UriParts(vExpected, true), "", false, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK(fCheckMemPool);
+    BOOST_CHECK(vOutPoints == vExpected);
+
+    BOOST_CHECK(ParseGetUTXOsRequest(UriParts(vExpected, false), "", true, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK(!fCheckMemPool);
+    BOOST_CHECK(vOutPoints == vExpected);
+
+    // Malformed outpoints
+    const char* vBad[] = {"", "-0", "1234-0", "nothex", "checkmempool"};
+    BOOST_FOREACH (const char* pszBad, vBad) {
+        std::vector<std::string> uriParts = UriParts(vExpected, false);
+        uriParts.push_back(pszBad);
+        BOOST_CHECK(!ParseGetUTXOsRequest(uriParts, "", false, fCheckMemPool, vOutPoints, strError));
+        BOOST_CHECK_EQUAL(strError, "Parse error");
+    }
+    std::vector<std::string> uriParts = UriParts(vExpected, false);
+    uriParts[1] = vExpected[1].hash.GetHex() + "--1";
+    BOOST_CHECK(!ParseGetUTXOsRequest(uriParts, "", false, fCheckMemPool, vOutPoints, strError));
+    uriParts[1] = vExpected[1].hash.GetHex() + "-x";
+    BOOST_CHECK(!ParseGetUTXOsRequest(uriParts, "", false, fCheckMemPool, vOutPoints, strError));
+
+    // Requests without any outpoint
+    BOOST_CHECK(!ParseGetUTXOsRequest(std::vector<std::string>(), "", true, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(strError, "Error: empty request");
+    BOOST_CHECK(!ParseGetUTXOsRequest(std::vector<std::string>(1, "checkmempool"), "", false, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(strError, "Error: empty request");
+}
+
+BOOST_AUTO_TEST_CASE(getutxos_parse_body)
+{
+    bool fCheckMemPool;
+    std::vector<COutPoint> vOutPoints, vExpected = RandomOutPoints(5);
+    std::string strError;
+
+    BOOST_CHECK(ParseGetUTXOsRequest(std::vector<std::string>(), SerializeRequest(true, vExpected), true, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK(fCheckMemPool);
+    BOOST_CHECK(vOutPoints == vExpected);
+
+    // The json format only takes outpoints from the URI
+    BOOST_CHECK(!ParseGetUTXOsRequest(std::vector<std::string>(), SerializeRequest(true, vExpected), false, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(strError, "Error: empty request");
+
+    // Outpoints in both the URI and the body
+    BOOST_CHECK(!ParseGetUTXOsRequest(UriParts(vExpected, false), SerializeRequest(false, vExpected), true, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(strError, "Combination of URI scheme inputs and raw post data is not allowed");
+
+    // A truncated body
+    std::string strBody = SerializeRequest(false, vExpected);
+    strBody.resize(strBody.size() - 1);
+    BOOST_CHECK(!ParseGetUTXOsRequest(std::vector<std::string>(), strBody, true, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(strError, "Parse error");
+}
+
+BOOST_AUTO_TEST_CASE(getutxos_parse_limit)
+{
+    bool fCheckMemPool;
+    std::vector<COutPoint> vOutPoints;
+    std::string strError;
+
+    std::vector<COutPoint> vMax = RandomOutPoints(MAX_GETUTXOS_OUTPOINTS);
+    BOOST_CHECK(ParseGetUTXOsRequest(UriParts(vMax, true), "", false, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(vOutPoints.size(), MAX_GETUTXOS_OUTPOINTS);
+    BOOST_CHECK(ParseGetUTXOsRequest(std::vector<std::string>(), SerializeRequest(false, vMax), true, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(vOutPoints.size(), MAX_GETUTXOS_OUTPOINTS);
+
+    std::vector<COutPoint> vOver = RandomOutPoints(MAX_GETUTXOS_OUTPOINTS + 1);
+    BOOST_CHECK(!ParseGetUTXOsRequest(UriParts(vOver, true), "", false, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(strError, "Error: max outpoints exceeded (max: 15, tried: 16)");
+    BOOST_CHECK(!ParseGetUTXOsRequest(std::vector<std::string>(), SerializeRequest(false, vOver), true, fCheckMemPool, vOutPoints, strError));
+    BOOST_CHECK_EQUAL(strError, "Error: max outpoints exceeded (max: 15, tried: 16)");
+}
+
+BOOST_AUTO_TEST_CASE(getutxos_bitmap)
+{
+    // A confirmed transaction with three outputs, the second one spent
+    CMutableTransaction txConfirmed;
+    txConfirmed.vin.resize(1);
+    txConfirmed.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txConfirmed.vout.resize(3);
+    for (int i = 0; i < 3; i++) {
+        txConfirmed.vout[i].nValue = (i + 1) * COIN;
+        txConfirmed.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    uint256 hashConfirmed = txConfirmed.GetHash();
+    {
+        LOCK(cs_main);
+        CCoinsModifier coins = pcoinsTip->ModifyCoins(hashConfirmed);
+        coins->FromTx(txConfirmed, 7);
+        coins->Spend(1);
+    }
+
+    // A mempool transaction spending the third output
+    CMutableTransaction txMempool;
+    txMempool.vin.resize(1);
+    txMempool.vin[0].prevout = COutPoint(hashConfirmed, 2);
+    txMempool.vout.resize(1);
+    txMempool.vout[0].nValue = COIN;
+    txMempool.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hashMempool = txMempool.GetHash();
+    LockPoints lp;
+    mempool.addUnchecked(hashMempool, CTxMemPoolEntry(MakeTransactionRef(txMempool), 0, 0, 0.0, 1, 0, false, 0, lp, true));
+
+    // Ten outpoints, so the bitmap takes a second byte
+    std::vector<COutPoint> vOutPoints;
+    for (int i = 0; i < 3; i++)
+        vOutPoints.push_back(COutPoint(hashConfirmed, i));
+    vOutPoints.push_back(COutPoint(hashConfirmed, 3));
+    vOutPoints.push_back(COutPoint(GetRandHash(), 0));
+    vOutPoints.push_back(COutPoint(hashMempool, 0));
+    vOutPoints.push_back(COutPoint(hashMempool, 1));
+    vOutPoints.push_back(COutPoint(hashConfirmed, 0));
+    vOutPoints.push_back(COutPoint(hashMempool, 0));
+    vOutPoints.push_back(COutPoint(hashConfirmed, 2));
+
+    {
+        LOCK2(cs_main, mempool.cs);
+        std::vector<unsigned char> bitmap;
+        std::vector<CCoin> outs;
+
+        // Confirmed outputs only: 0, 2, 7 and 9
+        GetUTXOs(vOutPoints, false, bitmap, outs);
+        BOOST_REQUIRE_EQUAL(bitmap.size(), 2U);
+        BOOST_CHECK_EQUAL(bitmap[0], 0x85);
+        BOOST_CHECK_EQUAL(bitmap[1], 0x02);
+        BOOST_REQUIRE_EQUAL(outs.size(), 4U);
+        BOOST_CHECK(outs[0].out == txConfirmed.vout[0]);
+        BOOST_CHECK_EQUAL(outs[0].nHeight, 7U);
+        BOOST_CHECK(outs[1].out == txConfirmed.vout[2]);
+        BOOST_CHECK(outs[3].out == txConfirmed.vout[2]);
+
+        // With the mempool, its output counts and the output it spends doesn't: 0, 5, 7 and 8
+        outs.clear();
+        GetUTXOs(vOutPoints, true, bitmap, outs);
+        BOOST_REQUIRE_EQUAL(bitmap.size(), 2U);
+        BOOST_CHECK_EQUAL(bitmap[0], 0xa1);
+        BOOST_CHECK_EQUAL(bitmap[1], 0x01);
+        BOOST_REQUIRE_EQUAL(outs.size(), 4U);
+        BOOST_CHECK(outs[1].out == txMempool.vout[0]);
+        BOOST_CHECK_EQUAL(outs[1].nHeight, MEMPOOL_HEIGHT);
+
+        // The BIP64 layout of the reply
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << bitmap << outs;
+        std::vector<unsigned char> bitmap2;
+        std::vector<CCoin> outs2;
+        ss >> bitmap2 >> outs2;
+        BOOST_CHECK(bitmap2 == bitmap);
+        BOOST_CHECK_EQUAL(outs2.size(), outs.size());
+        BOOST_CHECK(ss.empty());
+
+        // No outpoints, no bitmap
+        GetUTXOs(std::vector<COutPoint>(), true, bitmap, outs);
+        BOOST_CHECK(bitmap.empty());
+    }
+
+    mempool.removeRecursive(txMempool);
+    LOCK(cs_main);
+    pcoinsTip->ModifyCoins(hashConfirmed)->Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -162,6 +162,31 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+// Goal: check that the precomputed legacy sighash matches the plain serialization for every input
+BOOST_AUTO_TEST_CASE(sighash_legacy_cache)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<1000; i++) {
+        int nHashType = insecure_rand();
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        while (txTo.vin.size() < LEGACY_SIGHASH_CACHE_MIN_INPUTS)
+            txTo.vin.push_back(txTo.vin.back());
+        CTransaction tx(txTo);
+        PrecomputedTransactionData txdata(tx);
+        BOOST_CHECK(txdata.legacyReady);
+
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            uint256 sh = SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE);
+            uint256 shc = SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE, &txdata);
+            BOOST_CHECK(sh == shc);
+        }
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
@@ -0,0 +1,292 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+
+#include "chainparams.h"
+#include "coins.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <leveldb/env.h>
+#include <libdevcore/SHA3.h>
+#include <memenv.h>
+
+BOOST_AUTO_TEST_SUITE(snapshot_tests)
+
+static CSnapshotStateEntry StateEntry(unsigned char nDB, const std::string& strValue, bool fAux = false)
+{
+    CSnapshotStateEntry entry;
+    entry.nDB = nDB;
+    entry.strValue = strValue;
+    dev::h256 hash = dev::sha3(strValue);
+    entry.strKey.assign((const char*)hash.data(), hash.size);
+    if (fAux)
+        entry.strKey.push_back((char)0xff);
+    return entry;
+}
+
+/** Coins and contract state databases in memory, and a snapshot file of them. */
+struct SnapshotSource {
+    boost::scoped_ptr<leveldb::Env> penv;
+    CCoinsViewDB coinsdb;
+    ldb::DB* pstatedb[SNAPSHOT_DB_COUNT];
+    CSnapshotMetadata metadata;
+    boost::filesystem::path path;
+
+    SnapshotSource(const std::string& strName) : penv(leveldb::NewMemEnv(leveldb::Env::Default())), coinsdb(1 << 20, true, true)
+    {
+        for (unsigned char nDB = 0; nDB < SNAPSHOT_DB_COUNT; nDB++) {
+            ldb::Options options;
+            options.create_if_missing = true;
+            options.env = penv.get();
+            pstatedb[nDB] = NULL;
+            BOOST_REQUIRE(ldb::DB::Open(options, strprintf("state%d", (int)nDB), &pstatedb[nDB]).ok());
+        }
+        memcpy(metadata.pchMessageStart, Params().MessageStart(), sizeof(metadata.pchMessageStart));
+        metadata.hashBlock = Params().GenesisBlock().GetHash();
+        path = GetDataDir() / strName;
+    }
+
+    ~SnapshotSource()
+    {
+        for (unsigned char nDB = 0; nDB < SNAPSHOT_DB_COUNT; nDB++)
+            delete pstatedb[nDB];
+        boost::filesystem::remove(path);
+    }
+
+    void AddCoins(int nCount)
+    {
+        CCoinsViewCache cache(&coinsdb);
+        for (int i = 0; i < nCount; i++) {
+            CCoinsModifier coins = cache.ModifyCoins(GetRandHash());
+            coins->nVersion = 1;
+            coins->nHeight = i;
+            coins->vout.resize(2);
+            coins->vout[0].nValue = i + 1;
+            coins->vout[1].nValue = 2 * i + 1;
+        }
+        cache.SetBestBlock(metadata.hashBlock);
+        BOOST_REQUIRE(cache.Flush());
+    }
+
+    void AddState(const CSnapshotStateEntry& entry)
+    {
+        BOOST_REQUIRE(pstatedb[entry.nDB]->Put(ldb::WriteOptions(), entry.strKey, entry.strValue).ok());
+    }
+
+    /** Add a root node to each state database, committed to by the metadata */
+    void AddStateRoots()
+    {
+        CSnapshotStateEntry entryRoot = StateEntry(SNAPSHOT_DB_STATE, "state root node");
+        CSnapshotStateEntry entryRootUTXO = StateEntry(SNAPSHOT_DB_UTXO, "utxo root node");
+        AddState(entryRoot);
+        AddState(entryRootUTXO);
+        AddState(StateEntry(SNAPSHOT_DB_STATE, "state leaf node"));
+        AddState(StateEntry(SNAPSHOT_DB_STATE, "account address preimage", true));
+        metadata.hashStateRoot = h256Touint(dev::sha3(entryRoot.strValue));
+        metadata.hashUTXORoot = h256Touint(dev::sha3(entryRootUTXO.strValue));
+    }
+
+    bool Write(CSnapshotCommitment& commitment, std::string& strError)
+    {
+        boost::scoped_ptr<CCoinsViewCursor> pcursor(coinsdb.Cursor());
+        boost::scoped_ptr<ldb::Iterator> pstate(pstatedb[SNAPSHOT_DB_STATE]->NewIterator(ldb::ReadOptions()));
+        boost::scoped_ptr<ldb::Iterator> pstateUTXO(pstatedb[SNAPSHOT_DB_UTXO]->NewIterator(ldb::ReadOptions()));
+        ldb::Iterator* const pstatecursor[SNAPSHOT_DB_COUNT] = {pstate.get(), pstateUTXO.get()};
+        return WriteSnapshot(path, metadata, pcursor.get(), pstatecursor, commitment, strError);
+    }
+
+    /** Overwrite one byte of the snapshot file, counting from its end for negative positions */
+    void Corrupt(long nPos)
+    {
+        FILE* file = fopen(path.string().c_str(), "rb+");
+        BOOST_REQUIRE(file);
+        BOOST_REQUIRE(fseek(file, nPos, nPos < 0 ? SEEK_END : SEEK_SET) == 0);
+        int ch = fgetc(file);
+        BOOST_REQUIRE(ch != EOF);
+        BOOST_REQUIRE(fseek(file, -1, SEEK_CUR) == 0);
+        fputc(ch ^ 0x01, file);
+        fclose(file);
+    }
+};
+
+static std::map<std::string, std::string> ReadStateDB(ldb::DB* pdb)
+{
+    std::map<std::string, std::string> mapEntries;
+    boost::scoped_ptr<ldb::Iterator> it(pdb->NewIterator(ldb::ReadOptions()));
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+        mapEntries[it->key().ToString()] = it->value().ToString();
+    return mapEntries;
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_state_entry_test)
+{
+    dev::h256 hash;
+    CSnapshotStateEntry entry = StateEntry(SNAPSHOT_DB_STATE, "trie node");
+    BOOST_CHECK(IsAuthenticStateEntry(entry, hash));
+    BOOST_CHECK(hash == dev::sha3(entry.strValue));
+
+    // Key preimages are stored under the hash followed by 0xff
+    CSnapshotStateEntry entryAux = StateEntry(SNAPSHOT_DB_STATE, "preimage", true);
+    BOOST_CHECK(IsAuthenticStateEntry(entryAux, hash));
+    entryAux.strKey[entryAux.strKey.size() - 1] = 0x00;
+    BOOST_CHECK(!IsAuthenticStateEntry(entryAux, hash));
+
+    // Any change to the value or key is caught
+    CSnapshotStateEntry entryBad = entry;
+    entryBad.strValue += "x";
+    BOOST_CHECK(!IsAuthenticStateEntry(entryBad, hash));
+    entryBad = entry;
+    entryBad.strKey[0] ^= 0x01;
+    BOOST_CHECK(!IsAuthenticStateEntry(entryBad, hash));
+    entryBad = entry;
+    entryBad.strKey.resize(entry.strKey.size() - 1);
+    BOOST_CHECK(!IsAuthenticStateEntry(entryBad, hash));
+    entryBad = entry;
+    entryBad.strKey += "\xff\xff";
+    BOOST_CHECK(!IsAuthenticStateEntry(entryBad, hash));
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip_test)
+{
+    SnapshotSource source("snapshot_roundtrip.dat");
+    // More coins than fit in one chunk
+    source.AddCoins(SNAPSHOT_CHUNK_ENTRIES + 10);
+    source.AddStateRoots();
+
+    CSnapshotCommitment commitment;
+    std::string strError;
+    BOOST_REQUIRE(source.Write(commitment, strError));
+    BOOST_CHECK_EQUAL(commitment.nCoins, SNAPSHOT_CHUNK_ENTRIES + 10);
+    BOOST_CHECK_EQUAL(commitment.nStateEntries, 4U);
+
+    // The coins hash is the one gettxoutsetinfo reports for the same database
+    CCoinsStats stats;
+    BOOST_REQUIRE(source.coinsdb.GetStats(stats));
+    BOOST_CHECK(commitment.hashCoins == stats.hashSerialized);
+
+    // Verify only
+    CSnapshotMetadata metadata;
+    CSnapshotCommitment commitmentRead;
+    BOOST_CHECK_MESSAGE(ReadSnapshot(source.path, metadata, commitmentRead, NULL, NULL, strError), strError);
+    BOOST_CHECK(metadata.hashBlock == source.metadata.hashBlock);
+    BOOST_CHECK(metadata.hashStateRoot == source.metadata.hashStateRoot);
+    BOOST_CHECK(metadata.hashUTXORoot == source.metadata.hashUTXORoot);
+    BOOST_CHECK(commitmentRead.hashCoins == commitment.hashCoins);
+    BOOST_CHECK(commitmentRead.hashState == commitment.hashState);
+
+    // Load into empty databases and compare
+    SnapshotSource target("snapshot_roundtrip_target.dat");
+    {
+        CCoinsViewCache cache(&target.coinsdb);
+        BOOST_CHECK_MESSAGE(ReadSnapshot(source.path, metadata, commitmentRead, &cache, target.pstatedb, strError), strError);
+        cache.SetBestBlock(metadata.hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoinsStats statsTarget;
+    BOOST_REQUIRE(target.coinsdb.GetStats(statsTarget));
+    BOOST_CHECK_EQUAL(statsTarget.nTransactions, stats.nTransactions);
+    BOOST_CHECK_EQUAL(statsTarget.nTransactionOutputs, stats.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(statsTarget.nTotalAmount, stats.nTotalAmount);
+    BOOST_CHECK(statsTarget.hashSerialized == stats.hashSerialized);
+    for (unsigned char nDB = 0; nDB < SNAPSHOT_DB_COUNT; nDB++)
+        BOOST_CHECK(ReadStateDB(target.pstatedb[nDB]) == ReadStateDB(source.pstatedb[nDB]));
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_corruption_test)
+{
+    SnapshotSource source("snapshot_corrupt.dat");
+    source.AddCoins(10);
+    source.AddStateRoots();
+
+    CSnapshotMetadata metadata;
+    CSnapshotCommitment commitment;
+    std::string strError;
+    BOOST_REQUIRE(source.Write(commitment, strError));
+    BOOST_REQUIRE(ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+
+    // The first chunk starts with its entry count after the metadata, then the first txid
+    long nFirstCoin = ::GetSerializeSize(source.metadata, SER_DISK, CLIENT_VERSION) + sizeof(uint32_t);
+    source.Corrupt(nFirstCoin + 5);
+    BOOST_CHECK(!ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+    BOOST_CHECK_EQUAL(strError, "Snapshot chunk hash mismatch, the file is corrupt");
+
+    // The last bytes of the file are the state hash of the trailer
+    BOOST_REQUIRE(source.Write(commitment, strError));
+    source.Corrupt(-1);
+    BOOST_CHECK(!ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+    BOOST_CHECK_EQUAL(strError, "Snapshot contents do not match its commitment");
+
+    BOOST_REQUIRE(source.Write(commitment, strError));
+    source.Corrupt(0);
+    BOOST_CHECK(!ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+    BOOST_CHECK_EQUAL(strError, "Snapshot was created for a different network");
+
+    // A truncated file
+    BOOST_REQUIRE(source.Write(commitment, strError));
+    boost::filesystem::resize_file(source.path, boost::filesystem::file_size(source.path) - 10);
+    BOOST_CHECK(!ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_state_checks_test)
+{
+    std::string strError;
+    CSnapshotMetadata metadata;
+    CSnapshotCommitment commitment;
+
+    // A state entry not stored under its hash is refused even with valid chunk hashes and commitment
+    {
+        SnapshotSource source("snapshot_badstate.dat");
+        source.AddStateRoots();
+        CSnapshotStateEntry entryBad = StateEntry(SNAPSHOT_DB_STATE, "tampered node");
+        entryBad.strValue = "replaced node";
+        source.AddState(entryBad);
+        BOOST_REQUIRE(source.Write(commitment, strError));
+        BOOST_CHECK(!ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+        BOOST_CHECK(strError.find("does not match its value") != std::string::npos);
+    }
+
+    // The roots committed to by the base block header must be present
+    {
+        SnapshotSource source("snapshot_noroot.dat");
+        source.AddStateRoots();
+        source.metadata.hashUTXORoot = h256Touint(dev::sha3(std::string("missing root node")));
+        BOOST_REQUIRE(source.Write(commitment, strError));
+        BOOST_CHECK(!ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+        BOOST_CHECK_EQUAL(strError, "Snapshot does not contain the contract state of its base block");
+    }
+
+    // An aux entry carrying the root hash does not count as the root node
+    {
+        SnapshotSource source("snapshot_auxroot.dat");
+        CSnapshotStateEntry entryAux = StateEntry(SNAPSHOT_DB_STATE, "state root node", true);
+        source.AddState(entryAux);
+        source.AddState(StateEntry(SNAPSHOT_DB_UTXO, "utxo root node"));
+        source.metadata.hashStateRoot = h256Touint(dev::sha3(entryAux.strValue));
+        source.metadata.hashUTXORoot = h256Touint(dev::sha3(std::string("utxo root node")));
+        BOOST_REQUIRE(source.Write(commitment, strError));
+        BOOST_CHECK(!ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError));
+        BOOST_CHECK_EQUAL(strError, "Snapshot does not contain the contract state of its base block");
+    }
+
+    // Empty tries need no entries
+    {
+        SnapshotSource source("snapshot_empty.dat");
+        source.metadata.hashStateRoot = h256Touint(dev::EmptyTrie);
+        source.metadata.hashUTXORoot = h256Touint(dev::EmptyTrie);
+        BOOST_REQUIRE(source.Write(commitment, strError));
+        BOOST_CHECK_MESSAGE(ReadSnapshot(source.path, metadata, commitment, NULL, NULL, strError), strError);
+        BOOST_CHECK_EQUAL(commitment.nCoins, 0U);
+        BOOST_CHECK_EQUAL(commitment.nStateEntries, 0U);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
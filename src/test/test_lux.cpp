@@ -4,7 +4,10 @@
 
 #define BOOST_TEST_MODULE Lux Test Suite
 
+#include "crypto/sha256.h"
+#include "key.h"
 #include "main.h"
+#include "pubkey.h"
 #include "random.h"
 #include "txdb.h"
 #include "ui_interface.h"
@@ -25,12 +28,15 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
+    ECCVerifyHandle globalVerifyHandle;
     CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
     TestingSetup() {
         SetupEnvironment();
+        SHA256AutoDetect();
+        ECC_Start();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
@@ -44,7 +50,21 @@ struct TestingSetup {
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
         pcoinsTip = new CCoinsViewCache(pcoinsdbview);
-        InitBlockIndex();
+
+        // Connecting the genesis block needs the contract state, as AppInit2 sets it up
+        dev::eth::Ethash::init();
+        const std::string dirLux((pathTemp / "stateLux").string());
+        globalState = std::unique_ptr<LuxState>(new LuxState(dev::u256(0), LuxState::openDB(dirLux, dev::sha3(dev::rlp("")), dev::WithExisting::Trust), dirLux, dev::eth::BaseState::Empty));
+        dev::eth::ChainParams cp((dev::eth::genesisInfo(dev::eth::Network::luxMainNetwork)));
+        globalSealEngine = std::unique_ptr<dev::eth::SealEngineFace>(cp.createSealEngine());
+        pstorageresult = new StorageResults(dirLux);
+        globalState->setRoot(dev::sha3(dev::rlp("")));
+        globalState->setRootUTXO(uintToh256(Params().GenesisBlock().hashUTXORoot));
+        globalState->populateFrom(cp.genesisState);
+        globalState->db().commit();
+        globalState->dbUtxo().commit();
+
+        InitBlockIndex(Params());
 #ifdef ENABLE_WALLET
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -68,10 +88,15 @@ struct TestingSetup {
         delete pcoinsTip;
         delete pcoinsdbview;
         delete pblocktree;
+        delete pstorageresult;
+        pstorageresult = NULL;
+        globalState.reset();
+        globalSealEngine.reset();
 #ifdef ENABLE_WALLET
         bitdb.Flush(true);
 #endif
         boost::filesystem::remove_all(pathTemp);
+        ECC_Stop();
     }
 };
 
@@ -8,6 +8,7 @@
 #include <map>
 #include "univalue/univalue.h"
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -71,13 +72,13 @@ BOOST_AUTO_TEST_CASE(univalue_set)
 
     BOOST_CHECK(v.setObject());
     BOOST_CHECK(v.isObject());
-    BOOST_CHECK_EQUAL(v.count(), 0);
+    BOOST_CHECK_EQUAL(v.size(), 0);
     BOOST_CHECK_EQUAL(v.getType(), UniValue::VOBJ);
     BOOST_CHECK(v.empty());
 
     BOOST_CHECK(v.setArray());
     BOOST_CHECK(v.isArray());
-    BOOST_CHECK_EQUAL(v.count(), 0);
+    BOOST_CHECK_EQUAL(v.size(), 0);
 
     BOOST_CHECK(v.setStr("zum"));
     BOOST_CHECK(v.isStr());
@@ -144,7 +145,7 @@ BOOST_AUTO_TEST_CASE(univalue_array)
     BOOST_CHECK(arr.push_backV(vec));
 
     BOOST_CHECK_EQUAL(arr.empty(), false);
-    BOOST_CHECK_EQUAL(arr.count(), 5);
+    BOOST_CHECK_EQUAL(arr.size(), 5);
 
     BOOST_CHECK_EQUAL(arr[0].getValStr(), "1023");
     BOOST_CHECK_EQUAL(arr[1].getValStr(), "zippy");
@@ -156,7 +157,7 @@ BOOST_AUTO_TEST_CASE(univalue_array)
 
     arr.clear();
     BOOST_CHECK(arr.empty());
-    BOOST_CHECK_EQUAL(arr.count(), 0);
+    BOOST_CHECK_EQUAL(arr.size(), 0);
 }
 
 BOOST_AUTO_TEST_CASE(univalue_object)
@@ -196,7 +197,7 @@ BOOST_AUTO_TEST_CASE(univalue_object)
     BOOST_CHECK(obj.pushKVs(obj2));
 
     BOOST_CHECK_EQUAL(obj.empty(), false);
-    BOOST_CHECK_EQUAL(obj.count(), 9);
+    BOOST_CHECK_EQUAL(obj.size(), 9);
 
     BOOST_CHECK_EQUAL(obj["age"].getValStr(), "100");
     BOOST_CHECK_EQUAL(obj["first"].getValStr(), "John");
@@ -239,7 +240,7 @@ BOOST_AUTO_TEST_CASE(univalue_object)
 
     obj.clear();
     BOOST_CHECK(obj.empty());
-    BOOST_CHECK_EQUAL(obj.count(), 0);
+    BOOST_CHECK_EQUAL(obj.size(), 0);
 }
 
 static const char *json1 =
@@ -254,13 +255,13 @@ BOOST_AUTO_TEST_CASE(univalue_readwrite)
     BOOST_CHECK(v.read(strJson1));
 
     BOOST_CHECK(v.isArray());
-    BOOST_CHECK_EQUAL(v.count(), 2);
+    BOOST_CHECK_EQUAL(v.size(), 2);
 
     BOOST_CHECK_EQUAL(v[0].getValStr(), "1.1");
 
     UniValue obj = v[1];
     BOOST_CHECK(obj.isObject());
-    BOOST_CHECK_EQUAL(obj.count(), 3);
+    BOOST_CHECK_EQUAL(obj.size(), 3);
 
     BOOST_CHECK(obj["key1"].isStr());
     BOOST_CHECK_EQUAL(obj["key1"].getValStr(), "str");
@@ -271,5 +272,78 @@ BOOST_AUTO_TEST_CASE(univalue_readwrite)
     BOOST_CHECK_EQUAL(strJson1, v.write());
 }
 
+static void AppendChunk(string* out, size_t* nChunks, const string& chunk)
+{
+    *out += chunk;
+    (*nChunks)++;
+}
+
+BOOST_AUTO_TEST_CASE(univalue_streamwriter)
+{
+    UniValue v;
+    BOOST_CHECK(v.read(json1));
+
+    // Writing a tree as a single value matches UniValue::write
+    string strOut;
+    size_t nChunks = 0;
+    UniValueStreamWriter writer(boost::bind(AppendChunk, &strOut, &nChunks, _1));
+    writer.value(v);
+    writer.flush();
+    BOOST_CHECK_EQUAL(strOut, v.write());
+    BOOST_CHECK_EQUAL(nChunks, 1U);
+    BOOST_CHECK_EQUAL(writer.flushed(), strOut.size());
+
+    // Building the same document piece by piece, flushing after every token
+    string strStream;
+    nChunks = 0;
+    UniValueStreamWriter writer2(boost::bind(AppendChunk, &strStream, &nChunks, _1), 1);
+    UniValue key3(UniValue::VOBJ);
+    key3.push_back(Pair("name", "martian"));
+    UniValue head(UniValue::VOBJ);
+    head.push_back(Pair("key1", "str"));
+    head.push_back(Pair("key2", 800));
+    writer2.beginArray();
+    writer2.value(UniValue(UniValue::VNUM, "1.1"));
+    writer2.beginObject();
+    writer2.members(head);
+    writer2.key("key3");
+    writer2.value(key3);
+    writer2.endObject();
+    writer2.endArray();
+    BOOST_CHECK(writer2.release().empty());
+    BOOST_CHECK_EQUAL(strStream, v.write());
+    BOOST_CHECK(nChunks > 1);
+
+    // Keys and strings are escaped; empty containers and nesting
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("a\"b", "c\n"));
+    obj.push_back(Pair("empty", UniValue(UniValue::VARR)));
+    UniValue nested(UniValue::VARR);
+    nested.push_back(UniValue(UniValue::VOBJ));
+    nested.push_back(NullUniValue);
+    nested.push_back(true);
+    obj.push_back(Pair("nested", nested));
+
+    string strUnused;
+    UniValueStreamWriter writer3(boost::bind(AppendChunk, &strUnused, &nChunks, _1));
+    writer3.beginObject();
+    writer3.key("a\"b");
+    writer3.value("c\n");
+    writer3.key("empty");
+    writer3.beginArray();
+    writer3.endArray();
+    writer3.key("nested");
+    writer3.beginArray();
+    writer3.beginObject();
+    writer3.endObject();
+    writer3.value(NullUniValue);
+    writer3.value(true);
+    writer3.endArray();
+    writer3.endObject();
+    // Below the flush size nothing reaches the sink until asked
+    BOOST_CHECK(strUnused.empty());
+    BOOST_CHECK_EQUAL(writer3.release(), obj.write());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -53,18 +53,23 @@ uint256 CCoinsViewDB::GetBestBlock() const
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    bool fOk = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return fOk;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock)
 {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             BatchWriteCoins(batch, it->first, it->second.coins);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
@@ -73,6 +78,143 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     return db.WriteBatch(batch);
 }
 
+CCoinsViewDBWriter::CCoinsViewDBWriter(CCoinsViewDB* pdbIn) : pdb(pdbIn), hashFrozen(0), fPending(false), fFailed(false), fStop(false)
+{
+    threadWriter = boost::thread(boost::bind(&TraceThread<boost::function<void()> >, "coinsflush",
+        boost::function<void()>(boost::bind(&CCoinsViewDBWriter::ThreadWrite, this))));
+}
+
+CCoinsViewDBWriter::~CCoinsViewDBWriter()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condPending.notify_all();
+    }
+    // The writer drains a pending generation before it exits.
+    threadWriter.join();
+}
+
+void CCoinsViewDBWriter::ThreadWrite()
+{
+    while (true) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fPending && !fStop)
+            condPending.wait(lock);
+        if (!fPending)
+            return;
+        lock.unlock();
+
+        // Readers only look entries up while we iterate; nothing modifies
+        // mapFrozen until fPending is cleared below.
+        int64_t nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = pdb->WriteCoins(mapFrozen, hashFrozen);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        LogPrint("coindb", "Background coins flush of %u entries took %.2fms\n", (unsigned int)mapFrozen.size(), 0.001 * (GetTimeMicros() - nStart));
+
+        // Destroy the written entries outside the lock, it can take a while.
+        CCoinsMap mapWritten;
+        lock.lock();
+        if (fOk) {
+            mapWritten.swap(mapFrozen);
+            fPending = false;
+        } else {
+            fFailed = true;
+        }
+        condWritten.notify_all();
+        lock.unlock();
+
+        if (!fOk) {
+            AbortNode("Failed to write to coin database");
+            return;
+        }
+    }
+}
+
+bool CCoinsViewDBWriter::GetCoins(const uint256& txid, CCoins& coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapFrozen.find(txid);
+            if (it != mapFrozen.end()) {
+                coins = it->second.coins;
+                return true;
+            }
+        }
+    }
+    return pdb->GetCoins(txid, coins);
+}
+
+bool CCoinsViewDBWriter::HaveCoins(const uint256& txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapFrozen.find(txid);
+            if (it != mapFrozen.end())
+                return !it->second.coins.IsPruned();
+        }
+    }
+    return pdb->HaveCoins(txid);
+}
+
+uint256 CCoinsViewDBWriter::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending && hashFrozen != uint256(0))
+            return hashFrozen;
+    }
+    return pdb->GetBestBlock();
+}
+
+bool CCoinsViewDBWriter::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fPending && !fFailed)
+        condWritten.wait(lock);
+    if (fFailed)
+        return false;
+    mapFrozen.swap(mapCoins);
+    hashFrozen = hashBlock;
+    fPending = true;
+    condPending.notify_one();
+    return true;
+}
+
+bool CCoinsViewDBWriter::Sync() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fPending && !fFailed)
+        condWritten.wait(lock);
+    return !fFailed;
+}
+
+bool CCoinsViewDBWriter::IsWriting() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return fPending;
+}
+
+bool CCoinsViewDBWriter::GetStats(CCoinsStats& stats) const
+{
+    if (!Sync())
+        return false;
+    return pdb->GetStats(stats);
+}
+
+CCoinsViewCursor* CCoinsViewDBWriter::Cursor() const
+{
+    if (!Sync())
+        return 0;
+    return pdb->Cursor();
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
 {
 }
@@ -137,6 +279,74 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+void HashCoinsForStats(CHashWriter& ss, const uint256& txhash, const CCoins& coins)
+{
+    ss << txhash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut& out = coins.vout[i];
+        if (!out.IsNull()) {
+            ss << VARINT(i + 1);
+            ss << out;
+        }
+    }
+    ss << VARINT(0);
+}
+
+CCoinsViewCursor* CCoinsViewDB::Cursor() const
+{
+    /* It seems that there are no "const iterators" for LevelDB.  Since we
+       only need read operations on it, use a const-cast to get around
+       that restriction.  */
+    CCoinsViewDBCursor* pcursor = new CCoinsViewDBCursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator(), GetBestBlock());
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << 'c';
+    pcursor->pcursor->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+    return pcursor;
+}
+
+bool CCoinsViewDBCursor::Valid() const
+{
+    return pcursor->Valid() && pcursor->key().size() > 0 && pcursor->key().data()[0] == 'c';
+}
+
+void CCoinsViewDBCursor::Next()
+{
+    pcursor->Next();
+}
+
+bool CCoinsViewDBCursor::GetKey(uint256& key) const
+{
+    try {
+        leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        ssKey >> chType >> key;
+    } catch (const std::exception& e) {
+        return false;
+    }
+    return true;
+}
+
+bool CCoinsViewDBCursor::GetValue(CCoins& coins) const
+{
+    try {
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> coins;
+    } catch (const std::exception& e) {
+        return false;
+    }
+    return true;
+}
+
+unsigned int CCoinsViewDBCursor::GetValueSize() const
+{
+    return pcursor->value().size();
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
@@ -163,22 +373,16 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
+                HashCoinsForStats(ss, txhash, coins);
                 stats.nTransactions++;
                 for (unsigned int i = 0; i < coins.vout.size(); i++) {
                     const CTxOut& out = coins.vout[i];
                     if (!out.IsNull()) {
                         stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
                         nTotalAmount += out.nValue;
                     }
                 }
                 stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
             pcursor->Next();
         } catch (std::exception& e) {
@@ -14,7 +14,13 @@
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 class CCoins;
+class CHashWriter;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -24,6 +30,9 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
+/** Feed one coins entry into the hash reported as hash_serialized by gettxoutsetinfo */
+void HashCoinsForStats(CHashWriter& ss, const uint256& txhash, const CCoins& coins);
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -33,11 +42,85 @@ protected:
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
+    bool GetCoins(const uint256& txid, CCoins& coins) const;
+    bool HaveCoins(const uint256& txid) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! Write the dirty entries of mapCoins in one atomic batch, leaving the map untouched.
+    bool WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool GetStats(CCoinsStats& stats) const;
+    CCoinsViewCursor* Cursor() const;
+};
+
+/**
+ * Sits between the tip cache and the coin database. A flushed cache is taken
+ * over as a whole (its map is swapped in, not copied) and written to the
+ * database from a background thread, so the flushing thread does not wait
+ * for LevelDB. Until the write completes, lookups are answered from the
+ * frozen map. A second flush waits for the first to finish, which bounds
+ * memory to two cache generations.
+ *
+ * Each generation goes to the database in a single atomic batch together
+ * with its best block, so after a crash the database is always at the
+ * last completely written generation.
+ */
+class CCoinsViewDBWriter : public CCoinsView
+{
+private:
+    CCoinsViewDB* pdb;
+
+    mutable boost::mutex mutex;
+    //! Signalled when a generation is handed over, or on shutdown
+    boost::condition_variable condPending;
+    //! Signalled when a generation has been written (or failed to)
+    mutable boost::condition_variable condWritten;
+
+    //! The generation being written; not modified while fPending is set
+    CCoinsMap mapFrozen;
+    uint256 hashFrozen;
+    bool fPending;
+    bool fFailed;
+    bool fStop;
+
+    boost::thread threadWriter;
+
+    void ThreadWrite();
+
+public:
+    CCoinsViewDBWriter(CCoinsViewDB* pdbIn);
+    ~CCoinsViewDBWriter();
+
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    CCoinsViewCursor* Cursor() const;
+
+    //! Wait until everything handed over has reached the database; false if a write failed.
+    bool Sync() const;
+    //! Whether a generation is still being written
+    bool IsWriting() const;
+};
+
+/** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB; sees the database as of its creation */
+class CCoinsViewDBCursor : public CCoinsViewCursor
+{
+public:
+    ~CCoinsViewDBCursor() {}
+
+    bool GetKey(uint256& key) const;
+    bool GetValue(CCoins& coins) const;
+    unsigned int GetValueSize() const;
+
+    bool Valid() const;
+    void Next();
+
+private:
+    CCoinsViewDBCursor(leveldb::Iterator* pcursorIn, const uint256& hashBlockIn) : CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+    boost::scoped_ptr<leveldb::Iterator> pcursor;
+
+    friend class CCoinsViewDB;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -11,6 +11,7 @@
 #include <vector>
 #include <map>
 #include <cassert>
+#include <functional>
 
 #include <sstream>        // .get_int64()
 #include <utility>        // std::pair
@@ -135,9 +136,12 @@ private:
     std::vector<UniValue> values;
 
     int findKey(const std::string& key) const;
+    void writeTo(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
     void writeArray(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
     void writeObject(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
 
+    friend class UniValueStreamWriter;
+
 public:
     // Strict type-specific getters, these throw std::runtime_error if the
     // value is of unexpected type
@@ -158,6 +162,52 @@ public:
     friend const UniValue& find_value( const UniValue& obj, const std::string& name);
 };
 
+/**
+ * Push-style JSON emitter producing the same compact output as
+ * UniValue::write(). Output is buffered and handed to the sink each time
+ * the buffer grows past flushSize, so documents of any size can be written
+ * without building a UniValue tree or a string of the whole document.
+ *
+ * Containers are opened and closed explicitly; inside an object every
+ * value is preceded by key(). value() accepts any UniValue, so small
+ * subtrees can still be assembled the usual way and written in one go.
+ */
+class UniValueStreamWriter {
+public:
+    typedef std::function<void(const std::string&)> Sink;
+
+    static const size_t DEFAULT_FLUSH_SIZE = 65536;
+
+    UniValueStreamWriter(const Sink& sinkIn, size_t flushSizeIn = DEFAULT_FLUSH_SIZE);
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+    void key(const std::string& k);
+    void value(const UniValue& v);
+    /** Write the members of obj into the currently open object */
+    void members(const UniValue& obj);
+
+    /** Hand buffered output to the sink */
+    void flush();
+    /** Return buffered output that has not been handed to the sink, and clear it */
+    std::string release();
+    /** Bytes handed to the sink so far */
+    size_t flushed() const { return nFlushed; }
+
+private:
+    Sink sink;
+    size_t flushSize;
+    std::string buf;
+    size_t nFlushed;
+    std::vector<bool> vFirst;              // per open container: no element written yet
+    bool fAfterKey;
+
+    void separator();
+    void maybeFlush();
+};
+
 //
 // The following were added for compatibility with json_spirit.
 // Most duplicate other methods, and should be removed.
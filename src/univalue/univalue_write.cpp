@@ -33,7 +33,14 @@ string UniValue::write(unsigned int prettyIndent,
 {
     string s;
     s.reserve(1024);
+    writeTo(prettyIndent, indentLevel, s);
+    return s;
+}
 
+void UniValue::writeTo(unsigned int prettyIndent,
+                       unsigned int indentLevel,
+                       string& s) const
+{
     unsigned int modIndent = indentLevel;
     if (modIndent == 0)
         modIndent = 1;
@@ -65,8 +72,6 @@ string UniValue::write(unsigned int prettyIndent,
         s += (val == "1" ? "true" : "false");
         break;
     }
-
-    return s;
 }
 
 static void indentStr(unsigned int prettyIndent, unsigned int indentLevel, string& s)
@@ -83,7 +88,7 @@ void UniValue::writeArray(unsigned int prettyIndent, unsigned int indentLevel, s
     for (unsigned int i = 0; i < values.size(); i++) {
         if (prettyIndent)
             indentStr(prettyIndent, indentLevel, s);
-        s += values[i].write(prettyIndent, indentLevel + 1);
+        values[i].writeTo(prettyIndent, indentLevel + 1, s);
         if (i != (values.size() - 1)) {
             s += ",";
             if (prettyIndent)
@@ -110,7 +115,7 @@ void UniValue::writeObject(unsigned int prettyIndent, unsigned int indentLevel,
         s += "\"" + json_escape(keys[i]) + "\":";
         if (prettyIndent)
             s += " ";
-        s += values.at(i).write(prettyIndent, indentLevel + 1);
+        values.at(i).writeTo(prettyIndent, indentLevel + 1, s);
         if (i != (values.size() - 1))
             s += ",";
         if (prettyIndent)
@@ -122,3 +127,97 @@ void UniValue::writeObject(unsigned int prettyIndent, unsigned int indentLevel,
     s += "}";
 }
 
+UniValueStreamWriter::UniValueStreamWriter(const Sink& sinkIn, size_t flushSizeIn)
+    : sink(sinkIn), flushSize(flushSizeIn), nFlushed(0), fAfterKey(false)
+{
+    buf.reserve(flushSize + 1024);
+}
+
+void UniValueStreamWriter::separator()
+{
+    if (fAfterKey) {
+        fAfterKey = false;
+        return;
+    }
+    if (!vFirst.empty()) {
+        if (!vFirst.back())
+            buf += ",";
+        vFirst.back() = false;
+    }
+}
+
+void UniValueStreamWriter::maybeFlush()
+{
+    if (buf.size() >= flushSize)
+        flush();
+}
+
+void UniValueStreamWriter::beginObject()
+{
+    separator();
+    buf += "{";
+    vFirst.push_back(true);
+}
+
+void UniValueStreamWriter::endObject()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    buf += "}";
+    maybeFlush();
+}
+
+void UniValueStreamWriter::beginArray()
+{
+    separator();
+    buf += "[";
+    vFirst.push_back(true);
+}
+
+void UniValueStreamWriter::endArray()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    buf += "]";
+    maybeFlush();
+}
+
+void UniValueStreamWriter::key(const string& k)
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    separator();
+    buf += "\"" + json_escape(k) + "\":";
+    fAfterKey = true;
+}
+
+void UniValueStreamWriter::value(const UniValue& v)
+{
+    separator();
+    v.writeTo(0, 0, buf);
+    maybeFlush();
+}
+
+void UniValueStreamWriter::members(const UniValue& obj)
+{
+    assert(obj.isObject());
+    for (unsigned int i = 0; i < obj.keys.size(); i++) {
+        key(obj.keys[i]);
+        value(obj.values[i]);
+    }
+}
+
+void UniValueStreamWriter::flush()
+{
+    if (buf.empty())
+        return;
+    sink(buf);
+    nFlushed += buf.size();
+    buf.clear();
+}
+
+string UniValueStreamWriter::release()
+{
+    string ret;
+    ret.swap(buf);
+    return ret;
+}
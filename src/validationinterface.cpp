@@ -5,6 +5,10 @@
 
 #include "validationinterface.h"
 
+#include "primitives/transaction.h"
+
+#include <boost/foreach.hpp>
+
 static CMainSignals g_signals;
 
 CMainSignals &GetMainSignals() {
@@ -14,6 +18,7 @@ CMainSignals &GetMainSignals() {
 void RegisterValidationInterface(CValidationInterface *pwalletIn) {
     g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
     g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
+    g_signals.SyncTransactions.connect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2));
     g_signals.NotifyTransactionLock.connect(boost::bind(&CValidationInterface::NotifyTransactionLock, pwalletIn, _1));
     g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
@@ -34,6 +39,7 @@ void UnregisterValidationInterface(CValidationInterface *pwalletIn) {
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.NotifyTransactionLock.disconnect(
             boost::bind(&CValidationInterface::NotifyTransactionLock, pwalletIn, _1));
+    g_signals.SyncTransactions.disconnect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2));
     g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
     g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
 }
@@ -47,6 +53,7 @@ void UnregisterAllValidationInterfaces() {
     g_signals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
     g_signals.NotifyTransactionLock.disconnect_all_slots();
+    g_signals.SyncTransactions.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
     g_signals.UpdatedBlockTip.disconnect_all_slots();
 }
@@ -54,3 +61,12 @@ void UnregisterAllValidationInterfaces() {
 void SyncWithWallets(const CTransaction &tx, const CBlock *pblock = NULL) {
     g_signals.SyncTransaction(tx, pblock);
 }
+
+void SyncWithWallets(const std::vector<CTransaction> &vtx, const CBlock *pblock) {
+    g_signals.SyncTransactions(vtx, pblock);
+}
+
+void CValidationInterface::SyncTransactions(const std::vector<CTransaction> &vtx, const CBlock *pblock) {
+    BOOST_FOREACH (const CTransaction &tx, vtx)
+        SyncTransaction(tx, pblock);
+}
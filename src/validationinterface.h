@@ -6,6 +6,8 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include <vector>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -39,12 +41,18 @@ void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction &tx, const CBlock *pblock);
 
+/** Push the transactions of a connected or disconnected block to all registered wallets in one go */
+void SyncWithWallets(const std::vector<CTransaction> &vtx, const CBlock *pblock);
+
 class CValidationInterface {
 protected:
     virtual void UpdatedBlockTip(const CBlockIndex *pindex) {}
 
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
 
+    /** Defaults to SyncTransaction() for each transaction; listeners that can group the work override it */
+    virtual void SyncTransactions(const std::vector<CTransaction> &vtx, const CBlock *pblock);
+
     virtual void NotifyTransactionLock(const CTransaction &tx) {}
 
     virtual void SetBestChain(const CBlockLocator &locator) {}
@@ -74,6 +82,8 @@ struct CMainSignals {
     boost::signals2::signal<void(const CBlockIndex *)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void(const CTransaction &, const CBlock *)> SyncTransaction;
+    /** Notifies listeners of all the transactions of a block that was connected or disconnected. */
+    boost::signals2::signal<void(const std::vector<CTransaction> &, const CBlock *)> SyncTransactions;
     /** Notifies listeners of an updated transaction lock without new data. */
     boost::signals2::signal<void(const CTransaction &)> NotifyTransactionLock;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
@@ -62,6 +62,7 @@ bool fNotUseChangeAddress = DEFAULT_NOT_USE_CHANGE_ADDRESS;
 CFeeRate CWallet::minTxFee = CFeeRate(10000);
 
 const uint256 CMerkleTx::ABANDON_HASH(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
+const int CWallet::TX_HEIGHT_UNCONFIRMED;
 
 /** @defgroup mapWallet
  *
@@ -444,6 +445,96 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+void CWallet::AddToUnspentIndex(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet); // setUnspentTx
+    setUnspentTx.insert(wtx.GetHash());
+
+    // The outputs this transaction spends become unspent again if it
+    // leaves the chain, so they have to be looked at once more.
+    if (wtx.IsCoinBase())
+        return;
+    BOOST_FOREACH (const CTxIn& txin, wtx.vin) {
+        if (mapWallet.count(txin.prevout.hash))
+            setUnspentTx.insert(txin.prevout.hash);
+    }
+}
+
+/**
+ * Like IsSpent(), but only counting spends that are in the chain, which
+ * cannot be undone without the wallet hearing about it.
+ */
+bool CWallet::IsSpentByConfirmed(const uint256& hash, unsigned int n) const
+{
+    const COutPoint outpoint(hash, n);
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain(false) > 0)
+            return true;
+    }
+    return false;
+}
+
+void CWallet::GetUnspentWalletTxs(std::vector<const CWalletTx*>& vwtx) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    vwtx.clear();
+    vwtx.reserve(setUnspentTx.size());
+    std::set<uint256>::iterator it = setUnspentTx.begin();
+    while (it != setUnspentTx.end()) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(*it);
+        if (mit == mapWallet.end()) {
+            setUnspentTx.erase(it++);
+            continue;
+        }
+
+        const CWalletTx& wtx = mit->second;
+        bool fUnspent = false;
+        for (unsigned int i = 0; i < wtx.vout.size() && !fUnspent; i++)
+            fUnspent = IsMine(wtx.vout[i]) != ISMINE_NO && !IsSpentByConfirmed(wtx.GetHash(), i);
+
+        if (!fUnspent) {
+            setUnspentTx.erase(it++);
+            continue;
+        }
+        vwtx.push_back(&wtx);
+        ++it;
+    }
+}
+
+void CWallet::IndexByHeight(CWalletTx& wtx, int nHeightPrev, int nHeight)
+{
+    if (nHeightPrev == nHeight && wtx.nHeightIndexed == nHeight)
+        return;
+
+    if (nHeightPrev != -1) {
+        std::pair<TxHeightItems::iterator, TxHeightItems::iterator> range = wtxByHeight.equal_range(nHeightPrev);
+        for (TxHeightItems::iterator it = range.first; it != range.second; ++it) {
+            if (it->second == &wtx) {
+                wtxByHeight.erase(it);
+                break;
+            }
+        }
+    }
+    if (nHeight != -1)
+        wtxByHeight.insert(std::make_pair(nHeight, &wtx));
+    wtx.nHeightIndexed = nHeight;
+}
+
+void CWallet::GetWalletTxsAbove(int nHeight, std::vector<const CWalletTx*>& vwtx) const
+{
+    AssertLockHeld(cs_wallet);
+
+    vwtx.clear();
+    for (TxHeightItems::const_iterator it = wtxByHeight.upper_bound(nHeight); it != wtxByHeight.end(); ++it)
+        vwtx.push_back(it->second);
+}
+
 bool CWallet::GetVinAndKeysFromOutput(COutput out, CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet)
 {
     // wait for reindex and/or import to finish
@@ -552,8 +643,8 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
         NewKeyPool();
         Lock();
 
-        // Need to completely rewrite the wallet file; if we don't, bdb might keep
-        // bits of the unencrypted private key in slack space in the database file.
+        // Need to completely rewrite the wallet file; if we don't, the log keeps
+        // the records of the unencrypted private keys until it is compacted.
         CDB::Rewrite(strWalletFile);
 
      }
@@ -618,14 +709,18 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
+        // Whatever made the wallet dirty may have changed which outputs are ours
+        setUnspentTx.clear();
+        BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet) {
             item.second.MarkDirty();
+            setUnspentTx.insert(setUnspentTx.end(), item.first);
+        }
+        MarkBalancesDirty();
     }
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, bool fFlushOnClose)
 {
-    CWalletDB walletdb(strWalletFile, "r+", fFlushOnClose);
     uint256 hash = wtxIn.GetHash();
 
     if (fFromLoadWallet) {
@@ -634,6 +729,16 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, bool fFl
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        AddToUnspentIndex(wtx);
+        // A transaction stored with a block that is no longer in the active
+        // chain was never told about the disconnection, so index it as unconfirmed.
+        int nHeight = TX_HEIGHT_UNCONFIRMED;
+        if (!wtx.hashUnset()) {
+            BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+            if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+                nHeight = mi->second->nHeight;
+        }
+        IndexByHeight(wtx, -1, nHeight);
         BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
             if (mapWallet.count(txin.prevout.hash)) {
                 CWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -644,14 +749,28 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, bool fFl
         }
     } else {
         LOCK(cs_wallet);
+        // While a block is being synced, write through its database
+        // transaction, which is only opened once something is written.
+        // Loaded transactions skip this entirely: every handle opened and
+        // closed here costs a log checkpoint.
+        std::unique_ptr<CWalletDB> pwalletdbOwned;
+        CWalletDB* pwalletdb = NULL;
+        if (!fBatchSync) {
+            pwalletdbOwned.reset(new CWalletDB(strWalletFile, "r+", fFlushOnClose));
+            pwalletdb = pwalletdbOwned.get();
+        }
+
         // Inserts only if not already there, returns tx inserted or tx found
         pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
+        int nHeightPrev = wtx.nHeightIndexed;
         if (fInsertedNew) {
             wtx.nTimeReceived = GetAdjustedTime();
-            wtx.nOrderPos = IncOrderPosNext();
+            if (!pwalletdb)
+                pwalletdb = GetBatchDB();
+            wtx.nOrderPos = IncOrderPosNext(pwalletdb);
             wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
@@ -737,12 +856,28 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, bool fFl
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
         // Write to disk
-        if (fInsertedNew || fUpdated)
-            if (!wtx.WriteToDisk())
+        if (fInsertedNew || fUpdated) {
+            if (!pwalletdb)
+                pwalletdb = GetBatchDB();
+            if (pwalletdb == pwalletdbBatch)
+                vBatchTx.push_back(hash);
+            if (!wtx.WriteToDisk(pwalletdb))
                 return false;
+        }
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        AddToUnspentIndex(wtx);
+
+        // Without a block the transaction is new, back in the mempool or was
+        // disconnected with its block; either way it has no confirmations.
+        int nHeight = TX_HEIGHT_UNCONFIRMED;
+        if (!wtxIn.hashUnset()) {
+            BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+            if (mi != mapBlockIndex.end())
+                nHeight = mi->second->nHeight;
+        }
+        IndexByHeight(wtx, nHeightPrev, nHeight);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -915,14 +1050,82 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     }
 }
 
+void CWallet::SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock)
+{
+    LOCK2(cs_main, cs_wallet);
+    if (!fFileBacked || fBatchSync) {
+        BOOST_FOREACH (const CTransaction& tx, vtx)
+            SyncTransaction(tx, pblock);
+        return;
+    }
+
+    // Commit the wallet transactions of the whole block as one database
+    // transaction with a single flush, instead of a flushed write each.
+    fBatchSync = true;
+    try {
+        BOOST_FOREACH (const CTransaction& tx, vtx)
+            SyncTransaction(tx, pblock);
+    } catch (...) {
+        // Closing the handle aborts the transaction
+        fBatchSync = false;
+        delete pwalletdbBatch;
+        pwalletdbBatch = NULL;
+        vBatchTx.clear();
+        throw;
+    }
+    fBatchSync = false;
+    if (!pwalletdbBatch)
+        return; // Nothing of ours in this block
+
+    std::vector<uint256> vWritten;
+    vWritten.swap(vBatchTx);
+    bool fCommitted = CommitBatch(*pwalletdbBatch);
+    delete pwalletdbBatch;
+    pwalletdbBatch = NULL;
+    if (fCommitted)
+        return;
+
+    // The transactions are in mapWallet already but none of their records
+    // reached the database, so write them again without a transaction.
+    LogPrintf("%s : failed to commit wallet transactions of block %s, writing them one by one\n", __func__, pblock ? pblock->GetHash().ToString() : "(disconnected)");
+    CWalletDB walletdb(strWalletFile, "r+");
+    if (!walletdb.WriteOrderPosNext(nOrderPosNext))
+        LogPrintf("%s : failed to write the wallet order position\n", __func__);
+    BOOST_FOREACH (const uint256& hash, vWritten) {
+        std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end() && !walletdb.WriteTx(hash, it->second))
+            LogPrintf("%s : failed to write wallet transaction %s\n", __func__, hash.ToString());
+    }
+}
+
+CWalletDB* CWallet::GetBatchDB()
+{
+    AssertLockHeld(cs_wallet);
+    if (!pwalletdbBatch) {
+        pwalletdbBatch = new CWalletDB(strWalletFile, "r+");
+        if (!pwalletdbBatch->TxnBegin())
+            LogPrintf("%s : cannot begin a database transaction, wallet writes of this block are not grouped\n", __func__);
+    }
+    return pwalletdbBatch;
+}
+
+bool CWallet::CommitBatch(CWalletDB& walletdb)
+{
+    return walletdb.TxnCommit();
+}
+
 void CWallet::EraseFromWallet(const uint256& hash)
 {
     if (!fFileBacked)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        std::map<uint256, CWalletTx>::iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            IndexByHeight(it->second, it->second.nHeightIndexed, -1);
+            mapWallet.erase(it);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1142,10 +1345,17 @@ int CWalletTx::GetRequestCount() const
 
 void CWalletTx::GetAmounts(list<COutputEntry>& listReceived, list<COutputEntry>& listSent, CAmount& nFee, string& strSentAccount, const isminefilter& filter) const
 {
+    strSentAccount = strFromAccount;
+    if (fAmountsCached && nAmountsFilterCached == filter && nAmountsBookUpdatesCached == pwallet->nAddressBookUpdates) {
+        listReceived = listReceivedCached;
+        listSent = listSentCached;
+        nFee = nFeeCached;
+        return;
+    }
+
     nFee = 0;
     listReceived.clear();
     listSent.clear();
-    strSentAccount = strFromAccount;
 
     // Compute fee:
     CAmount nDebit = GetDebit(filter);
@@ -1187,6 +1397,13 @@ void CWalletTx::GetAmounts(list<COutputEntry>& listReceived, list<COutputEntry>&
         if (fIsMine & filter)
             listReceived.push_back(output);
     }
+
+    listReceivedCached = listReceived;
+    listSentCached = listSent;
+    nFeeCached = nFee;
+    nAmountsFilterCached = filter;
+    nAmountsBookUpdatesCached = pwallet->nAddressBookUpdates;
+    fAmountsCached = true;
 }
 
 void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived, CAmount& nSent, CAmount& nFee, const isminefilter& filter) const
@@ -1224,6 +1441,11 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+bool CWalletTx::WriteToDisk(CWalletDB* pwalletdb)
+{
+    return pwalletdb->WriteTx(GetHash(), *this);
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
@@ -1314,7 +1536,10 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("%s: wtx %s (command=%s)\n", __func__, hash.ToString(), strCommand);
 
             if (strCommand == "ix") {
-                mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
+                {
+                    LOCK(cs_instantx);
+                    mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
+                }
                 CreateNewLock(((CTransaction) * this));
                 RelayTransactionLockReq((CTransaction) * this, true);
             } else {
@@ -1380,19 +1605,49 @@ void CWallet::ResendWalletTransactions()
  */
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::CacheBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // Depths, and with them trust and maturity, move with the tip; an
+    // unconfirmed transaction that leaves the mempool is no longer counted.
+    unsigned int nMempoolUpdates = mempool.GetTransactionsUpdated();
+    if (fBalancesCached && pindexBalancesCached == chainActive.Tip() && nMempoolUpdatesBalancesCached == nMempoolUpdates)
+        return;
+
+    nBalanceCached = 0;
+    nUnconfirmedBalanceCached = 0;
+    nImmatureBalanceCached = 0;
+    nWatchOnlyBalanceCached = 0;
+    nUnconfirmedWatchOnlyBalanceCached = 0;
+    nImmatureWatchOnlyBalanceCached = 0;
+
+    std::vector<const CWalletTx*> vwtx;
+    GetUnspentWalletTxs(vwtx);
+    BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
+        if (pcoin->IsTrusted()) {
+            nBalanceCached += pcoin->GetAvailableCredit();
+            nWatchOnlyBalanceCached += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0)) {
+            nUnconfirmedBalanceCached += pcoin->GetAvailableCredit();
+            nUnconfirmedWatchOnlyBalanceCached += pcoin->GetAvailableWatchOnlyCredit();
         }
+        nImmatureBalanceCached += pcoin->GetImmatureCredit();
+        nImmatureWatchOnlyBalanceCached += pcoin->GetImmatureWatchOnlyCredit();
     }
 
-    return nTotal;
+    pindexBalancesCached = chainActive.Tip();
+    nMempoolUpdatesBalancesCached = nMempoolUpdates;
+    fBalancesCached = true;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nBalanceCached;
 }
 
 CAmount CWallet::GetAnonymizableBalance() const
@@ -1400,8 +1655,9 @@ CAmount CWallet::GetAnonymizableBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
 
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAnonymizableCredit();
@@ -1415,10 +1671,10 @@ CAmount CWallet::GetAnonymizedBalance() const
 {
     int64_t nTotal = 0;
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        LOCK2(cs_main, cs_wallet);
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
 
             if (pcoin->IsTrusted())
             {
@@ -1455,10 +1711,10 @@ double CWallet::GetAverageAnonymizedRounds() const
     double fCount = 0;
 
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        LOCK2(cs_main, cs_wallet);
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
 
             if (pcoin->IsTrusted())
             {
@@ -1496,10 +1752,11 @@ CAmount CWallet::GetNormalizedAnonymizedBalance() const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
 
-            uint256 hash = (*it).first;
+            uint256 hash = pcoin->GetHash();
 
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 CTxIn vin = CTxIn(hash, i);
@@ -1521,8 +1778,9 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
 
             nTotal += pcoin->GetDenominatedCredit(unconfirmed);
         }
@@ -1535,9 +1793,10 @@ CAmount CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) con
 {
     int64_t nTotal = 0;
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        LOCK2(cs_main, cs_wallet);
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
 
             int nDepth = pcoin->GetDepthInMainChain();
 
@@ -1568,71 +1827,37 @@ CAmount CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) con
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nUnconfirmedBalanceCached;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nWatchOnlyBalanceCached;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nUnconfirmedWatchOnlyBalanceCached;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nImmatureWatchOnlyBalanceCached;
 }
 
 /**
@@ -1644,9 +1869,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -1685,8 +1911,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (mine && !(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i))) {
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i))) {
                     COutput output(pcoin, i, nDepth, mine);
 #                   if defined(DEBUG_DUMP_STAKING_INFO)&&defined(DEBUG_DUMP_AvailableCoins_Coin)
                     DEBUG_DUMP_AvailableCoins_Coin();
@@ -1704,9 +1930,10 @@ void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, con
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        std::vector<const CWalletTx*> vwtx;
+        GetUnspentWalletTxs(vwtx);
+        BOOST_FOREACH (const CWalletTx* pcoin, vwtx) {
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1746,8 +1973,8 @@ void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, con
                 bool mine = IsMine(pcoin->vout[i]);
 
                 if (!(IsSpent(wtxid, i)) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                     vCoins.push_back(COutput(pcoin, i, nDepth, mine));
             }
         }
@@ -2893,6 +3120,8 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
         LOCK(cs_wallet); // mapAddressBook
         std::map<CTxDestination, CAddressBookData>::iterator mi = mapAddressBook.find(address);
         fUpdated = mi != mapAddressBook.end();
+        if (!fUpdated)
+            nAddressBookUpdates++;
         mapAddressBook[address].name = strName;
         if (!strPurpose.empty()) /* update purpose only if requested */
             mapAddressBook[address].purpose = strPurpose;
@@ -2918,7 +3147,8 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
                 CWalletDB(strWalletFile).EraseDestData(strAddress, item.first);
             }
         }
-        mapAddressBook.erase(address);
+        if (mapAddressBook.erase(address))
+            nAddressBookUpdates++;
     }
 
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address) != ISMINE_NO, "", CT_DELETED);
@@ -3268,6 +3498,8 @@ bool CWallet::UpdatedTransaction(const uint256& hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()) {
+            // A transaction lock changes the depth used to decide whether it is trusted
+            MarkBalancesDirty();
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -3425,6 +3657,8 @@ bool CWallet::AddDestData(const CTxDestination& dest, const std::string& key, co
     if (boost::get<CNoDestination>(&dest))
         return false;
 
+    if (!mapAddressBook.count(dest))
+        nAddressBookUpdates++;
     mapAddressBook[dest].destdata.insert(std::make_pair(key, value));
     if (!fFileBacked)
         return true;
@@ -3433,6 +3667,8 @@ bool CWallet::AddDestData(const CTxDestination& dest, const std::string& key, co
 
 bool CWallet::EraseDestData(const CTxDestination& dest, const std::string& key)
 {
+    if (!mapAddressBook.count(dest))
+        nAddressBookUpdates++;
     if (!mapAddressBook[dest].destdata.erase(key))
         return false;
     if (!fFileBacked)
@@ -3883,6 +4119,7 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if (!fEnableInstanTX) return -1;
 
     //compile consessus vote
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return (*i).second.CountSignatures();
@@ -3896,6 +4133,7 @@ bool CMerkleTx::IsTransactionLockTimedOut() const
     if (!fEnableInstanTX) return 0;
 
     //compile consessus vote
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return GetTime() > (*i).second.nTimeout;
@@ -25,6 +25,8 @@
 
 #include <algorithm>
 #include <atomic>
+#include <limits>
+#include <list>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -260,6 +262,13 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
     static std::atomic<bool> fFlushSchemed;
     CWalletDB* pwalletdbEncryption;
 
+    //! set while SyncTransactions() groups the wallet writes of a block
+    bool fBatchSync;
+    //! database transaction of that block, opened by the first AddToWallet() that writes
+    CWalletDB* pwalletdbBatch;
+    //! transactions written through pwalletdbBatch, written again one by one if the commit fails
+    std::vector<uint256> vBatchTx;
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -291,6 +300,42 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Wallet transactions that may still hold an unspent output of ours.
+     * Balances and coin selection walk these instead of all of mapWallet.
+     * Transactions are added when they are added to the wallet or one of
+     * their spends changes, and dropped lazily once every output of ours is
+     * spent by a confirmed transaction. MarkDirty() refills it from mapWallet.
+     */
+    mutable std::set<uint256> setUnspentTx;
+    void AddToUnspentIndex(const CWalletTx& wtx);
+    bool IsSpentByConfirmed(const uint256& hash, unsigned int n) const;
+    void GetUnspentWalletTxs(std::vector<const CWalletTx*>& vwtx) const;
+
+    /**
+     * Balances of the transactions in setUnspentTx, computed in one pass and
+     * valid while the tip, the mempool and the wallet transactions stay unchanged.
+     */
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalancesCached;
+    mutable unsigned int nMempoolUpdatesBalancesCached;
+    mutable CAmount nBalanceCached;
+    mutable CAmount nUnconfirmedBalanceCached;
+    mutable CAmount nImmatureBalanceCached;
+    mutable CAmount nWatchOnlyBalanceCached;
+    mutable CAmount nUnconfirmedWatchOnlyBalanceCached;
+    mutable CAmount nImmatureWatchOnlyBalanceCached;
+    void CacheBalances() const;
+
+    //! move wtx from key nHeightPrev to nHeight in wtxByHeight, where -1 means not indexed
+    void IndexByHeight(CWalletTx& wtx, int nHeightPrev, int nHeight);
+
+    CWalletDB* GetBatchDB();
+
+protected:
+    //! commit the database transaction of a synced block; virtual so tests can make it fail
+    virtual bool CommitBatch(CWalletDB& walletdb);
+
 public:
     bool MintableCoins();
     bool SelectCoinsDark(int64_t nValueMin, int64_t nValueMax, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax) const;
@@ -364,6 +409,9 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fBatchSync = false;
+        pwalletdbBatch = NULL;
+        nAddressBookUpdates = 0;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
@@ -382,6 +430,10 @@ public:
         //Auto Combine Dust
         fCombineDust = false;
         nAutoCombineThreshold = 0;
+
+        fBalancesCached = false;
+        pindexBalancesCached = NULL;
+        nMempoolUpdatesBalancesCached = 0;
     }
 
     bool isMultiSendEnabled()
@@ -402,6 +454,21 @@ public:
     typedef std::multimap<int64_t, TxPair > TxItems;
     TxItems wtxOrdered;
 
+    /**
+     * Wallet transactions by the height of the block that contains them.
+     * Unconfirmed transactions, and those whose block was disconnected, are
+     * kept under TX_HEIGHT_UNCONFIRMED, so everything that can have fewer
+     * confirmations than a block at height h lies above h in this index.
+     */
+    static const int TX_HEIGHT_UNCONFIRMED = std::numeric_limits<int>::max();
+    typedef std::multimap<int, CWalletTx*> TxHeightItems;
+    TxHeightItems wtxByHeight;
+    //! transactions above nHeight in wtxByHeight, lowest height first
+    void GetWalletTxsAbove(int nHeight, std::vector<const CWalletTx*>& vwtx) const;
+
+    //! bumped when an address book entry is added or removed, which may turn outputs into change or back
+    unsigned int nAddressBookUpdates;
+
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -511,8 +578,11 @@ public:
     bool GetAccountDestination(CTxDestination &dest, std::string strAccount, bool bForceNew = false);
 
     void MarkDirty();
+    //! forget the cached wallet balances, they are recomputed on next use
+    void MarkBalancesDirty() const { fBalancesCached = false; }
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false, bool fFlushOnClose=true);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
@@ -864,6 +934,15 @@ public:
     mutable CAmount nImmatureWatchCreditCached;
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
+    //! GetAmounts() result for nAmountsFilterCached, valid while the wallet's address book is unchanged
+    mutable bool fAmountsCached;
+    mutable isminefilter nAmountsFilterCached;
+    mutable unsigned int nAmountsBookUpdatesCached;
+    mutable std::list<COutputEntry> listReceivedCached;
+    mutable std::list<COutputEntry> listSentCached;
+    mutable CAmount nFeeCached;
+    //! key of this transaction in CWallet::wtxByHeight, -1 if not indexed
+    int nHeightIndexed;
 
     CWalletTx()
     {
@@ -910,6 +989,11 @@ public:
         fImmatureWatchCreditCached = false;
         fAvailableWatchCreditCached = false;
         fChangeCached = false;
+        fAmountsCached = false;
+        nAmountsFilterCached = ISMINE_NO;
+        nAmountsBookUpdatesCached = 0;
+        nFeeCached = 0;
+        nHeightIndexed = -1;
         nDebitCached = 0;
         nCreditCached = 0;
         nImmatureCreditCached = 0;
@@ -984,6 +1068,9 @@ public:
         fImmatureWatchCreditCached = false;
         fDebitCached = false;
         fChangeCached = false;
+        fAmountsCached = false;
+        if (pwallet)
+            pwallet->MarkBalancesDirty();
     }
 
     void BindWallet(CWallet* pwalletIn)
@@ -1293,6 +1380,7 @@ public:
     }
 
     bool WriteToDisk();
+    bool WriteToDisk(CWalletDB* pwalletdb);
 
     int64_t GetTxTime() const;
     int GetRequestCount() const;
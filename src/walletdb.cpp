@@ -306,24 +306,20 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    boost::scoped_ptr<CDBCursor> pcursor(GetCursor());
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
-    unsigned int fFlags = DB_SET_RANGE;
+    bool fSetRange = true;
     while (true) {
         // Read next record
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        if (fFlags == DB_SET_RANGE)
+        if (fSetRange)
             ssKey << std::make_pair(std::string("acentry"), std::make_pair((fAllAccounts ? string("") : strAccount), uint64_t(0)));
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
+        bool fFound = ReadAtCursor(pcursor.get(), ssKey, ssValue, fSetRange);
+        fSetRange = false;
+        if (!fFound)
             break;
-        else if (ret != 0) {
-            pcursor->close();
-            throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
-        }
 
         // Unserialize
         string strType;
@@ -339,8 +335,6 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         ssKey >> acentry.nEntryNo;
         entries.push_back(acentry);
     }
-
-    pcursor->close();
 }
 
 DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
@@ -745,7 +739,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        boost::scoped_ptr<CDBCursor> pcursor(GetCursor());
         if (!pcursor) {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
@@ -755,13 +749,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
+            if (!ReadAtCursor(pcursor.get(), ssKey, ssValue))
                 break;
-            else if (ret != 0) {
-                LogPrintf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
-            }
 
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
@@ -781,7 +770,6 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
     } catch (boost::thread_interrupted) {
         throw;
     } catch (...) {
@@ -843,7 +831,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        boost::scoped_ptr<CDBCursor> pcursor(GetCursor());
         if (!pcursor) {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
@@ -853,13 +841,8 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
+            if (!ReadAtCursor(pcursor.get(), ssKey, ssValue))
                 break;
-            else if (ret != 0) {
-                LogPrintf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
-            }
 
             string strType;
             ssKey >> strType;
@@ -874,7 +857,6 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
                 vWtx.push_back(wtx);
             }
         }
-        pcursor->close();
     } catch (boost::thread_interrupted) {
         throw;
     } catch (...) {
@@ -946,9 +928,8 @@ void ThreadFlushWalletDB(const string& strFile)
                         nLastFlushed = nWalletDBUpdated;
                         int64_t nStart = GetTimeMillis();
 
-                        // Flush wallet.dat so it's self contained
-                        bitdb.CloseDb(strFile);
-                        bitdb.CheckpointLSN(strFile);
+                        // Flush wallet.dat to disk and compact it if it has grown
+                        bitdb.FlushDb(strFile);
 
                         bitdb.mapFileUseCount.erase(mi++);
                         LogPrint("db", "Flushed wallet.dat %dms\n", GetTimeMillis() - nStart);
@@ -967,9 +948,8 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
         {
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(wallet.strWalletFile) || bitdb.mapFileUseCount[wallet.strWalletFile] == 0) {
-                // Flush log data to the dat file
-                bitdb.CloseDb(wallet.strWalletFile);
-                bitdb.CheckpointLSN(wallet.strWalletFile);
+                // Flush the commits to disk so the copy has all of them
+                bitdb.FlushDb(wallet.strWalletFile);
                 bitdb.mapFileUseCount.erase(wallet.strWalletFile);
 
                 // Copy wallet.dat
@@ -1014,11 +994,11 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys)
     int64_t now = GetTime();
     std::string newFilename = strprintf("wallet.%d.bak", now);
 
-    int result = dbenv.dbenv.dbrename(NULL, filename.c_str(), NULL,
-        newFilename.c_str(), DB_AUTO_COMMIT);
-    if (result == 0)
+    dbenv.CloseDb(filename);
+    try {
+        filesystem::rename(GetDataDir() / filename, GetDataDir() / newFilename);
         LogPrintf("Renamed %s to %s\n", filename, newFilename);
-    else {
+    } catch (const filesystem::filesystem_error& e) {
         LogPrintf("Failed to rename %s to %s\n", filename, newFilename);
         return false;
     }
@@ -1032,21 +1012,15 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys)
     LogPrintf("Salvage(aggressive) found %u records\n", salvagedData.size());
 
     bool fSuccess = allOK;
-    boost::scoped_ptr<Db> pdbCopy(new Db(&dbenv.dbenv, 0));
-    int ret = pdbCopy->open(NULL, // Txn pointer
-        filename.c_str(),         // Filename
-        "main",                   // Logical db name
-        DB_BTREE,                 // Database type
-        DB_CREATE,                // Flags
-        0);
-    if (ret > 0) {
+    CLogDB dbCopy((GetDataDir() / filename).string());
+    if (!dbCopy.Open(true)) {
         LogPrintf("Cannot create database file %s\n", filename);
         return false;
     }
     CWallet dummyWallet;
     CWalletScanState wss;
 
-    DbTxn* ptxn = dbenv.TxnBegin();
+    CLogDB::Batch batch;
     BOOST_FOREACH (CDBEnv::KeyValPair& row, salvagedData) {
         if (fOnlyKeys) {
             CDataStream ssKey(row.first, SER_DISK, CLIENT_VERSION);
@@ -1061,14 +1035,10 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys)
                 continue;
             }
         }
-        Dbt datKey(&row.first[0], row.first.size());
-        Dbt datValue(&row.second[0], row.second.size());
-        int ret2 = pdbCopy->put(ptxn, &datKey, &datValue, DB_NOOVERWRITE);
-        if (ret2 > 0)
-            fSuccess = false;
+        batch[row.first] = std::make_pair(false, row.second);
     }
-    ptxn->commit(0);
-    pdbCopy->close(0);
+    if (!dbCopy.Commit(batch, true))
+        fSuccess = false;
 
     return fSuccess;
 }